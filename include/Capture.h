@@ -0,0 +1,282 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "Message.h"
+#include "Protocol.h"
+
+// Capture files record the updates a PositionServer received, in arrival order, so the same
+// traffic can be replayed against another build. After an 8-byte magic and the capture's start
+// time, each event is a varint of (session << 2 | kind) and a zigzag varint of its arrival time
+// less the previous event's. Connect events carry the client ID. Update events carry a symbol
+// index (an index equal to the symbols seen so far introduces a new symbol by name), the raw
+// 8-byte position and the sender's timestamp as an offset from arrival. A typical update takes
+// 12 to 16 bytes instead of a 104-byte record.
+
+constexpr char capture_magic[8] = {'P', 'O', 'S', 'C', 'A', 'P', '0', '1'};
+
+enum class capture_kind : uint8_t {
+    connect = 0,
+    update = 1,
+    disconnect = 2
+};
+
+struct capture_event_t {
+    capture_kind kind;
+    uint32_t session;
+    int64_t arrival_ns;
+    std::string client_id;      // connect only
+    message_t update;           // update only
+};
+
+inline void put_varint(std::vector<uint8_t>& out, uint64_t value) {
+
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value) | 0x80);
+        value >>= 7;
+    }
+
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+inline bool get_varint(const uint8_t*& in, const uint8_t* end, uint64_t& value) {
+
+    value = 0;
+
+    for (unsigned shift = 0; shift < 64 && in < end; shift += 7) {
+
+        uint8_t byte = *in++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+inline uint64_t capture_zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t capture_unzigzag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// Appends encoded events to a byte buffer. Not thread-safe; the server serialises calls.
+class CaptureEncoder {
+public:
+    CaptureEncoder() : previous_ns_(0) {}
+
+    void header(std::vector<uint8_t>& out, int64_t start_ns) {
+
+        out.insert(out.end(), capture_magic, capture_magic + sizeof(capture_magic));
+        put_varint(out, capture_zigzag(start_ns));
+        previous_ns_ = start_ns;
+        symbols_.clear();
+    }
+
+    void connect(std::vector<uint8_t>& out, int64_t arrival_ns, uint32_t session, std::string_view client_id) {
+
+        begin(out, capture_kind::connect, arrival_ns, session);
+        put_string(out, client_id);
+    }
+
+    void update(std::vector<uint8_t>& out, int64_t arrival_ns, uint32_t session, const message_t& message) {
+
+        begin(out, capture_kind::update, arrival_ns, session);
+
+        std::string_view symbol = symbol_of(message);
+        auto it = symbols_.find(symbol);
+
+        if (it == symbols_.end()) {
+            put_varint(out, symbols_.size());
+            put_string(out, symbol);
+            symbols_.emplace(std::string(symbol), static_cast<uint32_t>(symbols_.size()));
+        } else {
+            put_varint(out, it->second);
+        }
+
+        uint8_t position[sizeof(double)];
+        std::memcpy(position, &message.net_position, sizeof(position));
+        out.insert(out.end(), position, position + sizeof(position));
+
+        put_varint(out, capture_zigzag(message.timestamp_ns != 0 ? message.timestamp_ns - arrival_ns : 0));
+    }
+
+    void disconnect(std::vector<uint8_t>& out, int64_t arrival_ns, uint32_t session) {
+        begin(out, capture_kind::disconnect, arrival_ns, session);
+    }
+
+private:
+    void begin(std::vector<uint8_t>& out, capture_kind kind, int64_t arrival_ns, uint32_t session) {
+
+        put_varint(out, (static_cast<uint64_t>(session) << 2) | static_cast<uint64_t>(kind));
+        put_varint(out, capture_zigzag(arrival_ns - previous_ns_));
+        previous_ns_ = arrival_ns;
+    }
+
+    static void put_string(std::vector<uint8_t>& out, std::string_view text) {
+
+        std::size_t length = std::min<std::size_t>(text.size(), sizeof(message_t::symbol) - 1);
+        out.push_back(static_cast<uint8_t>(length));
+        out.insert(out.end(), text.begin(), text.begin() + length);
+    }
+
+    int64_t previous_ns_;
+    std::map<std::string, uint32_t, std::less<>> symbols_;
+};
+
+// Reads a whole capture file into memory and walks its events in order.
+class CaptureReader {
+public:
+    CaptureReader() : position_(0), start_ns_(0), previous_ns_(0), ok_(false) {}
+
+    bool open(const std::string& path) {
+
+        std::FILE* file = std::fopen(path.c_str(), "rb");
+
+        if (file == nullptr) {
+            return false;
+        }
+
+        data_.clear();
+        uint8_t chunk[65536];
+        std::size_t length;
+
+        while ((length = std::fread(chunk, 1, sizeof(chunk), file)) > 0) {
+            data_.insert(data_.end(), chunk, chunk + length);
+        }
+
+        std::fclose(file);
+
+        if (data_.size() < sizeof(capture_magic) || std::memcmp(data_.data(), capture_magic, sizeof(capture_magic)) != 0) {
+            return false;
+        }
+
+        const uint8_t* in = data_.data() + sizeof(capture_magic);
+        uint64_t start;
+
+        if (!get_varint(in, data_.data() + data_.size(), start)) {
+            return false;
+        }
+
+        start_ns_ = previous_ns_ = capture_unzigzag(start);
+        position_ = static_cast<std::size_t>(in - data_.data());
+        symbols_.clear();
+        ok_ = true;
+        return true;
+    }
+
+    // False at the end of the file or on a truncated event (a capture cut short by a crash).
+    bool next(capture_event_t& event) {
+
+        const uint8_t* in = data_.data() + position_;
+        const uint8_t* end = data_.data() + data_.size();
+        uint64_t head;
+        uint64_t delta;
+
+        if (!ok_ || in >= end || !get_varint(in, end, head) || !get_varint(in, end, delta)) {
+            return false;
+        }
+
+        event.kind = static_cast<capture_kind>(head & 3);
+        event.session = static_cast<uint32_t>(head >> 2);
+        event.arrival_ns = previous_ns_ + capture_unzigzag(delta);
+        event.client_id.clear();
+        event.update = message_t();
+
+        if (event.kind == capture_kind::connect) {
+
+            if (!get_string(in, end, event.client_id)) {
+                return fail();
+            }
+        } else if (event.kind == capture_kind::update) {
+
+            uint64_t index;
+
+            if (!get_varint(in, end, index) || index > symbols_.size()) {
+                return fail();
+            }
+
+            if (index == symbols_.size()) {
+
+                std::string symbol;
+
+                if (!get_string(in, end, symbol) || symbol.size() >= event.update.symbol.size()) {
+                    return fail();
+                }
+
+                symbols_.push_back(symbol);
+            }
+
+            const std::string& symbol = symbols_[index];
+            std::memcpy(event.update.symbol.data(), symbol.data(), symbol.size());
+
+            uint64_t offset;
+
+            if (end - in < static_cast<std::ptrdiff_t>(sizeof(double))) {
+                return fail();
+            }
+
+            std::memcpy(&event.update.net_position, in, sizeof(double));
+            in += sizeof(double);
+
+            if (!get_varint(in, end, offset)) {
+                return fail();
+            }
+
+            int64_t sent_offset = capture_unzigzag(offset);
+            event.update.timestamp_ns = sent_offset != 0 ? event.arrival_ns + sent_offset : 0;
+        } else if (event.kind != capture_kind::disconnect) {
+            return fail();
+        }
+
+        previous_ns_ = event.arrival_ns;
+        position_ = static_cast<std::size_t>(in - data_.data());
+        return true;
+    }
+
+    int64_t start_ns() const { return start_ns_; }
+    std::size_t size() const { return data_.size(); }
+
+private:
+    bool fail() {
+        ok_ = false;
+        return false;
+    }
+
+    static bool get_string(const uint8_t*& in, const uint8_t* end, std::string& out) {
+
+        if (in >= end) {
+            return false;
+        }
+
+        std::size_t length = *in++;
+
+        if (static_cast<std::size_t>(end - in) < length) {
+            return false;
+        }
+
+        out.assign(reinterpret_cast<const char*>(in), length);
+        in += length;
+        return true;
+    }
+
+    std::vector<uint8_t> data_;
+    std::size_t position_;
+    int64_t start_ns_;
+    int64_t previous_ns_;
+    std::vector<std::string> symbols_;
+    bool ok_;
+};
+
+#endif // CAPTURE_H
@@ -0,0 +1,182 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <thread>
+
+#if defined(__linux__)
+#include <time.h>
+#endif
+
+#if defined(__linux__) && defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define POSITION_CLOCK_TSC 1
+#endif
+
+// Nanosecond timestamps for messages and latency measurement. Reads come from the TSC when the
+// CPU has an invariant one, otherwise from CLOCK_MONOTONIC_RAW, otherwise from
+// std::chrono::steady_clock. The TSC rate is calibrated once (~20 ms on first use), and each
+// thread re-anchors its TSC reading to CLOCK_MONOTONIC_RAW every 10 ms so calibration error
+// cannot accumulate; readings within a thread never go backwards. The result is shifted onto the
+// Unix epoch with an offset taken at start-up, so timestamps from different processes (and, given
+// NTP, hosts) are comparable and agree with kernel SO_TIMESTAMPNS stamps to within microseconds.
+// The clock does not follow later wall-clock adjustments; it is meant for intervals and ordering,
+// and text is only produced at the display edge (format_timestamp).
+class Clock {
+public:
+    // Nanoseconds since the Unix epoch.
+    static int64_t now_ns() {
+        const Clock& clock = instance();
+        return clock.wall_offset_ns_ + clock.monotonic();
+    }
+
+    // Which source backs now_ns(): "tsc", "monotonic_raw" or "steady_clock".
+    static const char* source() { return instance().source_; }
+
+private:
+    Clock() : source_("steady_clock"), wall_offset_ns_(0) {
+
+#if defined(__linux__)
+        source_ = "monotonic_raw";
+#endif
+
+#ifdef POSITION_CLOCK_TSC
+        if (invariant_tsc()) {
+            calibrate_tsc();
+        }
+#endif
+
+        // Bracket the wall-clock read and keep the tightest of a few tries, so the offset is good
+        // to about one clock read even if the first calls are slow.
+        int64_t best_width = -1;
+
+        for (int attempt = 0; attempt < 8; ++attempt) {
+
+            int64_t before = raw_ns();
+            int64_t wall = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            int64_t after = raw_ns();
+
+            if (best_width < 0 || after - before < best_width) {
+                best_width = after - before;
+                wall_offset_ns_ = wall - (before + (after - before) / 2);
+            }
+        }
+    }
+
+    static const Clock& instance() {
+        static const Clock clock;
+        return clock;
+    }
+
+    static int64_t raw_ns() {
+
+#if defined(__linux__)
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+        return static_cast<int64_t>(now.tv_sec) * 1000000000LL + now.tv_nsec;
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    int64_t monotonic() const {
+
+#ifdef POSITION_CLOCK_TSC
+        if (tsc_mult_ != 0) {
+
+            struct anchor_t {
+                uint64_t ticks = 0;
+                int64_t ns = 0;
+                int64_t last = 0;
+            };
+
+            thread_local anchor_t anchor;
+            uint64_t ticks = __rdtsc();
+
+            if (anchor.ns == 0 || ticks - anchor.ticks >= resync_ticks_) {
+                anchor.ns = raw_ns();
+                uint64_t after = __rdtsc();
+                anchor.ticks = ticks + (after - ticks) / 2;
+                ticks = after;
+            }
+
+            int64_t now = anchor.ns + static_cast<int64_t>((static_cast<unsigned __int128>(ticks - anchor.ticks) * tsc_mult_) >> 32);
+            anchor.last = now > anchor.last ? now : anchor.last;
+            return anchor.last;
+        }
+#endif
+
+        return raw_ns();
+    }
+
+#ifdef POSITION_CLOCK_TSC
+    static bool invariant_tsc() {
+
+        unsigned eax, ebx, ecx, edx;
+
+        if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+            return false;
+        }
+
+        __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+        return (edx & (1u << 8)) != 0;
+    }
+
+    // ns per tick as 32.32 fixed point, measured over a short sleep.
+    void calibrate_tsc() {
+
+        int64_t start_ns = raw_ns();
+        uint64_t start_ticks = __rdtsc();
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+        int64_t end_ns = raw_ns();
+        uint64_t end_ticks = __rdtsc();
+
+        if (end_ticks <= start_ticks || end_ns <= start_ns) {
+            return;
+        }
+
+        tsc_mult_ = (static_cast<unsigned __int128>(end_ns - start_ns) << 32) / (end_ticks - start_ticks);
+        resync_ticks_ = (end_ticks - start_ticks) / 2;
+        source_ = "tsc";
+    }
+
+    uint64_t tsc_mult_ = 0;
+    uint64_t resync_ticks_ = 0;
+#endif
+
+    const char* source_;
+    int64_t wall_offset_ns_;
+};
+
+// Local time with nanoseconds, e.g. "2024-Jun-24 09:56:13.123456789"; 0 prints as "-".
+inline std::string format_timestamp(int64_t timestamp_ns) {
+
+    if (timestamp_ns == 0) {
+        return "-";
+    }
+
+    int64_t seconds = timestamp_ns >= 0 ? timestamp_ns / 1000000000LL : (timestamp_ns - 999999999LL) / 1000000000LL;
+    long nanoseconds = static_cast<long>(timestamp_ns - seconds * 1000000000LL);
+    std::time_t time = static_cast<std::time_t>(seconds);
+    std::tm local{};
+
+#if defined(_WIN32)
+    localtime_s(&local, &time);
+#else
+    localtime_r(&time, &local);
+#endif
+
+    char text[48];
+    std::size_t length = std::strftime(text, sizeof(text), "%Y-%b-%d %H:%M:%S", &local);
+    std::snprintf(text + length, sizeof(text) - length, ".%09ld", nanoseconds);
+    return text;
+}
+
+#endif // CLOCK_H
@@ -0,0 +1,258 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Bit-level writer/reader plus Gorilla-style (delta-of-delta timestamps, XOR'd doubles)
+// sample coding. Encoder state is kept apart from the bit stream so a series can be
+// continued across several output buffers and reset to force a keyframe.
+
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<uint8_t>& out) : out_(out), free_(0) {}
+
+    void write_bit(bool bit) {
+        write_bits(bit ? 1 : 0, 1);
+    }
+
+    void write_bits(uint64_t value, unsigned bits) {
+
+        while (bits > 0) {
+
+            if (free_ == 0) {
+                out_.push_back(0);
+                free_ = 8;
+            }
+
+            unsigned take = bits < free_ ? bits : free_;
+            uint8_t chunk = static_cast<uint8_t>((value >> (bits - take)) & ((1u << take) - 1));
+            out_.back() |= static_cast<uint8_t>(chunk << (free_ - take));
+            free_ -= take;
+            bits -= take;
+        }
+    }
+
+private:
+    std::vector<uint8_t>& out_;
+    unsigned free_;
+};
+
+class BitReader {
+public:
+    BitReader(const uint8_t* data, std::size_t size) : data_(data), size_(size), position_(0), ok_(true) {}
+
+    bool read_bit() {
+        return read_bits(1) != 0;
+    }
+
+    uint64_t read_bits(unsigned bits) {
+
+        uint64_t value = 0;
+
+        while (bits > 0) {
+
+            std::size_t byte = position_ >> 3;
+
+            if (byte >= size_) {
+                ok_ = false;
+                return 0;
+            }
+
+            unsigned used = static_cast<unsigned>(position_ & 7);
+            unsigned available = 8 - used;
+            unsigned take = bits < available ? bits : available;
+            uint8_t chunk = static_cast<uint8_t>((data_[byte] >> (available - take)) & ((1u << take) - 1));
+            value = (value << take) | chunk;
+            position_ += take;
+            bits -= take;
+        }
+
+        return value;
+    }
+
+    bool ok() const { return ok_; }
+    bool exhausted() const { return (position_ >> 3) >= size_; }
+
+private:
+    const uint8_t* data_;
+    std::size_t size_;
+    std::size_t position_;
+    bool ok_;
+};
+
+struct gorilla_state_t {
+    bool has_previous = false;
+    int64_t previous_timestamp = 0;
+    int64_t previous_delta = 0;
+    uint64_t previous_bits = 0;
+    unsigned previous_leading = 0;
+    unsigned previous_trailing = 0;
+};
+
+inline uint64_t zigzag_encode(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t zigzag_decode(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+inline uint64_t double_bits(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+inline double bits_double(uint64_t bits) {
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+inline unsigned count_leading_zeros(uint64_t value) {
+    return value == 0 ? 64 : static_cast<unsigned>(__builtin_clzll(value));
+}
+
+inline unsigned count_trailing_zeros(uint64_t value) {
+    return value == 0 ? 64 : static_cast<unsigned>(__builtin_ctzll(value));
+}
+
+// Timestamp delta-of-delta buckets: 0 | 10+8 | 110+16 | 1110+32 | 1111+64 (zigzag encoded).
+inline void encode_timestamp(BitWriter& writer, gorilla_state_t& state, int64_t timestamp) {
+
+    int64_t delta = timestamp - state.previous_timestamp;
+    uint64_t dod = zigzag_encode(delta - state.previous_delta);
+
+    if (dod == 0) {
+        writer.write_bit(false);
+    } else if (dod < (1ull << 8)) {
+        writer.write_bits(0b10, 2);
+        writer.write_bits(dod, 8);
+    } else if (dod < (1ull << 16)) {
+        writer.write_bits(0b110, 3);
+        writer.write_bits(dod, 16);
+    } else if (dod < (1ull << 32)) {
+        writer.write_bits(0b1110, 4);
+        writer.write_bits(dod, 32);
+    } else {
+        writer.write_bits(0b1111, 4);
+        writer.write_bits(dod, 64);
+    }
+
+    state.previous_delta = delta;
+    state.previous_timestamp = timestamp;
+}
+
+inline int64_t decode_timestamp(BitReader& reader, gorilla_state_t& state) {
+
+    uint64_t dod = 0;
+
+    if (reader.read_bit()) {
+        if (!reader.read_bit()) {
+            dod = reader.read_bits(8);
+        } else if (!reader.read_bit()) {
+            dod = reader.read_bits(16);
+        } else if (!reader.read_bit()) {
+            dod = reader.read_bits(32);
+        } else {
+            dod = reader.read_bits(64);
+        }
+    }
+
+    state.previous_delta += zigzag_decode(dod);
+    state.previous_timestamp += state.previous_delta;
+    return state.previous_timestamp;
+}
+
+// XOR'd doubles: 0 = unchanged | 10 + bits within previous window | 11 + 6b leading + 6b length + bits.
+inline void encode_value(BitWriter& writer, gorilla_state_t& state, double value) {
+
+    uint64_t bits = double_bits(value);
+    uint64_t xored = bits ^ state.previous_bits;
+
+    if (xored == 0) {
+        writer.write_bit(false);
+    } else {
+
+        unsigned leading = count_leading_zeros(xored);
+        unsigned trailing = count_trailing_zeros(xored);
+
+        if (leading > 63) {
+            leading = 63;
+        }
+
+        if (state.previous_leading + state.previous_trailing > 0 && leading >= state.previous_leading && trailing >= state.previous_trailing) {
+            writer.write_bits(0b10, 2);
+            writer.write_bits(xored >> state.previous_trailing, 64 - state.previous_leading - state.previous_trailing);
+        } else {
+            unsigned length = 64 - leading - trailing;
+            writer.write_bits(0b11, 2);
+            writer.write_bits(leading, 6);
+            writer.write_bits(length - 1, 6);
+            writer.write_bits(xored >> trailing, length);
+            state.previous_leading = leading;
+            state.previous_trailing = trailing;
+        }
+    }
+
+    state.previous_bits = bits;
+}
+
+inline double decode_value(BitReader& reader, gorilla_state_t& state) {
+
+    if (reader.read_bit()) {
+
+        if (!reader.read_bit()) {
+            unsigned length = 64 - state.previous_leading - state.previous_trailing;
+            state.previous_bits ^= reader.read_bits(length) << state.previous_trailing;
+        } else {
+            unsigned leading = static_cast<unsigned>(reader.read_bits(6));
+            unsigned length = static_cast<unsigned>(reader.read_bits(6)) + 1;
+            unsigned trailing = 64 - leading - length;
+            state.previous_bits ^= reader.read_bits(length) << trailing;
+            state.previous_leading = leading;
+            state.previous_trailing = trailing;
+        }
+    }
+
+    return bits_double(state.previous_bits);
+}
+
+// The first sample of a series (or after a reset) is written raw and acts as the keyframe.
+inline void encode_sample(BitWriter& writer, gorilla_state_t& state, int64_t timestamp, double value) {
+
+    if (!state.has_previous) {
+        writer.write_bits(static_cast<uint64_t>(timestamp), 64);
+        writer.write_bits(double_bits(value), 64);
+        state = gorilla_state_t();
+        state.has_previous = true;
+        state.previous_timestamp = timestamp;
+        state.previous_bits = double_bits(value);
+        return;
+    }
+
+    encode_timestamp(writer, state, timestamp);
+    encode_value(writer, state, value);
+}
+
+inline bool decode_sample(BitReader& reader, gorilla_state_t& state, int64_t& timestamp, double& value) {
+
+    if (!state.has_previous) {
+        timestamp = static_cast<int64_t>(reader.read_bits(64));
+        uint64_t bits = reader.read_bits(64);
+        state = gorilla_state_t();
+        state.has_previous = true;
+        state.previous_timestamp = timestamp;
+        state.previous_bits = bits;
+        value = bits_double(bits);
+        return reader.ok();
+    }
+
+    timestamp = decode_timestamp(reader, state);
+    value = decode_value(reader, state);
+    return reader.ok();
+}
+
+#endif
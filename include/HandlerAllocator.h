@@ -0,0 +1,97 @@
+#ifndef HANDLER_ALLOCATOR_H
+#define HANDLER_ALLOCATOR_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Recycling storage for Asio completion handlers. Each handler_memory serves one
+// outstanding operation at a time (a session's read, its write, ...), so once a
+// connection is up its handlers never touch the heap. Oversized or overlapping
+// requests fall back to operator new.
+class handler_memory {
+public:
+    handler_memory() : in_use_(false) {}
+
+    handler_memory(const handler_memory&) = delete;
+    handler_memory& operator=(const handler_memory&) = delete;
+
+    void* allocate(std::size_t size) {
+
+        if (!in_use_ && size <= sizeof(storage_)) {
+            in_use_ = true;
+            return &storage_;
+        }
+
+        return ::operator new(size);
+    }
+
+    void deallocate(void* pointer) {
+
+        if (pointer == &storage_) {
+            in_use_ = false;
+        } else {
+            ::operator delete(pointer);
+        }
+    }
+
+private:
+    typename std::aligned_storage<512, alignof(std::max_align_t)>::type storage_;
+    bool in_use_;
+};
+
+template <typename T>
+class handler_allocator {
+public:
+    using value_type = T;
+
+    explicit handler_allocator(handler_memory& memory) : memory_(memory) {}
+
+    template <typename U>
+    handler_allocator(const handler_allocator<U>& other) noexcept : memory_(other.memory_) {}
+
+    bool operator==(const handler_allocator& other) const noexcept { return &memory_ == &other.memory_; }
+    bool operator!=(const handler_allocator& other) const noexcept { return &memory_ != &other.memory_; }
+
+    T* allocate(std::size_t n) const {
+        return static_cast<T*>(memory_.allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T* pointer, std::size_t /*n*/) const {
+        memory_.deallocate(pointer);
+    }
+
+private:
+    template <typename> friend class handler_allocator;
+
+    handler_memory& memory_;
+};
+
+template <typename Handler>
+class custom_alloc_handler {
+public:
+    using allocator_type = handler_allocator<Handler>;
+
+    custom_alloc_handler(handler_memory& memory, Handler handler) : memory_(memory), handler_(std::move(handler)) {}
+
+    allocator_type get_allocator() const noexcept {
+        return allocator_type(memory_);
+    }
+
+    template <typename... Args>
+    void operator()(Args&&... args) {
+        handler_(std::forward<Args>(args)...);
+    }
+
+private:
+    handler_memory& memory_;
+    Handler handler_;
+};
+
+template <typename Handler>
+inline custom_alloc_handler<Handler> make_custom_alloc_handler(handler_memory& memory, Handler handler) {
+    return custom_alloc_handler<Handler>(memory, std::move(handler));
+}
+
+#endif
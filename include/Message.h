@@ -2,18 +2,28 @@
 #define MESSAGE_H
 
 #include <array>
+#include <cstdint>
 
+// timestamp_ns is the sender's Clock::now_ns() when the update was sent. receive_ns is the
+// kernel's receive time for the update at the server that first read it, when that server
+// captures SO_TIMESTAMPNS stamps, and 0 otherwise. Both are nanoseconds since the Unix epoch.
 struct message_t {
     std::array<char, 64> symbol;
     double net_position;
-    std::array<char, 32> timestamp;
+    int64_t timestamp_ns;
+    int64_t receive_ns;
+    std::array<char, 16> reserved;
 
     message_t() {
-        
-        timestamp.fill(0);
+
+        symbol.fill(0);
         net_position = 0.0;
-        timestamp.fill(0);
+        timestamp_ns = 0;
+        receive_ns = 0;
+        reserved.fill(0);
     }
 };
 
+static_assert(sizeof(message_t) == 104, "the wire record size is fixed");
+
 #endif
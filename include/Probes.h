@@ -0,0 +1,63 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+#include "TraceRecorder.h"
+
+// Static tracepoints on the server's ingest and fan-out path and the client's send and receive.
+// Each POSITION_PROBE(name, a, b) site is, at once:
+//
+//  - a USDT probe "position:name" with two integer arguments, when built with -DPOSITION_PROBES
+//    on a system with <sys/sdt.h> (systemtap-sdt-dev). A USDT probe is a single nop in the code
+//    plus a note in the binary; perf, bpftrace or SystemTap patch it live, e.g.
+//        bpftrace -e 'usdt:./PositionServer:position:dispatch { @[arg0] = count(); }'
+//    Without -DPOSITION_PROBES the site compiles to nothing.
+//
+//  - an event in the in-process TraceRecorder, when it has been started at run time. When it has
+//    not, the cost is one relaxed load and an untaken branch.
+//
+// Probe                     a                         b
+// position:accept           session id                0
+// position:decode           session id                records decoded from one read
+// position:store_update     store sequence            update's timestamp_ns
+// position:enqueue          updates enqueued          first update's timestamp_ns
+// position:dispatch         sessions delivered to     update's timestamp_ns
+// position:write_done       session id                bytes written
+// position:client_send      0                         update's timestamp_ns
+// position:client_receive   0                         update's timestamp_ns
+//
+// An update's timestamp_ns is stamped by its sender and carried unchanged, so it ties one
+// update's events together from client_send through to every client_receive.
+
+#if defined(POSITION_PROBES)
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define POSITION_USDT(name, a, b) DTRACE_PROBE2(position, name, a, b)
+#endif
+#endif
+#ifndef POSITION_USDT
+#error "POSITION_PROBES needs <sys/sdt.h> (systemtap-sdt-dev)"
+#endif
+#else
+#define POSITION_USDT(name, a, b) do {} while (0)
+#endif
+
+#define POSITION_PROBE(name, a, b)                                                                          \
+    do {                                                                                                    \
+        POSITION_USDT(name, a, b);                                                                          \
+        if (TraceRecorder::active()) {                                                                      \
+            TraceRecorder::instant(#name, static_cast<uint64_t>(a), static_cast<uint64_t>(b));              \
+        }                                                                                                   \
+    } while (0)
+
+// For a probe that covers a span of time (a write from its start to its completion); the trace
+// shows it as a bar from start_ns, or as an instant when start_ns is 0.
+#define POSITION_PROBE_SPAN(name, start_ns, a, b)                                                           \
+    do {                                                                                                    \
+        POSITION_USDT(name, a, b);                                                                          \
+        if (TraceRecorder::active()) {                                                                      \
+            TraceRecorder::complete(#name, start_ns, static_cast<uint64_t>(a), static_cast<uint64_t>(b));   \
+        }                                                                                                   \
+    } while (0)
+
+#endif // PROBES_H
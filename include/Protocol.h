@@ -0,0 +1,188 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include "Message.h"
+
+// Every record on the wire is sizeof(message_t) bytes. Position updates are plain
+// message_t records; control records overlay the same size and are told apart by a
+// leading control_marker byte where a symbol would otherwise start. A control record
+// is followed by `count` payload records (plain message_t) belonging to it.
+
+constexpr char control_marker = '\x01';
+
+// A server closes a connection whose control record announces more payload records than this.
+constexpr uint32_t max_control_payload = 4096;
+
+enum class control_kind : uint8_t {
+    query_request = 1,
+    query_response = 2,
+    predicate_subscribe = 3,
+    predicate_unsubscribe = 4,
+    predicate_event = 5,
+    set_subscription = 6,
+    set_encoding = 7,
+    replication_subscribe = 8,
+    replication_snapshot = 9,
+    replication_batch = 10,
+    heartbeat = 11,
+};
+
+enum class query_type : uint8_t {
+    symbol = 1,
+    symbol_set = 2,
+    prefix = 3,
+    history_range = 4,
+    history_rollup = 5,
+};
+
+// History queries carry one history_query_t naming the symbol and an inclusive window of server
+// ingest times (nanoseconds since the Unix epoch). history_range is answered with one plain record
+// per sample (timestamp_ns = when the server ingested it) and history_rollup with one rollup_record_t
+// per non-empty bucket of bucket_ns, counted from from_ns. An answer is cut off after
+// max_history_records; one that long may continue, from just after its last sample or bucket.
+constexpr uint32_t max_history_records = 65536;
+
+// Standing predicates evaluated by the server on every ingested update. Thresholds fire on
+// crossing `upper` (direction chosen by flags), bands fire on leaving/re-entering
+// [lower, upper], and rate predicates fire when |change| per second exceeds `upper`.
+enum class predicate_type : uint8_t {
+    threshold = 1,
+    band = 2,
+    rate_of_change = 3,
+};
+
+enum predicate_flags : uint8_t {
+    predicate_rising = 1,
+    predicate_falling = 2,
+    predicate_band_exit = 4,
+};
+
+// set_subscription flags: without subscribe_broadcasts a session only receives events and responses.
+enum subscription_flags : uint8_t {
+    subscribe_broadcasts = 1,
+};
+
+// set_encoding (type = stream_encoding) is only accepted ahead of the identifying record. With
+// gorilla the server-to-client direction is sent as compressed frames (StreamCodec.h) from the
+// first write on, join snapshot included; the client-to-server direction stays plain records.
+enum class stream_encoding : uint8_t {
+    plain = 0,
+    gorilla = 1,
+};
+
+// Replication between servers. A replica opens an ordinary connection and, instead of identifying,
+// sends replication_subscribe with `sequence` = next sequence it needs (0 for a full sync). The
+// primary answers with either a replication_snapshot (`sequence` = store sequence it covers,
+// `count` positions) or straight away with replication_batch records: `count` updates carrying
+// consecutive sequences from `sequence`, `request_id` = the primary's latest sequence, `lower` =
+// wall-clock seconds at which the sender ingested the first of them and `upper` = the same for the
+// origin server at the head of a replica/relay chain. Plain updates the replica writes on that
+// connection are its clients' updates, forwarded to the primary.
+
+// Liveness. A server sends heartbeat (count 0) on a connection it has not heard from, or written
+// to, for a heartbeat interval; clients and replicas answer each one with a heartbeat of their own
+// and the server never answers, so an idle but healthy peer keeps its session alive.
+
+struct control_t {
+    char marker;
+    uint8_t kind;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t count;
+    uint64_t request_id;
+    uint64_t sequence;
+    double lower;
+    double upper;
+    char reserved[sizeof(message_t) - 40];
+
+    control_t() {
+        std::memset(static_cast<void*>(this), 0, sizeof(control_t));
+        marker = control_marker;
+    }
+};
+
+static_assert(sizeof(control_t) == sizeof(message_t), "control records must be exactly one wire record");
+
+struct history_query_t {
+    std::array<char, 64> symbol;
+    int64_t from_ns;
+    int64_t to_ns;
+    int64_t bucket_ns; // history_rollup only
+    char reserved[sizeof(message_t) - 88];
+
+    history_query_t() {
+        std::memset(static_cast<void*>(this), 0, sizeof(history_query_t));
+    }
+};
+
+static_assert(sizeof(history_query_t) == sizeof(message_t), "history queries must be exactly one wire record");
+
+// The bucket starts at the query's from_ns + bucket_index * bucket_ns.
+struct rollup_record_t {
+    std::array<char, 64> symbol;
+    uint32_t bucket_index;
+    uint32_t count;
+    double min;
+    double max;
+    double mean;
+    double last;
+};
+
+static_assert(sizeof(rollup_record_t) == sizeof(message_t), "rollup records must be exactly one wire record");
+
+inline bool is_control(const message_t& record) {
+    return record.symbol[0] == control_marker;
+}
+
+inline control_t to_control(const message_t& record) {
+    control_t control;
+    std::memcpy(static_cast<void*>(&control), &record, sizeof(control_t));
+    return control;
+}
+
+inline message_t to_record(const control_t& control) {
+    message_t record;
+    std::memcpy(static_cast<void*>(&record), &control, sizeof(message_t));
+    return record;
+}
+
+inline history_query_t to_history_query(const message_t& record) {
+    history_query_t query;
+    std::memcpy(static_cast<void*>(&query), &record, sizeof(history_query_t));
+    return query;
+}
+
+inline message_t to_record(const history_query_t& query) {
+    message_t record;
+    std::memcpy(static_cast<void*>(&record), &query, sizeof(message_t));
+    return record;
+}
+
+inline rollup_record_t to_rollup(const message_t& record) {
+    rollup_record_t rollup;
+    std::memcpy(static_cast<void*>(&rollup), &record, sizeof(rollup_record_t));
+    return rollup;
+}
+
+inline message_t to_record(const rollup_record_t& rollup) {
+    message_t record;
+    std::memcpy(static_cast<void*>(&record), &rollup, sizeof(message_t));
+    return record;
+}
+
+inline std::string_view symbol_of(const message_t& record) {
+    return std::string_view(record.symbol.data(), strnlen(record.symbol.data(), record.symbol.size()));
+}
+
+inline message_t symbol_record(const std::string& symbol) {
+    message_t record;
+    record.symbol.fill(0);
+    std::strncpy(record.symbol.data(), symbol.data(), record.symbol.size() - 1);
+    return record;
+}
+
+#endif
@@ -0,0 +1,235 @@
+#ifndef STREAM_CODEC_H
+#define STREAM_CODEC_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "Compression.h"
+#include "Protocol.h"
+
+// Compressed encoding of the server-to-client stream. Each batch of outgoing wire records is
+// sent as one length-prefixed frame instead of fixed-size records: a symbol is named once and
+// then referred to by index, and its (timestamp, position) series is Gorilla coded against the
+// previous update of the same symbol. Control records and their payloads are carried verbatim.
+// Every keyframe_interval frames (and on request) the dictionary and series state are reset
+// so a decoder never depends on more than one keyframe's worth of history.
+
+// Timestamps are coded as a delta-of-delta series in nanoseconds. A kernel receive time, when the
+// server captured one, is coded as its offset from the update's own timestamp.
+
+// Frame header: body length in bytes, then the record count with frame_keyframe set on keyframes.
+constexpr std::size_t frame_header_size = 8;
+constexpr uint32_t frame_keyframe = 0x80000000u;
+constexpr uint32_t max_frame_bytes = 16u << 20;
+
+class StreamEncoder {
+public:
+    explicit StreamEncoder(uint32_t keyframe_interval = 64) : keyframe_interval_(keyframe_interval), frames_since_keyframe_(0), keyframe_pending_(true) {}
+
+    // The next frame starts from an empty dictionary (new subscriber, join snapshot, ...).
+    void request_keyframe() { keyframe_pending_ = true; }
+
+    // Appends one frame carrying `count` wire records. Position updates are coded against the
+    // previous update of the same symbol; control records and the payload records that follow
+    // them are copied verbatim.
+    void encode_frame(const message_t* records, std::size_t count, std::vector<uint8_t>& out) {
+
+        uint32_t header_count = static_cast<uint32_t>(count);
+
+        if (keyframe_pending_ || ++frames_since_keyframe_ >= keyframe_interval_) {
+            symbols_.clear();
+            frames_since_keyframe_ = 0;
+            keyframe_pending_ = false;
+            header_count |= frame_keyframe;
+        }
+
+        std::size_t header_offset = out.size();
+        out.resize(header_offset + frame_header_size);
+
+        BitWriter writer(out);
+        std::size_t verbatim = 0;
+
+        for (std::size_t i = 0; i < count; ++i) {
+
+            if (verbatim == 0 && is_control(records[i])) {
+                verbatim = 1 + to_control(records[i]).count;
+            }
+
+            if (verbatim > 0) {
+
+                --verbatim;
+                writer.write_bit(true);
+
+                const uint8_t* raw = reinterpret_cast<const uint8_t*>(&records[i]);
+
+                for (std::size_t b = 0; b < sizeof(message_t); ++b) {
+                    writer.write_bits(raw[b], 8);
+                }
+
+                continue;
+            }
+
+            writer.write_bit(false);
+            encode_update(writer, records[i]);
+        }
+
+        uint32_t body_bytes = static_cast<uint32_t>(out.size() - header_offset - frame_header_size);
+        std::memcpy(out.data() + header_offset, &body_bytes, sizeof(body_bytes));
+        std::memcpy(out.data() + header_offset + sizeof(body_bytes), &header_count, sizeof(header_count));
+    }
+
+private:
+    struct symbol_state_t {
+        uint32_t index;
+        gorilla_state_t series;
+    };
+
+    void encode_update(BitWriter& writer, const message_t& update) {
+
+        std::string_view symbol = symbol_of(update);
+        auto it = symbols_.find(symbol);
+
+        if (it == symbols_.end()) {
+
+            it = symbols_.emplace(std::string(symbol), symbol_state_t{static_cast<uint32_t>(symbols_.size()), gorilla_state_t()}).first;
+            writer.write_bit(true);
+            writer.write_bits(symbol.size(), 7);
+
+            for (char c : symbol) {
+                writer.write_bits(static_cast<uint8_t>(c), 8);
+            }
+        } else {
+
+            writer.write_bit(false);
+
+            if (it->second.index < 16) {
+                writer.write_bit(false);
+                writer.write_bits(it->second.index, 4);
+            } else {
+                writer.write_bit(true);
+                writer.write_bits(it->second.index, 32);
+            }
+        }
+
+        encode_sample(writer, it->second.series, update.timestamp_ns, update.net_position);
+
+        writer.write_bit(update.receive_ns != 0);
+
+        if (update.receive_ns != 0) {
+            gorilla_state_t offset;
+            offset.previous_timestamp = update.timestamp_ns;
+            encode_timestamp(writer, offset, update.receive_ns);
+        }
+    }
+
+    std::map<std::string, symbol_state_t, std::less<>> symbols_;
+    uint32_t keyframe_interval_;
+    uint32_t frames_since_keyframe_;
+    bool keyframe_pending_;
+};
+
+class StreamDecoder {
+public:
+    // Reads a frame header. Returns false if the announced body is implausibly large.
+    static bool read_header(const uint8_t* header, uint32_t& body_bytes, uint32_t& records, bool& keyframe) {
+
+        uint32_t count;
+        std::memcpy(&body_bytes, header, sizeof(body_bytes));
+        std::memcpy(&count, header + sizeof(body_bytes), sizeof(count));
+        records = count & ~frame_keyframe;
+        keyframe = (count & frame_keyframe) != 0;
+        return body_bytes <= max_frame_bytes;
+    }
+
+    // Appends the wire records carried by one frame body. Returns false on a malformed frame.
+    bool decode_frame(const uint8_t* body, std::size_t size, uint32_t records, bool keyframe, std::vector<message_t>& out) {
+
+        if (keyframe) {
+            symbols_.clear();
+        }
+
+        BitReader reader(body, size);
+
+        for (uint32_t i = 0; i < records; ++i) {
+
+            if (reader.read_bit()) {
+
+                message_t record;
+                uint8_t* raw = reinterpret_cast<uint8_t*>(&record);
+
+                for (std::size_t b = 0; b < sizeof(message_t); ++b) {
+                    raw[b] = static_cast<uint8_t>(reader.read_bits(8));
+                }
+
+                out.push_back(record);
+                continue;
+            }
+
+            if (!decode_update(reader, out)) {
+                return false;
+            }
+        }
+
+        return reader.ok();
+    }
+
+private:
+    struct symbol_state_t {
+        message_t record;
+        gorilla_state_t series;
+    };
+
+    bool decode_update(BitReader& reader, std::vector<message_t>& out) {
+
+        symbol_state_t* state;
+
+        if (reader.read_bit()) {
+
+            symbols_.emplace_back();
+            state = &symbols_.back();
+
+            std::size_t length = static_cast<std::size_t>(reader.read_bits(7));
+
+            for (std::size_t c = 0; c < length; ++c) {
+
+                char value = static_cast<char>(reader.read_bits(8));
+
+                if (c < state->record.symbol.size()) {
+                    state->record.symbol[c] = value;
+                }
+            }
+        } else {
+
+            uint64_t index = reader.read_bit() ? reader.read_bits(32) : reader.read_bits(4);
+
+            if (index >= symbols_.size()) {
+                return false;
+            }
+
+            state = &symbols_[index];
+        }
+
+        message_t update = state->record;
+
+        if (!decode_sample(reader, state->series, update.timestamp_ns, update.net_position)) {
+            return false;
+        }
+
+        if (reader.read_bit()) {
+            gorilla_state_t offset;
+            offset.previous_timestamp = update.timestamp_ns;
+            update.receive_ns = decode_timestamp(reader, offset);
+        }
+
+        out.push_back(update);
+        return true;
+    }
+
+    std::vector<symbol_state_t> symbols_;
+};
+
+#endif // STREAM_CODEC_H
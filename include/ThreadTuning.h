@@ -0,0 +1,114 @@
+#ifndef THREAD_TUNING_H
+#define THREAD_TUNING_H
+
+#include <boost/asio.hpp>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// How a thread waits for work. blocking parks in the kernel (io_context::run, condition
+// variables); busy_poll spins on io_context::poll() and the ingest queue, trading a whole
+// core per thread for lower and steadier wake-up latency.
+enum class wait_mode {
+    blocking,
+    busy_poll
+};
+
+struct thread_tuning_t {
+    wait_mode mode = wait_mode::blocking;
+    int cpu = -1;                 // CPU to pin to, -1 leaves the thread unpinned
+    int busy_poll_usec = 50;      // SO_BUSY_POLL budget for sockets in busy_poll mode
+};
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Pins the calling thread to one CPU. Returns false where affinity is unsupported or refused.
+inline bool pin_current_thread(int cpu) {
+
+    if (cpu < 0) {
+        return false;
+    }
+
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+// Lets the kernel busy-poll the device queue on blocking socket reads. Needs a kernel built
+// with CONFIG_NET_RX_BUSY_POLL; raising the value may need CAP_NET_ADMIN.
+inline bool enable_socket_busy_poll(boost::asio::ip::tcp::socket& socket, int usec) {
+
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+    if (usec <= 0 || !socket.is_open()) {
+        return false;
+    }
+
+    return ::setsockopt(socket.native_handle(), SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == 0;
+#else
+    (void)socket;
+    (void)usec;
+    return false;
+#endif
+}
+
+// Drives an io_context until it is stopped, either parked in run() or spinning on poll().
+inline void run_io_context(boost::asio::io_context& io_context, wait_mode mode) {
+
+    if (mode == wait_mode::blocking) {
+        io_context.run();
+        return;
+    }
+
+    while (!io_context.stopped()) {
+        if (io_context.poll() == 0) {
+            cpu_relax();
+        }
+    }
+}
+
+// Parses a CPU list such as "2,3,6" into CPU numbers. Malformed entries are skipped.
+inline std::vector<int> parse_cpu_list(const std::string& list) {
+
+    std::vector<int> cpus;
+    std::size_t begin = 0;
+
+    while (begin <= list.size()) {
+
+        std::size_t end = list.find(',', begin);
+
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+
+        try {
+            cpus.push_back(std::stoi(list.substr(begin, end - begin)));
+        } catch (const std::exception&) {
+        }
+
+        begin = end + 1;
+    }
+
+    return cpus;
+}
+
+#endif // THREAD_TUNING_H
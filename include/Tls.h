@@ -0,0 +1,354 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <boost/asio.hpp>
+#include <boost/asio/ssl/error.hpp>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <memory>
+#include <string>
+
+using boost::asio::ip::tcp;
+
+// Optional TLS on client and server sessions. OpenSSL runs the handshake straight on the
+// socket's descriptor with SSL_OP_ENABLE_KTLS set, so on a kernel with the tls ULP it installs
+// the session keys in the socket (kTLS) and the record layer runs in the kernel. When both
+// directions were offloaded the socket carries plaintext as far as user space is concerned and a
+// session keeps its plain read and write paths: an outbound batch goes from the session's queue
+// to the kernel in one gather write, with no encrypt-and-copy per subscriber in user space.
+// Otherwise the session reads and writes through the channel below (SSL_read / SSL_write), which
+// still lets the kernel encrypt whichever direction it did take.
+
+struct tls_options_t {
+    bool enabled = false;
+    bool kernel_offload = true;       // false keeps the record layer in user space
+    std::string certificate_file;     // server: PEM certificate chain
+    std::string private_key_file;     // server: PEM private key
+    std::string ca_file;              // client: CA the server is verified against (system roots when empty)
+};
+
+using tls_context_ptr = std::shared_ptr<SSL_CTX>;
+
+inline std::string tls_error_string() {
+
+    unsigned long error = ERR_get_error();
+
+    if (error == 0) {
+        return "unknown TLS error";
+    }
+
+    char text[256];
+    ERR_error_string_n(error, text, sizeof(text));
+    return text;
+}
+
+// Returns null, with the reason in `error`, when the certificate, key or CA cannot be loaded.
+inline tls_context_ptr make_tls_context(const tls_options_t& options, bool server, std::string& error) {
+
+    SSL_CTX* context = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+
+    if (context == nullptr) {
+        error = tls_error_string();
+        return nullptr;
+    }
+
+    tls_context_ptr owned(context, SSL_CTX_free);
+
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    SSL_CTX_set_mode(context, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    // A peer that closes without close_notify reads as end of stream, like a plain socket.
+    SSL_CTX_set_options(context, SSL_OP_IGNORE_UNEXPECTED_EOF);
+
+#ifdef SSL_OP_ENABLE_KTLS
+    if (options.kernel_offload) {
+        SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+    }
+#endif
+
+    if (server) {
+
+        // No session tickets: a record after the handshake would fail a client's plaintext kTLS read.
+        SSL_CTX_set_num_tickets(context, 0);
+
+        if (SSL_CTX_use_certificate_chain_file(context, options.certificate_file.c_str()) != 1
+            || SSL_CTX_use_PrivateKey_file(context, options.private_key_file.c_str(), SSL_FILETYPE_PEM) != 1) {
+            error = tls_error_string();
+            return nullptr;
+        }
+
+        return owned;
+    }
+
+    int loaded = options.ca_file.empty() ? SSL_CTX_set_default_verify_paths(context)
+                                         : SSL_CTX_load_verify_locations(context, options.ca_file.c_str(), nullptr);
+
+    if (loaded != 1) {
+        error = tls_error_string();
+        return nullptr;
+    }
+
+    SSL_CTX_set_verify(context, SSL_VERIFY_PEER, nullptr);
+    return owned;
+}
+
+// One TLS connection over an Asio TCP socket. The asynchronous operations retry their SSL call
+// whenever the socket becomes readable or writable, and allocate through the completion handler's
+// allocator, so a session's handler_memory serves them as it does plain reads and writes. They
+// never complete inside the initiating call.
+class TlsChannel {
+public:
+    // A client checks the server's certificate against `host`: its IP addresses for an address,
+    // its DNS names (and SNI) otherwise.
+    TlsChannel(const tls_context_ptr& context, bool server, const std::string& host = std::string())
+        : context_(context), ssl_(SSL_new(context.get())), server_(server) {
+
+        if (server || host.empty()) {
+            return;
+        }
+
+        boost::system::error_code not_address;
+        boost::asio::ip::make_address(host, not_address);
+
+        if (!not_address) {
+            X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl_), host.c_str());
+            return;
+        }
+
+        SSL_set1_host(ssl_, host.c_str());
+        SSL_set_tlsext_host_name(ssl_, host.c_str());
+    }
+
+    ~TlsChannel() {
+        SSL_free(ssl_);
+    }
+
+    TlsChannel(const TlsChannel&) = delete;
+    TlsChannel& operator=(const TlsChannel&) = delete;
+
+    bool kernel_send() const { return BIO_get_ktls_send(SSL_get_wbio(ssl_)); }
+    bool kernel_receive() const { return BIO_get_ktls_recv(SSL_get_rbio(ssl_)); }
+
+    // Both directions are in the kernel, so the socket is read and written directly.
+    bool offloaded() const { return kernel_send() && kernel_receive(); }
+
+    const char* record_layer() const {
+        return offloaded() ? "kTLS" : kernel_send() ? "kTLS send, userspace receive" : kernel_receive() ? "kTLS receive, userspace send" : "userspace";
+    }
+
+    const char* version() const { return SSL_get_version(ssl_); }
+
+    // handler(error_code)
+    template <typename Handler>
+    void async_handshake(tcp::socket& socket, Handler handler) {
+
+        attach(socket);
+
+        start(socket, [](SSL* ssl, std::size_t&) {
+            return SSL_do_handshake(ssl);
+        }, [handler = std::move(handler)](boost::system::error_code ec, std::size_t) mutable {
+            handler(ec);
+        });
+    }
+
+    // Blocks; for clients that connect synchronously.
+    bool handshake(tcp::socket& socket, boost::system::error_code& ec) {
+
+        attach(socket);
+
+        std::size_t done = 0;
+        run_blocking(socket, [](SSL* ssl, std::size_t&) { return SSL_do_handshake(ssl); }, done, ec);
+        return !ec;
+    }
+
+    // handler(error_code, bytes) with at least one byte read, as socket::async_read_some.
+    template <typename Handler>
+    void async_read_some(tcp::socket& socket, boost::asio::mutable_buffer buffer, Handler handler) {
+
+        start(socket, [buffer](SSL* ssl, std::size_t& done) {
+
+            int result = SSL_read(ssl, buffer.data(), static_cast<int>(buffer.size()));
+
+            if (result > 0) {
+                done = static_cast<std::size_t>(result);
+            }
+
+            return result;
+        }, std::move(handler));
+    }
+
+    // Fills the whole buffer, as boost::asio::async_read.
+    template <typename Handler>
+    void async_read(tcp::socket& socket, boost::asio::mutable_buffer buffer, Handler handler) {
+
+        start(socket, [buffer](SSL* ssl, std::size_t& done) {
+
+            while (done < buffer.size()) {
+
+                int result = SSL_read(ssl, static_cast<uint8_t*>(buffer.data()) + done, static_cast<int>(buffer.size() - done));
+
+                if (result <= 0) {
+                    return result;
+                }
+
+                done += static_cast<std::size_t>(result);
+            }
+
+            return 1;
+        }, std::move(handler));
+    }
+
+    // Writes the whole buffer, as boost::asio::async_write; bytes counts plaintext written.
+    template <typename Handler>
+    void async_write(tcp::socket& socket, boost::asio::const_buffer buffer, Handler handler) {
+        start(socket, write_step{buffer}, std::move(handler));
+    }
+
+    std::size_t write(tcp::socket& socket, boost::asio::const_buffer buffer, boost::system::error_code& ec) {
+
+        std::size_t done = 0;
+        run_blocking(socket, write_step{buffer}, done, ec);
+        return done;
+    }
+
+private:
+    struct write_step {
+        boost::asio::const_buffer buffer;
+
+        int operator()(SSL* ssl, std::size_t& done) const {
+
+            while (done < buffer.size()) {
+
+                // A retry after WANT_WRITE passes the same bytes again, as SSL_write requires.
+                int result = SSL_write(ssl, static_cast<const uint8_t*>(buffer.data()) + done, static_cast<int>(buffer.size() - done));
+
+                if (result <= 0) {
+                    return result;
+                }
+
+                done += static_cast<std::size_t>(result);
+            }
+
+            return 1;
+        }
+    };
+
+    // The descriptor is made non-blocking underneath Asio, so SSL calls return WANT_READ or
+    // WANT_WRITE instead of blocking the I/O thread, while Asio's own synchronous calls still block.
+    void attach(tcp::socket& socket) {
+
+        boost::system::error_code ignore;
+        socket.native_non_blocking(true, ignore);
+        SSL_set_fd(ssl_, static_cast<int>(socket.native_handle()));
+
+        if (server_) {
+            SSL_set_accept_state(ssl_);
+        } else {
+            SSL_set_connect_state(ssl_);
+        }
+    }
+
+    // Maps an SSL call's result to what happens next: done, a wait for the socket, or an error.
+    enum class next_step { finished, wait_read, wait_write, failed };
+
+    next_step classify(int result, boost::system::error_code& ec) {
+
+        if (result > 0) {
+            return next_step::finished;
+        }
+
+        switch (SSL_get_error(ssl_, result)) {
+            case SSL_ERROR_WANT_READ:
+                return next_step::wait_read;
+            case SSL_ERROR_WANT_WRITE:
+                return next_step::wait_write;
+            case SSL_ERROR_ZERO_RETURN:
+                ec = boost::asio::error::eof;
+                return next_step::failed;
+            case SSL_ERROR_SYSCALL:
+                ec = errno != 0 ? boost::system::error_code(errno, boost::system::system_category()) : boost::asio::error::eof;
+                return next_step::failed;
+            default:
+                ec = boost::system::error_code(static_cast<int>(ERR_get_error()), boost::asio::error::get_ssl_category());
+                return next_step::failed;
+        }
+    }
+
+    template <typename Step>
+    void run_blocking(tcp::socket& socket, Step step, std::size_t& done, boost::system::error_code& ec) {
+
+        for (;;) {
+
+            ERR_clear_error();
+            errno = 0;
+
+            next_step next = classify(step(ssl_, done), ec);
+
+            if (next == next_step::finished || next == next_step::failed) {
+                return;
+            }
+
+            socket.wait(next == next_step::wait_read ? tcp::socket::wait_read : tcp::socket::wait_write, ec);
+
+            if (ec) {
+                return;
+            }
+        }
+    }
+
+    template <typename Step, typename Handler>
+    struct operation {
+        TlsChannel& channel;
+        tcp::socket& socket;
+        Step step;
+        Handler handler;
+        std::size_t done;
+        bool finished;
+        boost::system::error_code result;
+
+        using allocator_type = boost::asio::associated_allocator_t<Handler>;
+
+        allocator_type get_allocator() const noexcept {
+            return boost::asio::get_associated_allocator(handler);
+        }
+
+        void operator()(boost::system::error_code ec = boost::system::error_code()) {
+
+            if (finished) {
+                handler(result, done);
+                return;
+            }
+
+            if (ec) {
+                handler(ec, done);
+                return;
+            }
+
+            ERR_clear_error();
+            errno = 0;
+
+            next_step next = channel.classify(step(channel.ssl_, done), result);
+
+            if (next == next_step::wait_read || next == next_step::wait_write) {
+                socket.async_wait(next == next_step::wait_read ? tcp::socket::wait_read : tcp::socket::wait_write, std::move(*this));
+                return;
+            }
+
+            // Completed without waiting: deliver it from the executor rather than from inside the caller.
+            finished = true;
+            boost::asio::post(socket.get_executor(), std::move(*this));
+        }
+    };
+
+    template <typename Step, typename Handler>
+    void start(tcp::socket& socket, Step step, Handler handler) {
+        operation<Step, Handler>{*this, socket, std::move(step), std::move(handler), 0, false, boost::system::error_code()}();
+    }
+
+    tls_context_ptr context_;
+    SSL* ssl_;
+    bool server_;
+};
+
+#endif // TLS_H
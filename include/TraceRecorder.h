@@ -0,0 +1,198 @@
+#ifndef TRACE_RECORDER_H
+#define TRACE_RECORDER_H
+
+#include "Clock.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// An in-process flight recorder for the probe points in Probes.h, for when no tracer can be
+// attached. Off until start(); then each thread that records gets its own ring of fixed-size
+// events, which it alone writes, so recording takes no lock and shares no cache line with another
+// thread. A full ring overwrites its oldest events. dump() writes the events of the last window
+// as Chrome trace-event JSON, which chrome://tracing and Perfetto open directly, with one track
+// per recording thread.
+class TraceRecorder {
+public:
+    static void start(std::size_t events_per_thread) {
+
+        state_t& state = instance();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.capacity = std::max<std::size_t>(events_per_thread, 1);
+        state.active.store(true, std::memory_order_release);
+    }
+
+    static void stop() {
+
+        instance().active.store(false, std::memory_order_release);
+    }
+
+    static bool active() {
+
+        return instance().active.load(std::memory_order_relaxed);
+    }
+
+    static void instant(const char* name, uint64_t a, uint64_t b) {
+
+        record(name, Clock::now_ns(), -1, a, b);
+    }
+
+    // An event spanning from start_ns to now; an instant if start_ns is 0 (the span began before
+    // recording was started).
+    static void complete(const char* name, int64_t start_ns, uint64_t a, uint64_t b) {
+
+        int64_t now = Clock::now_ns();
+
+        if (start_ns <= 0) {
+            record(name, now, -1, a, b);
+        } else {
+            record(name, start_ns, now > start_ns ? now - start_ns : 0, a, b);
+        }
+    }
+
+    // Writes the events from the window_ns before the newest one recorded. Safe to call while
+    // threads are still recording; an event being overwritten during the dump is left out.
+    static bool dump(const std::string& path, int64_t window_ns) {
+
+        struct snapshot_t {
+            const char* name;
+            int64_t ts_ns;
+            int64_t dur_ns;
+            uint64_t a;
+            uint64_t b;
+            std::size_t tid;
+        };
+
+        std::vector<snapshot_t> events;
+        state_t& state = instance();
+
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+
+            for (std::size_t tid = 0; tid < state.rings.size(); ++tid) {
+                const ring_t& ring = *state.rings[tid];
+                uint64_t head = ring.head.load(std::memory_order_acquire);
+                uint64_t first = head > ring.events.size() ? head - ring.events.size() : 0;
+
+                for (uint64_t index = first; index < head; ++index) {
+                    const event_t& event = ring.events[index % ring.events.size()];
+                    uint64_t before = event.seq.load(std::memory_order_acquire);
+
+                    snapshot_t copy{event.name.load(std::memory_order_relaxed), event.ts_ns.load(std::memory_order_relaxed),
+                                    event.dur_ns.load(std::memory_order_relaxed), event.a.load(std::memory_order_relaxed),
+                                    event.b.load(std::memory_order_relaxed), tid + 1};
+
+                    std::atomic_thread_fence(std::memory_order_acquire);
+
+                    if (before == 2 * (index + 1) && event.seq.load(std::memory_order_relaxed) == before) {
+                        events.push_back(copy);
+                    }
+                }
+            }
+        }
+
+        int64_t newest = 0;
+
+        for (const auto& event : events) {
+            newest = std::max(newest, event.ts_ns + std::max<int64_t>(event.dur_ns, 0));
+        }
+
+        events.erase(std::remove_if(events.begin(), events.end(), [&](const snapshot_t& event) { return event.ts_ns < newest - window_ns; }), events.end());
+        std::sort(events.begin(), events.end(), [](const snapshot_t& left, const snapshot_t& right) { return left.ts_ns < right.ts_ns; });
+
+        FILE* file = std::fopen(path.c_str(), "w");
+
+        if (file == nullptr) {
+            return false;
+        }
+
+        // Chrome takes microseconds; they are kept relative to the first event so the fraction
+        // survives the conversion to double.
+        int64_t origin = events.empty() ? 0 : events.front().ts_ns;
+
+        std::fprintf(file, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"origin_ns\":%lld},\"traceEvents\":[", static_cast<long long>(origin));
+
+        for (std::size_t i = 0; i < events.size(); ++i) {
+            const snapshot_t& event = events[i];
+
+            std::fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"position\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,", i == 0 ? "" : ",", event.name, event.tid,
+                         static_cast<double>(event.ts_ns - origin) / 1000.0);
+
+            if (event.dur_ns >= 0) {
+                std::fprintf(file, "\"ph\":\"X\",\"dur\":%.3f,", static_cast<double>(event.dur_ns) / 1000.0);
+            } else {
+                std::fprintf(file, "\"ph\":\"i\",\"s\":\"t\",");
+            }
+
+            std::fprintf(file, "\"args\":{\"a\":%llu,\"b\":%llu}}", static_cast<unsigned long long>(event.a), static_cast<unsigned long long>(event.b));
+        }
+
+        std::fprintf(file, "\n]}\n");
+        return std::fclose(file) == 0;
+    }
+
+private:
+    // Every field is atomic so the dump can read a slot while its thread overwrites it; seq is
+    // odd while a write is under way and 2 * (event number + 1) once it is done.
+    struct event_t {
+        std::atomic<uint64_t> seq{0};
+        std::atomic<const char*> name{nullptr};
+        std::atomic<int64_t> ts_ns{0};
+        std::atomic<int64_t> dur_ns{0};
+        std::atomic<uint64_t> a{0};
+        std::atomic<uint64_t> b{0};
+    };
+
+    struct ring_t {
+        explicit ring_t(std::size_t capacity) : events(capacity), head(0) {}
+
+        std::vector<event_t> events;
+        alignas(64) std::atomic<uint64_t> head;
+    };
+
+    // Rings outlive their threads so a dump at shutdown still sees the events of threads that
+    // have already exited.
+    struct state_t {
+        std::atomic<bool> active{false};
+        std::mutex mutex;
+        std::size_t capacity = 0;
+        std::vector<std::unique_ptr<ring_t>> rings;
+    };
+
+    static state_t& instance() {
+        static state_t state;
+        return state;
+    }
+
+    static void record(const char* name, int64_t ts_ns, int64_t dur_ns, uint64_t a, uint64_t b) {
+
+        thread_local ring_t* ring = nullptr;
+
+        if (ring == nullptr) {
+            state_t& state = instance();
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.rings.push_back(std::make_unique<ring_t>(state.capacity));
+            ring = state.rings.back().get();
+        }
+
+        uint64_t index = ring->head.load(std::memory_order_relaxed);
+        event_t& event = ring->events[index % ring->events.size()];
+
+        event.seq.store(2 * index + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        event.name.store(name, std::memory_order_relaxed);
+        event.ts_ns.store(ts_ns, std::memory_order_relaxed);
+        event.dur_ns.store(dur_ns, std::memory_order_relaxed);
+        event.a.store(a, std::memory_order_relaxed);
+        event.b.store(b, std::memory_order_relaxed);
+        event.seq.store(2 * (index + 1), std::memory_order_release);
+        ring->head.store(index + 1, std::memory_order_release);
+    }
+};
+
+#endif // TRACE_RECORDER_H
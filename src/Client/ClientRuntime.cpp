@@ -0,0 +1,59 @@
+#include "ClientRuntime.h"
+#include "../../include/Common.h"
+#include <iostream>
+
+ClientRuntime::ClientRuntime(std::size_t threads, thread_tuning_t tuning)
+    : tuning_(tuning), next_context_(0), stopped_(false) {
+
+    for (std::size_t i = 0; i < std::max<std::size_t>(threads, 1); ++i) {
+        // Each context is driven by exactly one thread, as on the server.
+        contexts_.push_back(std::make_shared<boost::asio::io_context>(1));
+        work_.push_back(boost::asio::make_work_guard(*contexts_.back()));
+    }
+
+    for (std::size_t i = 0; i < contexts_.size(); ++i) {
+        threads_.emplace_back(&ClientRuntime::run, this, i);
+    }
+}
+
+ClientRuntime::~ClientRuntime() {
+    stop();
+}
+
+void ClientRuntime::stop() {
+
+    if (stopped_.exchange(true)) {
+        return;
+    }
+
+    work_.clear();
+
+    for (auto& context : contexts_) {
+        context->stop();
+    }
+
+    for (auto& thread : threads_) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+}
+
+std::shared_ptr<boost::asio::io_context> ClientRuntime::next_context() {
+    return contexts_[next_context_.fetch_add(1, std::memory_order_relaxed) % contexts_.size()];
+}
+
+void ClientRuntime::run(std::size_t index) {
+
+    if (tuning_.cpu >= 0 && !pin_current_thread(tuning_.cpu + static_cast<int>(index))) {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cerr << "Could not pin client runtime thread " << index << " to CPU " << tuning_.cpu + static_cast<int>(index) << std::endl;
+    }
+
+    try {
+        run_io_context(*contexts_[index], tuning_.mode);
+    } catch (const std::exception& e) {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cerr << "Exception in client runtime thread " << index << ": " << e.what() << std::endl;
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef CLIENT_RUNTIME_H
+#define CLIENT_RUNTIME_H
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "../../include/ThreadTuning.h"
+
+// A small pool of I/O threads for hosting many PositionClient sessions in one process (a gateway
+// with thousands of client IDs). Each thread drives its own io_context; sessions created on the
+// runtime are spread over them round-robin and do all their I/O there, so a session costs a socket
+// and a few KB of buffers rather than an io_context and a thread. Every session must be destroyed
+// before the runtime.
+class ClientRuntime {
+public:
+    // Thread i is pinned to tuning.cpu + i when tuning.cpu is set.
+    explicit ClientRuntime(std::size_t threads = 1, thread_tuning_t tuning = thread_tuning_t());
+    ~ClientRuntime();
+
+    void stop();
+    bool stopped() const { return stopped_.load(std::memory_order_acquire); }
+
+    std::shared_ptr<boost::asio::io_context> next_context();
+    std::size_t threads() const { return contexts_.size(); }
+    const thread_tuning_t& tuning() const { return tuning_; }
+
+private:
+    void run(std::size_t index);
+
+    thread_tuning_t tuning_;
+    std::vector<std::shared_ptr<boost::asio::io_context>> contexts_;
+    std::vector<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>> work_;
+    std::vector<std::thread> threads_;
+    std::atomic<std::size_t> next_context_;
+    std::atomic<bool> stopped_;
+};
+
+#endif // CLIENT_RUNTIME_H
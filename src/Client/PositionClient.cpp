@@ -1,41 +1,110 @@
 #include "PositionClient.h"
+#include "ClientRuntime.h"
 #include <iostream>
 #include "../../include/Common.h"
+#include "../../include/Probes.h"
 
-PositionClient::PositionClient(const std::string& host, short port, const std::string& clientID, bool& debugLogs, short local_port)
-    :   io_context_(std::make_shared<boost::asio::io_context>()), host_(host), port_(port), socket_(std::make_unique<tcp::socket>(*io_context_)), running_(false), local_port_(local_port),
-      clientID_(clientID), clientDebugLogs_(debugLogs), buffer_(sizeof(message_t)), 
-      work_guard_(boost::asio::make_work_guard(*io_context_)) {
+// Wraps a completion handler so the client's outstanding_ count covers it from initiation until
+// it returns. Asio frees the handler's memory before invoking it, so nothing of the client is
+// touched once the count drops.
+template <typename Handler>
+static auto counted(std::atomic<int>& outstanding, Handler handler) {
+
+    outstanding.fetch_add(1, std::memory_order_relaxed);
+
+    return [&outstanding, handler = std::move(handler)](auto&&... args) mutable {
+        handler(std::forward<decltype(args)>(args)...);
+        outstanding.fetch_sub(1, std::memory_order_release);
+    };
+}
+
+// Builds the TLS context once per client; every connection, including reconnects, gets its own channel on it.
+static tls_context_ptr client_tls_context(const tls_options_t& options) {
+
+    if (!options.enabled) {
+        return nullptr;
+    }
+
+    std::string error;
+    tls_context_ptr context = make_tls_context(options, false, error);
+
+    if (!context) {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cerr << "Could not set up TLS: " << error << std::endl;
+    }
+
+    return context;
+}
+
+PositionClient::PositionClient(const std::string& host, short port, const std::string& clientID, bool& debugLogs, short local_port, thread_tuning_t tuning, stream_encoding encoding, const tls_options_t& tls)
+    :   running_(false), host_(host), port_(port), local_port_(local_port), io_context_(std::make_shared<boost::asio::io_context>()),
+      work_guard_(boost::asio::make_work_guard(*io_context_)), socket_(std::make_unique<tcp::socket>(*io_context_)), buffer_(sizeof(message_t)),
+      clientID_(clientID), clientDebugLogs_(debugLogs), tuning_(tuning), encoding_(encoding), tls_options_(tls), tls_context_(client_tls_context(tls)) {
 
     reconnectCount = 0;
+    endpoints_.emplace_back(host, port);
+    pending_writes_.reserve(256);
+    in_flight_.reserve(256);
 
     std::cout << "Starting client...\n";
 
     connect();
 
-    receive_thread_ = std::make_unique<std::thread>([this]() {
-        try {
-            io_context_->run();
-        } catch (const std::exception& e) {
-            std::lock_guard<std::mutex> lock(print_mutex);
-            std::cerr << "Exception in io_context.run(): " << e.what() << std::endl;
-        }
-    });
+    receive_thread_ = std::make_unique<std::thread>(&PositionClient::run_receive_loop, this);
 
 }
 
+// No io_context, thread or write reserve of its own: the session shares one of the runtime's
+// contexts and is connected by handlers on it, so the constructor returns straight away.
+PositionClient::PositionClient(ClientRuntime& runtime, const std::string& host, short port, const std::string& clientID, bool& debugLogs, stream_encoding encoding, const tls_options_t& tls)
+    :   running_(false), host_(host), port_(port), local_port_(0), io_context_(runtime.next_context()), socket_(std::make_unique<tcp::socket>(*io_context_)),
+      buffer_(sizeof(message_t)), clientID_(clientID), clientDebugLogs_(debugLogs), tuning_(runtime.tuning()), encoding_(encoding),
+      tls_options_(tls), tls_context_(client_tls_context(tls)), runtime_(&runtime) {
+
+    reconnectCount = 0;
+    disconnected_ = false;
+    endpoints_.emplace_back(host, port);
+
+    boost::asio::post(*io_context_, counted(outstanding_, [this]() {
+        begin_connect(false);
+    }));
+}
+
 PositionClient::~PositionClient() {
 
     stop();
-    std::lock_guard<std::mutex> lock(print_mutex);
-    std::cout << "Position client has been destructed...\n"; 
+
+    if (verbose()) {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << "Position client has been destructed...\n"; 
+    }
 }
 
+bool PositionClient::wait_connected(std::chrono::milliseconds timeout) {
+
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+
+    while (!running_ && !stopping_ && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    return running_;
+}
 
 void PositionClient::start() {
 
+    if (runtime_) {
+
+        stopping_ = false;
+        boost::asio::post(*io_context_, counted(outstanding_, [this]() {
+            begin_connect(false);
+        }));
+        return;
+    }
+
     std::cout << "Starting client...\n";
 
+    stopping_ = false;
     work_guard_.reset(); 
     work_guard_.emplace(boost::asio::make_work_guard(*io_context_));
 
@@ -43,23 +112,30 @@ void PositionClient::start() {
 
     receive_thread_.reset();
 
-    receive_thread_ = std::make_unique<std::thread>([this]() {
-        try {
-            io_context_->run();
-        } catch (const std::exception& e) {
-            std::lock_guard<std::mutex> lock(print_mutex);
-            std::cerr << "Exception in io_context.run(): " << e.what() << std::endl;
-        }
-    });
+    receive_thread_ = std::make_unique<std::thread>(&PositionClient::run_receive_loop, this);
+
+}
+
+void PositionClient::add_failover_endpoint(const std::string& host, short port) {
+    endpoints_.emplace_back(host, port);
+}
 
+bool PositionClient::on_receive_thread() const {
+    return receive_thread_ && receive_thread_->get_id() == std::this_thread::get_id();
 }
 
 void PositionClient::stop() {
 
     // if (!running_) return;
 
+    if (runtime_) {
+        stop_session();
+        return;
+    }
+
     running_ = false;
     disconnected_ = true;
+    stopping_ = true;
 
     boost::system::error_code ignore;
 
@@ -68,6 +144,12 @@ void PositionClient::stop() {
     }
 
     io_context_->stop();
+    fail_queries();
+
+    // Reconnect handling runs on the receive thread, which exits on its own once the context stops.
+    if (on_receive_thread()) {
+        return;
+    }
 
     if (receive_thread_ && receive_thread_->joinable()) {
         receive_thread_->join();
@@ -79,255 +161,611 @@ void PositionClient::stop() {
     io_context_->reset();
 }
 
-bool PositionClient::connect() {
+// A runtime session cannot stop the shared io_context, so it closes its socket on its own I/O
+// thread and then waits until none of its handlers is queued or running.
+void PositionClient::stop_session() {
 
-    std::cout << "We have entered the connect function...\n";
+    running_ = false;
+    disconnected_ = true;
+    stopping_ = true;
 
-    try {
+    boost::asio::post(*io_context_, counted(outstanding_, [this]() {
+        boost::system::error_code ignore;
 
-        {
-            std::lock_guard<std::mutex> lock(print_mutex);
-            std::cout << "Attempting to connect...\n";
+        if (socket_) {
+            socket_->close(ignore);
         }
 
-        socket_ = std::make_unique<tcp::socket>(*io_context_);
+        if (resolver_) {
+            resolver_->cancel();
+        }
 
-        tcp::resolver resolver(*io_context_);
-        auto endpoints = resolver.resolve(host_, std::to_string(port_));
+        if (retry_timer_) {
+            retry_timer_->cancel();
+        }
 
-        tcp::endpoint local_endpoint(tcp::v4(), local_port_);
-        socket_->open(tcp::v4());
-        socket_->bind(local_endpoint);
+        if (publish_timer_) {
+            publish_timer_->cancel();
+        }
+    }));
 
-        boost::system::error_code ec;
-        boost::asio::connect(*socket_, endpoints, ec);
+    fail_queries();
 
-        if (ec) {
+    // Waiting on one of the runtime's own threads would stop the handlers from ever draining, and
+    // once the runtime has stopped they never run; either way the context destroys them unrun.
+    if (io_context_->get_executor().running_in_this_thread() || runtime_->stopped()) {
+        return;
+    }
 
-            {
-                std::lock_guard<std::mutex> lock(print_mutex);
-                std::cerr << "Connection failed: " << ec.message() << std::endl;
-            }
+    while (outstanding_.load(std::memory_order_acquire) > 0) {
+        std::this_thread::yield();
+    }
+}
 
-            socket_->close();
-            return false;
-        }
+// The asynchronous counterpart of connect(): tries each endpoint in turn from the one last used.
+void PositionClient::begin_connect(bool reconnecting) {
 
-        {
-            std::lock_guard<std::mutex> lock(print_mutex);
-            std::cout << "Connected to server.\n";
-            std::cout << "NOW OPERATING ON :" << socket_->remote_endpoint().address().to_string() << ":" << socket_->remote_endpoint().port() << std::endl;
-            running_ = true;
-        }
+    if (stopping_) {
+        return;
+    }
 
-        message_t message;
-        std::strncpy(message.symbol.data(), clientID_.data(), message.symbol.size());
-        message.net_position = 123.45;
+    reconnecting_ = reconnecting;
+    connect_attempt_ = 0;
+    connect_endpoint();
+}
 
-        boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
-        std::string timestamp_str = boost::posix_time::to_simple_string(now);
-        std::copy(timestamp_str.begin(), timestamp_str.end(), message.timestamp.begin());
+void PositionClient::connect_endpoint() {
 
-        std::memcpy(buffer_.data(), &message, sizeof(message));
+    if (connect_attempt_ > 0) {
+        endpoint_index_ = (endpoint_index_ + 1) % endpoints_.size();
+    }
 
-        boost::system::error_code error;
-        socket_->write_some(boost::asio::buffer(buffer_, sizeof(message_t)), error);
+    host_ = endpoints_[endpoint_index_].first;
+    port_ = endpoints_[endpoint_index_].second;
 
-        if (error) {
+    if (!resolver_) {
+        resolver_ = std::make_unique<tcp::resolver>(*io_context_);
+    }
 
-            {
-                std::lock_guard<std::mutex> lock(print_mutex);
-                std::cerr << "Failed to send client ID: " << error.message() << std::endl;
-            }
+    resolver_->async_resolve(host_, std::to_string(port_), counted(outstanding_, [this](boost::system::error_code ec, tcp::resolver::results_type endpoints) {
+        if (stopping_) {
+            return;
+        }
 
-            socket_->close();
-            running_ = false;
-            return false;
+        if (ec) {
+            endpoint_failed(ec);
+            return;
         }
 
-        do_receive(); 
-        return true;
+        socket_ = std::make_unique<tcp::socket>(*io_context_);
+        tls_.reset();
 
-    } catch (const std::exception& e) {
+        boost::asio::async_connect(*socket_, endpoints, counted(outstanding_, [this](boost::system::error_code ec, const tcp::endpoint& /*endpoint*/) {
+            if (stopping_) {
+                return;
+            }
+
+            if (ec) {
+                endpoint_failed(ec);
+                return;
+            }
+
+            on_connected();
+        }));
+    }));
+}
+
+void PositionClient::endpoint_failed(const boost::system::error_code& ec) {
 
+    if (verbose()) {
         std::lock_guard<std::mutex> lock(print_mutex);
-        std::cerr << "Failed to connect: " << e.what() << std::endl;
-        return false;
+        std::cerr << "Connection to " << host_ << ":" << port_ << " failed: " << ec.message() << std::endl;
     }
-}
 
-bool PositionClient::setConnection() {
+    boost::system::error_code ignore;
 
-    std::cout << "We have entered the connect function...\n";
+    if (socket_) {
+        socket_->close(ignore);
+    }
 
-    try {
+    if (++connect_attempt_ < endpoints_.size()) {
+        connect_endpoint();
+        return;
+    }
 
-        {
-            std::lock_guard<std::mutex> lock(print_mutex);
-            std::cout << "Attempting to connect...\n";
-        }
+    connection_failed();
+}
 
-        socket_ = std::make_unique<tcp::socket>(*io_context_);
+void PositionClient::on_connected() {
 
-        tcp::resolver resolver(*io_context_);
-        auto endpoints = resolver.resolve(host_, std::to_string(port_));
+    boost::system::error_code ec;
+    socket_->set_option(tcp::no_delay(true), ec);
 
-        if (local_port_ != 0) {
+    if (tuning_.mode == wait_mode::busy_poll) {
+        enable_socket_busy_poll(*socket_, tuning_.busy_poll_usec);
+    }
 
-            tcp::endpoint local_endpoint(tcp::v4(), local_port_);
-            socket_->open(tcp::v4());
-            socket_->bind(local_endpoint);
-        }
+    if (!tls_options_.enabled) {
+        identify();
+        return;
+    }
 
-        boost::system::error_code ec;
-        boost::asio::connect(*socket_, endpoints, ec);
+    if (!tls_context_) {
+        socket_->close(ec);
+        connection_failed();
+        return;
+    }
+
+    tls_ = std::make_unique<TlsChannel>(tls_context_, false, host_);
+
+    tls_->async_handshake(*socket_, counted(outstanding_, [this](boost::system::error_code ec) {
+        if (stopping_) {
+            return;
+        }
 
         if (ec) {
 
             {
                 std::lock_guard<std::mutex> lock(print_mutex);
-                std::cerr << "Connection failed: " << ec.message() << std::endl;
+                std::cerr << "TLS handshake with " << host_ << ":" << port_ << " failed: " << ec.message() << std::endl;
             }
 
-            socket_->close();
-            return false;
+            boost::system::error_code ignore;
+            socket_->close(ignore);
+            connection_failed();
+            return;
         }
 
-        {
-            std::lock_guard<std::mutex> lock(print_mutex);
-            std::cout << "Connected to server.\n";
-            running_ = true;
-        }
+        report_tls();
+        identify();
+    }));
+}
+
+// Runs on the session's I/O thread. The encoding request and identifying record go out with an
+// async write, so a slow peer does not hold up the other sessions on the thread, and nothing
+// queued by the application is written until they are out (do_write waits for running_).
+void PositionClient::identify() {
 
-        message_t message;
-        std::strncpy(message.symbol.data(), clientID_.data(), message.symbol.size());
-        message.net_position = 123.45;
+    std::size_t count = 0;
+
+    if (encoding_ != stream_encoding::plain) {
+        handshake_[count++] = encoding_record();
+    }
 
-        boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
-        std::string timestamp_str = boost::posix_time::to_simple_string(now);
-        std::copy(timestamp_str.begin(), timestamp_str.end(), message.timestamp.begin());
+    handshake_[count++] = identity_record();
 
-        std::memcpy(buffer_.data(), &message, sizeof(message));
+    auto handshake = boost::asio::buffer(handshake_.data(), count * sizeof(message_t));
 
-        boost::system::error_code error;
-        socket_->write_some(boost::asio::buffer(buffer_, sizeof(message_t)), error);
+    auto handler = counted(outstanding_, [this](boost::system::error_code ec, std::size_t /*length*/) {
+        if (stopping_) {
+            return;
+        }
 
-        if (error) {
+        if (ec) {
 
             {
                 std::lock_guard<std::mutex> lock(print_mutex);
-                std::cerr << "Failed to send client ID: " << error.message() << std::endl;
+                std::cerr << "Failed to send client ID: " << ec.message() << std::endl;
             }
 
-            socket_->close();
-            running_ = false;
-            return false;
+            boost::system::error_code ignore;
+            socket_->close(ignore);
+            connection_failed();
+            return;
         }
 
-        return true;
+        running_ = true;
+        disconnected_ = false;
 
-    } catch (const std::exception& e) {
+        if (verbose()) {
+            std::lock_guard<std::mutex> lock(print_mutex);
+            std::cout << (reconnecting_ ? "RECONNECTION SUCCESSFUL....\n" : "Connected to server.\n");
+            std::cout << "NOW OPERATING ON :" << socket_->remote_endpoint(ec).address().to_string() << ":" << port_ << std::endl;
+        }
 
-        std::lock_guard<std::mutex> lock(print_mutex);
-        std::cerr << "Failed to connect: " << e.what() << std::endl;
-        return false;
+        reconnectCount = 0;
+        reset_stream();
+        do_receive();
+        resubscribe();
+    });
+
+    if (tls_userspace()) {
+        tls_->async_write(*socket_, handshake, std::move(handler));
+        return;
     }
-}
 
-void PositionClient::restart_io_context() {
+    boost::asio::async_write(*socket_, handshake, std::move(handler));
+}
 
-    io_context_->reset();
-    work_guard_.reset(); 
-    work_guard_.emplace(boost::asio::make_work_guard(*io_context_));
+// As with the blocking constructor, a first connection that fails is not retried. A session that
+// gives up is stopped until start() is called again, so it stops queueing updates.
+void PositionClient::connection_failed() {
 
-    if (receive_thread_ && receive_thread_->joinable()) {
+    running_ = false;
+    disconnected_ = true;
 
-        receive_thread_->join();
+    if (!reconnecting_) {
 
         {
             std::lock_guard<std::mutex> lock(print_mutex);
-            std::cout << "recieve thread has been joined..." << std::endl;
+            std::cerr << "Client " << clientID_ << " failed to connect" << std::endl;
         }
+
+        stopping_ = true;
+        fail_queries();
+        return;
     }
 
-    receive_thread_ = std::make_unique<std::thread>([this]() {
-        try {
-            io_context_->run();
-        } catch (const std::exception& e) {
-            std::lock_guard<std::mutex> lock(print_mutex);
-            std::cerr << "Exception in io_context.run(): " << e.what() << std::endl;
-        }
-    });
+    if (verbose()) {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << "RECONNECTION UNSUCCESSFUL....\n";
+    }
+
+    if (++reconnectCount < 3) {
+        schedule_reconnect();
+    } else {
+        stopping_ = true;
+        fail_queries();
+    }
 }
 
-void PositionClient::runThreads() {
+// Waits out the reconnect delay on a timer rather than sleeping on a thread other sessions share.
+void PositionClient::schedule_reconnect() {
 
-    if (receive_thread_ && receive_thread_->joinable() && io_context_ -> stopped()) {
+    if (!retry_timer_) {
+        retry_timer_ = std::make_unique<boost::asio::steady_timer>(*io_context_);
+    }
 
-        {
-            std::lock_guard<std::mutex> lock(print_mutex);
-            std::cout << "attmepting to join running thread.." << std::endl;
+    retry_timer_->expires_after(std::chrono::seconds(5));
+    retry_timer_->async_wait(counted(outstanding_, [this](boost::system::error_code ec) {
+        if (!ec) {
+            begin_connect(true);
         }
+    }));
+}
 
-        receive_thread_->join();
+message_t PositionClient::identity_record() const {
+
+    message_t message;
+    std::strncpy(message.symbol.data(), clientID_.data(), message.symbol.size());
+    message.net_position = 123.45;
+
+    message.timestamp_ns = Clock::now_ns();
+    return message;
+}
+
+bool PositionClient::send_identity() {
+
+    message_t message = identity_record();
+    std::memcpy(buffer_.data(), &message, sizeof(message));
+
+    boost::system::error_code error;
+    write_blocking(boost::asio::buffer(buffer_, sizeof(message_t)), error);
+
+    if (error) {
 
         {
             std::lock_guard<std::mutex> lock(print_mutex);
-            std::cout << "Running thread has been joined..." << std::endl;
+            std::cerr << "Failed to send client ID: " << error.message() << std::endl;
         }
+
+        socket_->close();
+        running_ = false;
+        return false;
     }
 
-     receive_thread_ = std::make_unique<std::thread>([this]() {
-        try {
-            io_context_->run();
-        } catch (const std::exception& e) {
-            std::lock_guard<std::mutex> lock(print_mutex);
-            std::cerr << "Exception in io_context.run(): " << e.what() << std::endl;
-        }
-    });
+    return true;
 }
 
-void PositionClient::handle_disconnection() {
+// Blocking handshake for the threaded client, straight after the TCP connect.
+bool PositionClient::start_tls() {
 
-    if(!running_ && disconnected_)
-    {
-        {
-            std::lock_guard<std::mutex> lock(print_mutex); 
-            std::cout << "DISCONNECTION HAS ALREADY BEEN INTERNALLY INITIATED\n";
-        }   
+    tls_.reset();
 
-        return; 
+    if (!tls_options_.enabled) {
+        return true;
     }
 
-    running_ = false;
+    boost::system::error_code ec;
 
-    {
-        std::lock_guard<std::mutex> lock(print_mutex); 
-        std::cout << "DISCONNECTION CALLED INTERNALLY FROM FUNCTION FAILURE....\nAttempting to disconnect...\n";
+    if (!tls_context_) {
+        socket_->close(ec);
+        return false;
     }
 
-    if (socket_ && socket_->is_open()) {
+    tls_ = std::make_unique<TlsChannel>(tls_context_, false, host_);
 
-        boost::system::error_code ec;
+    if (!tls_->handshake(*socket_, ec)) {
+
+        {
+            std::lock_guard<std::mutex> lock(print_mutex);
+            std::cerr << "TLS handshake with " << host_ << ":" << port_ << " failed: " << ec.message() << std::endl;
+        }
 
         socket_->close(ec);
-        socket_.reset();
+        return false;
+    }
 
-        if (!ec) {
+    report_tls();
+    return true;
+}
 
-            {
-                std::lock_guard<std::mutex> lock(print_mutex); 
-                std::cout <<"DISCONNECTION SUCCESSFUL....\n";
-            }
+void PositionClient::report_tls() const {
 
-            disconnected_ = true; 
-        
-            handle_reconnect();
+    if (verbose()) {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << "TLS to " << host_ << ":" << port_ << ": " << tls_->version() << ", " << tls_->record_layer() << " record layer" << std::endl;
+    }
+}
 
-        } else {
+std::size_t PositionClient::write_blocking(boost::asio::const_buffer buffer, boost::system::error_code& ec) {
 
-            {
-                std::lock_guard<std::mutex> lock(print_mutex); 
+    if (tls_userspace()) {
+        return tls_->write(*socket_, buffer, ec);
+    }
+
+    return boost::asio::write(*socket_, buffer, ec);
+}
+
+bool PositionClient::connect() {
+
+    std::cout << "We have entered the connect function...\n";
+
+    try {
+
+        {
+            std::lock_guard<std::mutex> lock(print_mutex);
+            std::cout << "Attempting to connect...\n";
+        }
+
+        boost::system::error_code ec;
+
+        // Start with the server we last used, then try each failover endpoint in turn.
+        for (std::size_t attempt = 0; attempt < endpoints_.size(); ++attempt) {
+
+            if (attempt > 0) {
+                endpoint_index_ = (endpoint_index_ + 1) % endpoints_.size();
+            }
+
+            host_ = endpoints_[endpoint_index_].first;
+            port_ = endpoints_[endpoint_index_].second;
+            socket_ = std::make_unique<tcp::socket>(*io_context_);
+
+            tcp::resolver resolver(*io_context_);
+            auto endpoints = resolver.resolve(host_, std::to_string(port_));
+
+            tcp::endpoint local_endpoint(tcp::v4(), local_port_);
+            socket_->open(tcp::v4());
+            socket_->set_option(boost::asio::socket_base::reuse_address(true));
+            socket_->bind(local_endpoint);
+
+            boost::asio::connect(*socket_, endpoints, ec);
+
+            if (!ec) {
+                break;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(print_mutex);
+                std::cerr << "Connection to " << host_ << ":" << port_ << " failed: " << ec.message() << std::endl;
+            }
+
+            socket_->close();
+        }
+
+        if (ec) {
+            return false;
+        }
+
+        socket_->set_option(tcp::no_delay(true), ec);
+
+        if (tuning_.mode == wait_mode::busy_poll) {
+            enable_socket_busy_poll(*socket_, tuning_.busy_poll_usec);
+        }
+
+        if (!start_tls()) {
+            return false;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(print_mutex);
+            std::cout << "Connected to server.\n";
+            std::cout << "NOW OPERATING ON :" << socket_->remote_endpoint().address().to_string() << ":" << socket_->remote_endpoint().port() << std::endl;
+            running_ = true;
+        }
+
+        if (!send_encoding_request() || !send_identity()) {
+            return false;
+        }
+
+        reset_stream();
+        do_receive(); 
+        resubscribe();
+        return true;
+
+    } catch (const std::exception& e) {
+
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cerr << "Failed to connect: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+bool PositionClient::setConnection() {
+
+    std::cout << "We have entered the connect function...\n";
+
+    try {
+
+        {
+            std::lock_guard<std::mutex> lock(print_mutex);
+            std::cout << "Attempting to connect...\n";
+        }
+
+        socket_ = std::make_unique<tcp::socket>(*io_context_);
+
+        tcp::resolver resolver(*io_context_);
+        auto endpoints = resolver.resolve(host_, std::to_string(port_));
+
+        if (local_port_ != 0) {
+
+            tcp::endpoint local_endpoint(tcp::v4(), local_port_);
+            socket_->open(tcp::v4());
+            socket_->bind(local_endpoint);
+        }
+
+        boost::system::error_code ec;
+        boost::asio::connect(*socket_, endpoints, ec);
+
+        if (ec) {
+
+            {
+                std::lock_guard<std::mutex> lock(print_mutex);
+                std::cerr << "Connection failed: " << ec.message() << std::endl;
+            }
+
+            socket_->close();
+            return false;
+        }
+
+        socket_->set_option(tcp::no_delay(true), ec);
+
+        if (tuning_.mode == wait_mode::busy_poll) {
+            enable_socket_busy_poll(*socket_, tuning_.busy_poll_usec);
+        }
+
+        if (!start_tls()) {
+            return false;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(print_mutex);
+            std::cout << "Connected to server.\n";
+            running_ = true;
+        }
+
+        if (!send_encoding_request() || !send_identity()) {
+            return false;
+        }
+
+        return true;
+
+    } catch (const std::exception& e) {
+
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cerr << "Failed to connect: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+void PositionClient::restart_io_context() {
+
+    // Called from a receive handler the context is still running on this thread, so there is nothing to restart.
+    if (on_receive_thread() && !io_context_->stopped()) {
+        return;
+    }
+
+    io_context_->reset();
+    work_guard_.reset(); 
+    work_guard_.emplace(boost::asio::make_work_guard(*io_context_));
+
+    if (receive_thread_ && receive_thread_->joinable()) {
+
+        receive_thread_->join();
+
+        {
+            std::lock_guard<std::mutex> lock(print_mutex);
+            std::cout << "recieve thread has been joined..." << std::endl;
+        }
+    }
+
+    receive_thread_ = std::make_unique<std::thread>(&PositionClient::run_receive_loop, this);
+}
+
+void PositionClient::runThreads() {
+
+    if (receive_thread_ && receive_thread_->joinable() && io_context_ -> stopped()) {
+
+        {
+            std::lock_guard<std::mutex> lock(print_mutex);
+            std::cout << "attmepting to join running thread.." << std::endl;
+        }
+
+        receive_thread_->join();
+
+        {
+            std::lock_guard<std::mutex> lock(print_mutex);
+            std::cout << "Running thread has been joined..." << std::endl;
+        }
+    }
+
+     receive_thread_ = std::make_unique<std::thread>(&PositionClient::run_receive_loop, this);
+}
+
+// In busy_poll mode the receive thread spins on poll() instead of parking in run(), so a
+// broadcast is picked up as soon as it lands rather than after a wake-up.
+void PositionClient::run_receive_loop() {
+
+    if (tuning_.cpu >= 0 && !pin_current_thread(tuning_.cpu)) {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cerr << "Could not pin receive thread to CPU " << tuning_.cpu << std::endl;
+    }
+
+    try {
+        run_io_context(*io_context_, tuning_.mode);
+    } catch (const std::exception& e) {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cerr << "Exception in io_context.run(): " << e.what() << std::endl;
+    }
+}
+
+void PositionClient::handle_disconnection() {
+
+    if(!running_ && disconnected_)
+    {
+        {
+            std::lock_guard<std::mutex> lock(print_mutex); 
+            std::cout << "DISCONNECTION HAS ALREADY BEEN INTERNALLY INITIATED\n";
+        }   
+
+        return; 
+    }
+
+    running_ = false;
+    fail_queries();
+
+    if (verbose()) {
+        std::lock_guard<std::mutex> lock(print_mutex); 
+        std::cout << "DISCONNECTION CALLED INTERNALLY FROM FUNCTION FAILURE....\nAttempting to disconnect...\n";
+    }
+
+    if (socket_ && socket_->is_open()) {
+
+        boost::system::error_code ec;
+
+        socket_->close(ec);
+        socket_.reset();
+
+        if (!ec) {
+
+            if (verbose()) {
+                std::lock_guard<std::mutex> lock(print_mutex); 
+                std::cout <<"DISCONNECTION SUCCESSFUL....\n";
+            }
+
+            disconnected_ = true; 
+
+            if (runtime_) {
+                schedule_reconnect();
+                return;
+            }
+        
+            handle_reconnect();
+
+        } else {
+
+            {
+                std::lock_guard<std::mutex> lock(print_mutex); 
                 std::cerr << "Disconnection failed: " << ec.message() << "\n";
                 handle_disconnection();
             }
@@ -380,6 +818,21 @@ void PositionClient::disconnect() {
 
     running_ = false;
 
+    if (runtime_) {
+
+        boost::asio::post(*io_context_, counted(outstanding_, [this]() {
+            boost::system::error_code ignore;
+
+            if (socket_) {
+                socket_->close(ignore);
+            }
+
+            disconnected_ = true;
+            fail_queries();
+        }));
+        return;
+    }
+
     {
         std::lock_guard<std::mutex> lock(print_mutex); 
         std::cout <<"DISCONNECTION CALLED BY CLIENT....\n";
@@ -399,6 +852,7 @@ void PositionClient::disconnect() {
             }
 
             disconnected_ = true; 
+            fail_queries();
             return;
 
         } else {
@@ -421,6 +875,14 @@ void PositionClient::reconnect() {
 
     disconnect();
 
+    if (runtime_) {
+
+        boost::asio::post(*io_context_, counted(outstanding_, [this]() {
+            schedule_reconnect();
+        }));
+        return;
+    }
+
     std::this_thread::sleep_for(std::chrono::seconds(5));
 
     {
@@ -452,78 +914,726 @@ void PositionClient::reconnect() {
     }
 }
 
+// While disconnected updates wait in the write queue, latest per symbol, and are flushed to
+// whichever server the client reconnects to. Once the session has stopped, or given up
+// reconnecting, they are dropped.
 void PositionClient::send_position(message_t& message) {
 
-    if (!socket_->is_open() && running_) {
+    if (stopping_) {
+        updates_dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
 
-        {
-            std::lock_guard<std::mutex> lock(print_mutex);
-            std::cerr << "Socket is not open. Cannot send message.\n";
-        }
+    message.timestamp_ns = Clock::now_ns();
 
-        return;
+    int64_t wake_ns = 0;
+
+    if (publish_filter_.offer(message, message.timestamp_ns, wake_ns)) {
+        POSITION_PROBE(client_send, 0, message.timestamp_ns);
+        queue_updates(&message, 1);
     }
 
-    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
-    std::string timestamp_str = boost::posix_time::to_simple_string(now);
-    std::copy(timestamp_str.begin(), timestamp_str.end(), message.timestamp.begin());
+    if (wake_ns != 0) {
+        boost::asio::post(*io_context_, counted(outstanding_, [this, wake_ns]() {
+            arm_publish_timer(wake_ns);
+        }));
+    }
+}
 
-    // std::memcpy(buffer_.data(), &message, sizeof(message));
+void PositionClient::set_publish_policy(const publish_policy_t& policy) {
+    publish_filter_.set_default_policy(policy);
+}
 
-    boost::asio::async_write(*socket_, boost::asio::buffer(&message, sizeof(message)),
-        [this](boost::system::error_code ec, std::size_t /*length*/) {
-            if (ec) {
-                std::lock_guard<std::mutex> lock(print_mutex);
-                std::cerr << "Failed to send message: " << ec.message() << std::endl;
-            }
-        });
+void PositionClient::set_publish_policy(const std::string& symbol, const publish_policy_t& policy) {
+    publish_filter_.set_policy(symbol, policy);
 }
 
-void PositionClient::do_receive() {
+// On the I/O thread. A wait already set for an earlier time is kept, since flush_publishes then
+// re-arms for whatever is due next.
+void PositionClient::arm_publish_timer(int64_t wake_ns) {
 
-    if (!socket_->is_open() || !running_) {
-        std::cout << "Error in do_receive: socket not open or client not running.\n";
+    if (stopping_) {
         return;
     }
 
-    // std::cout << "We have made it back to the receive function..\n";
+    auto at = std::chrono::steady_clock::now() + std::chrono::nanoseconds(std::max<int64_t>(wake_ns - Clock::now_ns(), 0));
 
-    boost::asio::async_read(*socket_, boost::asio::buffer(&message_, sizeof(message_t)),
-        [this](boost::system::error_code ec, std::size_t length) {
-            if (!ec) {
-                // std::cout << "No errors here. Processing data...\n";
-                process_data(&message_, length);
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                do_receive(); 
-            } else {
+    if (!publish_timer_) {
+        publish_timer_ = std::make_unique<boost::asio::steady_timer>(*io_context_);
+    }
+
+    if (publish_timer_armed_ && publish_timer_->expiry() <= at) {
+        return;
+    }
+
+    publish_timer_armed_ = true;
+    publish_timer_->expires_at(at);
+    publish_timer_->async_wait(counted(outstanding_, [this](boost::system::error_code ec) {
+        if (ec) {
+            return;
+        }
+
+        publish_timer_armed_ = false;
+        flush_publishes();
+    }));
+}
+
+// Sends the updates the rate limits and refresh intervals have released, like any others: while
+// disconnected they wait in the write queue.
+void PositionClient::flush_publishes() {
+
+    std::vector<message_t> released;
+    int64_t next_ns = publish_filter_.due(Clock::now_ns(), released);
+
+    if (!released.empty()) {
+        queue_updates(released.data(), released.size());
+    }
+
+    if (next_ns != 0) {
+        arm_publish_timer(next_ns);
+    }
+}
+
+void PositionClient::queue_write(const std::vector<message_t>& records) {
+    queue_write(records.data(), records.size());
+}
+
+// A request built for sending becomes the write queue when nothing else is waiting, rather than
+// being copied into it.
+void PositionClient::queue_write(std::vector<message_t>&& records) {
+
+    {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+
+        if (pending_writes_.empty()) {
+            pending_writes_.swap(records);
+        } else {
+            pending_writes_.insert(pending_writes_.end(), records.begin(), records.end());
+        }
+
+        pending_indexed_ = false;
+
+        if (write_scheduled_) {
+            return;
+        }
+
+        write_scheduled_ = true;
+    }
+
+    schedule_write();
+}
+
+// Mirrors the server session: records are appended under a short lock and one flush is
+// posted per batch, with both handlers recycling their own handler_memory.
+void PositionClient::queue_write(const message_t* records, std::size_t count) {
+
+    {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        pending_writes_.insert(pending_writes_.end(), records, records + count);
+        pending_indexed_ = false;
+
+        if (write_scheduled_) {
+            return;
+        }
+
+        write_scheduled_ = true;
+    }
+
+    schedule_write();
+}
+
+// Connected, updates queue like any record. Disconnected, the queue would otherwise grow for as
+// long as the outage lasts, so an update replaces the one already queued for its symbol and a
+// symbol past max_pending_updates is dropped.
+void PositionClient::queue_updates(const message_t* updates, std::size_t count) {
+
+    {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+
+        if (running_) {
+            pending_writes_.insert(pending_writes_.end(), updates, updates + count);
+            pending_indexed_ = false;
+        } else {
+
+            if (!pending_indexed_) {
+
+                pending_updates_.clear();
+
+                // Query and predicate requests carry their payload records right behind them.
+                for (std::size_t i = 0; i < pending_writes_.size(); ++i) {
+
+                    if (is_control(pending_writes_[i])) {
+                        i += to_control(pending_writes_[i]).count;
+                        continue;
+                    }
+
+                    pending_updates_[std::string(symbol_of(pending_writes_[i]))] = i;
+                }
+
+                pending_indexed_ = true;
+            }
+
+            for (std::size_t i = 0; i < count; ++i) {
+
+                auto queued = pending_updates_.find(std::string(symbol_of(updates[i])));
+
+                if (queued != pending_updates_.end()) {
+                    pending_writes_[queued->second] = updates[i];
+                    updates_dropped_.fetch_add(1, std::memory_order_relaxed);
+                } else if (pending_updates_.size() < max_pending_updates) {
+                    pending_updates_.emplace(std::string(symbol_of(updates[i])), pending_writes_.size());
+                    pending_writes_.push_back(updates[i]);
+                } else {
+                    updates_dropped_.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        }
+
+        if (write_scheduled_) {
+            return;
+        }
+
+        write_scheduled_ = true;
+    }
+
+    schedule_write();
+}
+
+void PositionClient::schedule_write() {
+
+    boost::asio::post(*io_context_, make_custom_alloc_handler(flush_memory_, counted(outstanding_, [this]() {
+        do_write();
+    })));
+}
+
+void PositionClient::do_write() {
+
+    {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+
+        // Until the client is identified (running_) updates wait here rather than go out ahead of it.
+        if (pending_writes_.empty() || !running_ || !socket_ || !socket_->is_open()) {
+            write_scheduled_ = false;
+            return;
+        }
+
+        in_flight_.swap(pending_writes_);
+        pending_indexed_ = false;
+    }
+
+    auto outgoing = boost::asio::buffer(in_flight_.data(), in_flight_.size() * sizeof(message_t));
+
+    auto handler = make_custom_alloc_handler(write_memory_, counted(outstanding_,
+        [this](boost::system::error_code ec, std::size_t /*length*/) {
+            if (ec) {
 
                 {
                     std::lock_guard<std::mutex> lock(print_mutex);
-                    std::cerr << "Read error: " << ec.message() << std::endl;
+                    std::cerr << "Failed to send message: " << ec.message() << std::endl;
                 }
 
-                if (running_) {
+                // Put the batch back so it is resent after reconnecting.
+                std::lock_guard<std::mutex> lock(write_mutex_);
+                pending_writes_.insert(pending_writes_.begin(), in_flight_.begin(), in_flight_.end());
+                pending_indexed_ = false;
+                in_flight_.clear();
+                write_scheduled_ = false;
+                return;
+            }
 
-                    std::cout << "Handling disconnection...\n";
-                    handle_disconnection();
-                }
+            in_flight_.clear();
+            do_write();
+        }));
+
+    if (tls_userspace()) {
+        tls_->async_write(*socket_, outgoing, std::move(handler));
+        return;
+    }
+
+    boost::asio::async_write(*socket_, outgoing, std::move(handler));
+}
+
+uint64_t PositionClient::send_query(query_type type, std::vector<message_t> payload, query_callback callback, uint64_t request_id) {
+
+    if (request_id == 0) {
+        request_id = next_request_id_++;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_queries_[request_id] = std::move(callback);
+    }
+
+    control_t request;
+    request.kind = static_cast<uint8_t>(control_kind::query_request);
+    request.type = static_cast<uint8_t>(type);
+    request.request_id = request_id;
+    request.count = static_cast<uint32_t>(payload.size());
+
+    payload.insert(payload.begin(), to_record(request));
+    queue_write(std::move(payload));
+
+    return request_id;
+}
+
+uint64_t PositionClient::query_symbol(const std::string& symbol, query_callback callback) {
+    return send_query(query_type::symbol, {symbol_record(symbol)}, std::move(callback));
+}
+
+uint64_t PositionClient::query_symbols(const std::vector<std::string>& symbols, query_callback callback) {
+
+    if (symbols.size() <= max_control_payload) {
+
+        std::vector<message_t> payload;
+        payload.reserve(symbols.size());
+
+        for (const auto& symbol : symbols) {
+            payload.push_back(symbol_record(symbol));
+        }
+
+        return send_query(query_type::symbol_set, std::move(payload), std::move(callback));
+    }
+
+    // Each part has its own request id and the caller sees the first; the callback runs once the
+    // last part is in, lost if any part was.
+    struct gathered_t {
+        std::mutex mutex;
+        std::size_t remaining;
+        query_status status = query_status::answered;
+        std::vector<message_t> positions;
+        query_callback callback;
+    };
+
+    std::size_t parts = (symbols.size() + max_control_payload - 1) / max_control_payload;
+    uint64_t first_id = next_request_id_.fetch_add(parts);
+
+    auto gathered = std::make_shared<gathered_t>();
+    gathered->remaining = parts;
+    gathered->callback = std::move(callback);
+
+    for (std::size_t part = 0; part < parts; ++part) {
 
+        std::size_t begin = part * max_control_payload;
+        std::size_t end = std::min(symbols.size(), begin + max_control_payload);
+        std::vector<message_t> payload;
+        payload.reserve(end - begin);
+
+        for (std::size_t i = begin; i < end; ++i) {
+            payload.push_back(symbol_record(symbols[i]));
+        }
+
+        send_query(query_type::symbol_set, std::move(payload), [gathered, first_id](uint64_t, query_status status, const std::vector<message_t>& positions) {
+
+            std::unique_lock<std::mutex> lock(gathered->mutex);
+            gathered->positions.insert(gathered->positions.end(), positions.begin(), positions.end());
+
+            if (status != query_status::answered) {
+                gathered->status = status;
+            }
+
+            if (--gathered->remaining == 0) {
+                lock.unlock();
+                gathered->callback(first_id, gathered->status, gathered->positions);
+            }
+        }, first_id + part);
+    }
+
+    return first_id;
+}
+
+uint64_t PositionClient::query_prefix(const std::string& prefix, query_callback callback) {
+    return send_query(query_type::prefix, {symbol_record(prefix)}, std::move(callback));
+}
+
+uint64_t PositionClient::query_history(const std::string& symbol, int64_t from_ns, int64_t to_ns, query_callback callback) {
+
+    history_query_t query;
+    query.symbol = symbol_record(symbol).symbol;
+    query.from_ns = from_ns;
+    query.to_ns = to_ns;
+    return send_query(query_type::history_range, {to_record(query)}, std::move(callback));
+}
+
+uint64_t PositionClient::query_rollup(const std::string& symbol, int64_t from_ns, int64_t to_ns, int64_t bucket_ns, query_callback callback) {
+
+    history_query_t query;
+    query.symbol = symbol_record(symbol).symbol;
+    query.from_ns = from_ns;
+    query.to_ns = to_ns;
+    query.bucket_ns = bucket_ns;
+    return send_query(query_type::history_rollup, {to_record(query)}, std::move(callback));
+}
+
+void PositionClient::request_positions() {
+
+    query_prefix("", [this](uint64_t request_id, query_status, const std::vector<message_t>& positions) {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << "\nPositions on ClientID: " << clientID_ << " (request " << request_id << ")\n";
+
+        for (const auto& position : positions) {
+            std::cout << "  " << std::string(symbol_of(position)) << ", Net Position: " << position.net_position
+                      << ", Timestamp of update: " << format_timestamp(position.timestamp_ns) << std::endl;
+        }
+    });
+}
+
+template <typename Handler>
+void PositionClient::read_exact(boost::asio::mutable_buffer buffer, Handler handler) {
+
+    if (tls_userspace()) {
+        tls_->async_read(*socket_, buffer, std::move(handler));
+        return;
+    }
+
+    boost::asio::async_read(*socket_, buffer, std::move(handler));
+}
+
+void PositionClient::do_receive() {
+
+    if (!socket_->is_open() || !running_) {
+        std::cout << "Error in do_receive: socket not open or client not running.\n";
+        return;
+    }
+
+    // std::cout << "We have made it back to the receive function..\n";
+
+    if (encoding_ == stream_encoding::gorilla) {
+        receive_frame();
+        return;
+    }
+
+    read_exact(boost::asio::buffer(&message_, sizeof(message_t)), counted(outstanding_,
+        [this](boost::system::error_code ec, std::size_t length) {
+            if (!ec) {
+                // std::cout << "No errors here. Processing data...\n";
+                bytes_received_ += length;
+                process_data(&message_);
+                do_receive(); 
+            } else {
+                handle_receive_error(ec);
+            }
+        }));
+}
+
+// Compressed streams arrive as length-prefixed frames; each decodes back into the wire records
+// a plain stream would have carried, which then take the usual path.
+void PositionClient::receive_frame() {
+
+    read_exact(boost::asio::buffer(frame_header_), counted(outstanding_,
+        [this](boost::system::error_code ec, std::size_t /*length*/) {
+            if (ec) {
+                handle_receive_error(ec);
+                return;
+            }
+
+            uint32_t body_bytes;
+            uint32_t records;
+            bool keyframe;
+
+            if (!StreamDecoder::read_header(frame_header_.data(), body_bytes, records, keyframe)) {
+                handle_receive_error(boost::asio::error::message_size);
                 return;
             }
-        });
+
+            frame_body_.resize(body_bytes);
+
+            read_exact(boost::asio::buffer(frame_body_), counted(outstanding_,
+                [this, records, keyframe](boost::system::error_code ec, std::size_t length) {
+                    if (ec) {
+                        handle_receive_error(ec);
+                        return;
+                    }
+
+                    bytes_received_ += frame_header_size + length;
+                    decoded_.clear();
+
+                    if (!decoder_.decode_frame(frame_body_.data(), frame_body_.size(), records, keyframe, decoded_)) {
+                        std::lock_guard<std::mutex> lock(print_mutex);
+                        std::cerr << "Dropping malformed frame of " << records << " records" << std::endl;
+                    }
+
+                    for (const auto& record : decoded_) {
+                        process_data(&record);
+                    }
+
+                    do_receive();
+                }));
+        }));
+}
+
+void PositionClient::handle_receive_error(const boost::system::error_code& ec) {
+
+    if (stopping_) {
+        return;
+    }
+
+    if (verbose()) {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cerr << "Read error: " << ec.message() << std::endl;
+    }
+
+    if (running_) {
+
+        if (verbose()) {
+            std::cout << "Handling disconnection...\n";
+        }
+
+        handle_disconnection();
+    }
+}
+
+void PositionClient::process_data(const message_t* message) {
+
+    if (response_remaining_ > 0 || is_control(*message)) {
+        handle_control(message);
+        return;
+    }
+
+    handle_update(*message);
 }
 
-void PositionClient::process_data(const message_t* message, std::size_t length) {
+void PositionClient::handle_update(const message_t& update) {
+
+    ++updates_received_;
+    POSITION_PROBE(client_receive, 0, update.timestamp_ns);
+
+    if (update_callback_) {
+        update_callback_(update);
+        return;
+    }
 
     std::lock_guard<std::mutex> lock(print_mutex);
-    std::string symbol(message->symbol.data());
+    std::string symbol(symbol_of(update));
 
     // std::cout << "we have entered the process data function\n";
 
     if (symbol != clientID_) {
 
         std::cout << "\nReceived broadcast on ClientID: " << clientID_ << "| Update for Client: "
-                  << symbol << ", Net Position: " << message->net_position
-                  << ", Timestamp of update: " << std::string(message->timestamp.data()) << std::endl;
+                  << symbol << ", Net Position: " << update.net_position
+                  << ", Timestamp of update: " << format_timestamp(update.timestamp_ns);
+
+        if (update.receive_ns != 0) {
+            std::cout << ", Received by server: " << format_timestamp(update.receive_ns) << " (+" << (update.receive_ns - update.timestamp_ns) / 1000 << " us)";
+        }
+
+        std::cout << std::endl;
+    }
+}
+
+void PositionClient::handle_control(const message_t* message) {
+
+    if (response_remaining_ > 0) {
+        response_records_.push_back(*message);
+        --response_remaining_;
+    } else {
+        active_response_ = to_control(*message);
+        response_records_.clear();
+        response_remaining_ = active_response_.count;
+    }
+
+    if (response_remaining_ > 0) {
+        return;
+    }
+
+    switch (static_cast<control_kind>(active_response_.kind)) {
+        case control_kind::query_response: {
+            query_callback callback;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = pending_queries_.find(active_response_.request_id);
+
+                if (it != pending_queries_.end()) {
+                    callback = std::move(it->second);
+                    pending_queries_.erase(it);
+                }
+            }
+
+            if (callback) {
+                callback(active_response_.request_id, query_status::answered, response_records_);
+            }
+            break;
+        }
+        case control_kind::predicate_event: {
+            predicate_callback callback;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = predicates_.find(active_response_.request_id);
+
+                if (it != predicates_.end()) {
+                    callback = it->second.second;
+                }
+            }
+
+            if (callback && !response_records_.empty()) {
+                callback(active_response_.request_id, active_response_, response_records_.front());
+            }
+            break;
+        }
+        case control_kind::heartbeat: {
+            // Answering is what keeps a client that only listens from being reaped as idle.
+            message_t answer = to_record(active_response_);
+            queue_write(&answer, 1);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// A new connection starts a new record stream, so nothing of a response cut off by the last one
+// may be carried over into it.
+void PositionClient::reset_stream() {
+
+    active_response_ = control_t();
+    response_remaining_ = 0;
+    response_records_.clear();
+}
+
+// Their connection is gone, so these queries will never be answered. Queries sent after this wait
+// in the write queue for the next connection as usual.
+void PositionClient::fail_queries() {
+
+    std::unordered_map<uint64_t, query_callback> lost;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        lost.swap(pending_queries_);
+    }
+
+    static const std::vector<message_t> none;
+
+    for (auto& query : lost) {
+        query.second(query.first, query_status::connection_lost, none);
+    }
+}
+
+message_t PositionClient::encoding_record() const {
+
+    control_t request;
+    request.kind = static_cast<uint8_t>(control_kind::set_encoding);
+    request.type = static_cast<uint8_t>(encoding_);
+    return to_record(request);
+}
+
+// Sent ahead of the identifying record so the server compresses the join snapshot as well.
+bool PositionClient::send_encoding_request() {
+
+    if (encoding_ == stream_encoding::plain) {
+        return true;
+    }
+
+    message_t record = encoding_record();
+
+    boost::system::error_code error;
+    write_blocking(boost::asio::buffer(&record, sizeof(record)), error);
+
+    if (error) {
+
+        {
+            std::lock_guard<std::mutex> lock(print_mutex);
+            std::cerr << "Failed to send encoding request: " << error.message() << std::endl;
+        }
+
+        socket_->close();
+        running_ = false;
+        return false;
+    }
+
+    return true;
+}
+
+uint64_t PositionClient::send_predicate(predicate_type type, const std::string& symbol, uint8_t flags, double lower, double upper, predicate_callback callback) {
+
+    uint64_t predicate_id = next_request_id_++;
+
+    control_t request;
+    request.kind = static_cast<uint8_t>(control_kind::predicate_subscribe);
+    request.type = static_cast<uint8_t>(type);
+    request.flags = flags;
+    request.count = 1;
+    request.request_id = predicate_id;
+    request.lower = lower;
+    request.upper = upper;
+
+    std::vector<message_t> records{to_record(request), symbol_record(symbol)};
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        predicates_[predicate_id] = {records, std::move(callback)};
+    }
+
+    queue_write(std::move(records));
+    return predicate_id;
+}
+
+uint64_t PositionClient::watch_threshold(const std::string& symbol, double level, uint8_t direction, predicate_callback callback) {
+    return send_predicate(predicate_type::threshold, symbol, direction, level, level, std::move(callback));
+}
+
+uint64_t PositionClient::watch_band(const std::string& symbol, double lower, double upper, predicate_callback callback) {
+    return send_predicate(predicate_type::band, symbol, 0, lower, upper, std::move(callback));
+}
+
+uint64_t PositionClient::watch_rate(const std::string& symbol, double max_change_per_second, predicate_callback callback) {
+    return send_predicate(predicate_type::rate_of_change, symbol, 0, 0.0, max_change_per_second, std::move(callback));
+}
+
+void PositionClient::unwatch(uint64_t predicate_id) {
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        predicates_.erase(predicate_id);
     }
+
+    control_t request;
+    request.kind = static_cast<uint8_t>(control_kind::predicate_unsubscribe);
+    request.request_id = predicate_id;
+    message_t record = to_record(request);
+    queue_write(&record, 1);
+}
+
+void PositionClient::set_broadcasts(bool enabled) {
+
+    broadcasts_ = enabled;
+
+    control_t request;
+    request.kind = static_cast<uint8_t>(control_kind::set_subscription);
+    request.flags = enabled ? subscribe_broadcasts : 0;
+    message_t record = to_record(request);
+    queue_write(&record, 1);
+}
+
+// Replaces the printed broadcast log with a callback. It is installed on the receive thread,
+// which is the only thread that reads it.
+void PositionClient::on_update(update_callback callback) {
+
+    boost::asio::post(*io_context_, counted(outstanding_, [this, callback = std::move(callback)]() mutable {
+        update_callback_ = std::move(callback);
+    }));
+}
+
+// Standing predicates and the broadcast preference live on the server session, so they are replayed after every (re)connect.
+void PositionClient::resubscribe() {
+
+    std::vector<message_t> records;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        for (const auto& predicate : predicates_) {
+            records.insert(records.end(), predicate.second.first.begin(), predicate.second.first.end());
+        }
+    }
+
+    if (!broadcasts_) {
+        control_t request;
+        request.kind = static_cast<uint8_t>(control_kind::set_subscription);
+        records.push_back(to_record(request));
+    }
+
+    // Always queued, even when empty, so updates buffered while disconnected are flushed.
+    queue_write(std::move(records));
 }
@@ -2,7 +2,6 @@
 #define POSITION_CLIENT_H
 
 #include <boost/asio.hpp>
-#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <thread>
 #include <atomic>
@@ -10,18 +9,70 @@
 #include <chrono> 
 #include <sstream>
 #include <iomanip>
+#include <optional>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include "../../include/Clock.h"
+#include "../../include/HandlerAllocator.h"
 #include "../../include/Message.h"
+#include "../../include/Protocol.h"
+#include "../../include/StreamCodec.h"
+#include "../../include/ThreadTuning.h"
+#include "../../include/Tls.h"
+#include "PublishFilter.h"
 
 using boost::asio::ip::tcp;
 
+class ClientRuntime;
+
+// Every query is answered exactly once: with the server's response, or with no positions and
+// connection_lost when the connection it was sent on drops (or the client stops) first.
+enum class query_status : uint8_t {
+    answered,
+    connection_lost,
+};
+
+using query_callback = std::function<void(uint64_t request_id, query_status status, const std::vector<message_t>& positions)>;
+using predicate_callback = std::function<void(uint64_t predicate_id, const control_t& event, const message_t& update)>;
+using update_callback = std::function<void(const message_t& update)>;
+
 class PositionClient {
 public:
     std::atomic<bool> running_;
-    PositionClient(const std::string& host, short port, const std::string& ID, bool& debugLogs, short local_port);
+    PositionClient(const std::string& host, short port, const std::string& ID, bool& debugLogs, short local_port, thread_tuning_t tuning = thread_tuning_t(), stream_encoding encoding = stream_encoding::plain, const tls_options_t& tls = tls_options_t());
+    // A session hosted on a shared ClientRuntime; it connects in the background (see wait_connected).
+    PositionClient(ClientRuntime& runtime, const std::string& host, short port, const std::string& ID, bool& debugLogs, stream_encoding encoding = stream_encoding::plain, const tls_options_t& tls = tls_options_t());
+    bool wait_connected(std::chrono::milliseconds timeout);
     void start();
     void stop();
+    void add_failover_endpoint(const std::string& host, short port);
     void send_position(message_t& message);
+    // Publishing policies decide which of send_position's updates go on the wire (see PublishFilter.h).
+    void set_publish_policy(const publish_policy_t& policy);
+    void set_publish_policy(const std::string& symbol, const publish_policy_t& policy);
+    publish_stats_t publish_stats() const { return publish_filter_.stats(); }
     void request_positions();
+    uint64_t query_symbol(const std::string& symbol, query_callback callback);
+    // Sets larger than the server's max_control_payload go as several requests, answered together.
+    uint64_t query_symbols(const std::vector<std::string>& symbols, query_callback callback);
+    uint64_t query_prefix(const std::string& prefix, query_callback callback);
+    // History in the server's ingest time; the rollup's records are rollup_record_t (to_rollup).
+    uint64_t query_history(const std::string& symbol, int64_t from_ns, int64_t to_ns, query_callback callback);
+    uint64_t query_rollup(const std::string& symbol, int64_t from_ns, int64_t to_ns, int64_t bucket_ns, query_callback callback);
+    uint64_t watch_threshold(const std::string& symbol, double level, uint8_t direction, predicate_callback callback);
+    uint64_t watch_band(const std::string& symbol, double lower, double upper, predicate_callback callback);
+    uint64_t watch_rate(const std::string& symbol, double max_change_per_second, predicate_callback callback);
+    void unwatch(uint64_t predicate_id);
+    void set_broadcasts(bool enabled);
+    void on_update(update_callback callback);
+    uint64_t bytes_received() const { return bytes_received_.load(std::memory_order_relaxed); }
+    uint64_t updates_received() const { return updates_received_.load(std::memory_order_relaxed); }
+    // Symbols whose latest update is kept for sending while disconnected; newer symbols are dropped.
+    static constexpr std::size_t max_pending_updates = 16384;
+    // Updates send_position took that will never be sent: replaced by a newer one for the same
+    // symbol while disconnected, over max_pending_updates, or sent after the session stopped.
+    uint64_t updates_dropped() const { return updates_dropped_.load(std::memory_order_relaxed); }
     void handle_disconnection();
     void handle_reconnect();
     void disconnect(); 
@@ -30,15 +81,55 @@ public:
 
 private:
     void do_receive();
+    void receive_frame();
+    void handle_receive_error(const boost::system::error_code& ec);
     void restart_io_context();    
+    bool on_receive_thread() const;
     bool connect(); 
     bool setConnection();
     void runThreads();
-    void process_data(const message_t* message, std::size_t length);
+    void run_receive_loop();
+    void process_data(const message_t* message);
+    void handle_control(const message_t* message);
+    void handle_update(const message_t& message);
+    bool send_encoding_request();
+    message_t encoding_record() const;
+    uint64_t send_query(query_type type, std::vector<message_t> payload, query_callback callback, uint64_t request_id = 0);
+    void reset_stream();
+    void fail_queries();
+    uint64_t send_predicate(predicate_type type, const std::string& symbol, uint8_t flags, double lower, double upper, predicate_callback callback);
+    void resubscribe();
+    void queue_write(const std::vector<message_t>& records);
+    void queue_write(std::vector<message_t>&& records);
+    void queue_write(const message_t* records, std::size_t count);
+    void queue_updates(const message_t* updates, std::size_t count);
+    void schedule_write();
+    void do_write();
+    void arm_publish_timer(int64_t wake_ns);
+    void flush_publishes();
+    void begin_connect(bool reconnecting);
+    void connect_endpoint();
+    void endpoint_failed(const boost::system::error_code& ec);
+    void on_connected();
+    void identify();
+    void connection_failed();
+    void schedule_reconnect();
+    void stop_session();
+    bool send_identity();
+    message_t identity_record() const;
+    bool verbose() const { return !runtime_ || clientDebugLogs_; }
+    bool tls_userspace() const { return tls_ && !tls_->offloaded(); }
+    bool start_tls();
+    void report_tls() const;
+    template <typename Handler>
+    void read_exact(boost::asio::mutable_buffer buffer, Handler handler);
+    std::size_t write_blocking(boost::asio::const_buffer buffer, boost::system::error_code& ec);
 
     message_t message_;
     std::string host_;
     short port_;
+    std::vector<std::pair<std::string, short>> endpoints_;
+    std::size_t endpoint_index_ = 0;
     short local_port_;
     std::shared_ptr<boost::asio::io_context> io_context_;
     std::optional<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>> work_guard_;
@@ -50,6 +141,52 @@ private:
     bool clientDebugLogs_;
     std::atomic<bool> disconnected_;
     std::atomic<int> reconnectCount;
+    std::unordered_map<uint64_t, query_callback> pending_queries_;
+    std::unordered_map<uint64_t, std::pair<std::vector<message_t>, predicate_callback>> predicates_;
+    std::atomic<bool> broadcasts_{true};
+    std::atomic<uint64_t> next_request_id_{1};
+    control_t active_response_;
+    uint32_t response_remaining_ = 0;
+    std::vector<message_t> response_records_;
+    std::mutex write_mutex_;
+    std::vector<message_t> pending_writes_;
+    std::vector<message_t> in_flight_;
+    bool write_scheduled_ = false;
+    // While disconnected, where each symbol's queued update sits in pending_writes_, so a newer
+    // one replaces it; rebuilt on first use after anything else has touched pending_writes_.
+    std::unordered_map<std::string, std::size_t> pending_updates_;
+    bool pending_indexed_ = false;
+    std::atomic<uint64_t> updates_dropped_{0};
+    handler_memory flush_memory_;
+    handler_memory write_memory_;
+    thread_tuning_t tuning_;
+    update_callback update_callback_;
+    stream_encoding encoding_;
+    StreamDecoder decoder_;
+    std::array<uint8_t, frame_header_size> frame_header_;
+    std::vector<uint8_t> frame_body_;
+    std::vector<message_t> decoded_;
+    std::atomic<uint64_t> bytes_received_{0};
+    std::atomic<uint64_t> updates_received_{0};
+    PublishFilter publish_filter_;
+    std::unique_ptr<boost::asio::steady_timer> publish_timer_;
+    bool publish_timer_armed_ = false;
+
+    // With TLS each connection gets a fresh channel; null on a plaintext connection.
+    tls_options_t tls_options_;
+    tls_context_ptr tls_context_;
+    std::unique_ptr<TlsChannel> tls_;
+
+    // Runtime sessions only: the connection is driven by handlers on the runtime's threads, and
+    // outstanding_ counts those still queued or running so stop() knows when none can touch this.
+    ClientRuntime* runtime_ = nullptr;
+    std::unique_ptr<tcp::resolver> resolver_;
+    std::unique_ptr<boost::asio::steady_timer> retry_timer_;
+    std::size_t connect_attempt_ = 0;
+    bool reconnecting_ = false;
+    std::array<message_t, 2> handshake_; // encoding request and identity, written together
+    std::atomic<bool> stopping_{false};
+    std::atomic<int> outstanding_{0};
 };
 
 #endif 
@@ -0,0 +1,182 @@
+#include "PublishFilter.h"
+#include "../../include/Protocol.h"
+#include <algorithm>
+#include <cmath>
+
+PublishFilter::PublishFilter()
+    : wake_ns_(0), enabled_(false), offered_(0), sent_(0), suppressed_(0), coalesced_(0), refreshed_(0) {}
+
+void PublishFilter::set_default_policy(const publish_policy_t& policy) {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    default_policy_ = policy;
+
+    for (auto& entry : states_) {
+        if (policies_.find(entry.first) == policies_.end()) {
+            entry.second.policy = policy;
+        }
+    }
+
+    enabled_.store(!trivial(default_policy_) || std::any_of(policies_.begin(), policies_.end(), [](const auto& entry) { return !trivial(entry.second); }), std::memory_order_release);
+}
+
+void PublishFilter::set_policy(const std::string& symbol, const publish_policy_t& policy) {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    policies_[symbol] = policy;
+
+    auto it = states_.find(symbol);
+
+    if (it != states_.end()) {
+        it->second.policy = policy;
+    }
+
+    enabled_.store(!trivial(default_policy_) || std::any_of(policies_.begin(), policies_.end(), [](const auto& entry) { return !trivial(entry.second); }), std::memory_order_release);
+}
+
+bool PublishFilter::offer(const message_t& update, int64_t now_ns, int64_t& wake_ns) {
+
+    offered_.fetch_add(1, std::memory_order_relaxed);
+    wake_ns = 0;
+
+    // Without any policy every update goes straight out, without the lock.
+    if (!enabled()) {
+        sent_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    symbol_state_t& state = state_for(update);
+    const publish_policy_t& policy = state.policy;
+    bool send = true;
+
+    state.latest = update;
+
+    if (state.ever_sent) {
+
+        double threshold = std::max(policy.absolute_deadband, policy.relative_deadband * std::fabs(state.last_sent));
+        int64_t since_sent_ns = now_ns - state.last_sent_ns;
+        bool refresh_due = policy.refresh.count() > 0 && since_sent_ns >= std::chrono::duration_cast<std::chrono::nanoseconds>(policy.refresh).count();
+
+        if (threshold > 0 && std::fabs(update.net_position - state.last_sent) <= threshold && !refresh_due) {
+
+            // Back within the deadband of what subscribers have: a value waiting on the rate limit is now stale.
+            if (state.pending) {
+                state.pending = false;
+                coalesced_.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            suppressed_.fetch_add(1, std::memory_order_relaxed);
+            send = false;
+
+        } else if (policy.max_rate > 0 && since_sent_ns < static_cast<int64_t>(1e9 / policy.max_rate)) {
+
+            if (state.pending) {
+                coalesced_.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            state.pending = true;
+            send = false;
+        }
+    }
+
+    if (send) {
+        state.pending = false;
+        mark_sent(state, now_ns);
+        sent_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    int64_t at = next_due(state);
+
+    if (at != 0 && (wake_ns_ == 0 || at < wake_ns_)) {
+        wake_ns_ = wake_ns = at;
+    }
+
+    return send;
+}
+
+int64_t PublishFilter::due(int64_t now_ns, std::vector<message_t>& out) {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    int64_t next = 0;
+
+    for (auto& entry : states_) {
+
+        symbol_state_t& state = entry.second;
+        int64_t at = next_due(state);
+
+        if (at != 0 && at <= now_ns) {
+
+            if (!state.pending) {
+                refreshed_.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            out.push_back(state.latest);
+            state.pending = false;
+            mark_sent(state, now_ns);
+            sent_.fetch_add(1, std::memory_order_relaxed);
+            at = next_due(state);
+        }
+
+        if (at != 0 && (next == 0 || at < next)) {
+            next = at;
+        }
+    }
+
+    wake_ns_ = next;
+    return next;
+}
+
+publish_stats_t PublishFilter::stats() const {
+
+    publish_stats_t stats;
+    stats.offered = offered_.load(std::memory_order_relaxed);
+    stats.sent = sent_.load(std::memory_order_relaxed);
+    stats.suppressed = suppressed_.load(std::memory_order_relaxed);
+    stats.coalesced = coalesced_.load(std::memory_order_relaxed);
+    stats.refreshed = refreshed_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+bool PublishFilter::trivial(const publish_policy_t& policy) {
+    return policy.absolute_deadband <= 0 && policy.relative_deadband <= 0 && policy.max_rate <= 0 && policy.refresh.count() <= 0;
+}
+
+PublishFilter::symbol_state_t& PublishFilter::state_for(const message_t& update) {
+
+    std::string symbol(symbol_of(update));
+    auto it = states_.find(symbol);
+
+    if (it != states_.end()) {
+        return it->second;
+    }
+
+    auto policy = policies_.find(symbol);
+    symbol_state_t& state = states_[symbol];
+    state.policy = policy != policies_.end() ? policy->second : default_policy_;
+    return state;
+}
+
+// When the symbol next needs the timer: its rate slot for a waiting value, else its refresh.
+int64_t PublishFilter::next_due(const symbol_state_t& state) const {
+
+    // A value left waiting by a policy change that dropped the rate limit is due at once.
+    if (state.pending) {
+        return state.last_sent_ns + (state.policy.max_rate > 0 ? static_cast<int64_t>(1e9 / state.policy.max_rate) : 0);
+    }
+
+    if (state.ever_sent && state.policy.refresh.count() > 0) {
+        return state.last_sent_ns + std::chrono::duration_cast<std::chrono::nanoseconds>(state.policy.refresh).count();
+    }
+
+    return 0;
+}
+
+void PublishFilter::mark_sent(symbol_state_t& state, int64_t now_ns) {
+
+    state.last_sent = state.latest.net_position;
+    state.last_sent_ns = now_ns;
+    state.ever_sent = true;
+}
@@ -0,0 +1,79 @@
+#ifndef PUBLISH_FILTER_H
+#define PUBLISH_FILTER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "../../include/Message.h"
+
+// How a client publishes one symbol. The defaults send every update.
+struct publish_policy_t {
+    double absolute_deadband = 0;           // hold back moves of at most this much from the value last sent
+    double relative_deadband = 0;           // ... or of at most this fraction of it, whichever is larger
+    double max_rate = 0;                    // updates/s; a faster symbol sends only its newest value when the next slot opens
+    std::chrono::milliseconds refresh{0};   // resend the newest value when nothing was sent for this long
+};
+
+struct publish_stats_t {
+    uint64_t offered;       // updates passed to send_position
+    uint64_t sent;          // updates that went to the write queue, refreshes included
+    uint64_t suppressed;    // held back by the deadband
+    uint64_t coalesced;     // replaced by a newer value while waiting for the rate limit
+    uint64_t refreshed;     // resent because of the refresh interval
+};
+
+// Decides which of a publisher's updates go on the wire. send_position offers each update and
+// sends it at once or not at all; updates waiting on the rate limit or a refresh are returned by
+// due() once their time comes, which the client calls from a timer on its I/O thread. Callers on
+// any thread; a mutex guards the per-symbol state and the counters are atomics.
+class PublishFilter {
+public:
+    PublishFilter();
+
+    void set_default_policy(const publish_policy_t& policy);
+    void set_policy(const std::string& symbol, const publish_policy_t& policy);
+    bool enabled() const { return enabled_.load(std::memory_order_acquire); }
+
+    // True when `update` should be sent now. `wake_ns` is set when the client's timer must run
+    // due() before the time it is already set for (0 otherwise).
+    bool offer(const message_t& update, int64_t now_ns, int64_t& wake_ns);
+
+    // Appends the updates whose time has come and returns when due() should next run (0 for never).
+    int64_t due(int64_t now_ns, std::vector<message_t>& out);
+
+    publish_stats_t stats() const;
+
+private:
+    struct symbol_state_t {
+        publish_policy_t policy;
+        message_t latest;           // newest value offered
+        double last_sent = 0;
+        int64_t last_sent_ns = 0;
+        bool ever_sent = false;
+        bool pending = false;       // latest is waiting on the rate limit
+    };
+
+    static bool trivial(const publish_policy_t& policy);
+    symbol_state_t& state_for(const message_t& update);
+    int64_t next_due(const symbol_state_t& state) const;
+    void mark_sent(symbol_state_t& state, int64_t now_ns);
+
+    std::mutex mutex_;
+    publish_policy_t default_policy_;
+    std::unordered_map<std::string, publish_policy_t> policies_;
+    std::unordered_map<std::string, symbol_state_t> states_;
+    int64_t wake_ns_;
+    std::atomic<bool> enabled_;
+
+    std::atomic<uint64_t> offered_;
+    std::atomic<uint64_t> sent_;
+    std::atomic<uint64_t> suppressed_;
+    std::atomic<uint64_t> coalesced_;
+    std::atomic<uint64_t> refreshed_;
+};
+
+#endif // PUBLISH_FILTER_H
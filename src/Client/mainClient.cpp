@@ -1,18 +1,66 @@
 #include "PositionClient.h"
+#include "ClientRuntime.h"
 #include "../../include/Common.h"
+#include "../../include/TraceRecorder.h"
 #include <iostream>
+#include <fstream>
 #include <thread>
 #include <chrono>
 #include <random>
 #include <future>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
 
 std::mutex print_mutex;
 std::random_device rd;
 std::mt19937 gen(rd());
 
+// Set by the optional --tls flags and used by every client this process makes.
+tls_options_t clientTls;
+
+void raise_descriptor_limit() {
+
+#if defined(__unix__) || defined(__APPLE__)
+    rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+}
+
+struct process_usage_t {
+    long threads = 0;
+    long rss_kb = 0;
+};
+
+// Read from /proc, so both stay zero off Linux.
+process_usage_t process_usage() {
+
+    process_usage_t usage;
+    std::ifstream status("/proc/self/status");
+    std::string line;
+
+    while (std::getline(status, line)) {
+        if (line.rfind("Threads:", 0) == 0) {
+            usage.threads = std::stol(line.substr(8));
+        } else if (line.rfind("VmRSS:", 0) == 0) {
+            usage.rss_kb = std::stol(line.substr(6));
+        }
+    }
+
+    return usage;
+}
+
 void run_Client(const std::string& host, short port, const std::string& symbol_prefix, int index, bool requiresDebugLogs, short lclPort) {
 
-    PositionClient client(host, port, symbol_prefix, requiresDebugLogs, lclPort);
+    PositionClient client(host, port, symbol_prefix, requiresDebugLogs, lclPort, thread_tuning_t(), stream_encoding::plain, clientTls);
 
     std::uniform_real_distribution<> dis(70.0, 100.0);
 
@@ -53,7 +101,7 @@ void run_Client(const std::string& host, short port, const std::string& symbol_p
 
 void run_ClientTwo(const std::string& host, short port, const std::string& symbol_prefix, int index, bool requiresDebugLogs, short lclPort) {
 
-    PositionClient client(host, port, symbol_prefix, requiresDebugLogs, lclPort);
+    PositionClient client(host, port, symbol_prefix, requiresDebugLogs, lclPort, thread_tuning_t(), stream_encoding::plain, clientTls);
 
     std::uniform_real_distribution<> dis(70.0, 100.0);
 
@@ -73,13 +121,656 @@ void run_ClientTwo(const std::string& host, short port, const std::string& symbo
     std::this_thread::sleep_for(std::chrono::seconds(5));
 }
 
+void run_QueryBenchmark(const std::string& host, short port, const std::string& symbol_prefix, int totalQueries, bool requiresDebugLogs, short lclPort) {
+
+    PositionClient client(host, port, symbol_prefix, requiresDebugLogs, lclPort, thread_tuning_t(), stream_encoding::plain, clientTls);
+
+    message_t message = {};
+    std::copy(symbol_prefix.begin(), symbol_prefix.end(), message.symbol.begin());
+    message.net_position = 100.0;
+    client.send_position(message);
+
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+
+    // Keep a fixed window of queries in flight so the measurement reflects server throughput, not round trips.
+    const int window = 64;
+    std::atomic<int> completed{0};
+    std::atomic<size_t> positionsReturned{0};
+
+    auto onResponse = [&completed, &positionsReturned](uint64_t, query_status, const std::vector<message_t>& positions) {
+        positionsReturned += positions.size();
+        ++completed;
+    };
+
+    auto begin = std::chrono::steady_clock::now();
+
+    for (int sent = 0; sent < totalQueries && client.running_; ++sent) {
+
+        while (sent - completed.load() >= window) {
+            std::this_thread::yield();
+        }
+
+        switch (sent % 3) {
+            case 0: client.query_symbol(symbol_prefix, onResponse); break;
+            case 1: client.query_symbols({symbol_prefix, "BTCUSDT.BN", "BTCUSDT.KRKN"}, onResponse); break;
+            default: client.query_prefix("BTC", onResponse); break;
+        }
+    }
+
+    while (completed.load() < totalQueries && client.running_) {
+        std::this_thread::yield();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    std::lock_guard<std::mutex> lock(print_mutex);
+    std::cout << "\nQuery benchmark: " << completed.load() << " queries in " << seconds << "s = "
+              << static_cast<long long>(completed.load() / seconds) << " queries/sec ("
+              << positionsReturned.load() << " positions returned, window " << window << ")\n"
+              << "The server answers every query on the session's single I/O thread, so this is queries/sec per server core." << std::endl;
+}
+
+void run_RiskMonitor(const std::string& host, short port, const std::string& symbol_prefix, int limit, bool requiresDebugLogs, short lclPort) {
+
+    PositionClient client(host, port, symbol_prefix, requiresDebugLogs, lclPort, thread_tuning_t(), stream_encoding::plain, clientTls);
+
+    // Only trigger events are pushed to this client; the full broadcast stream is switched off.
+    client.set_broadcasts(false);
+
+    auto onEvent = [](uint64_t predicate_id, const control_t& event, const message_t& update) {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << "\nPredicate " << predicate_id << " triggered for " << std::string(symbol_of(update))
+                  << (event.flags & predicate_rising ? " (rising)" : " (falling)")
+                  << (event.flags & predicate_band_exit ? " left band" : "")
+                  << ", level: " << event.lower << ", observed: " << event.upper
+                  << ", Net Position: " << update.net_position << std::endl;
+    };
+
+    for (const std::string symbol : {"BTCUSDT.BKN", "BTCUSDT.BN", "BTCUSDT.KRKN"}) {
+        client.watch_threshold(symbol, limit, predicate_rising | predicate_falling, onEvent);
+        client.watch_band(symbol, limit - 10, limit + 10, onEvent);
+        client.watch_rate(symbol, 20.0, onEvent);
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(60));
+}
+
+void run_LoadGenerator(const std::string& host, short port, const std::string& symbol_prefix, int updatesPerSecond, bool requiresDebugLogs, short lclPort) {
+
+    PositionClient client(host, port, symbol_prefix, requiresDebugLogs, lclPort, thread_tuning_t(), stream_encoding::plain, clientTls);
+
+    std::uniform_real_distribution<> dis(70.0, 100.0);
+    auto interval = std::chrono::nanoseconds(1000000000LL / std::max(updatesPerSecond, 1));
+    auto next = std::chrono::steady_clock::now();
+    auto end = next + std::chrono::seconds(60);
+    long long sent = 0;
+
+    message_t message = {};
+    std::copy(symbol_prefix.begin(), symbol_prefix.end(), message.symbol.begin());
+
+    while (client.running_ && std::chrono::steady_clock::now() < end) {
+
+        message.net_position = dis(gen);
+        client.send_position(message);
+        ++sent;
+
+        next += interval;
+        std::this_thread::sleep_until(next);
+    }
+
+    std::lock_guard<std::mutex> lock(print_mutex);
+    std::cout << "\nLoad generator " << symbol_prefix << " sent " << sent << " updates" << std::endl;
+}
+
+// Ticks a noisy random walk on four symbols at the given rate for 20 s through a publishing policy
+// (0.05 deadband, at most 20 updates/s per symbol, refreshed every second) and reports how many
+// ticks reached the wire.
+void run_FilteredPublisher(const std::string& host, short port, const std::string& symbol_prefix, int ticksPerSecond, bool requiresDebugLogs, short lclPort) {
+
+    PositionClient client(host, port, symbol_prefix, requiresDebugLogs, lclPort, thread_tuning_t(), stream_encoding::plain, clientTls);
+
+    publish_policy_t policy;
+    policy.absolute_deadband = 0.05;
+    policy.max_rate = 20;
+    policy.refresh = std::chrono::seconds(1);
+    client.set_publish_policy(policy);
+
+    std::normal_distribution<> noise(0.0, 0.02);
+    std::vector<message_t> symbols(4);
+    std::vector<double> positions(symbols.size(), 100.0);
+
+    for (std::size_t i = 0; i < symbols.size(); ++i) {
+        std::string symbol = symbol_prefix + "." + std::to_string(i);
+        symbols[i] = {};
+        std::copy(symbol.begin(), symbol.begin() + std::min(symbol.size(), symbols[i].symbol.size()), symbols[i].symbol.begin());
+    }
+
+    auto interval = std::chrono::nanoseconds(1000000000LL / std::max(ticksPerSecond, 1));
+    auto next = std::chrono::steady_clock::now();
+    auto end = next + std::chrono::seconds(20);
+
+    for (std::size_t tick = 0; client.running_ && std::chrono::steady_clock::now() < end; ++tick) {
+
+        std::size_t i = tick % symbols.size();
+        positions[i] += noise(gen);
+        symbols[i].net_position = positions[i];
+        client.send_position(symbols[i]);
+
+        next += interval;
+        std::this_thread::sleep_until(next);
+    }
+
+    publish_stats_t stats = client.publish_stats();
+
+    std::lock_guard<std::mutex> lock(print_mutex);
+    std::cout << "\nFiltered publisher " << symbol_prefix << ": " << stats.offered << " ticks offered, " << stats.sent << " sent ("
+              << (stats.offered ? 100.0 * stats.sent / stats.offered : 0.0) << "%), " << stats.suppressed << " inside the deadband, "
+              << stats.coalesced << " coalesced under the rate limit, " << stats.refreshed << " refreshes" << std::endl;
+}
+
+// Round trip of the client's own update: send, server ingest and dispatch, broadcast back.
+// Run once against a default server with function 5 and once against a --busy-poll server with
+// function 6 to get the A/B comparison.
+void run_LatencyProbe(const std::string& host, short port, const std::string& symbol_prefix, int samples, bool requiresDebugLogs, short lclPort, wait_mode mode) {
+
+    thread_tuning_t tuning;
+    tuning.mode = mode;
+
+    if (mode == wait_mode::busy_poll) {
+        tuning.cpu = static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u)) - 1;
+    }
+
+    PositionClient client(host, port, symbol_prefix, requiresDebugLogs, lclPort, tuning, stream_encoding::plain, clientTls);
+
+    samples = std::max(samples, 1);
+
+    std::atomic<int> echoed{0};
+    std::atomic<int64_t> arrival_ns{0};
+
+    client.on_update([&](const message_t& update) {
+        if (symbol_of(update) == symbol_prefix && update.net_position == static_cast<double>(echoed.load() + 1)) {
+            arrival_ns.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+            echoed.fetch_add(1, std::memory_order_release);
+        }
+    });
+
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+
+    std::vector<double> latencies_us;
+    latencies_us.reserve(samples);
+
+    message_t message = {};
+    std::copy(symbol_prefix.begin(), symbol_prefix.end(), message.symbol.begin());
+
+    for (int i = 0; i < samples && client.running_; ++i) {
+
+        message.net_position = static_cast<double>(i + 1);
+        auto sent = std::chrono::steady_clock::now();
+        auto deadline = sent + std::chrono::seconds(1);
+        client.send_position(message);
+
+        while (echoed.load(std::memory_order_acquire) < i + 1 && std::chrono::steady_clock::now() < deadline) {
+            if (mode == wait_mode::busy_poll) {
+                cpu_relax();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+
+        if (echoed.load(std::memory_order_acquire) < i + 1) {
+            std::lock_guard<std::mutex> lock(print_mutex);
+            std::cerr << "Probe " << i + 1 << " was not echoed within 1s, stopping." << std::endl;
+            break;
+        }
+
+        latencies_us.push_back((arrival_ns.load(std::memory_order_relaxed) - sent.time_since_epoch().count()) / 1000.0);
+
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+
+    if (latencies_us.empty()) {
+        return;
+    }
+
+    std::sort(latencies_us.begin(), latencies_us.end());
+
+    auto percentile = [&latencies_us](double p) {
+        std::size_t rank = static_cast<std::size_t>(std::ceil(p * latencies_us.size()));
+        return latencies_us[std::min(latencies_us.size(), std::max<std::size_t>(rank, 1)) - 1];
+    };
+
+    std::lock_guard<std::mutex> lock(print_mutex);
+    std::cout << "\nLatency probe (" << (mode == wait_mode::busy_poll ? "busy-poll" : "blocking") << " receive, "
+              << latencies_us.size() << " round trips): p50 " << percentile(0.50) << "us";
+
+    // A tail percentile is only shown when at least 10 samples lie above it; with fewer it is
+    // just the maximum under another name.
+    const std::pair<double, const char*> tails[] = {{0.90, "p90"}, {0.99, "p99"}, {0.999, "p99.9"}, {0.9999, "p99.99"}};
+
+    for (const auto& tail : tails) {
+        if (latencies_us.size() * (1.0 - tail.first) >= 10.0) {
+            std::cout << ", " << tail.second << " " << percentile(tail.first) << "us";
+        }
+    }
+
+    std::cout << ", max " << latencies_us.back() << "us" << std::endl;
+}
+
+// Subscribes with the gorilla stream encoding and reports wire bytes against the plain encoding.
+void run_CompressedSubscriber(const std::string& host, short port, const std::string& symbol_prefix, int seconds, bool requiresDebugLogs, short lclPort) {
+
+    PositionClient client(host, port, symbol_prefix, requiresDebugLogs, lclPort, thread_tuning_t(), stream_encoding::gorilla, clientTls);
+
+    client.on_update([](const message_t&) {});
+
+    std::this_thread::sleep_for(std::chrono::seconds(std::max(seconds, 1)));
+
+    uint64_t bytes = client.bytes_received();
+    uint64_t plain_bytes = client.updates_received() * sizeof(message_t);
+
+    std::lock_guard<std::mutex> lock(print_mutex);
+    std::cout << "\nCompressed subscriber " << symbol_prefix << ": " << client.updates_received() << " updates in " << bytes << " bytes ("
+              << plain_bytes << " bytes plain, ratio " << (bytes ? static_cast<double>(plain_bytes) / bytes : 0.0) << "x)" << std::endl;
+}
+
+// Writes a numbered series of updates while failing over between a primary and a replica
+// (field 5 is the replica's port), then checks the surviving server holds the last one.
+void run_FailoverClient(const std::string& host, short port, const std::string& symbol_prefix, int failoverPort, bool requiresDebugLogs, short lclPort) {
+
+    PositionClient client(host, port, symbol_prefix, requiresDebugLogs, lclPort, thread_tuning_t(), stream_encoding::plain, clientTls);
+    client.add_failover_endpoint(host, static_cast<short>(failoverPort));
+    client.on_update([](const message_t&) {});
+
+    const int updates = 3000;
+
+    for (int i = 1; i <= updates; ++i) {
+
+        message_t message = {};
+        std::copy(symbol_prefix.begin(), symbol_prefix.end(), message.symbol.begin());
+        message.net_position = i;
+        client.send_position(message);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+
+    std::promise<double> result;
+    client.query_symbol(symbol_prefix, [&result](uint64_t, query_status, const std::vector<message_t>& positions) {
+        result.set_value(positions.empty() ? 0.0 : positions.front().net_position);
+    });
+
+    auto future = result.get_future();
+
+    std::lock_guard<std::mutex> lock(print_mutex);
+
+    if (future.wait_for(std::chrono::seconds(10)) != std::future_status::ready) {
+        std::cout << "Failover check: no query response" << std::endl;
+        return;
+    }
+
+    std::cout << "Failover check: last update sent " << updates << ", server holds " << future.get() << std::endl;
+}
+
+// Publishes updates 1..N on its own symbol, then reads them back through a history range query
+// and a 100 ms rollup and checks both against what was sent. N above 1024 spans sealed blocks.
+void run_HistoryCheck(const std::string& host, short port, const std::string& symbol_prefix, int updates, bool requiresDebugLogs, short lclPort) {
+
+    PositionClient client(host, port, symbol_prefix, requiresDebugLogs, lclPort, thread_tuning_t(), stream_encoding::plain, clientTls);
+    client.on_update([](const message_t&) {});
+
+    updates = std::max(updates, 1);
+    int64_t from_ns = Clock::now_ns();
+
+    for (int i = 1; i <= updates; ++i) {
+
+        message_t message = {};
+        std::copy(symbol_prefix.begin(), symbol_prefix.end(), message.symbol.begin());
+        message.net_position = i;
+        client.send_position(message);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+
+    int64_t to_ns = Clock::now_ns();
+    const int64_t bucket_ns = 100000000;
+
+    std::promise<std::vector<message_t>> range_result;
+    std::promise<std::vector<message_t>> rollup_result;
+    client.query_history(symbol_prefix, from_ns, to_ns, [&range_result](uint64_t, query_status, const std::vector<message_t>& records) { range_result.set_value(records); });
+    client.query_rollup(symbol_prefix, from_ns, to_ns, bucket_ns, [&rollup_result](uint64_t, query_status, const std::vector<message_t>& records) { rollup_result.set_value(records); });
+
+    auto range_future = range_result.get_future();
+    auto rollup_future = rollup_result.get_future();
+
+    std::lock_guard<std::mutex> lock(print_mutex);
+
+    if (range_future.wait_for(std::chrono::seconds(10)) != std::future_status::ready || rollup_future.wait_for(std::chrono::seconds(10)) != std::future_status::ready) {
+        std::cout << "History check: FAIL, no response" << std::endl;
+        return;
+    }
+
+    std::vector<message_t> samples = range_future.get();
+    std::vector<message_t> buckets = rollup_future.get();
+    std::string failure;
+
+    if (samples.size() != static_cast<std::size_t>(updates)) {
+        failure = "range returned " + std::to_string(samples.size()) + " samples";
+    }
+
+    for (std::size_t i = 0; failure.empty() && i < samples.size(); ++i) {
+        if (samples[i].net_position != static_cast<double>(i + 1) || (i > 0 && samples[i].timestamp_ns < samples[i - 1].timestamp_ns)) {
+            failure = "range sample " + std::to_string(i) + " is out of order";
+        }
+    }
+
+    uint64_t counted = 0;
+    double low = 0;
+    double high = 0;
+
+    for (std::size_t i = 0; failure.empty() && i < buckets.size(); ++i) {
+
+        rollup_record_t bucket = to_rollup(buckets[i]);
+
+        if (bucket.count == 0 || (i > 0 && bucket.bucket_index <= to_rollup(buckets[i - 1]).bucket_index) || bucket.min > bucket.mean || bucket.mean > bucket.max) {
+            failure = "rollup bucket " + std::to_string(i) + " is inconsistent";
+        }
+
+        low = i == 0 ? bucket.min : std::min(low, bucket.min);
+        high = i == 0 ? bucket.max : std::max(high, bucket.max);
+        counted += bucket.count;
+    }
+
+    if (failure.empty() && (counted != static_cast<uint64_t>(updates) || low != 1.0 || high != updates || to_rollup(buckets.back()).last != updates)) {
+        failure = "rollup covers " + std::to_string(counted) + " samples from " + std::to_string(low) + " to " + std::to_string(high);
+    }
+
+    if (!failure.empty()) {
+        std::cout << "History check: FAIL, " << failure << std::endl;
+        return;
+    }
+
+    std::cout << "History check: PASS, " << samples.size() << " samples and " << buckets.size() << " 100 ms buckets match the " << updates << " updates sent" << std::endl;
+}
+
+// Opens `clients` connections at once from a single thread and times how long each takes to
+// become fully live: connected, identified, join snapshot received and a query answered. The
+// query is sent right behind the identifying record, so its response arrives after the snapshot.
+// Needs a descriptor limit above the client count on both ends (e.g. ulimit -n 20000).
+void run_ConnectionStorm(const std::string& host, short port, const std::string& symbol_prefix, int clients, bool /*requiresDebugLogs*/, short /*lclPort*/) {
+
+    raise_descriptor_limit();
+
+    struct connection_t {
+        explicit connection_t(boost::asio::io_context& io_context) : socket(io_context) {}
+
+        tcp::socket socket;
+        std::array<message_t, 3> greeting;
+        message_t record;
+        uint32_t payload_remaining = 0;
+        bool live = false;
+    };
+
+    boost::asio::io_context io_context;
+    tcp::resolver resolver(io_context);
+    auto endpoints = resolver.resolve(host, std::to_string(port));
+
+    clients = std::max(clients, 1);
+    std::vector<std::unique_ptr<connection_t>> connections;
+    std::vector<double> live_ms;
+    int failed = 0;
+    live_ms.reserve(clients);
+
+    auto begin = std::chrono::steady_clock::now();
+
+    auto elapsed_ms = [begin]() {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    };
+
+    std::function<void(connection_t&)> read_record = [&](connection_t& connection) {
+        boost::asio::async_read(connection.socket, boost::asio::buffer(&connection.record, sizeof(message_t)), [&, &connection = connection](boost::system::error_code ec, std::size_t) {
+            if (ec) {
+                ++failed;
+                return;
+            }
+
+            if (connection.payload_remaining > 0) {
+                --connection.payload_remaining;
+            } else if (is_control(connection.record)) {
+
+                control_t control = to_control(connection.record);
+                connection.payload_remaining = control.count;
+
+                if (static_cast<control_kind>(control.kind) == control_kind::query_response && control.request_id == 1) {
+                    connection.live = true;
+                    live_ms.push_back(elapsed_ms());
+                    return;
+                }
+            }
+
+            read_record(connection);
+        });
+    };
+
+    for (int i = 0; i < clients; ++i) {
+
+        connections.push_back(std::make_unique<connection_t>(io_context));
+        connection_t& connection = *connections.back();
+
+        std::string id = symbol_prefix + "." + std::to_string(i);
+        control_t query;
+        query.kind = static_cast<uint8_t>(control_kind::query_request);
+        query.type = static_cast<uint8_t>(query_type::symbol);
+        query.request_id = 1;
+        query.count = 1;
+
+        connection.greeting = {symbol_record(id), to_record(query), symbol_record(id)};
+
+        boost::asio::async_connect(connection.socket, endpoints, [&, &connection = connection](boost::system::error_code ec, const tcp::endpoint&) {
+            if (ec) {
+                ++failed;
+                return;
+            }
+
+            boost::asio::async_write(connection.socket, boost::asio::buffer(connection.greeting), [&, &connection = connection](boost::system::error_code ec, std::size_t) {
+                if (ec) {
+                    ++failed;
+                    return;
+                }
+
+                read_record(connection);
+            });
+        });
+    }
+
+    boost::asio::steady_timer deadline(io_context, std::chrono::seconds(60));
+    deadline.async_wait([&io_context](boost::system::error_code ec) {
+        if (!ec) {
+            io_context.stop();
+        }
+    });
+
+    while (!io_context.stopped() && static_cast<int>(live_ms.size()) + failed < clients) {
+        io_context.run_one();
+    }
+
+    double total_ms = elapsed_ms();
+    std::sort(live_ms.begin(), live_ms.end());
+
+    auto percentile = [&live_ms](double p) {
+        std::size_t rank = static_cast<std::size_t>(std::ceil(p * live_ms.size()));
+        return live_ms.empty() ? 0.0 : live_ms[std::min(live_ms.size(), std::max<std::size_t>(rank, 1)) - 1];
+    };
+
+    std::lock_guard<std::mutex> lock(print_mutex);
+    std::cout << "\nConnection storm: " << live_ms.size() << " of " << clients << " clients live in " << total_ms << " ms ("
+              << failed << " failed); time to live p50 " << percentile(0.50) << " ms, p99 " << percentile(0.99)
+              << " ms, max " << (live_ms.empty() ? 0.0 : live_ms.back()) << " ms" << std::endl;
+}
+
+// Hosts `sessions` client IDs in one process, each publishing an update a second for 30 seconds
+// with broadcasts off, and reports the threads and resident memory they cost. Function 10 puts
+// them on a two-thread ClientRuntime; function 11 gives each its own io_context and thread.
+void run_Gateway(const std::string& host, short port, const std::string& symbol_prefix, int sessions, bool requiresDebugLogs, short lclPort, bool shared) {
+
+    raise_descriptor_limit();
+
+    sessions = std::max(sessions, 1);
+    process_usage_t before = process_usage();
+    auto begin = std::chrono::steady_clock::now();
+
+    std::unique_ptr<ClientRuntime> runtime;
+    std::vector<std::unique_ptr<PositionClient>> clients;
+    clients.reserve(sessions);
+
+    if (shared) {
+        runtime = std::make_unique<ClientRuntime>(2);
+    }
+
+    for (int i = 0; i < sessions; ++i) {
+
+        std::string id = symbol_prefix + "." + std::to_string(i);
+
+        if (shared) {
+            clients.push_back(std::make_unique<PositionClient>(*runtime, host, port, id, requiresDebugLogs, stream_encoding::plain, clientTls));
+        } else {
+            clients.push_back(std::make_unique<PositionClient>(host, port, id, requiresDebugLogs, lclPort, thread_tuning_t(), stream_encoding::plain, clientTls));
+        }
+
+        clients.back()->on_update([](const message_t&) {});
+        clients.back()->set_broadcasts(false);
+    }
+
+    int connected = 0;
+
+    for (auto& client : clients) {
+        connected += client->wait_connected(std::chrono::seconds(10)) ? 1 : 0;
+    }
+
+    double connect_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    process_usage_t loaded = process_usage();
+
+    std::uniform_real_distribution<> dis(70.0, 100.0);
+    auto next = std::chrono::steady_clock::now();
+    long long sent = 0;
+
+    for (int second = 0; second < 30; ++second) {
+
+        for (int i = 0; i < sessions; ++i) {
+
+            std::string id = symbol_prefix + "." + std::to_string(i);
+            message_t message = {};
+            std::copy(id.begin(), id.begin() + std::min(id.size(), message.symbol.size()), message.symbol.begin());
+            message.net_position = dis(gen);
+            clients[i]->send_position(message);
+            ++sent;
+        }
+
+        next += std::chrono::seconds(1);
+        std::this_thread::sleep_until(next);
+    }
+
+    auto stopping = std::chrono::steady_clock::now();
+    clients.clear();
+    runtime.reset();
+    double stop_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - stopping).count();
+
+    long threads = loaded.threads - before.threads;
+    long rss_kb = loaded.rss_kb - before.rss_kb;
+
+    std::lock_guard<std::mutex> lock(print_mutex);
+    std::cout << "\nGateway (" << (shared ? "shared runtime" : "thread per client") << "): " << connected << " of " << sessions << " sessions connected in "
+              << connect_ms << " ms; " << threads << " threads and " << rss_kb << " KB resident for them (" << static_cast<double>(rss_kb) / sessions
+              << " KB per session); sent " << sent << " updates; stopped in " << stop_ms << " ms" << std::endl;
+}
+
+// Many subscriber sessions on one runtime, each receiving every broadcast, for measuring what the
+// server's fan-out delivers; run with and without --tls to compare the record layers.
+void run_FanoutSubscribers(const std::string& host, short port, const std::string& symbol_prefix, int sessions, bool requiresDebugLogs, short /*lclPort*/) {
+
+    raise_descriptor_limit();
+
+    sessions = std::max(sessions, 1);
+
+    ClientRuntime runtime(1);
+    std::vector<std::unique_ptr<PositionClient>> clients;
+
+    for (int i = 0; i < sessions; ++i) {
+        clients.push_back(std::make_unique<PositionClient>(runtime, host, port, symbol_prefix + "." + std::to_string(i), requiresDebugLogs, stream_encoding::plain, clientTls));
+        clients.back()->on_update([](const message_t&) {});
+    }
+
+    int connected = 0;
+
+    for (auto& client : clients) {
+        connected += client->wait_connected(std::chrono::seconds(10)) ? 1 : 0;
+    }
+
+    auto totals = [&clients]() {
+        std::pair<uint64_t, uint64_t> sum(0, 0);
+
+        for (auto& client : clients) {
+            sum.first += client->updates_received();
+            sum.second += client->bytes_received();
+        }
+
+        return sum;
+    };
+
+    // The first second covers the join snapshots and lets the publisher reach its rate.
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+
+    auto first = totals();
+    auto begin = std::chrono::steady_clock::now();
+
+    std::this_thread::sleep_for(std::chrono::seconds(10));
+
+    auto last = totals();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    clients.clear();
+    runtime.stop();
+
+    std::lock_guard<std::mutex> lock(print_mutex);
+    std::cout << "\nFan-out (" << (clientTls.enabled ? (clientTls.kernel_offload ? "TLS, kTLS requested" : "TLS, userspace") : "plaintext") << "): "
+              << connected << " of " << sessions << " sessions; " << (last.first - first.first) / seconds << " updates/s and "
+              << (last.second - first.second) / seconds / 1e6 << " MB/s delivered in total" << std::endl;
+}
+
 int main(int argc, char* argv[]) {
 
-    if (argc != 8) {
-        std::cerr << "Usage: " << argv[0] << " <host> <port> <symbol_prefix> <interimDataSending> <debugLogsRequired> <localPortNumber> <clientFunctionSpecifier>" << std::endl;
+    if (argc < 8) {
+        std::cerr << "Usage: " << argv[0] << " <host> <port> <symbol_prefix> <interimDataSending> <debugLogsRequired> <localPortNumber> <clientFunctionSpecifier>"
+                  << " [--tls] [--tls-ca PEM] [--tls-no-ktls] [--trace PATH [--trace-window-ms N]]" << std::endl;
         return 1;
     }
 
+    std::string tracePath;
+    int traceWindowMs = 1000;
+
+    for (int i = 8; i < argc; ++i) {
+
+        std::string option = argv[i];
+
+        if (option == "--tls") {
+            clientTls.enabled = true;
+        } else if (option == "--tls-ca" && i + 1 < argc) {
+            clientTls.enabled = true;
+            clientTls.ca_file = argv[++i];
+        } else if (option == "--tls-no-ktls") {
+            clientTls.kernel_offload = false;
+        } else if (option == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (option == "--trace-window-ms" && i + 1 < argc) {
+            traceWindowMs = std::stoi(argv[++i]);
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            return 1;
+        }
+    }
+
     std::string host = argv[1];
     short port = static_cast<short>(std::stoi(argv[2]));
     std::string symbol_prefix = argv[3];
@@ -98,6 +789,10 @@ int main(int argc, char* argv[]) {
         debugLogs = false;
     }
 
+    if (!tracePath.empty()) {
+        TraceRecorder::start(65536);
+    }
+
     if(spec == 0) {
         std::thread client_thread(run_Client, host, port, symbol_prefix, interimTimeBetweenMessages, debugLogs, local_port);
 
@@ -109,8 +804,84 @@ int main(int argc, char* argv[]) {
         
         client_thread.join();
     }
+    else if (spec == 3) {
+
+        std::thread client_thread(run_RiskMonitor, host, port, symbol_prefix, interimTimeBetweenMessages, debugLogs, local_port);
+
+        client_thread.join();
+    }
+    else if (spec == 4) {
+
+        std::thread client_thread(run_LoadGenerator, host, port, symbol_prefix, interimTimeBetweenMessages, debugLogs, local_port);
+
+        client_thread.join();
+    }
+    else if (spec == 2) {
+
+        std::thread client_thread(run_QueryBenchmark, host, port, symbol_prefix, interimTimeBetweenMessages, debugLogs, local_port);
+
+        client_thread.join();
+    }
+    else if (spec == 7) {
+
+        std::thread client_thread(run_CompressedSubscriber, host, port, symbol_prefix, interimTimeBetweenMessages, debugLogs, local_port);
+
+        client_thread.join();
+    }
+    else if (spec == 8) {
+
+        std::thread client_thread(run_FailoverClient, host, port, symbol_prefix, interimTimeBetweenMessages, debugLogs, local_port);
+
+        client_thread.join();
+    }
+    else if (spec == 9) {
+
+        std::thread client_thread(run_ConnectionStorm, host, port, symbol_prefix, interimTimeBetweenMessages, debugLogs, local_port);
+
+        client_thread.join();
+    }
+    else if (spec == 10 || spec == 11) {
+
+        std::thread client_thread(run_Gateway, host, port, symbol_prefix, interimTimeBetweenMessages, debugLogs, local_port, spec == 10);
+
+        client_thread.join();
+    }
+    else if (spec == 13) {
+
+        std::thread client_thread(run_FilteredPublisher, host, port, symbol_prefix, interimTimeBetweenMessages, debugLogs, local_port);
+
+        client_thread.join();
+    }
+    else if (spec == 14) {
+
+        std::thread client_thread(run_HistoryCheck, host, port, symbol_prefix, interimTimeBetweenMessages, debugLogs, local_port);
 
+        client_thread.join();
+    }
+    else if (spec == 12) {
+
+        std::thread client_thread(run_FanoutSubscribers, host, port, symbol_prefix, interimTimeBetweenMessages, debugLogs, local_port);
+
+        client_thread.join();
+    }
+    else if (spec == 5 || spec == 6) {
 
+        wait_mode mode = spec == 6 ? wait_mode::busy_poll : wait_mode::blocking;
+        std::thread client_thread(run_LatencyProbe, host, port, symbol_prefix, interimTimeBetweenMessages, debugLogs, local_port, mode);
+
+        client_thread.join();
+    }
+
+    if (!tracePath.empty()) {
+
+        TraceRecorder::stop();
+
+        if (TraceRecorder::dump(tracePath, static_cast<int64_t>(traceWindowMs) * 1000000)) {
+            std::cout << "Wrote the last " << traceWindowMs << " ms of trace events to " << tracePath << std::endl;
+        } else {
+            std::cerr << "Could not write trace to " << tracePath << std::endl;
+        }
+    }
 
     return 0;
 }
\ No newline at end of file
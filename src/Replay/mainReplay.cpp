@@ -0,0 +1,288 @@
+#include "../Client/PositionClient.h"
+#include "../../include/Capture.h"
+#include "../../include/Clock.h"
+#include "../../include/Common.h"
+#include <iostream>
+#include <fstream>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+std::mutex print_mutex;
+
+// Replays a capture file (recorded with the server's --capture) against a server: one client per
+// recorded client ID sends its updates in the recorded order and at the recorded spacing, scaled
+// by the speed factor or as fast as possible, while a subscriber measures how long each update
+// takes from being sent to being broadcast back. Results can be saved and compared between builds.
+
+struct replay_result_t {
+    std::map<std::string, double> metrics;
+};
+
+static bool save_result(const std::string& path, const replay_result_t& result) {
+
+    std::ofstream out(path);
+
+    for (const auto& metric : result.metrics) {
+        out << metric.first << " " << metric.second << "\n";
+    }
+
+    return static_cast<bool>(out);
+}
+
+static bool load_result(const std::string& path, replay_result_t& result) {
+
+    std::ifstream in(path);
+    std::string name;
+    double value;
+
+    while (in >> name >> value) {
+        result.metrics[name] = value;
+    }
+
+    return !result.metrics.empty();
+}
+
+int main(int argc, char* argv[]) {
+
+    if (argc < 5) {
+        std::cerr << "Usage: " << argv[0] << " <host> <port> <captureFile> <speed: 1, N or max> [--save FILE] [--compare FILE]" << std::endl;
+        return 1;
+    }
+
+    std::string host = argv[1];
+    short port = static_cast<short>(std::stoi(argv[2]));
+    std::string capturePath = argv[3];
+    std::string speedText = argv[4];
+    double speed = speedText == "max" ? 0.0 : std::stod(speedText);
+    std::string savePath;
+    std::string comparePath;
+
+    for (int i = 5; i < argc; ++i) {
+
+        std::string option = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (option == "--save" && hasValue) {
+            savePath = argv[++i];
+        } else if (option == "--compare" && hasValue) {
+            comparePath = argv[++i];
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            return 1;
+        }
+    }
+
+    // First pass: which client sent from each session, how many updates and over what span.
+    CaptureReader reader;
+
+    if (!reader.open(capturePath)) {
+        std::cerr << "Could not read capture file " << capturePath << std::endl;
+        return 1;
+    }
+
+    std::unordered_map<uint32_t, std::string> sessionClients;
+    std::vector<std::string> clientIds;
+    capture_event_t event;
+    uint64_t updates = 0;
+    int64_t firstArrival = 0;
+    int64_t lastArrival = 0;
+
+    auto clientOf = [&](uint32_t session) -> const std::string& {
+
+        auto it = sessionClients.find(session);
+
+        if (it == sessionClients.end()) {
+            it = sessionClients.emplace(session, "REPLAY." + std::to_string(session)).first;
+        }
+
+        if (std::find(clientIds.begin(), clientIds.end(), it->second) == clientIds.end()) {
+            clientIds.push_back(it->second);
+        }
+
+        return it->second;
+    };
+
+    while (reader.next(event)) {
+
+        if (event.kind == capture_kind::connect) {
+            sessionClients[event.session] = event.client_id;
+        } else if (event.kind == capture_kind::update) {
+            clientOf(event.session);
+            firstArrival = updates == 0 ? event.arrival_ns : firstArrival;
+            lastArrival = event.arrival_ns;
+            ++updates;
+        }
+    }
+
+    if (updates == 0) {
+        std::cerr << "Capture file " << capturePath << " holds no updates." << std::endl;
+        return 1;
+    }
+
+    double recordedSeconds = (lastArrival - firstArrival) / 1e9;
+
+    {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << "Capture " << capturePath << ": " << updates << " updates from " << clientIds.size() << " clients over "
+                  << recordedSeconds << " s (" << reader.size() << " bytes)" << std::endl;
+    }
+
+    // Every recorded client is connected (and past its join snapshot) before the clock starts, so
+    // the replay exercises ingest and fan-out rather than connection setup. Senders keep receiving
+    // broadcasts, as the recorded clients did.
+    bool debugLogs = false;
+    std::unordered_map<std::string, std::unique_ptr<PositionClient>> senders;
+
+    for (const auto& id : clientIds) {
+        senders[id] = std::make_unique<PositionClient>(host, port, id, debugLogs, 0);
+        senders[id]->on_update([](const message_t&) {});
+    }
+
+    PositionClient subscriber(host, port, "REPLAY.SUBSCRIBER", debugLogs, 0);
+
+    std::vector<int64_t> latencies_ns;
+    latencies_ns.reserve(updates);
+    std::atomic<uint64_t> received{0};
+    std::atomic<int64_t> lastReceived{0};
+    std::atomic<int64_t> replayStart{0};
+
+    // Runs on the subscriber's receive thread only; the join snapshot predates replayStart.
+    subscriber.on_update([&](const message_t& update) {
+
+        int64_t now = Clock::now_ns();
+        int64_t start = replayStart.load(std::memory_order_acquire);
+
+        if (start == 0 || update.timestamp_ns < start) {
+            return;
+        }
+
+        latencies_ns.push_back(now - update.timestamp_ns);
+        lastReceived.store(now, std::memory_order_relaxed);
+        received.fetch_add(1, std::memory_order_release);
+    });
+
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+
+    // Second pass: send.
+    reader.open(capturePath);
+
+    auto begin = std::chrono::steady_clock::now();
+    int64_t beginNs = Clock::now_ns();
+    int64_t maxBehindNs = 0;
+    uint64_t sent = 0;
+
+    replayStart.store(beginNs, std::memory_order_release);
+
+    while (reader.next(event)) {
+
+        if (event.kind != capture_kind::update) {
+            continue;
+        }
+
+        if (speed > 0) {
+
+            auto due = begin + std::chrono::nanoseconds(static_cast<int64_t>((event.arrival_ns - firstArrival) / speed));
+            auto now = std::chrono::steady_clock::now();
+
+            if (due > now) {
+                std::this_thread::sleep_until(due);
+            } else {
+                maxBehindNs = std::max<int64_t>(maxBehindNs, std::chrono::duration_cast<std::chrono::nanoseconds>(now - due).count());
+            }
+        }
+
+        senders[clientOf(event.session)]->send_position(event.update);
+        ++sent;
+    }
+
+    double sendSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    // Wait for the broadcasts to drain: everything arrived, or nothing new for two seconds.
+    uint64_t seen = 0;
+    auto quietSince = std::chrono::steady_clock::now();
+
+    while (received.load(std::memory_order_acquire) < sent && std::chrono::steady_clock::now() - quietSince < std::chrono::seconds(2)) {
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        if (received.load(std::memory_order_acquire) != seen) {
+            seen = received.load(std::memory_order_acquire);
+            quietSince = std::chrono::steady_clock::now();
+        }
+    }
+
+    subscriber.stop();
+
+    for (auto& sender : senders) {
+        sender.second->stop();
+    }
+
+    uint64_t delivered = received.load(std::memory_order_acquire);
+    double deliverSeconds = delivered > 0 ? (lastReceived.load() - beginNs) / 1e9 : 0.0;
+
+    std::sort(latencies_ns.begin(), latencies_ns.end());
+
+    auto percentile = [&latencies_ns](double p) {
+        std::size_t rank = static_cast<std::size_t>(std::ceil(p * latencies_ns.size()));
+        return latencies_ns.empty() ? 0.0 : latencies_ns[std::min(latencies_ns.size(), std::max<std::size_t>(rank, 1)) - 1] / 1000.0;
+    };
+
+    replay_result_t result;
+    result.metrics["sent_per_second"] = sendSeconds > 0 ? sent / sendSeconds : 0.0;
+    result.metrics["delivered_per_second"] = deliverSeconds > 0 ? delivered / deliverSeconds : 0.0;
+    result.metrics["delivered_fraction"] = static_cast<double>(delivered) / sent;
+    result.metrics["latency_p50_us"] = percentile(0.50);
+    result.metrics["latency_p99_us"] = percentile(0.99);
+    result.metrics["latency_p999_us"] = percentile(0.999);
+    result.metrics["latency_max_us"] = latencies_ns.empty() ? 0.0 : latencies_ns.back() / 1000.0;
+
+    {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << "\nReplayed " << sent << " updates at " << (speed > 0 ? speedText + "x" : std::string("max speed")) << " in " << sendSeconds << " s ("
+                  << result.metrics["sent_per_second"] << " updates/s";
+
+        if (speed > 0) {
+            std::cout << ", up to " << maxBehindNs / 1e6 << " ms behind schedule";
+        }
+
+        std::cout << ")\nSubscriber received " << delivered << " of " << sent << " (" << result.metrics["delivered_per_second"] << " updates/s); send to broadcast latency p50 "
+                  << result.metrics["latency_p50_us"] << "us, p99 " << result.metrics["latency_p99_us"] << "us, p99.9 " << result.metrics["latency_p999_us"]
+                  << "us, max " << result.metrics["latency_max_us"] << "us" << std::endl;
+    }
+
+    if (!savePath.empty() && !save_result(savePath, result)) {
+        std::cerr << "Could not write " << savePath << std::endl;
+    }
+
+    replay_result_t baseline;
+
+    if (!comparePath.empty()) {
+
+        if (!load_result(comparePath, baseline)) {
+            std::cerr << "Could not read " << comparePath << std::endl;
+            return 1;
+        }
+
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << "\nAgainst " << comparePath << ":" << std::endl;
+
+        for (const auto& metric : result.metrics) {
+
+            auto before = baseline.metrics.find(metric.first);
+
+            if (before == baseline.metrics.end()) {
+                continue;
+            }
+
+            double change = before->second != 0 ? (metric.second - before->second) / before->second * 100.0 : 0.0;
+            std::cout << "  " << metric.first << ": " << before->second << " -> " << metric.second << " (" << (change >= 0 ? "+" : "") << change << "%)" << std::endl;
+        }
+    }
+
+    return 0;
+}
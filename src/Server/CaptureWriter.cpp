@@ -0,0 +1,109 @@
+#include "CaptureWriter.h"
+#include "../../include/Clock.h"
+
+static constexpr std::size_t capture_flush_bytes = 64 * 1024;
+
+CaptureWriter::CaptureWriter() : open_(false), file_(nullptr), events_(0), bytes_(0) {
+    buffer_.reserve(capture_flush_bytes + 256);
+}
+
+CaptureWriter::~CaptureWriter() {
+    close();
+}
+
+bool CaptureWriter::open(const std::string& path) {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (file_ != nullptr) {
+        return true;
+    }
+
+    file_ = std::fopen(path.c_str(), "wb");
+
+    if (file_ == nullptr) {
+        return false;
+    }
+
+    buffer_.clear();
+    events_ = 0;
+    bytes_ = 0;
+    encoder_.header(buffer_, Clock::now_ns());
+    open_ = true;
+    return true;
+}
+
+void CaptureWriter::close() {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (file_ == nullptr) {
+        return;
+    }
+
+    open_ = false;
+    flush_locked();
+    std::fclose(file_);
+    file_ = nullptr;
+}
+
+void CaptureWriter::connect(uint32_t session, std::string_view client_id) {
+
+    int64_t arrival_ns = Clock::now_ns();
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (file_ == nullptr) {
+        return;
+    }
+
+    encoder_.connect(buffer_, arrival_ns, session, client_id);
+    ++events_;
+}
+
+void CaptureWriter::update(uint32_t session, const message_t& message) {
+    update(session, &message, 1);
+}
+
+// A batch read together shares one arrival time unless the kernel stamped it.
+void CaptureWriter::update(uint32_t session, const message_t* messages, std::size_t count) {
+
+    int64_t now_ns = Clock::now_ns();
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (file_ == nullptr) {
+        return;
+    }
+
+    for (std::size_t i = 0; i < count; ++i) {
+        encoder_.update(buffer_, messages[i].receive_ns != 0 ? messages[i].receive_ns : now_ns, session, messages[i]);
+    }
+
+    events_ += count;
+
+    if (buffer_.size() >= capture_flush_bytes) {
+        flush_locked();
+    }
+}
+
+void CaptureWriter::disconnect(uint32_t session) {
+
+    int64_t arrival_ns = Clock::now_ns();
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (file_ == nullptr) {
+        return;
+    }
+
+    encoder_.disconnect(buffer_, arrival_ns, session);
+    ++events_;
+}
+
+void CaptureWriter::flush_locked() {
+
+    if (buffer_.empty()) {
+        return;
+    }
+
+    bytes_ += std::fwrite(buffer_.data(), 1, buffer_.size(), file_);
+    buffer_.clear();
+}
@@ -0,0 +1,46 @@
+#ifndef CAPTURE_WRITER_H
+#define CAPTURE_WRITER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "../../include/Capture.h"
+
+// Records a server's inbound traffic to a capture file (Capture.h) for replay. I/O threads
+// append encoded events to one buffer under a short lock; the buffer is written out in 64 KB
+// chunks, so the file write costs one fwrite per few thousand updates. Arrival times are the
+// kernel receive stamps when the server captures them, and Clock::now_ns() otherwise.
+class CaptureWriter {
+public:
+    CaptureWriter();
+    ~CaptureWriter();
+
+    bool open(const std::string& path);
+    void close();
+    bool is_open() const { return open_.load(std::memory_order_relaxed); }
+
+    void connect(uint32_t session, std::string_view client_id);
+    void update(uint32_t session, const message_t& message);
+    void update(uint32_t session, const message_t* messages, std::size_t count);
+    void disconnect(uint32_t session);
+
+    uint64_t events() const { return events_; }
+    uint64_t bytes() const { return bytes_; }
+
+private:
+    void flush_locked();
+
+    std::mutex mutex_;
+    std::atomic<bool> open_;
+    std::FILE* file_;
+    CaptureEncoder encoder_;
+    std::vector<uint8_t> buffer_;
+    uint64_t events_;
+    uint64_t bytes_;
+};
+
+#endif // CAPTURE_WRITER_H
@@ -0,0 +1,138 @@
+#include "ClientRegistry.h"
+#include <algorithm>
+#include <functional>
+
+ClientRegistry::ClientRegistry(std::size_t capacity) {
+
+    std::size_t size = 2;
+
+    while (size < capacity * 2) {
+        size <<= 1;
+    }
+
+    mask_ = size - 1;
+    probe_limit_ = std::min(max_probe, size);
+    slots_ = std::make_unique<std::atomic<uint64_t>[]>(size);
+    clear();
+}
+
+// Slots are only ever empty, released or holding a key, and never go back to empty while
+// threads are running, so every key stays reachable from its home slot without crossing an
+// empty one, and lies within probe_limit_ slots of it.
+bool ClientRegistry::try_register(std::string_view client_id) {
+
+    uint64_t key = key_of(client_id);
+    std::size_t home = key & mask_;
+
+    for (;;) {
+
+        std::size_t claim = mask_ + 1;
+
+        for (std::size_t probe = 0; probe < probe_limit_; ++probe) {
+
+            std::size_t index = (home + probe) & mask_;
+            uint64_t value = slots_[index].load(std::memory_order_acquire);
+
+            if (value == key) {
+                return false;
+            }
+
+            if (value == released_slot && claim > mask_) {
+                claim = index;
+            }
+
+            if (value == empty_slot) {
+
+                if (claim > mask_) {
+                    claim = index;
+                }
+
+                break;
+            }
+        }
+
+        if (claim > mask_) {
+            return false;
+        }
+
+        uint64_t expected = slots_[claim].load(std::memory_order_acquire);
+
+        if (expected != empty_slot && expected != released_slot) {
+            continue;
+        }
+
+        if (!slots_[claim].compare_exchange_strong(expected, key, std::memory_order_acq_rel)) {
+
+            if (expected == key) {
+                return false;
+            }
+
+            continue;
+        }
+
+        // Two threads registering the same ID can claim different slots if a release reshaped the
+        // chain in between. Whichever claims later always sees the other and backs out; if both
+        // see each other both back out and the clients simply retry.
+        if (has_other(key, home, claim)) {
+            slots_[claim].store(released_slot, std::memory_order_release);
+            return false;
+        }
+
+        return true;
+    }
+}
+
+bool ClientRegistry::release(std::string_view client_id) {
+
+    uint64_t key = key_of(client_id);
+    std::size_t home = key & mask_;
+
+    for (std::size_t probe = 0; probe < probe_limit_; ++probe) {
+
+        std::size_t index = (home + probe) & mask_;
+        uint64_t value = slots_[index].load(std::memory_order_acquire);
+
+        if (value == empty_slot) {
+            return false;
+        }
+
+        if (value == key) {
+            uint64_t expected = key;
+            return slots_[index].compare_exchange_strong(expected, released_slot, std::memory_order_acq_rel);
+        }
+    }
+
+    return false;
+}
+
+void ClientRegistry::clear() {
+
+    for (std::size_t i = 0; i <= mask_; ++i) {
+        slots_[i].store(empty_slot, std::memory_order_relaxed);
+    }
+}
+
+uint64_t ClientRegistry::key_of(std::string_view client_id) {
+
+    uint64_t key = std::hash<std::string_view>()(client_id);
+    return key > released_slot ? key : key + 2;
+}
+
+bool ClientRegistry::has_other(uint64_t key, std::size_t home, std::size_t own) const {
+
+    for (std::size_t probe = 0; probe < probe_limit_; ++probe) {
+
+        std::size_t index = (home + probe) & mask_;
+        uint64_t value = slots_[index].load(std::memory_order_acquire);
+
+        if (value == empty_slot) {
+            return false;
+        }
+
+        if (index != own && value == key) {
+            return true;
+        }
+    }
+
+    return false;
+}
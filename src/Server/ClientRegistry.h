@@ -0,0 +1,45 @@
+#ifndef CLIENT_REGISTRY_H
+#define CLIENT_REGISTRY_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+// Set of connected client IDs that I/O threads register into and release from without a
+// lock, so a reconnect storm spread over several threads does not queue on clients_mutex_
+// for the duplicate check. IDs are kept as 64-bit hashes in an open-addressed table claimed
+// by compare-and-swap; released slots become tombstones that later registrations reuse. A key
+// is only ever placed within max_probe slots of its home, so every probe stays that short even
+// once churning IDs have turned every empty slot into a tombstone.
+// Two distinct IDs with colliding hashes would be treated as duplicates (about 1 in 10^11
+// with 10k clients connected).
+class ClientRegistry {
+public:
+    // Room for `capacity` IDs at once; the table is sized to stay at most half full.
+    explicit ClientRegistry(std::size_t capacity = 65536);
+
+    // Returns false if the ID is already registered (or the max_probe slots from its home are
+    // all taken, which at half full is vanishingly rare).
+    bool try_register(std::string_view client_id);
+
+    // Returns false if the ID was not registered.
+    bool release(std::string_view client_id);
+
+    // Forgets every ID. Only called while no I/O thread is running.
+    void clear();
+
+private:
+    static constexpr uint64_t empty_slot = 0;
+    static constexpr uint64_t released_slot = 1;
+    static constexpr std::size_t max_probe = 128;
+
+    static uint64_t key_of(std::string_view client_id);
+    bool has_other(uint64_t key, std::size_t home, std::size_t own) const;
+
+    std::size_t mask_;
+    std::size_t probe_limit_;
+    std::unique_ptr<std::atomic<uint64_t>[]> slots_;
+};
+
+#endif // CLIENT_REGISTRY_H
@@ -0,0 +1,361 @@
+#include "Handoff.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define POSITION_SERVER_HANDOFF 1
+#endif
+
+// Descriptors sent per sendmsg; the kernel caps a single SCM_RIGHTS message (253 on Linux).
+static constexpr std::size_t fds_per_message = 128;
+static constexpr uint32_t handoff_magic = 0x4f485350; // "PSHO"
+static constexpr uint32_t handoff_version = 1;
+
+#ifdef POSITION_SERVER_HANDOFF
+
+namespace {
+
+class BlobWriter {
+public:
+    explicit BlobWriter(std::vector<uint8_t>& out) : out_(out) {}
+
+    template <typename T>
+    void put(const T& value) {
+        const uint8_t* raw = reinterpret_cast<const uint8_t*>(&value);
+        out_.insert(out_.end(), raw, raw + sizeof(T));
+    }
+
+    template <typename T>
+    void put_vector(const std::vector<T>& values) {
+        put<uint64_t>(values.size());
+        const uint8_t* raw = reinterpret_cast<const uint8_t*>(values.data());
+        out_.insert(out_.end(), raw, raw + values.size() * sizeof(T));
+    }
+
+private:
+    std::vector<uint8_t>& out_;
+};
+
+class BlobReader {
+public:
+    BlobReader(const std::vector<uint8_t>& in) : in_(in), offset_(0), ok_(true) {}
+
+    template <typename T>
+    T get() {
+        T value{};
+        if (!ok_ || in_.size() - offset_ < sizeof(T)) {
+            ok_ = false;
+            return value;
+        }
+        std::memcpy(static_cast<void*>(&value), in_.data() + offset_, sizeof(T));
+        offset_ += sizeof(T);
+        return value;
+    }
+
+    template <typename T>
+    void get_vector(std::vector<T>& values) {
+        uint64_t count = get<uint64_t>();
+        if (!ok_ || count > (in_.size() - offset_) / sizeof(T)) {
+            ok_ = false;
+            return;
+        }
+        values.resize(count);
+        std::memcpy(static_cast<void*>(values.data()), in_.data() + offset_, count * sizeof(T));
+        offset_ += count * sizeof(T);
+    }
+
+    bool ok() const { return ok_; }
+
+private:
+    const std::vector<uint8_t>& in_;
+    std::size_t offset_;
+    bool ok_;
+};
+
+} // namespace
+
+static void encode_state(const handoff_state_t& state, std::vector<uint8_t>& out) {
+
+    BlobWriter writer(out);
+    writer.put(handoff_magic);
+    writer.put(handoff_version);
+    writer.put(state.sequence);
+    writer.put_vector(state.positions);
+    writer.put<uint64_t>(state.sessions.size());
+
+    for (const auto& session : state.sessions) {
+        writer.put(session.client_record);
+        writer.put(session.encoding);
+        writer.put<uint8_t>(session.wants_broadcasts);
+        writer.put(session.read_partial);
+        writer.put(session.read_buffer);
+        writer.put(to_record(session.pending_request));
+        writer.put(session.pending_records);
+        writer.put_vector(session.pending_payload);
+        writer.put_vector(session.predicates);
+        writer.put_vector(session.unsent);
+        writer.put_vector(session.queued);
+    }
+}
+
+static bool decode_state(const std::vector<uint8_t>& in, handoff_state_t& state) {
+
+    BlobReader reader(in);
+
+    if (reader.get<uint32_t>() != handoff_magic || reader.get<uint32_t>() != handoff_version) {
+        return false;
+    }
+
+    state.sequence = reader.get<uint64_t>();
+    reader.get_vector(state.positions);
+
+    uint64_t sessions = reader.get<uint64_t>();
+
+    for (uint64_t i = 0; i < sessions && reader.ok(); ++i) {
+
+        handoff_session_t session;
+        session.client_record = reader.get<message_t>();
+        session.encoding = reader.get<uint8_t>();
+        session.wants_broadcasts = reader.get<uint8_t>() != 0;
+        session.read_partial = reader.get<uint32_t>();
+        session.read_buffer = reader.get<message_t>();
+        session.pending_request = to_control(reader.get<message_t>());
+        session.pending_records = reader.get<uint32_t>();
+        reader.get_vector(session.pending_payload);
+        reader.get_vector(session.predicates);
+        reader.get_vector(session.unsent);
+        reader.get_vector(session.queued);
+
+        if (session.read_partial >= sizeof(message_t)) {
+            return false;
+        }
+
+        state.sessions.push_back(std::move(session));
+    }
+
+    return reader.ok();
+}
+
+static bool write_all(int fd, const void* data, std::size_t size) {
+
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+
+    while (size > 0) {
+
+        ssize_t written = ::write(fd, bytes, size);
+
+        if (written <= 0) {
+            return false;
+        }
+
+        bytes += written;
+        size -= static_cast<std::size_t>(written);
+    }
+
+    return true;
+}
+
+static bool read_all(int fd, void* data, std::size_t size) {
+
+    uint8_t* bytes = static_cast<uint8_t*>(data);
+
+    while (size > 0) {
+
+        ssize_t got = ::read(fd, bytes, size);
+
+        if (got <= 0) {
+            return false;
+        }
+
+        bytes += got;
+        size -= static_cast<std::size_t>(got);
+    }
+
+    return true;
+}
+
+static sockaddr_un handoff_address(const std::string& path) {
+
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    return address;
+}
+
+int listen_handoff(const std::string& path) {
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    sockaddr_un address = handoff_address(path);
+    ::unlink(path.c_str());
+
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(fd, 1) != 0) {
+        ::close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int connect_handoff(const std::string& path) {
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    sockaddr_un address = handoff_address(path);
+
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int accept_handoff(int listener, int timeout_ms) {
+
+    pollfd waiting{listener, POLLIN, 0};
+
+    if (::poll(&waiting, 1, timeout_ms) <= 0) {
+        return -1;
+    }
+
+    return ::accept(listener, nullptr, nullptr);
+}
+
+bool handoff_pair(int channels[2]) {
+    return ::socketpair(AF_UNIX, SOCK_STREAM, 0, channels) == 0;
+}
+
+bool send_handoff(int channel, const handoff_state_t& state) {
+
+    std::vector<uint8_t> blob;
+    encode_state(state, blob);
+
+    uint64_t size = blob.size();
+
+    if (!write_all(channel, &size, sizeof(size)) || !write_all(channel, blob.data(), blob.size())) {
+        return false;
+    }
+
+    std::vector<int> fds;
+    fds.push_back(state.listener_fd);
+
+    for (const auto& session : state.sessions) {
+        fds.push_back(session.fd);
+    }
+
+    // Each chunk of descriptors rides on a one-byte message holding the chunk size.
+    for (std::size_t begin = 0; begin < fds.size(); begin += fds_per_message) {
+
+        std::size_t count = std::min(fds_per_message, fds.size() - begin);
+        uint8_t marker = static_cast<uint8_t>(count);
+        iovec data{&marker, 1};
+
+        std::vector<char> control(CMSG_SPACE(count * sizeof(int)), 0);
+        msghdr message;
+        std::memset(&message, 0, sizeof(message));
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control.data();
+        message.msg_controllen = control.size();
+
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(count * sizeof(int));
+        std::memcpy(CMSG_DATA(header), fds.data() + begin, count * sizeof(int));
+
+        if (::sendmsg(channel, &message, 0) != 1) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool receive_handoff(int channel, handoff_state_t& state) {
+
+    uint64_t size = 0;
+
+    if (!read_all(channel, &size, sizeof(size)) || size > (uint64_t(1) << 34)) {
+        return false;
+    }
+
+    std::vector<uint8_t> blob(size);
+
+    if (!read_all(channel, blob.data(), blob.size()) || !decode_state(blob, state)) {
+        return false;
+    }
+
+    std::vector<int> fds;
+    std::size_t expected = 1 + state.sessions.size();
+
+    while (fds.size() < expected) {
+
+        std::size_t count = std::min(fds_per_message, expected - fds.size());
+        uint8_t marker = 0;
+        iovec data{&marker, 1};
+
+        std::vector<char> control(CMSG_SPACE(count * sizeof(int)), 0);
+        msghdr message;
+        std::memset(&message, 0, sizeof(message));
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control.data();
+        message.msg_controllen = control.size();
+
+        if (::recvmsg(channel, &message, 0) != 1 || marker != count) {
+            return false;
+        }
+
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+
+        if (!header || header->cmsg_type != SCM_RIGHTS || header->cmsg_len != CMSG_LEN(count * sizeof(int))) {
+            return false;
+        }
+
+        std::size_t offset = fds.size();
+        fds.resize(offset + count);
+        std::memcpy(fds.data() + offset, CMSG_DATA(header), count * sizeof(int));
+    }
+
+    state.listener_fd = fds[0];
+
+    for (std::size_t i = 0; i < state.sessions.size(); ++i) {
+        state.sessions[i].fd = fds[i + 1];
+    }
+
+    return true;
+}
+
+void close_handoff(int channel) {
+
+    if (channel >= 0) {
+        ::close(channel);
+    }
+}
+
+#else
+
+int listen_handoff(const std::string&) { return -1; }
+int connect_handoff(const std::string&) { return -1; }
+int accept_handoff(int, int) { return -1; }
+bool handoff_pair(int[2]) { return false; }
+bool send_handoff(int, const handoff_state_t&) { return false; }
+bool receive_handoff(int, handoff_state_t&) { return false; }
+void close_handoff(int) {}
+
+#endif
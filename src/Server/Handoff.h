@@ -0,0 +1,56 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "../../include/Message.h"
+#include "../../include/Protocol.h"
+
+// State passed from a running server to the one replacing it, so the replacement keeps
+// serving the same listening socket and client connections. Socket descriptors travel as
+// SCM_RIGHTS ancillary data over a Unix domain socket; everything else is a flat byte blob.
+
+// One client session, captured between records: whatever part of an inbound record was
+// already read, an interrupted outbound write's unsent tail and the records still queued.
+struct handoff_session_t {
+    int fd = -1;
+    message_t client_record;
+    uint8_t encoding = 0;
+    bool wants_broadcasts = true;
+    uint32_t read_partial = 0;
+    message_t read_buffer;
+    control_t pending_request;
+    uint32_t pending_records = 0;
+    std::vector<message_t> pending_payload;
+    std::vector<message_t> predicates;
+    std::vector<uint8_t> unsent;
+    std::vector<message_t> queued;
+};
+
+struct handoff_state_t {
+    int listener_fd = -1;
+    uint64_t sequence = 0;
+    std::vector<message_t> positions;
+    std::vector<handoff_session_t> sessions;
+};
+
+// Unix domain socket the outgoing server waits on, and the incoming server connects to.
+int listen_handoff(const std::string& path);
+int connect_handoff(const std::string& path);
+
+// Waits up to timeout_ms for a successor to connect. Returns the channel, or -1 on timeout.
+int accept_handoff(int listener, int timeout_ms);
+
+// A connected pair of channels, for handing off within one process.
+bool handoff_pair(int channels[2]);
+
+// Sends the state and its descriptors. The sender keeps its own copies of the descriptors.
+bool send_handoff(int channel, const handoff_state_t& state);
+
+// Receives a state sent by send_handoff; the descriptors in it are new ones owned by the caller.
+bool receive_handoff(int channel, handoff_state_t& state);
+
+void close_handoff(int channel);
+
+#endif // HANDOFF_H
@@ -0,0 +1,174 @@
+#include "IngestBudget.h"
+#include "../../include/Protocol.h"
+#include <algorithm>
+
+IngestBudget::IngestBudget()
+    : update_rate_(0), byte_rate_(0), update_depth_(0), byte_depth_(0), update_tokens_(0), byte_tokens_(0), last_refill_ns_(0),
+      policy_(budget_policy::conflate), hold_limit_(0), over_budget_(false), held_front_(0), held_base_(0),
+      admitted_(0), held_count_(0), conflated_(0), rejected_(0), paused_reads_(0) {}
+
+void IngestBudget::configure(double updates_per_second, double bytes_per_second, std::chrono::milliseconds burst, budget_policy policy, std::size_t hold_limit) {
+
+    double seconds = std::chrono::duration<double>(burst).count();
+
+    update_rate_ = std::max(updates_per_second, 0.0);
+    byte_rate_ = std::max(bytes_per_second, 0.0);
+    update_depth_ = update_tokens_ = std::max(update_rate_ * seconds, 1.0);
+    byte_depth_ = byte_tokens_ = std::max(byte_rate_ * seconds, static_cast<double>(sizeof(message_t)));
+    last_refill_ns_ = 0;
+    policy_ = policy;
+    hold_limit_ = std::max<std::size_t>(hold_limit, 1);
+}
+
+bool IngestBudget::admit(const message_t* updates, std::size_t count, int64_t now_ns, std::vector<message_t>& out) {
+
+    refill(now_ns);
+    release_held(out);
+
+    // Anything still held is older than this batch, so the batch waits behind it.
+    std::size_t allowed = held() == 0 ? take(count) : 0;
+
+    out.insert(out.end(), updates, updates + allowed);
+    admitted_.fetch_add(allowed, std::memory_order_relaxed);
+
+    if (allowed == count) {
+        held_count_.store(held(), std::memory_order_relaxed);
+        return false;
+    }
+
+    if (policy_ == budget_policy::reject) {
+        rejected_.fetch_add(count - allowed, std::memory_order_relaxed);
+    } else {
+
+        for (std::size_t i = allowed; i < count; ++i) {
+            hold(updates[i]);
+        }
+    }
+
+    held_count_.store(held(), std::memory_order_relaxed);
+
+    bool first = !over_budget_;
+    over_budget_ = true;
+    return first;
+}
+
+void IngestBudget::release(int64_t now_ns, std::vector<message_t>& out) {
+
+    refill(now_ns);
+    release_held(out);
+    held_count_.store(held(), std::memory_order_relaxed);
+}
+
+void IngestBudget::drain(std::vector<message_t>& out) {
+
+    out.insert(out.end(), held_.begin() + held_front_, held_.end());
+    admitted_.fetch_add(held(), std::memory_order_relaxed);
+
+    held_base_ += held_.size();
+    held_.clear();
+    held_front_ = 0;
+    held_index_.clear();
+    held_count_.store(0, std::memory_order_relaxed);
+}
+
+void IngestBudget::charge_bytes(std::size_t bytes, int64_t now_ns) {
+
+    if (byte_rate_ <= 0) {
+        return;
+    }
+
+    // Control traffic may run the byte bucket into debt (at most one burst deep), which updates then wait out.
+    refill(now_ns);
+    byte_tokens_ = std::max(byte_tokens_ - static_cast<double>(bytes), -byte_depth_);
+}
+
+ingest_budget_stats_t IngestBudget::stats() const {
+
+    ingest_budget_stats_t stats;
+    stats.session = 0;
+    stats.admitted = admitted_.load(std::memory_order_relaxed);
+    stats.held = held_count_.load(std::memory_order_relaxed);
+    stats.conflated = conflated_.load(std::memory_order_relaxed);
+    stats.rejected = rejected_.load(std::memory_order_relaxed);
+    stats.paused_reads = paused_reads_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void IngestBudget::refill(int64_t now_ns) {
+
+    if (last_refill_ns_ == 0 || now_ns <= last_refill_ns_) {
+        last_refill_ns_ = std::max(last_refill_ns_, now_ns);
+        return;
+    }
+
+    double seconds = (now_ns - last_refill_ns_) / 1e9;
+    last_refill_ns_ = now_ns;
+
+    update_tokens_ = std::min(update_depth_, update_tokens_ + update_rate_ * seconds);
+    byte_tokens_ = std::min(byte_depth_, byte_tokens_ + byte_rate_ * seconds);
+}
+
+// How many of `count` updates both buckets can pay for; spends their tokens.
+std::size_t IngestBudget::take(std::size_t count) {
+
+    std::size_t allowed = count;
+
+    if (update_rate_ > 0) {
+        allowed = std::min(allowed, static_cast<std::size_t>(std::max(update_tokens_, 0.0)));
+    }
+
+    if (byte_rate_ > 0) {
+        allowed = std::min(allowed, static_cast<std::size_t>(std::max(byte_tokens_, 0.0) / sizeof(message_t)));
+    }
+
+    update_tokens_ -= update_rate_ > 0 ? static_cast<double>(allowed) : 0.0;
+    byte_tokens_ -= byte_rate_ > 0 ? static_cast<double>(allowed * sizeof(message_t)) : 0.0;
+    return allowed;
+}
+
+void IngestBudget::hold(const message_t& update) {
+
+    if (policy_ == budget_policy::conflate) {
+
+        std::string symbol(symbol_of(update));
+        auto it = held_index_.find(symbol);
+
+        if (it != held_index_.end()) {
+            held_[it->second - held_base_] = update;
+            conflated_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        held_index_.emplace(std::move(symbol), held_base_ + held_.size());
+    }
+
+    held_.push_back(update);
+}
+
+void IngestBudget::release_held(std::vector<message_t>& out) {
+
+    if (held() == 0) {
+        return;
+    }
+
+    std::size_t allowed = take(held());
+    auto first = held_.begin() + held_front_;
+
+    out.insert(out.end(), first, first + allowed);
+    admitted_.fetch_add(allowed, std::memory_order_relaxed);
+
+    if (policy_ == budget_policy::conflate) {
+        for (auto it = first; it != first + allowed; ++it) {
+            held_index_.erase(std::string(symbol_of(*it)));
+        }
+    }
+
+    held_front_ += allowed;
+
+    // Released slots are reclaimed once they make up half the buffer.
+    if (held_front_ * 2 >= held_.size()) {
+        held_.erase(held_.begin(), held_.begin() + held_front_);
+        held_base_ += held_front_;
+        held_front_ = 0;
+    }
+}
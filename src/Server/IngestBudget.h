@@ -0,0 +1,95 @@
+#ifndef INGEST_BUDGET_H
+#define INGEST_BUDGET_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "../../include/Message.h"
+
+// What happens to a publisher's updates once it is over its ingest budget.
+enum class budget_policy : uint8_t {
+    conflate,   // hold them, keeping only the newest per symbol, and release as the budget refills
+    delay,      // hold them all in order and release as the budget refills; stop reading when too many are held
+    reject,     // drop them
+};
+
+struct ingest_budget_stats_t {
+    uint32_t session;
+    std::string client_id;
+    uint64_t admitted;
+    uint64_t held;
+    uint64_t conflated;
+    uint64_t rejected;
+    uint64_t paused_reads;
+};
+
+// Per-session token buckets on updates per second and inbound bytes per second. Only updates are
+// ever held back or dropped; control records spend byte tokens but always pass, so queries and
+// subscriptions are never stuck behind a publisher's backlog. Used only on the session's I/O
+// thread; the counters are atomics so the status thread can read them.
+class IngestBudget {
+public:
+    IngestBudget();
+
+    // Zero rates are unlimited. The buckets hold `burst` worth of their rate and start full.
+    void configure(double updates_per_second, double bytes_per_second, std::chrono::milliseconds burst, budget_policy policy, std::size_t hold_limit);
+    bool enabled() const { return update_rate_ > 0 || byte_rate_ > 0; }
+    budget_policy policy() const { return policy_; }
+
+    // Appends to `out` the held updates and then those of `updates` that the budget allows now;
+    // the rest are held or dropped according to the policy. Returns false when this call was the
+    // first to find the session over budget.
+    bool admit(const message_t* updates, std::size_t count, int64_t now_ns, std::vector<message_t>& out);
+
+    // Appends whatever held updates the budget allows now.
+    void release(int64_t now_ns, std::vector<message_t>& out);
+
+    // Appends every held update regardless of the budget (before a disconnect or hot restart).
+    void drain(std::vector<message_t>& out);
+
+    // Spends byte tokens for control traffic, which is never held back.
+    void charge_bytes(std::size_t bytes, int64_t now_ns);
+
+    std::size_t held() const { return held_.size() - held_front_; }
+
+    // The delay policy has as many updates held as it may; the session should stop reading.
+    bool full() const { return policy_ == budget_policy::delay && held() >= hold_limit_; }
+    void note_paused() { paused_reads_.fetch_add(1, std::memory_order_relaxed); }
+
+    ingest_budget_stats_t stats() const;
+
+private:
+    void refill(int64_t now_ns);
+    std::size_t take(std::size_t count);
+    void hold(const message_t& update);
+    void release_held(std::vector<message_t>& out);
+
+    double update_rate_;
+    double byte_rate_;
+    double update_depth_;
+    double byte_depth_;
+    double update_tokens_;
+    double byte_tokens_;
+    int64_t last_refill_ns_;
+    budget_policy policy_;
+    std::size_t hold_limit_;
+    bool over_budget_;
+
+    // Held updates in arrival order from held_front_. With conflation, held_index_ maps a symbol to
+    // its slot (counted from the first slot ever held, held_base_) so a newer update replaces it.
+    std::vector<message_t> held_;
+    std::size_t held_front_;
+    uint64_t held_base_;
+    std::unordered_map<std::string, uint64_t> held_index_;
+
+    std::atomic<uint64_t> admitted_;
+    std::atomic<uint64_t> held_count_;
+    std::atomic<uint64_t> conflated_;
+    std::atomic<uint64_t> rejected_;
+    std::atomic<uint64_t> paused_reads_;
+};
+
+#endif // INGEST_BUDGET_H
@@ -0,0 +1,264 @@
+#include "MemoryArena.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <new>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+static constexpr std::size_t huge_page_bytes = std::size_t(2) << 20;
+static constexpr std::size_t small_page_bytes = 4096;
+
+static std::size_t align_up(std::size_t value, std::size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+#if defined(__linux__)
+// MADV_HUGEPAGE is accepted even when transparent huge pages are switched off, so ask the kernel
+// whether it will act on it.
+static bool transparent_huge_pages_enabled() {
+
+    std::ifstream file("/sys/kernel/mm/transparent_hugepage/enabled");
+    std::string setting;
+    std::getline(file, setting);
+    return setting.find("[never]") == std::string::npos && !setting.empty();
+}
+#endif
+
+MemoryArena::MemoryArena(std::size_t bytes) {
+
+    if (bytes == 0) {
+        return;
+    }
+
+    capacity_ = align_up(bytes, huge_page_bytes);
+
+#if defined(__linux__)
+    // Explicit huge pages are reserved when mapped, so this fails cleanly when the pool
+    // (vm.nr_hugepages) is too small rather than faulting later.
+    void* memory = mmap(nullptr, capacity_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if (memory != MAP_FAILED) {
+        mapping_ = memory;
+        mapping_bytes_ = capacity_;
+        base_ = static_cast<uint8_t*>(memory);
+        backing_ = arena_backing::huge_pages;
+        return;
+    }
+
+    // Otherwise an ordinary mapping, over-sized so it can start on a 2 MB boundary, which
+    // transparent huge pages need.
+    mapping_bytes_ = capacity_ + huge_page_bytes;
+    memory = mmap(nullptr, mapping_bytes_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (memory == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+
+    mapping_ = memory;
+    base_ = reinterpret_cast<uint8_t*>(align_up(reinterpret_cast<uintptr_t>(memory), huge_page_bytes));
+    backing_ = madvise(base_, capacity_, MADV_HUGEPAGE) == 0 && transparent_huge_pages_enabled() ? arena_backing::transparent_huge_pages : arena_backing::small_pages;
+#else
+    base_ = static_cast<uint8_t*>(::operator new(capacity_, std::align_val_t(huge_page_bytes)));
+    backing_ = arena_backing::heap;
+#endif
+}
+
+MemoryArena::~MemoryArena() {
+
+#if defined(__linux__)
+    if (mapping_ != nullptr) {
+        munmap(mapping_, mapping_bytes_);
+    }
+#else
+    if (base_ != nullptr) {
+        ::operator delete(base_, std::align_val_t(huge_page_bytes));
+    }
+#endif
+}
+
+void* MemoryArena::allocate(std::size_t bytes, std::size_t alignment) {
+
+    std::size_t used = used_.load(std::memory_order_relaxed);
+    std::size_t offset;
+
+    do {
+        offset = align_up(used, alignment);
+
+        if (base_ == nullptr || offset + bytes > capacity_) {
+            return nullptr;
+        }
+    } while (!used_.compare_exchange_weak(used, offset + bytes, std::memory_order_relaxed));
+
+    return base_ + offset;
+}
+
+bool MemoryArena::lock(std::string& error) {
+
+    if (base_ == nullptr || locked_) {
+        return locked_;
+    }
+
+#if defined(__linux__)
+    // MLOCK_ONFAULT leaves each page to be faulted in by whoever touches it first. Kernels
+    // without it lock (and so fault in) the whole arena here instead.
+    int result = mlock2(base_, capacity_, MLOCK_ONFAULT);
+
+    if (result != 0 && (errno == EINVAL || errno == ENOSYS)) {
+        result = mlock(base_, capacity_);
+    }
+
+    if (result != 0) {
+        error = std::strerror(errno);
+
+        if (errno == EPERM || errno == ENOMEM) {
+            error += "; raise the locked-memory limit (ulimit -l) or grant CAP_IPC_LOCK";
+        }
+
+        return false;
+    }
+
+    locked_ = true;
+    return true;
+#else
+    error = "not supported on this platform";
+    return false;
+#endif
+}
+
+void MemoryArena::touch(void* memory, std::size_t bytes) {
+
+    volatile uint8_t* bytes_ptr = static_cast<volatile uint8_t*>(memory);
+
+    for (std::size_t offset = 0; offset < bytes; offset += small_page_bytes) {
+        bytes_ptr[offset] = 0;
+    }
+
+    if (bytes > 0) {
+        bytes_ptr[bytes - 1] = 0;
+    }
+}
+
+const char* MemoryArena::backing_name(arena_backing backing) {
+
+    switch (backing) {
+        case arena_backing::huge_pages: return "2 MB huge pages";
+        case arena_backing::transparent_huge_pages: return "transparent huge pages";
+        case arena_backing::small_pages: return "4 KB pages";
+        case arena_backing::heap: return "heap";
+    }
+
+    return "unknown";
+}
+
+// Each pool starts on a huge page boundary, so no huge page holds two I/O threads' slabs and
+// each is first touched, and placed, by its own thread.
+SlabPool::SlabPool(MemoryArena& arena, std::size_t slab_bytes, std::size_t count)
+    : slab_bytes_(align_up(slab_bytes, 64)), count_(0), spills_(0), spilled_bytes_(0) {
+
+    uint8_t* region = static_cast<uint8_t*>(arena.allocate(slab_bytes_ * count, huge_page_bytes));
+
+    if (region == nullptr) {
+        return;
+    }
+
+    count_ = count;
+    free_.reserve(count);
+
+    // Handed out lowest address first.
+    for (std::size_t i = count; i > 0; --i) {
+        free_.push_back(region + (i - 1) * slab_bytes_);
+    }
+}
+
+void* SlabPool::acquire() {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (free_.empty()) {
+        return nullptr;
+    }
+
+    void* slab = free_.back();
+    free_.pop_back();
+    return slab;
+}
+
+void SlabPool::release(void* slab) {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.push_back(slab);
+}
+
+void SlabPool::touch() {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    for (void* slab : free_) {
+        MemoryArena::touch(slab, slab_bytes_);
+    }
+}
+
+void SlabPool::record_spill(std::size_t bytes) {
+
+    spills_.fetch_add(1, std::memory_order_relaxed);
+    spilled_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+std::size_t SlabPool::in_use() const {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    return count_ - free_.size();
+}
+
+SlabResource::SlabResource(SlabPool* pool)
+    : pool_(pool), slab_(pool != nullptr ? static_cast<uint8_t*>(pool->acquire()) : nullptr), used_(0) {}
+
+SlabResource::~SlabResource() {
+
+    if (slab_ != nullptr) {
+        pool_->release(slab_);
+    }
+}
+
+void* SlabResource::do_allocate(std::size_t bytes, std::size_t alignment) {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (slab_ != nullptr) {
+
+        std::size_t offset = align_up(used_, alignment);
+
+        if (offset + bytes <= pool_->slab_bytes()) {
+            used_ = offset + bytes;
+            return slab_ + offset;
+        }
+    }
+
+    if (pool_ != nullptr) {
+        pool_->record_spill(bytes);
+    }
+
+    return ::operator new(bytes, std::align_val_t(std::max(alignment, alignof(std::max_align_t))));
+}
+
+void SlabResource::do_deallocate(void* pointer, std::size_t bytes, std::size_t alignment) {
+
+    uint8_t* address = static_cast<uint8_t*>(pointer);
+
+    if (slab_ != nullptr && address >= slab_ && address < slab_ + pool_->slab_bytes()) {
+
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (address + bytes == slab_ + used_) {
+            used_ = address - slab_;
+        }
+
+        return;
+    }
+
+    ::operator delete(pointer, std::align_val_t(std::max(alignment, alignof(std::max_align_t))));
+}
@@ -0,0 +1,121 @@
+#ifndef MEMORY_ARENA_H
+#define MEMORY_ARENA_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// How an arena's memory is backed, best first.
+enum class arena_backing {
+    huge_pages,             // explicit 2 MB pages (MAP_HUGETLB) from the kernel's reserved pool
+    transparent_huge_pages, // an ordinary mapping the kernel is asked (MADV_HUGEPAGE) to back with 2 MB pages
+    small_pages,            // an ordinary mapping
+    heap                    // no mmap on this platform
+};
+
+// One up-front reservation that fixed-size structures are carved from at start-up. The mapping is
+// not populated when it is made: each region is first written by the thread that owns it, so its
+// pages come from that thread's NUMA node, and lock() pins pages as they are first touched. Carving
+// bumps an offset; nothing is given back before the arena goes.
+class MemoryArena {
+public:
+    MemoryArena() = default;
+    explicit MemoryArena(std::size_t bytes);
+    ~MemoryArena();
+
+    MemoryArena(const MemoryArena&) = delete;
+    MemoryArena& operator=(const MemoryArena&) = delete;
+
+    // nullptr once the arena is used up, or if nothing was reserved.
+    void* allocate(std::size_t bytes, std::size_t alignment = 64);
+
+    // Locks the arena in memory, each page as it is first touched. False, with the reason in
+    // error, when the kernel refuses (RLIMIT_MEMLOCK without CAP_IPC_LOCK) or cannot lock.
+    bool lock(std::string& error);
+
+    // Writes every page of a region, so it is faulted in (and locked) by the calling thread.
+    static void touch(void* memory, std::size_t bytes);
+
+    static const char* backing_name(arena_backing backing);
+
+    std::size_t capacity() const { return capacity_; }
+    std::size_t used() const { return used_.load(std::memory_order_relaxed); }
+    arena_backing backing() const { return backing_; }
+    bool locked() const { return locked_; }
+
+private:
+    uint8_t* base_ = nullptr;
+    std::size_t capacity_ = 0;
+    std::size_t mapping_bytes_ = 0;
+    void* mapping_ = nullptr;
+    std::atomic<std::size_t> used_{0};
+    arena_backing backing_ = arena_backing::heap;
+    bool locked_ = false;
+};
+
+// Equal-sized slabs carved from an arena for one I/O thread's sessions. Sessions open and close
+// off the hot path, so slabs are handed out and taken back under a mutex. Slabs beyond the plan,
+// and allocations a session makes past the end of its slab, come from the heap and are counted
+// here as spills.
+class SlabPool {
+public:
+    SlabPool(MemoryArena& arena, std::size_t slab_bytes, std::size_t count);
+
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    // nullptr when every slab is in use.
+    void* acquire();
+    void release(void* slab);
+
+    // First-touches every free slab from the calling thread; run by the owning I/O thread before
+    // it serves any session.
+    void touch();
+
+    void record_spill(std::size_t bytes);
+
+    std::size_t slab_bytes() const { return slab_bytes_; }
+    std::size_t count() const { return count_; }
+    std::size_t in_use() const;
+    uint64_t spills() const { return spills_.load(std::memory_order_relaxed); }
+    uint64_t spilled_bytes() const { return spilled_bytes_.load(std::memory_order_relaxed); }
+
+private:
+    std::size_t slab_bytes_;
+    std::size_t count_;
+    mutable std::mutex mutex_;
+    std::vector<void*> free_;
+    std::atomic<uint64_t> spills_;
+    std::atomic<uint64_t> spilled_bytes_;
+};
+
+// One session's allocator. Hands out its slab front to back and, past the end of it or without a
+// pool, falls back to the heap. Freeing the newest allocation in the slab gives its bytes back;
+// any other slab memory is reused only when the session ends and the slab returns to its pool,
+// so the session's buffers are reserved once, at their planned sizes, when it starts. A session's
+// buffers belong to different threads (its write queue to the dispatchers, its read buffers to
+// its I/O thread), so the rare allocation takes a lock.
+class SlabResource : public std::pmr::memory_resource {
+public:
+    explicit SlabResource(SlabPool* pool);
+    ~SlabResource() override;
+
+    SlabResource(const SlabResource&) = delete;
+    SlabResource& operator=(const SlabResource&) = delete;
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+    void do_deallocate(void* pointer, std::size_t bytes, std::size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+    SlabPool* pool_;
+    uint8_t* slab_;
+    std::mutex mutex_;
+    std::size_t used_;
+};
+
+#endif // MEMORY_ARENA_H
@@ -0,0 +1,126 @@
+#include "MetricsEndpoint.h"
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+
+// Requests larger than this are answered without reading the rest.
+static constexpr std::size_t max_request_bytes = 8192;
+
+MetricsEndpoint::MetricsEndpoint(short port, render_callback render) : render_(std::move(render)) {
+
+    using boost::asio::ip::tcp;
+
+    tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), static_cast<unsigned short>(port));
+    tcp_acceptor_ = std::make_unique<tcp::acceptor>(io_context_);
+
+    boost::system::error_code ec;
+    tcp_acceptor_->open(endpoint.protocol(), ec);
+
+    if (!ec) {
+        tcp_acceptor_->set_option(tcp::acceptor::reuse_address(true), ec);
+        tcp_acceptor_->bind(endpoint, ec);
+    }
+
+    if (!ec) {
+        tcp_acceptor_->listen(boost::asio::socket_base::max_listen_connections, ec);
+    }
+
+    if (ec) {
+        throw std::runtime_error("Could not listen for metrics on port " + std::to_string(port) + ": " + ec.message());
+    }
+
+    accept(*tcp_acceptor_);
+    thread_ = std::thread([this]() { io_context_.run(); });
+}
+
+MetricsEndpoint::MetricsEndpoint(const std::string& unix_path, render_callback render) : render_(std::move(render)), unix_path_(unix_path) {
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    using boost::asio::local::stream_protocol;
+
+    // A socket file left by an earlier run would make the bind fail.
+    std::remove(unix_path.c_str());
+
+    unix_acceptor_ = std::make_unique<stream_protocol::acceptor>(io_context_);
+
+    boost::system::error_code ec;
+    unix_acceptor_->open(stream_protocol(), ec);
+
+    if (!ec) {
+        unix_acceptor_->bind(stream_protocol::endpoint(unix_path), ec);
+    }
+
+    if (!ec) {
+        unix_acceptor_->listen(boost::asio::socket_base::max_listen_connections, ec);
+    }
+
+    if (ec) {
+        throw std::runtime_error("Could not listen for metrics on " + unix_path + ": " + ec.message());
+    }
+
+    accept(*unix_acceptor_);
+    thread_ = std::thread([this]() { io_context_.run(); });
+#else
+    throw std::runtime_error("Unix sockets are not supported on this platform");
+#endif
+}
+
+MetricsEndpoint::~MetricsEndpoint() {
+    stop();
+}
+
+void MetricsEndpoint::stop() {
+
+    io_context_.stop();
+
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+
+    if (!unix_path_.empty()) {
+        std::remove(unix_path_.c_str());
+        unix_path_.clear();
+    }
+}
+
+template <typename Acceptor>
+void MetricsEndpoint::accept(Acceptor& acceptor) {
+
+    using socket_type = typename Acceptor::protocol_type::socket;
+
+    auto socket = std::make_shared<socket_type>(io_context_);
+
+    acceptor.async_accept(*socket, [this, &acceptor, socket](boost::system::error_code ec) {
+        if (ec == boost::asio::error::operation_aborted) {
+            return;
+        }
+
+        if (!ec) {
+            serve(socket);
+        }
+
+        accept(acceptor);
+    });
+}
+
+template <typename Socket>
+void MetricsEndpoint::serve(std::shared_ptr<Socket> socket) {
+
+    auto request = std::make_shared<boost::asio::streambuf>(max_request_bytes);
+
+    boost::asio::async_read_until(*socket, *request, "\r\n\r\n", [this, socket, request](boost::system::error_code ec, std::size_t /*length*/) {
+        if (ec && ec != boost::asio::error::not_found) {
+            return;
+        }
+
+        std::string body = render_();
+        auto response = std::make_shared<std::string>(
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body);
+
+        boost::asio::async_write(*socket, boost::asio::buffer(*response), [socket, response](boost::system::error_code /*ec*/, std::size_t /*length*/) {
+            boost::system::error_code ignore;
+            socket->shutdown(Socket::shutdown_both, ignore);
+            socket->close(ignore);
+        });
+    });
+}
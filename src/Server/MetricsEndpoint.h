@@ -0,0 +1,41 @@
+#ifndef METRICS_ENDPOINT_H
+#define METRICS_ENDPOINT_H
+
+#include <boost/asio.hpp>
+#include <functional>
+#include <string>
+#include <thread>
+
+// A minimal HTTP listener for scrapers, on its own thread and io_context so a scrape never runs
+// on a session's I/O thread. Every request, whatever its path, is answered with the text the
+// render callback returns (Prometheus text exposition format) and the connection is closed.
+// Listens on a loopback TCP port or, where supported, a Unix socket path.
+class MetricsEndpoint {
+public:
+    using render_callback = std::function<std::string()>;
+
+    // Throws if the port or path cannot be bound.
+    MetricsEndpoint(short port, render_callback render);
+    MetricsEndpoint(const std::string& unix_path, render_callback render);
+    ~MetricsEndpoint();
+
+    void stop();
+
+private:
+    template <typename Acceptor>
+    void accept(Acceptor& acceptor);
+
+    template <typename Socket>
+    void serve(std::shared_ptr<Socket> socket);
+
+    boost::asio::io_context io_context_;
+    render_callback render_;
+    std::unique_ptr<boost::asio::ip::tcp::acceptor> tcp_acceptor_;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    std::unique_ptr<boost::asio::local::stream_protocol::acceptor> unix_acceptor_;
+#endif
+    std::string unix_path_;
+    std::thread thread_;
+};
+
+#endif // METRICS_ENDPOINT_H
@@ -0,0 +1,474 @@
+#include "PositionHistory.h"
+#include "../../include/Compression.h"
+#include <algorithm>
+#include <limits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Expired block buffers kept per series for reuse.
+static constexpr std::size_t max_spare_blocks = 4;
+
+static void reduce_positions(const double* values, std::size_t count, double& min_out, double& max_out, double& sum_out) {
+
+    double min_value = std::numeric_limits<double>::infinity();
+    double max_value = -std::numeric_limits<double>::infinity();
+    double sum = 0.0;
+    std::size_t i = 0;
+
+#if defined(__SSE2__)
+    if (count >= 4) {
+
+        __m128d vmin = _mm_set1_pd(min_value);
+        __m128d vmax = _mm_set1_pd(max_value);
+        __m128d vsum_a = _mm_setzero_pd();
+        __m128d vsum_b = _mm_setzero_pd();
+
+        for (; i + 4 <= count; i += 4) {
+            __m128d a = _mm_loadu_pd(values + i);
+            __m128d b = _mm_loadu_pd(values + i + 2);
+            vmin = _mm_min_pd(vmin, _mm_min_pd(a, b));
+            vmax = _mm_max_pd(vmax, _mm_max_pd(a, b));
+            vsum_a = _mm_add_pd(vsum_a, a);
+            vsum_b = _mm_add_pd(vsum_b, b);
+        }
+
+        double lanes[2];
+        _mm_storeu_pd(lanes, vmin);
+        min_value = std::min(lanes[0], lanes[1]);
+        _mm_storeu_pd(lanes, vmax);
+        max_value = std::max(lanes[0], lanes[1]);
+        _mm_storeu_pd(lanes, _mm_add_pd(vsum_a, vsum_b));
+        sum = lanes[0] + lanes[1];
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    if (count >= 4) {
+
+        float64x2_t vmin = vdupq_n_f64(min_value);
+        float64x2_t vmax = vdupq_n_f64(max_value);
+        float64x2_t vsum_a = vdupq_n_f64(0.0);
+        float64x2_t vsum_b = vdupq_n_f64(0.0);
+
+        for (; i + 4 <= count; i += 4) {
+            float64x2_t a = vld1q_f64(values + i);
+            float64x2_t b = vld1q_f64(values + i + 2);
+            vmin = vminq_f64(vmin, vminq_f64(a, b));
+            vmax = vmaxq_f64(vmax, vmaxq_f64(a, b));
+            vsum_a = vaddq_f64(vsum_a, a);
+            vsum_b = vaddq_f64(vsum_b, b);
+        }
+
+        min_value = vminvq_f64(vmin);
+        max_value = vmaxvq_f64(vmax);
+        sum = vaddvq_f64(vaddq_f64(vsum_a, vsum_b));
+    }
+#endif
+
+    for (; i < count; ++i) {
+        min_value = std::min(min_value, values[i]);
+        max_value = std::max(max_value, values[i]);
+        sum += values[i];
+    }
+
+    min_out = min_value;
+    max_out = max_value;
+    sum_out = sum;
+}
+
+PositionHistory::PositionHistory(std::chrono::nanoseconds retention, std::size_t chunk_capacity)
+    : retention_ns_(retention.count()), chunk_capacity_(chunk_capacity) {}
+
+void PositionHistory::block_ring_t::push_back(sealed_block_t&& block) {
+
+    if (count_ == blocks_.size()) {
+        reserve(std::max<std::size_t>(8, blocks_.size() * 2));
+    }
+
+    blocks_[(head_ + count_) % blocks_.size()] = std::move(block);
+    ++count_;
+}
+
+void PositionHistory::block_ring_t::pop_front() {
+
+    std::vector<uint8_t>().swap(blocks_[head_].bytes);
+    head_ = (head_ + 1) % blocks_.size();
+    --count_;
+}
+
+void PositionHistory::block_ring_t::reserve(std::size_t capacity) {
+
+    if (capacity <= blocks_.size()) {
+        return;
+    }
+
+    std::vector<sealed_block_t> grown(capacity);
+
+    for (std::size_t i = 0; i < count_; ++i) {
+        grown[i] = std::move(blocks_[(head_ + i) % blocks_.size()]);
+    }
+
+    blocks_.swap(grown);
+    head_ = 0;
+}
+
+std::shared_ptr<PositionHistory::series_t> PositionHistory::find_series(std::string_view symbol) const {
+
+    std::shared_lock<std::shared_mutex> lock(series_mutex_);
+
+    auto it = series_.find(symbol);
+    return it == series_.end() ? nullptr : it->second;
+}
+
+void PositionHistory::append(std::string_view symbol, int64_t timestamp_ns, double net_position) {
+
+    std::shared_ptr<series_t> series = find_series(symbol);
+    std::unique_lock<std::mutex> lock;
+
+    // A series the sweep removed between the lookup and the lock is looked up again.
+    while (true) {
+
+        if (series == nullptr) {
+
+            std::unique_lock<std::shared_mutex> map_lock(series_mutex_);
+
+            auto& slot = series_[std::string(symbol)];
+
+            if (!slot) {
+                slot = std::make_shared<series_t>();
+                slot->timestamps.reserve(chunk_capacity_);
+                slot->positions.reserve(chunk_capacity_);
+                slot->spare_blocks.reserve(max_spare_blocks + 1);
+            }
+
+            series = slot;
+        }
+
+        lock = std::unique_lock<std::mutex>(series->mutex);
+
+        if (!series->removed) {
+            break;
+        }
+
+        lock.unlock();
+        series = find_series(symbol);
+    }
+
+    // Out-of-order arrivals are clamped so the timestamp column stays sorted for range lookups.
+    if (!series->timestamps.empty() && timestamp_ns < series->timestamps.back()) {
+        timestamp_ns = series->timestamps.back();
+    }
+
+    series->timestamps.push_back(timestamp_ns);
+    series->positions.push_back(net_position);
+
+    if (series->timestamps.size() >= chunk_capacity_) {
+        seal(*series);
+    }
+
+    expire(*series, timestamp_ns, chunk_capacity_ / 4);
+}
+
+void PositionHistory::seal(series_t& series) {
+
+    sealed_block_t block;
+    block.first_ns = series.timestamps.front();
+    block.last_ns = series.timestamps.back();
+    block.count = static_cast<uint32_t>(series.timestamps.size());
+
+    // Buffers of expired blocks, or ones the sweep stocked, are reused; a fresh one is only
+    // allocated here when neither is left.
+    if (!series.spare_blocks.empty()) {
+        block.bytes = std::move(series.spare_blocks.back());
+        series.spare_blocks.pop_back();
+        block.bytes.clear();
+    } else {
+        block.bytes.reserve(block_reserve(series));
+    }
+
+    BitWriter writer(block.bytes);
+    gorilla_state_t state;
+
+    for (std::size_t i = 0; i < series.timestamps.size(); ++i) {
+        encode_sample(writer, state, series.timestamps[i], series.positions[i]);
+    }
+
+    series.sealed.push_back(std::move(block));
+    series.timestamps.clear();
+    series.positions.clear();
+}
+
+// Sized from the block before, so encoding rarely has to grow the buffer.
+std::size_t PositionHistory::block_reserve(const series_t& series) const {
+
+    if (series.sealed.empty()) {
+        return chunk_capacity_ * 8;
+    }
+
+    std::size_t previous = series.sealed.back().bytes.size();
+    return previous + previous / 8;
+}
+
+void PositionHistory::stock(series_t& series) const {
+
+    if (series.timestamps.size() < chunk_capacity_ / 2) {
+        return;
+    }
+
+    if (series.sealed.size() == series.sealed.capacity()) {
+        series.sealed.reserve(std::max<std::size_t>(8, series.sealed.capacity() * 2));
+    }
+
+    if (series.spare_blocks.empty()) {
+        series.spare_blocks.emplace_back();
+        series.spare_blocks.back().reserve(block_reserve(series));
+    }
+}
+
+void PositionHistory::expire(series_t& series, int64_t now_ns, std::size_t min_trim) {
+
+    int64_t cutoff = now_ns - retention_ns_;
+
+    while (!series.sealed.empty() && series.sealed.front().last_ns < cutoff) {
+
+        if (series.spare_blocks.size() < max_spare_blocks) {
+            series.spare_blocks.push_back(std::move(series.sealed.front().bytes));
+        }
+
+        series.sealed.pop_front();
+    }
+
+    if (series.sealed.empty() && !series.timestamps.empty() && series.timestamps.front() < cutoff) {
+
+        auto first_live = std::lower_bound(series.timestamps.begin(), series.timestamps.end(), cutoff);
+        std::size_t expired = static_cast<std::size_t>(first_live - series.timestamps.begin());
+
+        // Trimming the open chunk is a memmove, so appends only do it once a sizeable prefix has
+        // aged out; the sweep trims whatever it finds.
+        if (expired > 0 && expired >= min_trim) {
+            series.timestamps.erase(series.timestamps.begin(), first_live);
+            series.positions.erase(series.positions.begin(), series.positions.begin() + expired);
+        }
+    }
+}
+
+std::size_t PositionHistory::expire(int64_t now_ns, std::size_t max_series) {
+
+    std::size_t visited = 0;
+
+    {
+        std::shared_lock<std::shared_mutex> lock(series_mutex_);
+
+        auto it = series_.upper_bound(sweep_cursor_);
+
+        while (visited < max_series && visited < series_.size()) {
+
+            if (it == series_.end()) {
+                it = series_.begin();
+            }
+
+            if (visited == sweep_batch_.size()) {
+                sweep_batch_.emplace_back();
+            }
+
+            sweep_batch_[visited].first.assign(it->first);
+            sweep_batch_[visited].second = it->second;
+            ++visited;
+            ++it;
+        }
+    }
+
+    if (visited == 0) {
+        return 0;
+    }
+
+    sweep_cursor_.assign(sweep_batch_[visited - 1].first);
+
+    std::size_t empty = 0;
+
+    for (std::size_t i = 0; i < visited; ++i) {
+
+        series_t& series = *sweep_batch_[i].second;
+        std::lock_guard<std::mutex> lock(series.mutex);
+        expire(series, now_ns, 1);
+        stock(series);
+
+        if (series.sealed.empty() && series.timestamps.empty()) {
+            ++empty;
+        } else {
+            sweep_batch_[i].second.reset();
+        }
+    }
+
+    std::size_t removed = 0;
+
+    // Series are only removed while both locks are held and still empty, so an append that
+    // got in first keeps its series.
+    if (empty > 0) {
+
+        std::unique_lock<std::shared_mutex> map_lock(series_mutex_);
+
+        for (std::size_t i = 0; i < visited; ++i) {
+
+            auto& entry = sweep_batch_[i];
+
+            if (!entry.second) {
+                continue;
+            }
+
+            std::lock_guard<std::mutex> lock(entry.second->mutex);
+            auto it = series_.find(entry.first);
+
+            if (it != series_.end() && it->second == entry.second && entry.second->sealed.empty() && entry.second->timestamps.empty()) {
+                entry.second->removed = true;
+                series_.erase(it);
+                ++removed;
+            }
+        }
+    }
+
+    for (std::size_t i = 0; i < visited; ++i) {
+        sweep_batch_[i].second.reset();
+    }
+
+    return removed;
+}
+
+void PositionHistory::collect(const series_t& series, int64_t from_ns, int64_t to_ns, std::vector<int64_t>& timestamps, std::vector<double>& positions) const {
+
+    for (std::size_t b = 0; b < series.sealed.size(); ++b) {
+
+        const sealed_block_t& block = series.sealed[b];
+
+        if (block.last_ns < from_ns || block.first_ns > to_ns) {
+            continue;
+        }
+
+        BitReader reader(block.bytes.data(), block.bytes.size());
+        gorilla_state_t state;
+
+        for (uint32_t i = 0; i < block.count; ++i) {
+
+            int64_t timestamp;
+            double value;
+
+            if (!decode_sample(reader, state, timestamp, value)) {
+                break;
+            }
+
+            if (timestamp >= from_ns && timestamp <= to_ns) {
+                timestamps.push_back(timestamp);
+                positions.push_back(value);
+            }
+        }
+    }
+
+    auto begin = std::lower_bound(series.timestamps.begin(), series.timestamps.end(), from_ns);
+    auto end = std::upper_bound(begin, series.timestamps.end(), to_ns);
+    std::size_t offset = static_cast<std::size_t>(begin - series.timestamps.begin());
+
+    timestamps.insert(timestamps.end(), begin, end);
+    positions.insert(positions.end(), series.positions.begin() + offset, series.positions.begin() + offset + (end - begin));
+}
+
+std::vector<PositionHistory::sample_t> PositionHistory::range(std::string_view symbol, int64_t from_ns, int64_t to_ns) const {
+
+    std::vector<sample_t> samples;
+    std::shared_ptr<series_t> series = find_series(symbol);
+
+    if (series == nullptr) {
+        return samples;
+    }
+
+    std::vector<int64_t> timestamps;
+    std::vector<double> positions;
+
+    {
+        std::lock_guard<std::mutex> lock(series->mutex);
+        collect(*series, from_ns, to_ns, timestamps, positions);
+    }
+
+    samples.reserve(timestamps.size());
+
+    for (std::size_t i = 0; i < timestamps.size(); ++i) {
+        samples.push_back({timestamps[i], positions[i]});
+    }
+
+    return samples;
+}
+
+std::vector<PositionHistory::rollup_t> PositionHistory::rollup(std::string_view symbol, int64_t from_ns, int64_t to_ns, int64_t bucket_ns) const {
+
+    std::vector<rollup_t> buckets;
+    std::shared_ptr<series_t> series = find_series(symbol);
+
+    if (series == nullptr || bucket_ns <= 0 || to_ns < from_ns) {
+        return buckets;
+    }
+
+    std::vector<int64_t> timestamps;
+    std::vector<double> positions;
+
+    {
+        std::lock_guard<std::mutex> lock(series->mutex);
+        collect(*series, from_ns, to_ns, timestamps, positions);
+    }
+
+    std::size_t begin = 0;
+
+    while (begin < timestamps.size()) {
+
+        // Jump straight to the bucket holding the next sample so sparse series skip empty buckets.
+        int64_t bucket_start = from_ns + ((timestamps[begin] - from_ns) / bucket_ns) * bucket_ns;
+        int64_t bucket_end = bucket_start + bucket_ns;
+        auto end_it = std::lower_bound(timestamps.begin() + begin, timestamps.end(), bucket_end);
+        std::size_t end = static_cast<std::size_t>(end_it - timestamps.begin());
+
+        rollup_t bucket;
+        double sum;
+
+        reduce_positions(positions.data() + begin, end - begin, bucket.min, bucket.max, sum);
+        bucket.bucket_start_ns = bucket_start;
+        bucket.count = static_cast<uint32_t>(end - begin);
+        bucket.mean = sum / static_cast<double>(end - begin);
+        bucket.last = positions[end - 1];
+        buckets.push_back(bucket);
+
+        begin = end;
+    }
+
+    return buckets;
+}
+
+std::size_t PositionHistory::memory_bytes() const {
+
+    std::shared_lock<std::shared_mutex> lock(series_mutex_);
+
+    std::size_t total = 0;
+
+    for (const auto& entry : series_) {
+
+        std::lock_guard<std::mutex> series_lock(entry.second->mutex);
+
+        total += entry.second->timestamps.capacity() * sizeof(int64_t);
+        total += entry.second->positions.capacity() * sizeof(double);
+
+        for (std::size_t b = 0; b < entry.second->sealed.size(); ++b) {
+            total += entry.second->sealed[b].bytes.capacity();
+        }
+
+        for (const auto& spare : entry.second->spare_blocks) {
+            total += spare.capacity();
+        }
+    }
+
+    return total;
+}
+
+std::size_t PositionHistory::series_count() const {
+
+    std::shared_lock<std::shared_mutex> lock(series_mutex_);
+    return series_.size();
+}
@@ -0,0 +1,103 @@
+#ifndef POSITION_HISTORY_H
+#define POSITION_HISTORY_H
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Per-symbol columnar history of net positions. Updates land in an open chunk
+// (separate timestamp and position columns); full chunks are sealed into
+// Gorilla-compressed blocks and anything older than the retention window is dropped.
+// Sealing runs inline, in the append that fills a chunk, so every chunk_capacity-th update of a
+// symbol pays for encoding the chunk: about 30 us for 1024 samples at -O2. Appends trim their own
+// series; expire() sweeps the rest, so idle symbols age out too and their series are removed.
+// The sweep also stocks each series that is about to seal with a block buffer and ring slot, so
+// an append only allocates for a new symbol, or when a symbol seals faster than the sweep
+// comes round.
+class PositionHistory {
+public:
+    struct sample_t {
+        int64_t timestamp_ns;
+        double net_position;
+    };
+
+    struct rollup_t {
+        int64_t bucket_start_ns;
+        uint32_t count;
+        double min;
+        double max;
+        double mean;
+        double last;
+    };
+
+    explicit PositionHistory(std::chrono::nanoseconds retention = std::chrono::hours(1), std::size_t chunk_capacity = 1024);
+
+    void append(std::string_view symbol, int64_t timestamp_ns, double net_position);
+    std::vector<sample_t> range(std::string_view symbol, int64_t from_ns, int64_t to_ns) const;
+    std::vector<rollup_t> rollup(std::string_view symbol, int64_t from_ns, int64_t to_ns, int64_t bucket_ns) const;
+    std::size_t memory_bytes() const;
+    std::size_t series_count() const;
+
+    // Drops what has aged out of up to max_series series, resuming after the last one visited,
+    // and removes series left empty. Returns how many series were removed. One caller at a time.
+    std::size_t expire(int64_t now_ns, std::size_t max_series);
+
+private:
+    struct sealed_block_t {
+        int64_t first_ns;
+        int64_t last_ns;
+        uint32_t count;
+        std::vector<uint8_t> bytes;
+    };
+
+    // Sealed blocks, oldest first, in a ring so sealing and expiring reuse its storage. Only
+    // growing it allocates, and the sweep grows it before a seal needs the room.
+    class block_ring_t {
+    public:
+        bool empty() const { return count_ == 0; }
+        std::size_t size() const { return count_; }
+        std::size_t capacity() const { return blocks_.size(); }
+        sealed_block_t& front() { return blocks_[head_]; }
+        const sealed_block_t& back() const { return blocks_[(head_ + count_ - 1) % blocks_.size()]; }
+        const sealed_block_t& operator[](std::size_t index) const { return blocks_[(head_ + index) % blocks_.size()]; }
+        void push_back(sealed_block_t&& block);
+        void pop_front();
+        void reserve(std::size_t capacity);
+
+    private:
+        std::vector<sealed_block_t> blocks_;
+        std::size_t head_ = 0;
+        std::size_t count_ = 0;
+    };
+
+    struct series_t {
+        mutable std::mutex mutex;
+        std::vector<int64_t> timestamps;
+        std::vector<double> positions;
+        block_ring_t sealed;
+        std::vector<std::vector<uint8_t>> spare_blocks;
+        bool removed = false; // set under mutex once the series has left series_
+    };
+
+    std::shared_ptr<series_t> find_series(std::string_view symbol) const;
+    void seal(series_t& series);
+    void stock(series_t& series) const;
+    std::size_t block_reserve(const series_t& series) const;
+    void expire(series_t& series, int64_t now_ns, std::size_t min_trim);
+    void collect(const series_t& series, int64_t from_ns, int64_t to_ns, std::vector<int64_t>& timestamps, std::vector<double>& positions) const;
+
+    int64_t retention_ns_;
+    std::size_t chunk_capacity_;
+    mutable std::shared_mutex series_mutex_;
+    std::map<std::string, std::shared_ptr<series_t>, std::less<>> series_;
+    std::string sweep_cursor_;
+    std::vector<std::pair<std::string, std::shared_ptr<series_t>>> sweep_batch_; // reused, so a sweep does not allocate
+};
+
+#endif // POSITION_HISTORY_H
@@ -1,21 +1,152 @@
 #include "PositionServer.h"
+#include "../../include/Clock.h"
 #include "../../include/Common.h"
+#include "../../include/Probes.h"
+#include <algorithm>
+#include <future>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+// Connections taken off the listen backlog per accept completion.
+static constexpr std::size_t max_accept_batch = 64;
+
+// Sessions are numbered from 1, so in-process publishes are captured as session 0.
+static constexpr uint32_t in_process_session = 0;
+
+static std::vector<std::unique_ptr<boost::asio::io_context>> make_io_contexts(std::size_t count) {
+
+    std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+
+    for (std::size_t i = 0; i < std::max<std::size_t>(count, 1); ++i) {
+        // Each context is driven by exactly one thread; the hint lets Asio queue handlers posted from it privately.
+        contexts.push_back(std::make_unique<boost::asio::io_context>(1));
+    }
+
+    return contexts;
+}
+
+// Nodes for the broadcast queue are allocated once, here; pushes never grow it.
+static constexpr std::size_t broadcast_queue_capacity = 1024;
+
+// History series the sweep visits per timer tick, so one tick never holds up the I/O thread
+// for long however many symbols there are.
+static constexpr std::size_t history_sweep_batch = 1024;
+
+// Set on a dispatch thread while it calls local subscribers, so unsubscribe() from inside one
+// does not wait for itself.
+static thread_local bool in_local_subscriber = false;
+
+static std::size_t slabs_per_io_thread(const ServerConfig& config) {
+
+    std::size_t threads = std::max<std::size_t>(config.io_threads, 1);
+    return (config.max_sessions + threads - 1) / threads;
+}
+
+// Everything ServerConfig::preallocate carves from the arena: the store's slots, the replication
+// log and a pool of session slabs for each I/O thread, each pool starting on its own huge page.
+static std::size_t arena_bytes(const ServerConfig& config) {
+
+    if (!config.preallocate) {
+        return 0;
+    }
+
+    constexpr std::size_t huge_page_bytes = std::size_t(2) << 20;
+    std::size_t threads = std::max<std::size_t>(config.io_threads, 1);
+
+    return PositionStore::bytes_for(config.max_symbols) + ReplicationLog::bytes_for(config.replication_log_capacity) + 2 * 64 +
+           threads * (Session::slab_bytes(config) * slabs_per_io_thread(config) + huge_page_bytes);
+}
+
+static ServerConfig config_for_port(short port) {
+
+    ServerConfig config;
+    config.port = port;
+    return config;
+}
 
 PositionServer::PositionServer(short port, bool& debugLogs)
-    : port_(port), acceptor_(io_context_, tcp::endpoint(tcp::v4(), port)),
-      message_queue_(1024),
+    : PositionServer(config_for_port(port), debugLogs) {}
+
+PositionServer::PositionServer(const ServerConfig& config, bool& debugLogs)
+    : config_(config), port_(config.port), io_contexts_(make_io_contexts(config.io_threads)), next_io_context_(0),
+      acceptor_(*io_contexts_.front()),
+      arena_(arena_bytes(config)),
+      store_(config.max_symbols),
+      history_(config.history_retention),
+      replication_log_(config.replication_log_capacity, arena_.allocate(ReplicationLog::bytes_for(config.replication_log_capacity))),
+      replica_count_(0),
+      promoted_(false),
+      handing_off_(false),
+      handed_off_(false),
+      dispatching_(0),
+      publishing_(0),
+      local_subscribers_(std::make_shared<const local_subscribers_t>()),
+      next_subscription_(1),
+      message_queue_(broadcast_queue_capacity),
+      waiting_dispatchers_(0),
       running_(false),
-      debugLogs_(debugLogs),
-      buffer_(sizeof(message_t)) {
+      sessions_reaped_(0),
+      debugLogs_(debugLogs) {
+
+        // Registration holds clients_mutex_ only for the insert, which then never rehashes below
+        // max_sessions.
+        clients_.reserve(config_.max_sessions);
+
+        for (auto& io_context : io_contexts_) {
+            timer_wheels_.push_back(std::make_unique<TimerWheel>(*io_context, config_.timer_tick));
+        }
+
+        // A symbol's own appends trim its history; this ages out symbols that have gone quiet.
+        timer_wheels_.front()->every(config_.timer_tick, [this]() { history_.expire(Clock::now_ns(), history_sweep_batch); });
+
+        // The store and replication log are shared by every ingest thread, so this thread places
+        // them; each I/O thread first-touches its own session slabs before it starts serving.
+        if (config_.preallocate) {
+
+            store_.reserve(arena_.allocate(PositionStore::bytes_for(config_.max_symbols)), config_.max_symbols);
+
+            for (std::size_t i = 0; i < io_contexts_.size(); ++i) {
+                session_slabs_.push_back(std::make_unique<SlabPool>(arena_, Session::slab_bytes(config_), slabs_per_io_thread(config_)));
+            }
+
+            std::string lock_error;
+            arena_.lock(lock_error);
+            report_memory_plan(lock_error);
+        }
+
+        if (config_.tls.enabled) {
+
+            std::string error;
+            tls_context_ = make_tls_context(config_.tls, true, error);
+
+            if (!tls_context_) {
+                throw std::runtime_error("Could not set up TLS: " + error);
+            }
+        }
+
+        // A successor adopts its predecessor's listening socket in start() instead of binding the port.
+        if (config_.takeover_path.empty()) {
+            tcp::endpoint endpoint(tcp::v4(), config_.port);
+            acceptor_.open(endpoint.protocol());
+            acceptor_.set_option(boost::asio::socket_base::reuse_address(true));
+            acceptor_.bind(endpoint);
+            acceptor_.listen();
+        }
         
         std::lock_guard<std::mutex> lock(print_mutex); 
-        std::cout << "PositionServer constructed and acceptor initialized on port " << port << std::endl;
+        std::cout << "PositionServer constructed and acceptor initialized on port " << port_ << std::endl;
 
       }
 
 PositionServer::~PositionServer() {
+
     stop();
+
+    if (handoff_thread_.joinable()) {
+        handoff_thread_.join();
+    }
 }
 
 void PositionServer::stop() {
@@ -28,25 +159,47 @@ void PositionServer::stop() {
 
     running_ = false;
     
-    std::lock_guard<std::mutex> lock(print_mutex);
-    std::cout << "Stopping server..." << std::endl;
+    {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << "Stopping server..." << std::endl;
+    }
+
+    // First, so no scrape is running while the rest is torn down.
+    metrics_endpoint_.reset();
 
     boost::system::error_code ec;
     acceptor_.cancel(ec);
     acceptor_.close(ec);
 
-    io_context_.stop();
+    if (handoff_thread_.joinable() && handoff_thread_.get_id() != std::this_thread::get_id()) {
+        handoff_thread_.join();
+    }
 
-    std::cout << "Stopping server and closing all client connections...\n";
-    for (auto& client : clients_) {
-        client->close();
+    if (replica_link_) {
+        replica_link_->stop();
     }
-    
-    clients_.clear();
-    connected_client_ids_.clear();
 
-    if (accept_thread_.joinable()) {
-        accept_thread_.join();
+    io_work_.clear();
+
+    for (auto& io_context : io_contexts_) {
+        io_context->stop();
+    }
+
+    for (auto& thread : io_threads_) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    io_threads_.clear();
+
+    for (auto& wheel : timer_wheels_) {
+        wheel->stop();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(message_mutex_);
+        message_condition_.notify_all();
     }
 
     for (auto& thread : worker_threads_) {
@@ -57,6 +210,37 @@ void PositionServer::stop() {
 
     worker_threads_.clear();
 
+    std::lock_guard<std::mutex> lock(print_mutex);
+
+    if (capture_.is_open()) {
+        capture_.close();
+        std::cout << "Captured " << capture_.events() << " events (" << capture_.bytes() << " bytes) to " << config_.capture_path << std::endl;
+    }
+
+    std::cout << "Stopping server and closing all client connections...\n";
+
+    {
+        std::lock_guard<std::mutex> clients_lock(clients_mutex_);
+
+        for (auto& client : clients_) {
+            client->socket().close(ec);
+        }
+
+        clients_.clear();
+        client_ids_.clear();
+    }
+
+    {
+        std::lock_guard<std::mutex> replicas_lock(replicas_mutex_);
+
+        for (auto& replica : replicas_) {
+            replica->socket().close(ec);
+        }
+
+        replicas_.clear();
+        replica_count_ = 0;
+    }
+
     std::cout << "Server stopped." << std::endl;
 }
 
@@ -72,6 +256,30 @@ void PositionServer::start() {
     
     std::cout << "Starting PositionServer on port " << port_ << std::endl;
 
+    if (!config_.takeover_path.empty() && !acceptor_.is_open() && !takeover_state_) {
+
+        int channel = connect_handoff(config_.takeover_path);
+        handoff_state_t state;
+
+        if (channel < 0 || !receive_handoff(channel, state)) {
+            std::cerr << "Could not take over from " << config_.takeover_path << std::endl;
+            close_handoff(channel);
+            stop();
+            return;
+        }
+
+        close_handoff(channel);
+        takeover_state_ = std::move(state);
+    }
+
+    uint64_t resume_sequence = 0;
+
+    if (takeover_state_) {
+        boost::system::error_code ec;
+        acceptor_.assign(tcp::v4(), takeover_state_->listener_fd, ec);
+        resume_sequence = takeover_state_->sequence;
+    }
+
     if (!acceptor_.is_open()) {
         std::lock_guard<std::mutex> lock(print_mutex); 
         std::cerr << "Acceptor is not open." << std::endl;
@@ -79,269 +287,1254 @@ void PositionServer::start() {
         return;
     }
 
-    accept_thread_ = std::thread([this]() {
-        do_accept();
-        io_context_.run();
-    });
+    if (!config_.capture_path.empty()) {
 
-    std::cout << "Starting worker threads" << std::endl;
-    for (size_t i = 0; i < 2; ++i) {
-        worker_threads_.emplace_back(&PositionServer::process_messages, this);
+        if (capture_.open(config_.capture_path)) {
+            std::cout << "Capturing inbound updates to " << config_.capture_path << std::endl;
+        } else {
+            std::cerr << "Could not open capture file " << config_.capture_path << std::endl;
+        }
     }
 
-    std::cout << "Running io_context" << std::endl;
-}
+    // A successor process may start while its predecessor still holds the port; it runs without metrics then.
+    if (config_.metrics_port != 0 || !config_.metrics_path.empty()) {
 
-void PositionServer::do_accept() {
+        try {
+            auto render = [this]() { return render_metrics(); };
+            metrics_endpoint_ = config_.metrics_path.empty() ? std::make_unique<MetricsEndpoint>(config_.metrics_port, render)
+                                                             : std::make_unique<MetricsEndpoint>(config_.metrics_path, render);
+            std::cout << "Serving metrics on " << (config_.metrics_path.empty() ? "127.0.0.1:" + std::to_string(config_.metrics_port) : config_.metrics_path) << std::endl;
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+        }
+    }
 
-    auto socket = std::make_shared<tcp::socket>(io_context_);
+    for (std::size_t i = 0; i < io_contexts_.size(); ++i) {
+        io_contexts_[i]->restart();
+        io_work_.push_back(boost::asio::make_work_guard(*io_contexts_[i]));
+        timer_wheels_[i]->start();
+    }
 
-    acceptor_.async_accept(*socket, [this, socket](boost::system::error_code ec) {
-        if (!ec) {
+    if (takeover_state_) {
+        take_over(*takeover_state_);
+        takeover_state_.reset();
+    }
 
-            {
-                std::lock_guard<std::mutex> lock(print_mutex);
-                std::cout << "Accepted connection from: " << socket->remote_endpoint().address().to_string() << ":" << socket->remote_endpoint().port() << std::endl;
-            }
+    do_accept();
 
-            start_read(socket);
+    if (config_.replica_of_port != 0 && !promoted_) {
 
-            do_accept();
-        } else {
+        std::cout << "Running as a " << (config_.relay ? "relay" : "replica") << " of " << config_.replica_of_host << ":" << config_.replica_of_port << std::endl;
 
-            if (running_) {
-                std::lock_guard<std::mutex> lock(print_mutex);
-                std::cerr << "Accept error: " << ec.message() << std::endl;
-            }
+        // A relay only widens fan-out, so it never takes over from its upstream.
+        std::chrono::milliseconds promote_after = config_.relay ? std::chrono::milliseconds(0) : config_.promote_after;
+        // Kept across stop() and start(): handlers queued on the stopped io_context still refer to it.
+        if (!replica_link_) {
+            replica_link_ = std::make_unique<ReplicaLink>(*io_contexts_.front(), *this, config_.replica_of_host, config_.replica_of_port, promote_after);
         }
-    });
+
+        if (resume_sequence != 0) {
+            replica_link_->resume_after(resume_sequence);
+        }
+
+        replica_link_->start();
+    }
+
+    for (std::size_t i = 0; i < io_contexts_.size(); ++i) {
+        io_threads_.emplace_back(&PositionServer::run_io_thread, this, i);
+    }
+
+    std::cout << "Starting worker threads" << std::endl;
+    for (size_t i = 0; i < config_.dispatch_threads; ++i) {
+        worker_threads_.emplace_back(&PositionServer::process_messages, this, i);
+    }
+
+    if (config_.mode == wait_mode::busy_poll) {
+
+        std::size_t spinning = io_contexts_.size() + config_.dispatch_threads;
+        std::cout << "Busy-poll mode: " << io_contexts_.size() << " I/O and " << config_.dispatch_threads << " dispatch threads spinning" << std::endl;
+
+        // Spinning threads that share a core take turns by scheduler quantum, which is far slower than blocking.
+        if (spinning >= std::thread::hardware_concurrency()) {
+            std::cerr << "Warning: " << spinning << " spinning threads on " << std::thread::hardware_concurrency()
+                      << " CPUs; busy-poll needs a dedicated core per thread (plus one for the rest of the host)." << std::endl;
+        }
+    }
+
+    if (!config_.handoff_path.empty()) {
+        handoff_thread_ = std::thread(&PositionServer::wait_for_successor, this);
+    }
+
+    std::cout << "Running io_context" << std::endl;
 }
 
-void PositionServer::sendPositions(const std::string& clientId, std::shared_ptr<tcp::socket> socket) {
- 
-    std::lock_guard<std::mutex> lock(clients_mutex_);
+void PositionServer::run_io_thread(std::size_t index) {
+
+    if (index < config_.io_cpus.size() && !pin_current_thread(config_.io_cpus[index])) {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cerr << "Could not pin I/O thread " << index << " to CPU " << config_.io_cpus[index] << std::endl;
+    }
 
-            for (auto& client : client_positions_) {
+    if (index < session_slabs_.size()) {
+        session_slabs_[index]->touch();
+    }
 
-                if(client.first == clientId) {
-                    continue;
-                }
-                else {
+    run_io_context(*io_contexts_[index], config_.mode);
+}
 
-                    auto & msg = client.second;
-                    
-                    boost::asio::async_write(*socket, boost::asio::buffer(&client.second, sizeof(message_t)),
-                        [this, msg , socket, clientId](boost::system::error_code ec, std::size_t length) {
-                            if (ec) {
+SlabPool* PositionServer::session_slabs(std::size_t index) {
+    return index < session_slabs_.size() ? session_slabs_[index].get() : nullptr;
+}
 
-                                std::cerr << "Failed to send message: " << ec.message() << std::endl;
-                            } 
-                            else {
+void PositionServer::report_memory_plan(const std::string& lock_error) {
 
-                                std::lock_guard<std::mutex> lock(print_mutex);                
-                                std::cout << "Sending BroadCast to: " << socket->remote_endpoint().address().to_string() << ":" << socket->remote_endpoint().port() << std::endl;
-                                std::cout << "\nSent broadcast: Client positions to (" << clientId << ") upon joining:|\t " << std::string(msg.symbol.data()) << ", Net Position: " << msg.net_position << ", Timestamp of client: " << std::string(msg.timestamp.data()) << std::endl;
-                            }
-                        });
+    auto mb = [](std::size_t bytes) { return static_cast<double>(bytes) / (1 << 20); };
 
-                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                }
-            }
+    std::size_t slabs = 0;
+
+    for (auto& pool : session_slabs_) {
+        slabs += pool->count();
+    }
+
+    std::lock_guard<std::mutex> lock(print_mutex);
+    std::streamsize precision = std::cout.precision();
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "Memory plan: " << mb(arena_.capacity()) << " MB arena on " << MemoryArena::backing_name(arena_.backing()) << ", "
+              << (arena_.locked() ? "locked as touched" : "not locked (" + lock_error + ")") << std::endl;
+    std::cout << "  store: " << config_.max_symbols << " symbols, " << mb(PositionStore::bytes_for(config_.max_symbols)) << " MB" << std::endl;
+    std::cout << "  replication log: " << config_.replication_log_capacity << " updates, " << mb(ReplicationLog::bytes_for(config_.replication_log_capacity)) << " MB" << std::endl;
+    std::cout << "  sessions: " << slabs << " slabs of " << Session::slab_bytes(config_) / 1024 << " KB over " << session_slabs_.size()
+              << " I/O threads (write queues of " << config_.session_queue_records << " records, " << config_.ingest_buffer_bytes / 1024
+              << " KB read buffer), " << mb(slabs * Session::slab_bytes(config_)) << " MB" << std::endl;
+    std::cout << "  broadcast queue: " << broadcast_queue_capacity << " updates, allocated once at construction" << std::endl;
+    std::cout << "  arena carved: " << mb(arena_.used()) << " MB" << std::endl;
+    std::cout << std::defaultfloat << std::setprecision(precision);
+
+    if (slabs < config_.max_sessions) {
+        std::cout << "  only " << slabs << " of " << config_.max_sessions << " session slabs fit; the rest use the heap" << std::endl;
+    }
+}
+
+// Sessions are spread round-robin over the I/O threads and stay on theirs (and its timer wheel) for life.
+std::size_t PositionServer::next_io_thread() {
+
+    std::size_t index = next_io_context_;
+    next_io_context_ = (next_io_context_ + 1) % io_contexts_.size();
+    return index;
 }
 
+// After each asynchronous accept the backlog is drained with non-blocking accepts, so a burst of
+// reconnecting clients costs one wakeup per batch rather than one per connection.
+void PositionServer::do_accept() {
 
-void PositionServer::start_read(std::shared_ptr<tcp::socket> socket) {
+    std::size_t index = next_io_thread();
 
-    auto message = std::make_shared<message_t>();
+    acceptor_.async_accept(*io_contexts_[index], [this, index](boost::system::error_code ec, tcp::socket socket) {
+        if (!ec) {
 
-    boost::asio::async_read(*socket, boost::asio::buffer(message.get(), sizeof(message_t)),
-        [this, socket, acceptMessage_ = message](boost::system::error_code ec, std::size_t length) {
-            if (!ec) {
+            std::vector<std::pair<std::size_t, tcp::socket>> batch;
+            batch.emplace_back(index, std::move(socket));
 
-                std::string received_symbol(acceptMessage_->symbol.data(), strnlen(acceptMessage_->symbol.data(), acceptMessage_->symbol.size()));
-                std::string received_timestamp(acceptMessage_->timestamp.data(), strnlen(acceptMessage_->timestamp.data(), acceptMessage_->timestamp.size()));
-                double received_net_position = acceptMessage_->net_position;
+            boost::system::error_code ignore;
+            acceptor_.non_blocking(true, ignore);
 
-                {
-                    std::lock_guard<std::mutex> lock(clients_mutex_);
-                    if (connected_client_ids_.find(received_symbol) != connected_client_ids_.end()) {
-                        std::lock_guard<std::mutex> lock(print_mutex);
-                        std::cerr << "Client ID " << received_symbol << " already exists. Rejecting connection." << std::endl;
-                        socket->close();
-                        return;
-                    } else {
+            while (batch.size() < max_accept_batch) {
 
-                        connected_client_ids_.insert(received_symbol);
-                        clients_.insert(socket);
-                    }
-                }
+                std::size_t next = next_io_context_;
+                tcp::socket more = acceptor_.accept(*io_contexts_[next], ignore);
 
-                {
-                    std::lock_guard<std::mutex> lock(print_mutex);
-                    std::cout << "Received message from client: " << received_symbol << ", net position: " << received_net_position << ", timestamp: " << received_timestamp << std::endl;
+                if (ignore) {
+                    break;
                 }
 
-                sendPositions(received_symbol, socket);
+                next_io_thread();
+                batch.emplace_back(next, std::move(more));
+            }
+
+            bool single = batch.size() == 1;
 
-                std::thread(&PositionServer::handle_client, this, socket, received_symbol).detach();
+            for (auto& accepted : batch) {
+                open_session(accepted.first, std::move(accepted.second), single || debugLogs_);
+            }
 
-            } else {
+            if (!single) {
                 std::lock_guard<std::mutex> lock(print_mutex);
-                std::cerr << "Read error: " << ec.message() << std::endl;
+                std::cout << "Accepted " << batch.size() << " connections" << std::endl;
             }
-        });
+
+            do_accept();
+        } else {
+
+            if (running_ && !handing_off_) {
+                std::lock_guard<std::mutex> lock(print_mutex);
+                std::cerr << "Accept error: " << ec.message() << std::endl;
+            }
+        }
+    });
 }
 
-void PositionServer::simulate_disconnect() {
+void PositionServer::open_session(std::size_t index, tcp::socket socket, bool log) {
 
-    stop();
+    metrics_.add(server_counter::accepted);
+
+    auto session = std::make_shared<Session>(std::move(socket), *io_contexts_[index], *timer_wheels_[index], *this, session_slabs(index));
 
-    std::this_thread::sleep_for(std::chrono::seconds(1));
+    if (config_.mode == wait_mode::busy_poll) {
+        enable_socket_busy_poll(session->socket(), config_.busy_poll_usec);
+    }
+
+    if (config_.kernel_timestamps) {
+        session->enable_receive_timestamps();
+    }
+
+    if (log) {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << "Accepted connection from: " << session->remote_address() << std::endl;
+    }
 
-    try {
+    POSITION_PROBE(accept, session->id(), 0);
+    session->start();
+}
 
-        acceptor_.open(tcp::v4());
-        acceptor_.set_option(boost::asio::socket_base::reuse_address(true));
-        acceptor_.bind(tcp::endpoint(tcp::v4(), port_));
-        acceptor_.listen();
-        start();
+// The join snapshot is queued on the session's writer in one batch, so it goes out in as few writes as the
+// socket allows (one keyframe frame when compressed) and the handshake handler returns straight away.
+void PositionServer::sendPositions(std::shared_ptr<Session> session) {
 
-    } catch (const boost::system::system_error& e) {
+    // Reused per I/O thread, like the query scratch space.
+    thread_local std::vector<message_t> positions;
+    positions.clear();
+    store_.snapshot(positions);
 
-        std::cerr << "Failed to start the acceptor: " << e.what() << std::endl;
-        stop(); 
+    positions.erase(std::remove_if(positions.begin(), positions.end(), [&session](const message_t& msg) {
+        return symbol_of(msg) == session->client_id();
+    }), positions.end());
+
+    if (positions.empty()) {
         return;
     }
+
+    session->deliver(positions.data(), positions.size());
+
+    if (debugLogs_) {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << "Sent " << positions.size() << " positions to (" << session->client_id() << ") upon joining" << std::endl;
+    }
 }
 
-void PositionServer::handle_client(std::shared_ptr<tcp::socket> socket, const std::string& client_id) {
-    try {
-        while (running_) {
+bool PositionServer::register_client(std::shared_ptr<Session> session, const message_t& handshake) {
 
-            message_t message;
-            boost::system::error_code ec;
-            size_t length = socket->read_some(boost::asio::buffer(&message, sizeof(message_t)), ec);
+    // Mid-handoff the session could not be passed on; the client reconnects to the successor.
+    if (handing_off_) {
+        metrics_.add(server_counter::rejected);
+        return false;
+    }
 
-            if (ec) {
-                std::lock_guard<std::mutex> lock(print_mutex);
-                if (ec == boost::asio::error::eof) {
-                    std::cout << "Client " << client_id << " closed connection.\n";
-                } else if (ec == boost::asio::error::operation_aborted) {
-                    std::cout << "Operation aborted for client " << client_id << ".\n";
-                } else {
-                    std::cerr << "Error in handle_client for " << client_id << ": " << ec.message() << std::endl;
-                }
-                handle_disconnection(socket, client_id);
-                break;
-            }
+    // Registrations are counted in the metrics; a reconnect storm printing one line per client
+    // would serialise every I/O thread on print_mutex and the terminal.
+    if (!client_ids_.try_register(session->client_id())) {
+        metrics_.add(server_counter::rejected);
 
-            process_data(socket, message);
-        }
-    } catch (const std::exception& e) {
-        if (running_) {
+        if (debugLogs_) {
             std::lock_guard<std::mutex> lock(print_mutex);
-            std::cerr << "Exception in handle_client for " << client_id << ": " << e.what() << "\n";
-            handle_disconnection(socket, client_id);
+            std::cerr << "Client ID " << session->client_id() << " already exists. Rejecting connection." << std::endl;
         }
+
+        return false;
     }
-}
 
-void PositionServer::handle_disconnection(std::shared_ptr<tcp::socket> socket, const std::string& clients_ID) {
+    {
+        std::lock_guard<std::mutex> lock(clients_mutex_);
+        clients_.insert(session);
+    }
 
-    std::lock_guard<std::mutex> lock(clients_mutex_);
+    if (capture_.is_open()) {
+        capture_.connect(session->id(), session->client_id());
+    }
 
-    auto it = clients_.find(socket);
-    auto itTwo = connected_client_ids_.find(clients_ID); 
+    if (debugLogs_) {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << "Received message from client: " << session->client_id() << ", net position: " << handshake.net_position << ", timestamp: " << format_timestamp(handshake.timestamp_ns) << std::endl;
+    }
 
-    if (it != clients_.end()) {
+    return true;
+}
 
-        std::string IPID = (*it)->remote_endpoint().address().to_string();
-        boost::system::error_code ec;
+void PositionServer::simulate_disconnect() {
 
-        (*it)->close(ec);
-        if (ec) {
-            std::cerr << "Error during socket close: " << ec.message() << std::endl;
-        }
+    int channels[2];
 
-        clients_.erase(it);
-        std::cout << "Client " << IPID << " disconnected and removed from the set." << std::endl;
-    } else {
+    if (!handoff_pair(channels)) {
         std::lock_guard<std::mutex> lock(print_mutex);
-        std::cerr << "Client socket not found in the set." << std::endl;
+        std::cerr << "Hot restart is not supported on this platform." << std::endl;
+        return;
     }
 
-    if (itTwo != connected_client_ids_.end()) {
+    handoff_state_t state;
+    bool received = false;
 
-        connected_client_ids_.erase(clients_ID);
-        std::cout << "Client " << clients_ID << " disconnected and removed from the set." << std::endl;
+    std::thread receiver([&]() { received = receive_handoff(channels[1], state); });
+    bool sent = hand_off(channels[0]);
 
-    } else {
-        std::lock_guard<std::mutex> lock(print_mutex);
-        std::cerr << "Client ID not found in the set." << std::endl;
+    close_handoff(channels[0]);
+    receiver.join();
+    close_handoff(channels[1]);
+
+    if (!sent || !received) {
+        {
+            std::lock_guard<std::mutex> lock(print_mutex);
+            std::cerr << "Hot restart failed; carrying on with the current sessions." << std::endl;
+        }
 
+        if (sent) {
+            cancel_handoff();
+        }
+
+        return;
     }
+
+    stop();
+
+    handing_off_ = false;
+    takeover_state_ = std::move(state);
+    start();
 }
 
-void PositionServer::process_data(std::shared_ptr<tcp::socket> socket, message_t& message) {
+// Runs on its own thread while the server is up, waiting for a successor process to connect.
+void PositionServer::wait_for_successor() {
 
-    std::string symbol(message.symbol.data());
+    int listener = listen_handoff(config_.handoff_path);
 
-    if(debugLogs_) 
-    {
+    if (listener < 0) {
         std::lock_guard<std::mutex> lock(print_mutex);
-        std::cout << "Processing data for client: " << symbol << std::endl;
+        std::cerr << "Could not listen for a successor on " << config_.handoff_path << std::endl;
+        return;
     }
 
     {
-        std::lock_guard<std::mutex> lock(clients_mutex_);
-        client_positions_[symbol] = message;
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << "Waiting for a successor on " << config_.handoff_path << std::endl;
     }
 
-    enqueue_message(message);
-}
+    while (running_) {
 
-void PositionServer::enqueue_message(const message_t& message) {
+        int channel = accept_handoff(listener, 200);
 
-    while (!message_queue_.push(message)) {
-        
-        std::this_thread::yield();
+        if (channel < 0) {
+            continue;
+        }
+
+        bool sent = hand_off(channel);
+        close_handoff(channel);
+
+        if (sent) {
+            handed_off_ = true;
+            break;
+        }
     }
+
+    close_handoff(listener);
 }
 
-void PositionServer::process_messages() {
+// Quiesces the server and sends its listening socket, sessions and store down `channel`.
+// Reads and writes are cancelled on every session, the dispatch queue is drained, and each
+// session is captured between records. The sessions stay suspended afterwards; this process
+// only has to release its copies of the sockets.
+bool PositionServer::hand_off(int channel) {
 
-    while (running_) {
+    auto began = std::chrono::steady_clock::now();
+    handing_off_ = true;
 
-        message_t message;
+    if (replica_link_) {
+        replica_link_->stop();
+    }
 
-        while (message_queue_.pop(message)) {
+    // The listening socket stays open, so new connections wait in its backlog for the successor.
+    // Posted after the replica link's stop, so no replicated update is applied once this has run.
+    std::promise<void> accept_cancelled;
+    boost::asio::post(*io_contexts_.front(), [this, &accept_cancelled]() {
+        boost::system::error_code ignore;
+        acceptor_.cancel(ignore);
+        accept_cancelled.set_value();
+    });
+    accept_cancelled.get_future().wait();
 
-            std::lock_guard<std::mutex> lock(clients_mutex_);
+    {
+        std::lock_guard<std::mutex> lock(replicas_mutex_);
 
-            for (auto& client : clients_) {
+        for (auto& replica : replicas_) {
+            replica->close();
+        }
+    }
 
-                if (client->is_open()) {
+    std::vector<std::shared_ptr<Session>> sessions;
 
-                    boost::asio::async_write(*client, boost::asio::buffer(&message, sizeof(message_t)),
-                        [this, client, message](boost::system::error_code ec, std::size_t length) {
-                            if (ec) {
+    {
+        std::lock_guard<std::mutex> lock(clients_mutex_);
+        sessions.assign(clients_.begin(), clients_.end());
+    }
 
-                                std::cerr << "Failed to send message: " << ec.message() << std::endl;
-                                clients_.erase(client); 
+    struct latch_t {
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::size_t remaining;
+    };
 
-                            } 
-                            else if(debugLogs_){
+    auto latch = std::make_shared<latch_t>();
+    latch->remaining = sessions.size();
 
-                                std::lock_guard<std::mutex> lock(print_mutex);                
-                                std::cout << "Sending BroadCast to: " << client->remote_endpoint().address().to_string() << ":" << client->remote_endpoint().port() << std::endl;
-                                std::cout << "\nSent broadcast: Client: " << std::string(message.symbol.data()) << ", Net Position: " << message.net_position << ", Timestamp of client: " << std::string(message.timestamp.data()) << std::endl;
-                            }
-                        });
-                }
-            }
+    for (auto& session : sessions) {
+        session->suspend([latch]() {
+            std::lock_guard<std::mutex> lock(latch->mutex);
+            --latch->remaining;
+            latch->condition.notify_all();
+        });
+    }
 
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    {
+        std::unique_lock<std::mutex> lock(latch->mutex);
+        latch->condition.wait(lock, [&latch]() { return latch->remaining == 0; });
+    }
 
-        }
+    // New in-process publishes back out once handing_off_ is set; let those already under way finish.
+    while (publishing_.load() > 0) {
+        std::this_thread::yield();
+    }
+
+    // With every read suspended nothing new is ingested; wait for queued broadcasts to land in the session queues.
+    while (!message_queue_.empty() || dispatching_.load() > 0) {
+        std::this_thread::yield();
     }
-}
\ No newline at end of file
+
+    handoff_state_t state;
+    state.listener_fd = acceptor_.native_handle();
+    state.sequence = store_.sequence();
+    store_.snapshot(state.positions);
+
+    {
+        std::lock_guard<std::mutex> lock(clients_mutex_);
+
+        for (auto& session : clients_) {
+
+            // A userspace TLS record layer cannot be passed on, so those clients reconnect to the successor.
+            if (!session->identified() || !session->socket().is_open() || session->tls_userspace()) {
+                continue;
+            }
+
+            state.sessions.emplace_back();
+            session->export_state(state.sessions.back());
+            predicates_.export_session(session.get(), state.sessions.back().predicates);
+        }
+    }
+
+    if (!send_handoff(channel, state)) {
+        {
+            std::lock_guard<std::mutex> lock(print_mutex);
+            std::cerr << "Handoff failed; resuming." << std::endl;
+        }
+
+        cancel_handoff();
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(print_mutex);
+    std::cout << "Handed off " << state.sessions.size() << " sessions and " << state.positions.size() << " positions at sequence " << state.sequence
+              << " in " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - began).count() << " ms" << std::endl;
+    return true;
+}
+
+// Undoes a handoff that did not complete: sessions, accepts and replication pick up where they stopped.
+void PositionServer::cancel_handoff() {
+
+    handing_off_ = false;
+
+    {
+        std::lock_guard<std::mutex> lock(clients_mutex_);
+
+        for (auto& session : clients_) {
+            session->resume();
+        }
+    }
+
+    boost::asio::post(*io_contexts_.front(), [this]() { do_accept(); });
+
+    if (replica_link_) {
+        replica_link_->resume_after(store_.sequence());
+        replica_link_->start();
+    }
+}
+
+void PositionServer::take_over(handoff_state_t& state) {
+
+    for (const auto& position : state.positions) {
+        store_.update(position);
+    }
+
+    store_.set_sequence(state.sequence);
+
+    for (auto& exported : state.sessions) {
+
+        std::size_t index = next_io_thread();
+        boost::system::error_code ec;
+        tcp::socket socket(*io_contexts_[index]);
+        socket.assign(tcp::v4(), exported.fd, ec);
+
+        if (ec) {
+            close_handoff(exported.fd);
+            continue;
+        }
+
+        auto session = std::make_shared<Session>(std::move(socket), *io_contexts_[index], *timer_wheels_[index], *this, session_slabs(index));
+        session->restore(exported);
+
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex_);
+            clients_.insert(session);
+            client_ids_.try_register(session->client_id());
+        }
+
+        if (capture_.is_open()) {
+            capture_.connect(session->id(), session->client_id());
+        }
+
+        for (std::size_t i = 0; i + 1 < exported.predicates.size(); i += 2) {
+            std::vector<message_t> payload{exported.predicates[i + 1]};
+            handle_predicate_request(session, to_control(exported.predicates[i]), payload);
+        }
+
+        if (config_.mode == wait_mode::busy_poll) {
+            enable_socket_busy_poll(session->socket(), config_.busy_poll_usec);
+        }
+
+        if (config_.kernel_timestamps) {
+            session->enable_receive_timestamps();
+        }
+
+        session->resume();
+    }
+
+    std::lock_guard<std::mutex> lock(print_mutex);
+    std::cout << "Took over " << state.sessions.size() << " sessions and " << state.positions.size() << " positions at sequence " << state.sequence << std::endl;
+}
+
+void PositionServer::register_replica(std::shared_ptr<Session> session) {
+
+    {
+        std::lock_guard<std::mutex> lock(replicas_mutex_);
+        replicas_.push_back(session);
+        replica_count_ = replicas_.size();
+    }
+
+    std::lock_guard<std::mutex> lock(print_mutex);
+    std::cout << "Replica " << session->remote_address() << " subscribed at local sequence " << store_.sequence() << std::endl;
+}
+
+void PositionServer::handle_disconnection(std::shared_ptr<Session> session) {
+
+    if (session->is_replica()) {
+
+        {
+            std::lock_guard<std::mutex> lock(replicas_mutex_);
+            replicas_.erase(std::remove(replicas_.begin(), replicas_.end(), session), replicas_.end());
+            replica_count_ = replicas_.size();
+        }
+
+        boost::system::error_code ec;
+        session->socket().close(ec);
+
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << "Replica " << session->remote_address() << " disconnected." << std::endl;
+        return;
+    }
+
+    predicates_.remove_all(session.get());
+
+    std::lock_guard<std::mutex> lock(clients_mutex_);
+
+    auto it = clients_.find(session);
+    bool registered = it != clients_.end();
+
+    if (registered) {
+
+        boost::system::error_code ec;
+
+        session->socket().close(ec);
+        if (ec) {
+            std::cerr << "Error during socket close: " << ec.message() << std::endl;
+        }
+
+        clients_.erase(it);
+        metrics_.add(server_counter::closed);
+        std::cout << "Client " << session->remote_address() << " disconnected and removed from the set." << std::endl;
+    } else {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cerr << "Client socket not found in the set." << std::endl;
+    }
+
+    if (registered && capture_.is_open()) {
+        capture_.disconnect(session->id());
+    }
+
+    // Only a registered session owns its ID; a rejected duplicate must not release the original's.
+    if (registered && client_ids_.release(session->client_id())) {
+
+        std::cout << "Client " << session->client_id() << " disconnected and removed from the set." << std::endl;
+
+    } else {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cerr << "Client ID not found in the set." << std::endl;
+
+    }
+}
+
+// Takes the run of updates a session decoded from one read.
+void PositionServer::process_batch(std::shared_ptr<Session> session, const message_t* messages, std::size_t count) {
+
+    if(debugLogs_) 
+    {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << "Processing " << count << " updates for client: " << session->client_id() << std::endl;
+    }
+
+    if (capture_.is_open()) {
+        capture_.update(session->id(), messages, count);
+    }
+
+    route_batch(messages, count);
+}
+
+bool PositionServer::publish(const message_t* messages, std::size_t count) {
+
+    // Raised before the check, so a handoff that has set handing_off_ can wait for it to drop.
+    ++publishing_;
+
+    if (!running_ || handing_off_) {
+        --publishing_;
+        return false;
+    }
+
+    if (capture_.is_open()) {
+        std::call_once(local_capture_connected_, [this]() {
+            capture_.connect(in_process_session, "in-process");
+        });
+
+        capture_.update(in_process_session, messages, count);
+    }
+
+    route_batch(messages, count);
+
+    --publishing_;
+    return true;
+}
+
+uint64_t PositionServer::subscribe(local_subscriber subscriber) {
+
+    std::lock_guard<std::mutex> lock(subscribers_mutex_);
+
+    auto next = std::make_shared<local_subscribers_t>(*std::atomic_load_explicit(&local_subscribers_, std::memory_order_acquire));
+    next->emplace_back(next_subscription_, std::move(subscriber));
+    std::atomic_store_explicit(&local_subscribers_, std::shared_ptr<const local_subscribers_t>(std::move(next)), std::memory_order_release);
+
+    return next_subscription_++;
+}
+
+void PositionServer::unsubscribe(uint64_t subscription) {
+
+    std::shared_ptr<const local_subscribers_t> previous;
+
+    {
+        std::lock_guard<std::mutex> lock(subscribers_mutex_);
+
+        previous = std::atomic_load_explicit(&local_subscribers_, std::memory_order_acquire);
+        auto next = std::make_shared<local_subscribers_t>(*previous);
+
+        next->erase(std::remove_if(next->begin(), next->end(), [subscription](const auto& entry) {
+            return entry.first == subscription;
+        }), next->end());
+
+        std::atomic_store_explicit(&local_subscribers_, std::shared_ptr<const local_subscribers_t>(std::move(next)), std::memory_order_release);
+    }
+
+    // A dispatcher keeps the list it loaded until its calls return. Waiting for those references
+    // to go means the caller can free what the subscriber uses, unless the caller is a subscriber
+    // itself, which would wait on its own call.
+    if (!in_local_subscriber) {
+        while (previous.use_count() > 1) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void PositionServer::route_batch(const message_t* messages, std::size_t count) {
+
+    // A replica does not sequence updates itself: they go to the primary and come back through
+    // the replication stream, so every server applies them in the same order.
+    if (replica_link_ && !promoted_) {
+
+        std::size_t forwarded = 0;
+
+        while (forwarded < count && replica_link_->forward(messages[forwarded])) {
+            ++forwarded;
+        }
+
+        messages += forwarded;
+        count -= forwarded;
+    }
+
+    if (count > 0) {
+        ingest_batch(messages, count);
+    }
+}
+
+// Applies an update to the store, history, predicates, replication log and broadcast queue.
+// replicated_sequence and origin_ns are the primary's sequence for the update and the time the
+// origin server ingested it, when applied on a replica or relay.
+void PositionServer::ingest(const message_t& message, uint64_t replicated_sequence, int64_t origin_ns) {
+
+    apply_update(message, Clock::now_ns(), replicated_sequence, origin_ns);
+    notify_replicas();
+
+    metrics_.add(server_counter::updates_in);
+    enqueue_message(message);
+}
+
+// One clock read, one replica wakeup and one dispatcher wakeup for the whole batch.
+void PositionServer::ingest_batch(const message_t* messages, std::size_t count) {
+
+    int64_t now_ns = Clock::now_ns();
+
+    for (std::size_t i = 0; i < count; ++i) {
+        apply_update(messages[i], now_ns, 0, 0);
+    }
+
+    notify_replicas();
+
+    metrics_.add(server_counter::updates_in, count);
+    enqueue_messages(messages, count);
+}
+
+void PositionServer::apply_update(const message_t& message, int64_t now_ns, uint64_t replicated_sequence, int64_t origin_ns) {
+
+    std::string_view symbol = symbol_of(message);
+
+    message_t previous;
+    bool had_previous = false;
+    uint64_t sequence = store_.update(message, &previous, &had_previous);
+
+    if (replicated_sequence != 0 && sequence != replicated_sequence) {
+        store_.set_sequence(replicated_sequence);
+        sequence = replicated_sequence;
+    }
+
+    POSITION_PROBE(store_update, sequence, message.timestamp_ns);
+
+    replication_log_.append(sequence, message, ReplicationLog::entry_times_t{now_ns, origin_ns != 0 ? origin_ns : now_ns});
+    history_.append(symbol, now_ns, message.net_position);
+
+    thread_local std::vector<PredicateIndex::trigger_t> triggers;
+    triggers.clear();
+    predicates_.evaluate(symbol, had_previous, previous.net_position, message.net_position, now_ns, triggers);
+
+    for (auto& trigger : triggers) {
+
+        control_t event;
+        event.kind = static_cast<uint8_t>(control_kind::predicate_event);
+        event.type = static_cast<uint8_t>(trigger.type);
+        event.flags = trigger.direction;
+        event.count = 1;
+        event.request_id = trigger.predicate_id;
+        event.lower = trigger.level;
+        event.upper = trigger.observed;
+
+        message_t records[2] = {to_record(event), message};
+        trigger.session->deliver_priority(records, 2);
+    }
+
+    triggers.clear();
+}
+
+void PositionServer::notify_replicas() {
+
+    if (replica_count_.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(replicas_mutex_);
+
+    for (auto& replica : replicas_) {
+        replica->notify_replication();
+    }
+}
+
+void PositionServer::apply_replicated(const message_t& message, uint64_t sequence, int64_t origin_ns) {
+    ingest(message, sequence, origin_ns);
+}
+
+// Replaces local state with the primary's. Positions missing from the snapshot are kept; the
+// primary never deletes symbols, so they can only be ones this server already had.
+void PositionServer::apply_replicated_snapshot(const std::vector<message_t>& positions, uint64_t sequence) {
+
+    // Loaded straight into the store and history rather than ingested: the positions already
+    // went through the primary's predicates, and downstream replicas resync from the reset log.
+    // Only positions that differ from what this server holds reach its own clients.
+    int64_t now_ns = Clock::now_ns();
+    std::size_t changed = 0;
+
+    for (const auto& position : positions) {
+
+        std::string_view symbol = symbol_of(position);
+        message_t current;
+
+        if (store_.get(symbol, current) && current.net_position == position.net_position && current.timestamp_ns == position.timestamp_ns) {
+            continue;
+        }
+
+        store_.update(position);
+        history_.append(symbol, now_ns, position.net_position);
+        enqueue_message(position);
+        ++changed;
+    }
+
+    store_.set_sequence(sequence);
+    replication_log_.reset();
+
+    std::lock_guard<std::mutex> lock(print_mutex);
+    std::cout << "Applied replication snapshot of " << positions.size() << " positions (" << changed << " changed) at sequence " << sequence << std::endl;
+}
+
+void PositionServer::promote() {
+
+    if (!replica_link_ || promoted_.exchange(true)) {
+        return;
+    }
+
+    replica_link_->stop();
+
+    std::vector<message_t> unsent;
+    replica_link_->take_forwarded(unsent);
+
+    for (const auto& message : unsent) {
+        ingest(message);
+    }
+
+    std::lock_guard<std::mutex> lock(print_mutex);
+    std::cout << "Promoted to primary at sequence " << store_.sequence() << " (" << unsent.size() << " forwarded updates applied locally)" << std::endl;
+}
+
+PositionServer::replication_status_t PositionServer::replication_status() const {
+
+    replication_status_t status{};
+    status.replica = config_.replica_of_port != 0;
+    status.relay = config_.relay;
+    status.promoted = promoted_;
+    status.replicas = replica_count_;
+
+    if (replica_link_ && !promoted_) {
+        status.connected = replica_link_->connected();
+        status.applied_sequence = replica_link_->applied_sequence();
+        status.primary_sequence = replica_link_->primary_sequence();
+        status.lag_seconds = replica_link_->lag_seconds();
+        status.latency = replica_link_->latency_summary();
+    } else {
+        status.applied_sequence = store_.sequence();
+        status.primary_sequence = status.applied_sequence;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(clients_mutex_);
+
+        for (const auto& client : clients_) {
+            status.conflated += client->conflated();
+        }
+    }
+
+    return status;
+}
+
+std::vector<ingest_budget_stats_t> PositionServer::ingest_budgets() const {
+
+    std::vector<ingest_budget_stats_t> budgets;
+
+    if (config_.ingest_updates_per_second <= 0 && config_.ingest_bytes_per_second <= 0) {
+        return budgets;
+    }
+
+    std::lock_guard<std::mutex> lock(clients_mutex_);
+
+    for (const auto& client : clients_) {
+
+        ingest_budget_stats_t stats = client->budget_stats();
+
+        if (stats.admitted + stats.held + stats.rejected > 0) {
+            budgets.push_back(std::move(stats));
+        }
+    }
+
+    std::sort(budgets.begin(), budgets.end(), [](const ingest_budget_stats_t& a, const ingest_budget_stats_t& b) {
+        return a.client_id < b.client_id;
+    });
+
+    return budgets;
+}
+
+// Escapes a Prometheus label value.
+static std::string label_value(std::string_view value) {
+
+    std::string escaped;
+    escaped.reserve(value.size());
+
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
+        }
+    }
+
+    return escaped;
+}
+
+static void write_metric(std::ostringstream& out, const char* name, const char* type, const char* help, uint64_t value) {
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n" << name << " " << value << "\n";
+}
+
+// Runs on the metrics thread. The event counters are summed over their per-thread slots here;
+// the session list is copied under clients_mutex_ and each session's queue is read afterwards,
+// so the dispatchers wait on a scrape only for the copy.
+std::string PositionServer::render_metrics() const {
+
+    std::vector<std::shared_ptr<Session>> sessions;
+    std::vector<std::shared_ptr<Session>> replicas;
+
+    {
+        std::lock_guard<std::mutex> lock(clients_mutex_);
+        sessions.assign(clients_.begin(), clients_.end());
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(replicas_mutex_);
+        replicas = replicas_;
+    }
+
+    std::ostringstream out;
+    write_metric(out, "position_connections", "gauge", "Identified client sessions.", sessions.size());
+    write_metric(out, "position_replicas", "gauge", "Replicas and relays following this server.", replicas.size());
+    write_metric(out, "position_accepted_total", "counter", "Connections accepted.", metrics_.total(server_counter::accepted));
+    write_metric(out, "position_rejected_total", "counter", "Connections refused at identification.", metrics_.total(server_counter::rejected));
+    write_metric(out, "position_closed_total", "counter", "Client sessions removed.", metrics_.total(server_counter::closed));
+    write_metric(out, "position_reaped_total", "counter", "Sessions closed by the liveness checks.", sessions_reaped_.load(std::memory_order_relaxed));
+    write_metric(out, "position_updates_in_total", "counter", "Updates ingested.", metrics_.total(server_counter::updates_in));
+    write_metric(out, "position_updates_out_total", "counter", "Broadcasts queued to sessions, one per recipient.", metrics_.total(server_counter::updates_out));
+    write_metric(out, "position_bytes_in_total", "counter", "Bytes read from client sockets.", metrics_.total(server_counter::bytes_in));
+    write_metric(out, "position_bytes_out_total", "counter", "Bytes written to client sockets.", metrics_.total(server_counter::bytes_out));
+
+    // Dequeued is read first, so a push and pop landing between the two reads cannot make it exceed enqueued.
+    uint64_t dequeued = metrics_.total(server_counter::dequeued);
+    uint64_t enqueued = metrics_.total(server_counter::enqueued);
+    write_metric(out, "position_broadcast_queue_depth", "gauge", "Updates waiting for a dispatcher.", enqueued > dequeued ? enqueued - dequeued : 0);
+    write_metric(out, "position_store_sequence", "gauge", "Sequence of the last update applied to the store.", store_.sequence());
+    write_metric(out, "position_history_series", "gauge", "Symbols with history inside the retention window.", history_.series_count());
+    write_metric(out, "position_history_bytes", "gauge", "Bytes held by position history.", history_.memory_bytes());
+
+    if (config_.preallocate) {
+
+        uint64_t slabs_in_use = 0;
+        uint64_t spills = 0;
+        uint64_t spilled_bytes = 0;
+
+        for (auto& pool : session_slabs_) {
+            slabs_in_use += pool->in_use();
+            spills += pool->spills();
+            spilled_bytes += pool->spilled_bytes();
+        }
+
+        write_metric(out, "position_arena_bytes", "gauge", "Bytes reserved for the preallocated arena.", arena_.capacity());
+        write_metric(out, "position_session_slabs_in_use", "gauge", "Preallocated session slabs held by sessions.", slabs_in_use);
+        write_metric(out, "position_session_spills_total", "counter", "Session buffer allocations that did not fit the plan and went to the heap.", spills);
+        write_metric(out, "position_session_spilled_bytes_total", "counter", "Bytes of those allocations.", spilled_bytes);
+    }
+
+    out << "# HELP position_session_outbound_bytes Bytes queued for the session and not yet written.\n# TYPE position_session_outbound_bytes gauge\n";
+
+    std::vector<session_outbound_t> outbound;
+    outbound.reserve(sessions.size() + replicas.size());
+
+    for (auto& session : sessions) {
+        outbound.push_back(session->outbound());
+        out << "position_session_outbound_bytes{session=\"" << session->id() << "\",client=\"" << label_value(session->client_id()) << "\"} " << outbound.back().queued_bytes << "\n";
+    }
+
+    for (auto& replica : replicas) {
+        outbound.push_back(replica->outbound());
+        out << "position_session_outbound_bytes{session=\"" << replica->id() << "\",client=\"" << label_value(replica->client_id()) << "\"} " << outbound.back().queued_bytes << "\n";
+    }
+
+    out << "# HELP position_session_lag Records queued for a client session and not yet written; store sequences not yet sent to a replica.\n# TYPE position_session_lag gauge\n";
+
+    for (std::size_t i = 0; i < sessions.size(); ++i) {
+        out << "position_session_lag{session=\"" << sessions[i]->id() << "\",client=\"" << label_value(sessions[i]->client_id()) << "\"} " << outbound[i].lag << "\n";
+    }
+
+    for (std::size_t i = 0; i < replicas.size(); ++i) {
+        out << "position_session_lag{session=\"" << replicas[i]->id() << "\",client=\"" << label_value(replicas[i]->client_id()) << "\"} " << outbound[sessions.size() + i].lag << "\n";
+    }
+
+    std::vector<ingest_budget_stats_t> budgets = ingest_budgets();
+
+    if (!budgets.empty()) {
+
+        out << "# HELP position_ingest_budget_updates_total Updates of a budgeted publisher, by outcome.\n# TYPE position_ingest_budget_updates_total counter\n";
+
+        for (const auto& budget : budgets) {
+
+            std::string client = label_value(budget.client_id);
+            out << "position_ingest_budget_updates_total{client=\"" << client << "\",outcome=\"admitted\"} " << budget.admitted << "\n";
+            out << "position_ingest_budget_updates_total{client=\"" << client << "\",outcome=\"conflated\"} " << budget.conflated << "\n";
+            out << "position_ingest_budget_updates_total{client=\"" << client << "\",outcome=\"rejected\"} " << budget.rejected << "\n";
+        }
+    }
+
+    return out.str();
+}
+
+void PositionServer::handle_control(std::shared_ptr<Session> session, const control_t& control, const std::vector<message_t>& payload) {
+
+    switch (static_cast<control_kind>(control.kind)) {
+        case control_kind::query_request:
+            handle_position_request(session, control, payload);
+            break;
+        case control_kind::predicate_subscribe:
+        case control_kind::predicate_unsubscribe:
+            handle_predicate_request(session, control, payload);
+            break;
+        case control_kind::set_subscription:
+            session->set_wants_broadcasts(control.flags & subscribe_broadcasts);
+            break;
+        case control_kind::heartbeat:
+            break;
+        default:
+            if (debugLogs_) {
+                std::lock_guard<std::mutex> lock(print_mutex);
+                std::cerr << "Ignoring unknown control record " << static_cast<int>(control.kind) << " from " << session->client_id() << std::endl;
+            }
+            break;
+    }
+}
+
+// Runs on the requesting session's I/O thread and reads only the store snapshot, so queries never
+// take clients_mutex_ or wait on ingest. Responses carry the request id so clients can pipeline.
+void PositionServer::handle_position_request(std::shared_ptr<Session> session, const control_t& request, const std::vector<message_t>& payload) {
+
+    // Scratch space is reused per I/O thread so answering a query does not allocate.
+    thread_local std::vector<message_t> records;
+    records.clear();
+    records.emplace_back();
+
+    switch (static_cast<query_type>(request.type)) {
+        case query_type::symbol:
+        case query_type::symbol_set:
+            for (const auto& entry : payload) {
+                records.emplace_back();
+                if (!store_.get(symbol_of(entry), records.back())) {
+                    records.pop_back();
+                }
+            }
+            break;
+        case query_type::prefix:
+            store_.get_prefix(payload.empty() ? std::string_view() : symbol_of(payload.front()), records);
+            break;
+        case query_type::history_range:
+        case query_type::history_rollup:
+            if (!payload.empty()) {
+                append_history(static_cast<query_type>(request.type), payload.front(), records);
+            }
+            break;
+        default:
+            break;
+    }
+
+    control_t response;
+    response.kind = static_cast<uint8_t>(control_kind::query_response);
+    response.type = request.type;
+    response.request_id = request.request_id;
+    response.sequence = store_.sequence();
+    response.count = static_cast<uint32_t>(records.size() - 1);
+    records.front() = to_record(response);
+
+    session->deliver_priority(records.data(), records.size());
+}
+
+// Sealed blocks are decoded on the requesting session's I/O thread; the series is locked only
+// while its samples are copied out, so ingest waits at most for that copy.
+void PositionServer::append_history(query_type type, const message_t& query_record, std::vector<message_t>& records) const {
+
+    history_query_t query = to_history_query(query_record);
+    std::string_view symbol = symbol_of(query_record);
+    message_t named = symbol_record(std::string(symbol));
+
+    if (query.to_ns < query.from_ns) {
+        return;
+    }
+
+    if (type == query_type::history_range) {
+
+        for (const auto& sample : history_.range(symbol, query.from_ns, query.to_ns)) {
+
+            if (records.size() > max_history_records) {
+                break;
+            }
+
+            message_t record = named;
+            record.net_position = sample.net_position;
+            record.timestamp_ns = sample.timestamp_ns;
+            records.push_back(record);
+        }
+
+        return;
+    }
+
+    if (query.bucket_ns <= 0 || static_cast<uint64_t>(query.to_ns - query.from_ns) / static_cast<uint64_t>(query.bucket_ns) > UINT32_MAX) {
+        return;
+    }
+
+    for (const auto& bucket : history_.rollup(symbol, query.from_ns, query.to_ns, query.bucket_ns)) {
+
+        if (records.size() > max_history_records) {
+            break;
+        }
+
+        rollup_record_t record;
+        record.symbol = named.symbol;
+        record.bucket_index = static_cast<uint32_t>((bucket.bucket_start_ns - query.from_ns) / query.bucket_ns);
+        record.count = bucket.count;
+        record.min = bucket.min;
+        record.max = bucket.max;
+        record.mean = bucket.mean;
+        record.last = bucket.last;
+        records.push_back(to_record(record));
+    }
+}
+
+void PositionServer::handle_predicate_request(std::shared_ptr<Session> session, const control_t& request, const std::vector<message_t>& payload) {
+
+    if (static_cast<control_kind>(request.kind) == control_kind::predicate_unsubscribe) {
+        predicates_.remove(session.get(), request.request_id);
+        return;
+    }
+
+    bool added = !payload.empty() && predicates_.add(session, symbol_of(payload.front()), request.request_id, static_cast<predicate_type>(request.type), request.flags, request.lower, request.upper);
+
+    if (debugLogs_ || !added) {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << (added ? "Registered" : "Rejected") << " predicate " << request.request_id << " from client " << session->client_id()
+                  << " on " << (payload.empty() ? std::string() : std::string(symbol_of(payload.front()))) << std::endl;
+    }
+}
+
+void PositionServer::enqueue_message(const message_t& message) {
+    enqueue_messages(&message, 1);
+}
+
+// A batch is pushed whole and wakes the dispatchers once. If the queue fills part way through,
+// parked dispatchers are woken before spinning so they can drain what is already queued.
+void PositionServer::enqueue_messages(const message_t* messages, std::size_t count) {
+
+    for (std::size_t i = 0; i < count; ++i) {
+
+        while (!message_queue_.bounded_push(messages[i])) {
+        
+            wake_dispatchers(true);
+            std::this_thread::yield();
+        }
+    }
+
+    metrics_.add(server_counter::enqueued, count);
+    POSITION_PROBE(enqueue, count, count > 0 ? messages[0].timestamp_ns : 0);
+    wake_dispatchers(count > 1);
+}
+
+void PositionServer::wake_dispatchers(bool all) {
+
+    // Only pay for the mutex when a blocking dispatcher may be parked. The counter is raised
+    // under message_mutex_ before the dispatcher re-checks the queue, so a push is never missed.
+    if (waiting_dispatchers_.load() > 0) {
+        std::lock_guard<std::mutex> lock(message_mutex_);
+
+        if (all) {
+            message_condition_.notify_all();
+        } else {
+            message_condition_.notify_one();
+        }
+    }
+}
+
+void PositionServer::process_messages(std::size_t index) {
+
+    if (index < config_.dispatch_cpus.size() && !pin_current_thread(config_.dispatch_cpus[index])) {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cerr << "Could not pin dispatch thread " << index << " to CPU " << config_.dispatch_cpus[index] << std::endl;
+    }
+
+    message_t message;
+
+    while (running_) {
+
+        // Raised before popping, so a handoff that sees an empty queue and no dispatcher knows every broadcast is delivered.
+        ++dispatching_;
+
+        uint64_t dequeued = 0;
+        uint64_t delivered = 0;
+
+        while (message_queue_.pop(message)) {
+
+            uint64_t recipients = 0;
+
+            {
+                std::lock_guard<std::mutex> lock(clients_mutex_);
+
+                for (auto& client : clients_) {
+                    if (client->wants_broadcasts()) {
+                        client->deliver_update(message);
+                        ++recipients;
+                    }
+                }
+            }
+
+            auto subscribers = std::atomic_load_explicit(&local_subscribers_, std::memory_order_acquire);
+
+            if (!subscribers->empty()) {
+
+                in_local_subscriber = true;
+
+                for (const auto& subscriber : *subscribers) {
+                    subscriber.second(message);
+                }
+
+                in_local_subscriber = false;
+            }
+
+            POSITION_PROBE(dispatch, recipients, message.timestamp_ns);
+            delivered += recipients;
+            ++dequeued;
+        }
+
+        if (dequeued > 0) {
+            metrics_.add(server_counter::dequeued, dequeued);
+            metrics_.add(server_counter::updates_out, delivered);
+        }
+
+        --dispatching_;
+
+        if (config_.mode == wait_mode::busy_poll) {
+            cpu_relax();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(message_mutex_);
+        ++waiting_dispatchers_;
+        message_condition_.wait(lock, [this]() { return !message_queue_.empty() || !running_; });
+        --waiting_dispatchers_;
+    }
+}
@@ -8,48 +8,178 @@
 #include <vector>
 #include <mutex>
 #include <condition_variable>
+#include <functional>
 #include <thread>
 #include <memory>
+#include <optional>
 #include "../../include/Message.h"
+#include "../../include/Protocol.h"
+#include "CaptureWriter.h"
+#include "ClientRegistry.h"
+#include "PositionHistory.h"
+#include "PositionStore.h"
+#include "Handoff.h"
+#include "MemoryArena.h"
+#include "PredicateIndex.h"
+#include "ReplicaLink.h"
+#include "ReplicationLog.h"
+#include "MetricsEndpoint.h"
+#include "ServerMetrics.h"
+#include "ServerConfig.h"
+#include "Session.h"
+#include "TimerWheel.h"
 
 using boost::asio::ip::tcp;
 
+using local_subscriber = std::function<void(const message_t& update)>;
+
 class PositionServer : public std::enable_shared_from_this<PositionServer> {
 public:
+    struct replication_status_t {
+        bool replica;
+        bool relay;
+        bool promoted;
+        bool connected;
+        uint64_t applied_sequence;
+        uint64_t primary_sequence;
+        double lag_seconds;
+        std::size_t replicas;
+        ReplicaLink::latency_summary_t latency;
+        uint64_t conflated;
+    };
+
     PositionServer(short port,  bool& debugLogs);
+    PositionServer(const ServerConfig& config, bool& debugLogs);
+
+    // Hot-restarts the server in place through the same handoff a successor process would get:
+    // sessions are suspended, exported with their sockets, torn down and resumed from the export.
     void simulate_disconnect();
     ~PositionServer();
     void start();
     void stop();
+    const PositionHistory& history() const { return history_; }
+    const PositionStore& store() const { return store_; }
+    uint64_t updates_processed() const { return metrics_.total(server_counter::updates_in); }
+    uint64_t sessions_reaped() const { return sessions_reaped_.load(std::memory_order_relaxed); }
+    // Connections accepted plus sessions closed, so a caller can tell windows where the set of
+    // sessions stayed the same.
+    uint64_t session_events() const { return metrics_.total(server_counter::accepted) + metrics_.total(server_counter::closed); }
+    replication_status_t replication_status() const;
+
+    // In-process producers and consumers, for code linked into the server's process. publish()
+    // takes updates from the caller's buffer straight into the store and broadcast path the
+    // network sessions use, with no socket or encoding in between. It returns false, ingesting
+    // nothing, while the server is stopped or handing its state to a successor; stop publishing
+    // before calling stop(). A subscriber is called on a dispatch thread with every broadcast
+    // network clients get, by reference to the dispatcher's copy, and outside the server's locks,
+    // so it may subscribe or unsubscribe. It should return quickly: the dispatcher delivers
+    // nothing else until it does. With one dispatch thread, calls are serial and in ingest order.
+    // With several, each dispatcher calls every subscriber for the updates it dequeued, so one
+    // subscriber can be called concurrently from several threads and may see two updates of a
+    // symbol out of order; timestamp_ns or store() gives the latest position. Once unsubscribe()
+    // returns the subscriber is no longer being called, except when unsubscribe() is itself
+    // called from a subscriber, where a call already under way on another dispatcher may finish.
+    bool publish(const message_t* messages, std::size_t count);
+    bool publish(const message_t& message) { return publish(&message, 1); }
+    uint64_t subscribe(local_subscriber subscriber);
+    void unsubscribe(uint64_t subscription);
+
+    // Budget usage of every client that has published, by client ID; empty when no budget is set.
+    std::vector<ingest_budget_stats_t> ingest_budgets() const;
+
+    // Counters, queue depths and per-session backlogs in Prometheus text format; what the metrics
+    // endpoint serves (ServerConfig::metrics_port / metrics_path).
+    std::string render_metrics() const;
+
+    // True once the listening socket and sessions have been handed to a successor process.
+    bool handed_off() const { return handed_off_; }
+
+    // Takes over as primary: stops following the old primary and applies any client updates
+    // that were forwarded to it but never came back. Called by the replica link on timeout.
+    void promote();
 
 private:
+    friend class Session;
+    friend class ReplicaLink;
+
     void do_accept();
-    void handle_client(std::shared_ptr<tcp::socket> socket, const std::string& client_id);
+    void open_session(std::size_t index, tcp::socket socket, bool log);
+    bool register_client(std::shared_ptr<Session> session, const message_t& handshake);
     void enqueue_message(const message_t& message);
-    void process_messages();
-    void handle_position_request(std::shared_ptr<tcp::socket> socket, const std::string& clientID);
-    void start_read(std::shared_ptr<tcp::socket> socket);
-    void handle_disconnection(std::shared_ptr<tcp::socket> socket, const std::string& client_id);
-    void process_data(std::shared_ptr<tcp::socket> socket, message_t& message);
-    void sendPositions(const std::string& clientId, std::shared_ptr<tcp::socket> socket);
-
-    short port_; 
-    boost::asio::io_context io_context_;
+    void enqueue_messages(const message_t* messages, std::size_t count);
+    void wake_dispatchers(bool all);
+    void process_messages(std::size_t index);
+    void run_io_thread(std::size_t index);
+    std::size_t next_io_thread();
+    void handle_control(std::shared_ptr<Session> session, const control_t& control, const std::vector<message_t>& payload);
+    void handle_position_request(std::shared_ptr<Session> session, const control_t& request, const std::vector<message_t>& payload);
+    void append_history(query_type type, const message_t& query, std::vector<message_t>& records) const;
+    void handle_predicate_request(std::shared_ptr<Session> session, const control_t& request, const std::vector<message_t>& payload);
+    void handle_disconnection(std::shared_ptr<Session> session);
+    void process_batch(std::shared_ptr<Session> session, const message_t* messages, std::size_t count);
+    void route_batch(const message_t* messages, std::size_t count);
+    void ingest(const message_t& message, uint64_t replicated_sequence = 0, int64_t origin_ns = 0);
+    void ingest_batch(const message_t* messages, std::size_t count);
+    void apply_update(const message_t& message, int64_t now_ns, uint64_t replicated_sequence, int64_t origin_ns);
+    void notify_replicas();
+    void register_replica(std::shared_ptr<Session> session);
+    void apply_replicated(const message_t& message, uint64_t sequence, int64_t origin_ns);
+    void apply_replicated_snapshot(const std::vector<message_t>& positions, uint64_t sequence);
+    void wait_for_successor();
+    bool hand_off(int channel);
+    void cancel_handoff();
+    void take_over(handoff_state_t& state);
+    void sendPositions(std::shared_ptr<Session> session);
+    SlabPool* session_slabs(std::size_t index);
+    void report_memory_plan(const std::string& lock_error);
+
+    ServerConfig config_;
+    tls_context_ptr tls_context_;
+    short port_;
+    std::vector<std::unique_ptr<boost::asio::io_context>> io_contexts_;
+    std::vector<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>> io_work_;
+    std::vector<std::unique_ptr<TimerWheel>> timer_wheels_;
+    std::size_t next_io_context_;
     tcp::acceptor acceptor_;
-    std::unordered_set<std::shared_ptr<tcp::socket>> clients_;
-    std::unordered_map< std::string, std::shared_ptr<tcp::socket> > clientsSocketIds_;
-    std::unordered_set<std::string> connected_client_ids_;
-    std::unordered_map<std::string, message_t> client_positions_;
-    std::mutex clients_mutex_;
+    std::unordered_set<std::shared_ptr<Session>> clients_;
+    ClientRegistry client_ids_;
+    MemoryArena arena_;
+    std::vector<std::unique_ptr<SlabPool>> session_slabs_;
+    PositionStore store_;
+    PositionHistory history_;
+    PredicateIndex predicates_;
+    ReplicationLog replication_log_;
+    mutable std::mutex replicas_mutex_;
+    std::vector<std::shared_ptr<Session>> replicas_;
+    std::atomic<std::size_t> replica_count_;
+    std::unique_ptr<ReplicaLink> replica_link_;
+    CaptureWriter capture_;
+    std::atomic<bool> promoted_;
+    std::optional<handoff_state_t> takeover_state_;
+    std::thread handoff_thread_;
+    std::atomic<bool> handing_off_;
+    std::atomic<bool> handed_off_;
+    std::atomic<int> dispatching_;
+    std::atomic<int> publishing_;
+    // Copied on subscribe and unsubscribe and swapped in atomically, so dispatchers call
+    // subscribers without holding a lock.
+    using local_subscribers_t = std::vector<std::pair<uint64_t, local_subscriber>>;
+    std::shared_ptr<const local_subscribers_t> local_subscribers_;
+    std::mutex subscribers_mutex_;
+    uint64_t next_subscription_;
+    std::once_flag local_capture_connected_;
+    mutable std::mutex clients_mutex_;
+    std::mutex message_mutex_;
     std::condition_variable message_condition_;
     boost::lockfree::queue<message_t> message_queue_;
+    std::atomic<int> waiting_dispatchers_;
     std::atomic<bool> running_;
+    std::atomic<uint64_t> sessions_reaped_;
+    mutable ServerMetrics metrics_;
+    std::unique_ptr<MetricsEndpoint> metrics_endpoint_;
     std::vector<std::thread> worker_threads_;
-    std::thread accept_thread_;
-    bool debugLogs_; 
-    std::vector<char> buffer_;
-    message_t acceptMessage_;
+    std::vector<std::thread> io_threads_;
+    bool debugLogs_;
 };
 
 #endif // POSITION_SERVER_H
-
@@ -0,0 +1,225 @@
+#include "PositionStore.h"
+#include "../../include/Protocol.h"
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <type_traits>
+
+// Reserved slots are never destroyed, only released with their memory.
+static_assert(std::is_trivially_destructible<message_t>::value, "reserved store slots are not destroyed");
+
+PositionStore::directory_t::directory_t(std::size_t capacity)
+    : mask(capacity - 1), entries(new std::atomic<slot_t*>[capacity]) {
+
+    for (std::size_t i = 0; i < capacity; ++i) {
+        entries[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+PositionStore::PositionStore(std::size_t expected_symbols)
+    : size_(0), reserved_slots_(nullptr), reserved_capacity_(0), reserved_used_(0), sequence_(0) {
+
+    std::size_t capacity = 16;
+
+    while (capacity < expected_symbols * 2) {
+        capacity *= 2;
+    }
+
+    directories_.push_back(std::make_unique<directory_t>(capacity));
+    directory_.store(directories_.back().get(), std::memory_order_release);
+}
+
+void PositionStore::reserve(void* memory, std::size_t capacity) {
+
+    if (memory == nullptr) {
+        return;
+    }
+
+    reserved_slots_ = static_cast<slot_t*>(memory);
+    reserved_capacity_ = capacity;
+
+    for (std::size_t i = 0; i < capacity; ++i) {
+        new (&reserved_slots_[i]) slot_t();
+    }
+}
+
+const PositionStore::slot_t* PositionStore::find(const directory_t& directory, std::string_view symbol) {
+
+    std::size_t index = std::hash<std::string_view>()(symbol) & directory.mask;
+
+    while (true) {
+
+        const slot_t* slot = directory.entries[index].load(std::memory_order_acquire);
+
+        if (slot == nullptr || slot->symbol() == symbol) {
+            return slot;
+        }
+
+        index = (index + 1) & directory.mask;
+    }
+}
+
+// Writers only, under directory_mutex_; the release store publishes the slot's key with it.
+void PositionStore::place(directory_t& directory, slot_t* slot) {
+
+    std::size_t index = std::hash<std::string_view>()(slot->symbol()) & directory.mask;
+
+    while (directory.entries[index].load(std::memory_order_relaxed) != nullptr) {
+        index = (index + 1) & directory.mask;
+    }
+
+    directory.entries[index].store(slot, std::memory_order_release);
+}
+
+PositionStore::slot_t* PositionStore::find_or_insert(std::string_view symbol) {
+
+    symbol = symbol.substr(0, sizeof(slot_t::key));
+
+    if (const slot_t* slot = find(*directory_.load(std::memory_order_acquire), symbol)) {
+        return const_cast<slot_t*>(slot);
+    }
+
+    std::lock_guard<std::mutex> lock(directory_mutex_);
+
+    directory_t* directory = directory_.load(std::memory_order_acquire);
+
+    if (const slot_t* slot = find(*directory, symbol)) {
+        return const_cast<slot_t*>(slot);
+    }
+
+    slot_t* slot;
+
+    if (reserved_used_ < reserved_capacity_) {
+        slot = &reserved_slots_[reserved_used_++];
+    } else {
+        slots_.emplace_back();
+        slot = &slots_.back();
+    }
+
+    std::memcpy(slot->key.data(), symbol.data(), symbol.size());
+    slot->key_length = static_cast<uint8_t>(symbol.size());
+
+    std::size_t size = size_.load(std::memory_order_relaxed) + 1;
+
+    // Kept at most half full, so probes stay short and there is always an empty entry to stop at.
+    if (size * 2 > directory->mask + 1) {
+
+        auto grown = std::make_unique<directory_t>((directory->mask + 1) * 2);
+
+        for (std::size_t i = 0; i <= directory->mask; ++i) {
+            if (slot_t* existing = directory->entries[i].load(std::memory_order_relaxed)) {
+                place(*grown, existing);
+            }
+        }
+
+        directory = grown.get();
+        directories_.push_back(std::move(grown));
+    }
+
+    place(*directory, slot);
+    directory_.store(directory, std::memory_order_release);
+    size_.store(size, std::memory_order_release);
+
+    return slot;
+}
+
+uint64_t PositionStore::update(const message_t& message, message_t* previous, bool* had_previous) {
+
+    slot_t* slot = find_or_insert(symbol_of(message));
+
+    // Writers claim the slot by moving its version to an odd value; readers retry while it is odd.
+    uint64_t version = slot->version.load(std::memory_order_relaxed);
+
+    while ((version & 1) || !slot->version.compare_exchange_weak(version, version + 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+        std::this_thread::yield();
+        version = slot->version.load(std::memory_order_relaxed);
+    }
+
+    std::atomic_thread_fence(std::memory_order_release);
+
+    // A slot that has never been written still has version zero.
+    if (had_previous != nullptr) {
+        *had_previous = version != 0;
+    }
+
+    if (previous != nullptr && version != 0) {
+        std::memcpy(static_cast<void*>(previous), &slot->message, sizeof(message_t));
+    }
+
+    std::memcpy(static_cast<void*>(&slot->message), &message, sizeof(message_t));
+
+    // Numbered while the slot is still held, so two racing updates of a symbol are sequenced in
+    // the order they landed; replicas apply by sequence and must end on the same value.
+    uint64_t sequence = sequence_.fetch_add(1, std::memory_order_acq_rel) + 1;
+    slot->version.store(version + 2, std::memory_order_release);
+
+    return sequence;
+}
+
+void PositionStore::read_slot(const slot_t& slot, message_t& out) {
+
+    while (true) {
+
+        uint64_t before = slot.version.load(std::memory_order_acquire);
+
+        if (before & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        std::memcpy(static_cast<void*>(&out), &slot.message, sizeof(message_t));
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (slot.version.load(std::memory_order_relaxed) == before) {
+            return;
+        }
+    }
+}
+
+bool PositionStore::get(std::string_view symbol, message_t& out) const {
+
+    const slot_t* slot = find(*directory_.load(std::memory_order_acquire), symbol);
+
+    if (slot == nullptr) {
+        return false;
+    }
+
+    read_slot(*slot, out);
+    return true;
+}
+
+// A scan of the whole directory, sorted afterwards so results keep the symbol order they had.
+void PositionStore::get_prefix(std::string_view prefix, std::vector<message_t>& out) const {
+
+    const directory_t& directory = *directory_.load(std::memory_order_acquire);
+    std::vector<const slot_t*> matches;
+
+    for (std::size_t i = 0; i <= directory.mask; ++i) {
+
+        const slot_t* slot = directory.entries[i].load(std::memory_order_acquire);
+
+        if (slot != nullptr && slot->symbol().compare(0, prefix.size(), prefix) == 0) {
+            matches.push_back(slot);
+        }
+    }
+
+    std::sort(matches.begin(), matches.end(), [](const slot_t* a, const slot_t* b) {
+        return a->symbol() < b->symbol();
+    });
+
+    out.reserve(out.size() + matches.size());
+
+    for (const slot_t* slot : matches) {
+        out.emplace_back();
+        read_slot(*slot, out.back());
+    }
+}
+
+void PositionStore::snapshot(std::vector<message_t>& out) const {
+    get_prefix(std::string_view(), out);
+}
+
+std::size_t PositionStore::size() const {
+    return size_.load(std::memory_order_acquire);
+}
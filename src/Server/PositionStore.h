@@ -0,0 +1,71 @@
+#ifndef POSITION_STORE_H
+#define POSITION_STORE_H
+
+#include <array>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "../../include/Message.h"
+
+// Latest position per symbol. Each symbol owns a seqlock-protected slot, found through an
+// open-addressed directory that readers (snapshots and queries) probe without a lock. A new
+// symbol claims an empty entry in place; only when the directory is half full is it rebuilt at
+// twice the size, so filling it costs amortised O(1) per symbol. Retired directories are kept
+// until the store goes, for readers still walking them.
+class PositionStore {
+public:
+    // Sizes the directory for expected_symbols without a rebuild.
+    explicit PositionStore(std::size_t expected_symbols = 1024);
+
+    // Slots for the first `capacity` symbols come from memory (bytes_for(capacity) bytes, 64-byte
+    // aligned, kept alive by the caller) instead of growing on the heap. Call before any update.
+    void reserve(void* memory, std::size_t capacity);
+    static std::size_t bytes_for(std::size_t capacity) { return capacity * sizeof(slot_t); }
+
+    uint64_t update(const message_t& message, message_t* previous = nullptr, bool* had_previous = nullptr);
+    bool get(std::string_view symbol, message_t& out) const;
+    void get_prefix(std::string_view prefix, std::vector<message_t>& out) const;
+    void snapshot(std::vector<message_t>& out) const;
+    std::size_t size() const;
+    uint64_t sequence() const { return sequence_.load(std::memory_order_acquire); }
+    void set_sequence(uint64_t sequence) { sequence_.store(sequence, std::memory_order_release); }
+
+private:
+    struct alignas(64) slot_t {
+        std::atomic<uint64_t> version{0};
+        message_t message;
+        std::array<char, 64> key{};   // the symbol, set before the slot is published and never changed
+        uint8_t key_length = 0;
+
+        std::string_view symbol() const { return std::string_view(key.data(), key_length); }
+    };
+
+    struct directory_t {
+        explicit directory_t(std::size_t capacity);
+
+        std::size_t mask;
+        std::unique_ptr<std::atomic<slot_t*>[]> entries;
+    };
+
+    static const slot_t* find(const directory_t& directory, std::string_view symbol);
+    static void place(directory_t& directory, slot_t* slot);
+    slot_t* find_or_insert(std::string_view symbol);
+    static void read_slot(const slot_t& slot, message_t& out);
+
+    std::atomic<directory_t*> directory_;
+    std::vector<std::unique_ptr<directory_t>> directories_; // the current one last
+    std::atomic<std::size_t> size_;
+    std::mutex directory_mutex_;
+    std::deque<slot_t> slots_;
+    slot_t* reserved_slots_;
+    std::size_t reserved_capacity_;
+    std::size_t reserved_used_;
+    std::atomic<uint64_t> sequence_;
+};
+
+#endif // POSITION_STORE_H
@@ -0,0 +1,207 @@
+#include "PredicateIndex.h"
+#include <cmath>
+#include <mutex>
+
+bool PredicateIndex::add(const std::shared_ptr<Session>& session, std::string_view symbol, uint64_t predicate_id, predicate_type type, uint8_t flags, double lower, double upper) {
+
+    if (type == predicate_type::band && !(lower < upper)) {
+        return false;
+    }
+
+    if (type == predicate_type::rate_of_change && !(upper >= 0.0)) {
+        return false;
+    }
+
+    if (type != predicate_type::threshold && type != predicate_type::band && type != predicate_type::rate_of_change) {
+        return false;
+    }
+
+    auto predicate = std::make_unique<predicate_t>();
+    predicate->session = session;
+    predicate->symbol = std::string(symbol);
+    predicate->predicate_id = predicate_id;
+    predicate->type = type;
+    predicate->flags = (flags & (predicate_rising | predicate_falling)) ? flags : static_cast<uint8_t>(predicate_rising | predicate_falling);
+    predicate->lower = lower;
+    predicate->upper = upper;
+
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+
+    auto existing = registrations_.find({session.get(), predicate_id});
+
+    if (existing != registrations_.end()) {
+        erase(*existing->second);
+        registrations_.erase(existing);
+    }
+
+    auto& index = symbols_[predicate->symbol];
+
+    if (!index) {
+        index = std::make_unique<symbol_index_t>();
+    }
+
+    switch (type) {
+        case predicate_type::threshold:
+            index->levels.emplace(upper, predicate.get());
+            break;
+        case predicate_type::band:
+            index->levels.emplace(lower, predicate.get());
+            index->levels.emplace(upper, predicate.get());
+            break;
+        case predicate_type::rate_of_change:
+            index->rates.emplace(upper, predicate.get());
+            break;
+    }
+
+    registrations_[{session.get(), predicate_id}] = std::move(predicate);
+    return true;
+}
+
+void PredicateIndex::erase_entry(std::multimap<double, const predicate_t*>& entries, double key, const predicate_t* predicate) {
+
+    auto range = entries.equal_range(key);
+
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == predicate) {
+            entries.erase(it);
+            return;
+        }
+    }
+}
+
+void PredicateIndex::erase(const predicate_t& predicate) {
+
+    auto it = symbols_.find(predicate.symbol);
+
+    if (it == symbols_.end()) {
+        return;
+    }
+
+    switch (predicate.type) {
+        case predicate_type::threshold:
+            erase_entry(it->second->levels, predicate.upper, &predicate);
+            break;
+        case predicate_type::band:
+            erase_entry(it->second->levels, predicate.lower, &predicate);
+            erase_entry(it->second->levels, predicate.upper, &predicate);
+            break;
+        case predicate_type::rate_of_change:
+            erase_entry(it->second->rates, predicate.upper, &predicate);
+            break;
+    }
+
+    if (it->second->levels.empty() && it->second->rates.empty()) {
+        symbols_.erase(it);
+    }
+}
+
+void PredicateIndex::remove(const Session* session, uint64_t predicate_id) {
+
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+
+    auto it = registrations_.find({session, predicate_id});
+
+    if (it != registrations_.end()) {
+        erase(*it->second);
+        registrations_.erase(it);
+    }
+}
+
+void PredicateIndex::remove_all(const Session* session) {
+
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+
+    for (auto it = registrations_.begin(); it != registrations_.end();) {
+        if (it->first.first == session) {
+            erase(*it->second);
+            it = registrations_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void PredicateIndex::export_session(const Session* session, std::vector<message_t>& out) const {
+
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+
+    for (const auto& registration : registrations_) {
+
+        if (registration.first.first != session) {
+            continue;
+        }
+
+        const predicate_t& predicate = *registration.second;
+
+        control_t request;
+        request.kind = static_cast<uint8_t>(control_kind::predicate_subscribe);
+        request.type = static_cast<uint8_t>(predicate.type);
+        request.flags = predicate.flags;
+        request.count = 1;
+        request.request_id = predicate.predicate_id;
+        request.lower = predicate.lower;
+        request.upper = predicate.upper;
+
+        out.push_back(to_record(request));
+        out.push_back(symbol_record(predicate.symbol));
+    }
+}
+
+void PredicateIndex::evaluate(std::string_view symbol, bool had_previous, double previous, double current, int64_t now_ns, std::vector<trigger_t>& out) const {
+
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+
+    auto it = symbols_.find(symbol);
+
+    if (it == symbols_.end()) {
+        return;
+    }
+
+    const symbol_index_t& index = *it->second;
+    int64_t last_ns = index.last_update_ns.exchange(now_ns, std::memory_order_acq_rel);
+
+    if (!had_previous || current == previous) {
+        return;
+    }
+
+    bool rising = current > previous;
+    uint8_t direction = rising ? predicate_rising : predicate_falling;
+
+    // Levels crossed moving up are in (previous, current]; moving down, in (current, previous].
+    auto first = index.levels.upper_bound(rising ? previous : current);
+    auto last = index.levels.upper_bound(rising ? current : previous);
+
+    for (auto level = first; level != last; ++level) {
+
+        const predicate_t& predicate = *level->second;
+
+        if (predicate.type == predicate_type::band) {
+            bool exit = (level->first == predicate.upper) == rising;
+            out.push_back({predicate.session, predicate.predicate_id, predicate.type, static_cast<uint8_t>(direction | (exit ? predicate_band_exit : 0)), level->first, current});
+        } else if (predicate.flags & direction) {
+            out.push_back({predicate.session, predicate.predicate_id, predicate.type, direction, level->first, current});
+        }
+    }
+
+    if (index.rates.empty() || last_ns == 0 || now_ns <= last_ns) {
+        return;
+    }
+
+    double rate = std::fabs(current - previous) / (static_cast<double>(now_ns - last_ns) / 1e9);
+    auto rate_end = index.rates.lower_bound(rate);
+
+    for (auto limit = index.rates.begin(); limit != rate_end; ++limit) {
+
+        const predicate_t& predicate = *limit->second;
+
+        if (predicate.flags & direction) {
+            out.push_back({predicate.session, predicate.predicate_id, predicate.type, direction, limit->first, rate});
+        }
+    }
+}
+
+std::size_t PredicateIndex::size() const {
+
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return registrations_.size();
+}
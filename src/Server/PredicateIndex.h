@@ -0,0 +1,75 @@
+#ifndef PREDICATE_INDEX_H
+#define PREDICATE_INDEX_H
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "../../include/Protocol.h"
+
+class Session;
+
+// Standing predicates registered by sessions, indexed per symbol so an update only
+// touches the predicates it actually trips. Threshold and band edges live in one
+// sorted map keyed by level (a move from old to new is a range scan over the levels
+// in between); rate predicates are sorted by limit so every limit below the observed
+// rate is a prefix of the map. Both cost O(log n + triggered).
+class PredicateIndex {
+public:
+    struct trigger_t {
+        std::shared_ptr<Session> session;
+        uint64_t predicate_id;
+        predicate_type type;
+        uint8_t direction;
+        double level;
+        double observed;
+    };
+
+    bool add(const std::shared_ptr<Session>& session, std::string_view symbol, uint64_t predicate_id, predicate_type type, uint8_t flags, double lower, double upper);
+    void remove(const Session* session, uint64_t predicate_id);
+    void remove_all(const Session* session);
+
+    // Appends a session's predicates as the predicate_subscribe records (control plus symbol)
+    // that would register them again, e.g. on a server taking the session over.
+    void export_session(const Session* session, std::vector<message_t>& out) const;
+    void evaluate(std::string_view symbol, bool had_previous, double previous, double current, int64_t now_ns, std::vector<trigger_t>& out) const;
+    std::size_t size() const;
+
+private:
+    struct predicate_t {
+        std::shared_ptr<Session> session;
+        std::string symbol;
+        uint64_t predicate_id;
+        predicate_type type;
+        uint8_t flags;
+        double lower;
+        double upper;
+    };
+
+    struct symbol_index_t {
+        std::multimap<double, const predicate_t*> levels;
+        std::multimap<double, const predicate_t*> rates;
+        mutable std::atomic<int64_t> last_update_ns{0};
+    };
+
+    using owner_key_t = std::pair<const Session*, uint64_t>;
+
+    struct owner_key_hash {
+        std::size_t operator()(const owner_key_t& key) const {
+            return std::hash<const void*>()(key.first) ^ (std::hash<uint64_t>()(key.second) << 1);
+        }
+    };
+
+    void erase(const predicate_t& predicate);
+    static void erase_entry(std::multimap<double, const predicate_t*>& entries, double key, const predicate_t* predicate);
+
+    mutable std::shared_mutex mutex_;
+    std::map<std::string, std::unique_ptr<symbol_index_t>, std::less<>> symbols_;
+    std::unordered_map<owner_key_t, std::unique_ptr<predicate_t>, owner_key_hash> registrations_;
+};
+
+#endif // PREDICATE_INDEX_H
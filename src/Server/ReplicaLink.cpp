@@ -0,0 +1,432 @@
+#include "ReplicaLink.h"
+#include "PositionServer.h"
+#include "../../include/Clock.h"
+#include "../../include/Common.h"
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+
+// Snapshots carry one record per symbol, so this bounds the symbol count a replica accepts.
+static constexpr uint32_t max_replication_payload = 1u << 20;
+
+// Batches remembered for the latency percentiles.
+static constexpr std::size_t latency_window = 4096;
+
+// Forwarded updates kept until they come back from the primary. Past this the oldest are
+// given up on, since a primary that has not echoed that many has dropped the link long ago.
+static constexpr std::size_t max_unacknowledged = 65536;
+
+ReplicaLink::ReplicaLink(boost::asio::io_context& io_context, PositionServer& server, const std::string& host, short port, std::chrono::milliseconds promote_after)
+    : io_context_(io_context), server_(server), host_(host), port_(port), promote_after_(promote_after),
+      socket_(io_context), retry_timer_(io_context), liveness_timer_(io_context), heard_(false), disconnected_since_(std::chrono::steady_clock::now()),
+      pending_records_(0), write_scheduled_(false), stopped_(false), connected_(false),
+      applied_sequence_(0), primary_sequence_(0), lag_ns_(0), next_sample_(0) {
+
+    pending_writes_.reserve(256);
+    in_flight_.reserve(256);
+    hop_samples_.reserve(latency_window);
+    origin_samples_.reserve(latency_window);
+}
+
+void ReplicaLink::start() {
+
+    {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        stopped_ = false;
+    }
+
+    boost::asio::post(io_context_, [this]() { connect(); });
+}
+
+void ReplicaLink::stop() {
+
+    {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        stopped_ = true;
+    }
+
+    boost::asio::post(io_context_, [this]() {
+        boost::system::error_code ignore;
+        retry_timer_.cancel();
+        liveness_timer_.cancel();
+        socket_.close(ignore);
+        connected_ = false;
+    });
+}
+
+void ReplicaLink::connect() {
+
+    if (stopped_) {
+        return;
+    }
+
+    boost::system::error_code ec;
+    tcp::resolver resolver(io_context_);
+    auto endpoints = resolver.resolve(host_, std::to_string(port_), ec);
+
+    if (ec) {
+        handle_error(ec);
+        return;
+    }
+
+    boost::asio::async_connect(socket_, endpoints, [this](boost::system::error_code ec, const tcp::endpoint& /*endpoint*/) {
+        if (ec) {
+            handle_error(ec);
+            return;
+        }
+
+        boost::system::error_code ignore;
+        socket_.set_option(tcp::no_delay(true), ignore);
+
+        // Resume right after the last applied sequence; a primary that no longer has it sends a snapshot.
+        control_t subscribe;
+        subscribe.kind = static_cast<uint8_t>(control_kind::replication_subscribe);
+        subscribe.sequence = applied_sequence_ == 0 ? 0 : applied_sequence_ + 1;
+        subscribe_record_ = to_record(subscribe);
+        pending_records_ = 0;
+
+        boost::asio::async_write(socket_, boost::asio::buffer(&subscribe_record_, sizeof(message_t)), [this](boost::system::error_code ec, std::size_t /*length*/) {
+            if (ec) {
+                handle_error(ec);
+                return;
+            }
+
+            connected_ = true;
+            heard_ = true;
+            watch_liveness();
+
+            {
+                std::lock_guard<std::mutex> lock(print_mutex);
+                std::cout << "Replicating from " << host_ << ":" << port_ << " starting after sequence " << applied_sequence_ << std::endl;
+            }
+
+            read_next();
+
+            {
+                std::lock_guard<std::mutex> lock(write_mutex_);
+
+                if (write_scheduled_) {
+                    return;
+                }
+
+                write_scheduled_ = true;
+            }
+
+            do_write();
+        });
+    });
+}
+
+void ReplicaLink::read_next() {
+
+    boost::asio::async_read(socket_, boost::asio::buffer(&read_buffer_, sizeof(message_t)), [this](boost::system::error_code ec, std::size_t /*length*/) {
+        if (ec) {
+            handle_error(ec);
+            return;
+        }
+
+        heard_ = true;
+        handle_record();
+
+        if (socket_.is_open()) {
+            read_next();
+        }
+    });
+}
+
+void ReplicaLink::handle_record() {
+
+    if (pending_records_ > 0) {
+
+        payload_.push_back(read_buffer_);
+
+        if (--pending_records_ == 0) {
+            apply_batch();
+        }
+
+        return;
+    }
+
+    if (!is_control(read_buffer_)) {
+        return;
+    }
+
+    pending_control_ = to_control(read_buffer_);
+    payload_.clear();
+
+    if (pending_control_.count > max_replication_payload) {
+        handle_error(boost::asio::error::message_size);
+        return;
+    }
+
+    pending_records_ = pending_control_.count;
+
+    if (pending_records_ == 0) {
+        apply_batch();
+    }
+}
+
+void ReplicaLink::apply_batch() {
+
+    switch (static_cast<control_kind>(pending_control_.kind)) {
+        case control_kind::replication_snapshot:
+            server_.apply_replicated_snapshot(payload_, pending_control_.sequence);
+            acknowledge(payload_, true);
+            applied_sequence_ = pending_control_.sequence;
+            primary_sequence_ = pending_control_.request_id;
+            break;
+        case control_kind::replication_batch: {
+
+            uint64_t sequence = pending_control_.sequence;
+            int64_t upstream_ns = static_cast<int64_t>(pending_control_.lower * 1e9);
+            int64_t origin_ns = static_cast<int64_t>(pending_control_.upper * 1e9);
+
+            if (sequence > applied_sequence_ + 1) {
+                {
+                    std::lock_guard<std::mutex> lock(print_mutex);
+                    std::cerr << "Replication gap: expected sequence " << applied_sequence_ + 1 << ", got " << sequence << ". Resubscribing." << std::endl;
+                }
+
+                handle_error(boost::asio::error::connection_aborted);
+                return;
+            }
+
+            for (const auto& update : payload_) {
+
+                if (sequence > applied_sequence_) {
+                    server_.apply_replicated(update, sequence, origin_ns);
+                    applied_sequence_ = sequence;
+                }
+
+                ++sequence;
+            }
+
+            acknowledge(payload_, false);
+            primary_sequence_ = std::max<uint64_t>(pending_control_.request_id, applied_sequence_);
+
+            int64_t now_ns = Clock::now_ns();
+            lag_ns_ = std::max<int64_t>(0, now_ns - upstream_ns);
+            record_latency(now_ns - upstream_ns, now_ns - origin_ns);
+            break;
+        }
+        case control_kind::heartbeat:
+            forward(to_record(pending_control_));
+            break;
+        default:
+            break;
+    }
+}
+
+void ReplicaLink::handle_error(const boost::system::error_code& ec) {
+
+    bool was_connected = connected_.exchange(false);
+
+    boost::system::error_code ignore;
+    liveness_timer_.cancel();
+    socket_.close(ignore);
+
+    if (stopped_) {
+        return;
+    }
+
+    if (was_connected) {
+        disconnected_since_ = std::chrono::steady_clock::now();
+
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cerr << "Lost primary " << host_ << ":" << port_ << ": " << ec.message() << std::endl;
+    }
+
+    schedule_retry();
+}
+
+void ReplicaLink::schedule_retry() {
+
+    retry_timer_.expires_after(std::chrono::milliseconds(250));
+    retry_timer_.async_wait([this](boost::system::error_code ec) {
+        if (ec || stopped_) {
+            return;
+        }
+
+        if (promote_after_.count() > 0 && std::chrono::steady_clock::now() - disconnected_since_ >= promote_after_) {
+            server_.promote();
+            return;
+        }
+
+        connect();
+    });
+}
+
+// Each period must have seen at least one record from the primary.
+void ReplicaLink::watch_liveness() {
+
+    std::chrono::milliseconds limit = server_.config_.idle_timeout;
+
+    if (limit.count() == 0) {
+        return;
+    }
+
+    liveness_timer_.expires_after(limit);
+    liveness_timer_.async_wait([this](boost::system::error_code ec) {
+        if (ec || stopped_ || !connected_) {
+            return;
+        }
+
+        if (!heard_) {
+            handle_error(boost::asio::error::timed_out);
+            return;
+        }
+
+        heard_ = false;
+        watch_liveness();
+    });
+}
+
+bool ReplicaLink::forward(const message_t& message) {
+
+    {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+
+        if (stopped_) {
+            return false;
+        }
+
+        pending_writes_.push_back(message);
+
+        if (write_scheduled_ || !connected_) {
+            return true;
+        }
+
+        write_scheduled_ = true;
+    }
+
+    boost::asio::post(io_context_, [this]() { do_write(); });
+    return true;
+}
+
+void ReplicaLink::take_forwarded(std::vector<message_t>& out) {
+
+    std::lock_guard<std::mutex> lock(write_mutex_);
+
+    // Heartbeat answers share the queue but are not updates.
+    out.insert(out.end(), unacknowledged_.begin(), unacknowledged_.end());
+    std::copy_if(in_flight_.begin(), in_flight_.end(), std::back_inserter(out), [](const message_t& message) { return !is_control(message); });
+    std::copy_if(pending_writes_.begin(), pending_writes_.end(), std::back_inserter(out), [](const message_t& message) { return !is_control(message); });
+    unacknowledged_.clear();
+    pending_writes_.clear();
+}
+
+// An update on the stream matches a forwarded one by symbol and client timestamp. A snapshot
+// only holds each symbol's latest value, so there any forwarded update it is at least as new as
+// counts as applied or superseded.
+void ReplicaLink::acknowledge(const std::vector<message_t>& updates, bool snapshot) {
+
+    std::lock_guard<std::mutex> lock(write_mutex_);
+
+    for (const auto& update : updates) {
+
+        if (unacknowledged_.empty()) {
+            return;
+        }
+
+        for (auto it = unacknowledged_.begin(); it != unacknowledged_.end();) {
+
+            bool covered = snapshot ? update.timestamp_ns >= it->timestamp_ns : update.timestamp_ns == it->timestamp_ns;
+
+            if (!covered || symbol_of(update) != symbol_of(*it)) {
+                ++it;
+                continue;
+            }
+
+            it = unacknowledged_.erase(it);
+
+            if (!snapshot) {
+                break;
+            }
+        }
+    }
+}
+
+void ReplicaLink::do_write() {
+
+    {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+
+        if (pending_writes_.empty() || !connected_ || stopped_) {
+            write_scheduled_ = false;
+            return;
+        }
+
+        in_flight_.swap(pending_writes_);
+    }
+
+    boost::asio::async_write(socket_, boost::asio::buffer(in_flight_.data(), in_flight_.size() * sizeof(message_t)), [this](boost::system::error_code ec, std::size_t /*length*/) {
+
+        {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+
+            if (ec) {
+                // Keep the batch so it is resent (or applied locally on promotion).
+                pending_writes_.insert(pending_writes_.begin(), in_flight_.begin(), in_flight_.end());
+                in_flight_.clear();
+                write_scheduled_ = false;
+                return;
+            }
+
+            // Written is not applied: the primary may die before sequencing them, so they stay
+            // until the stream brings them back.
+            for (const auto& message : in_flight_) {
+                if (!is_control(message)) {
+                    unacknowledged_.push_back(message);
+                }
+            }
+
+            while (unacknowledged_.size() > max_unacknowledged) {
+                unacknowledged_.pop_front();
+            }
+
+            in_flight_.clear();
+        }
+
+        do_write();
+    });
+}
+
+void ReplicaLink::record_latency(int64_t hop_ns, int64_t origin_ns) {
+
+    std::lock_guard<std::mutex> lock(latency_mutex_);
+
+    if (hop_samples_.size() < latency_window) {
+        hop_samples_.push_back(hop_ns);
+        origin_samples_.push_back(origin_ns);
+        return;
+    }
+
+    hop_samples_[next_sample_] = hop_ns;
+    origin_samples_[next_sample_] = origin_ns;
+    next_sample_ = (next_sample_ + 1) % latency_window;
+}
+
+static double percentile_ms(std::vector<int64_t> samples, double fraction) {
+
+    if (samples.empty()) {
+        return 0.0;
+    }
+
+    auto nth = samples.begin() + static_cast<std::ptrdiff_t>(fraction * (samples.size() - 1));
+    std::nth_element(samples.begin(), nth, samples.end());
+    return *nth / 1e6;
+}
+
+ReplicaLink::latency_summary_t ReplicaLink::latency_summary() const {
+
+    std::vector<int64_t> hop;
+    std::vector<int64_t> origin;
+
+    {
+        std::lock_guard<std::mutex> lock(latency_mutex_);
+        hop = hop_samples_;
+        origin = origin_samples_;
+    }
+
+    return latency_summary_t{hop.size(), percentile_ms(hop, 0.5), percentile_ms(hop, 0.99), percentile_ms(origin, 0.5), percentile_ms(origin, 0.99)};
+}
@@ -0,0 +1,102 @@
+#ifndef REPLICA_LINK_H
+#define REPLICA_LINK_H
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "../../include/Message.h"
+#include "../../include/Protocol.h"
+
+using boost::asio::ip::tcp;
+
+class PositionServer;
+
+// A replica's connection to its primary. It subscribes from the next sequence it needs,
+// applies snapshots and ordered batches to the local server, and forwards the updates its
+// own clients send so they are sequenced by the primary. While the primary is unreachable it
+// retries, and after promote_after (if set) promotes the local server instead.
+// Every batch also yields two latency samples: from the upstream server ingesting its first
+// update to this server applying it (one hop), and from the origin ingesting it (whole chain).
+// The primary heartbeats a quiet link, so a connection that stays silent for the server's
+// idle_timeout is treated as lost even if TCP has not noticed.
+class ReplicaLink {
+public:
+    struct latency_summary_t {
+        std::size_t samples;
+        double hop_p50_ms;
+        double hop_p99_ms;
+        double origin_p50_ms;
+        double origin_p99_ms;
+    };
+
+    ReplicaLink(boost::asio::io_context& io_context, PositionServer& server, const std::string& host, short port, std::chrono::milliseconds promote_after);
+
+    void start();
+    void stop();
+
+    // Continues after `sequence` instead of starting with a snapshot (a hot restart's successor).
+    void resume_after(uint64_t sequence) { applied_sequence_ = sequence; }
+
+    // Queues a client update for the primary. Returns false once the link has been stopped.
+    bool forward(const message_t& message);
+
+    // Hands back forwarded updates that have not come back on the replication stream: the
+    // primary may never have received or sequenced them (used on promotion).
+    void take_forwarded(std::vector<message_t>& out);
+
+    bool connected() const { return connected_.load(std::memory_order_relaxed); }
+    uint64_t applied_sequence() const { return applied_sequence_.load(std::memory_order_relaxed); }
+    uint64_t primary_sequence() const { return primary_sequence_.load(std::memory_order_relaxed); }
+    double lag_seconds() const { return lag_ns_.load(std::memory_order_relaxed) / 1e9; }
+
+    // Percentiles over the most recent batches.
+    latency_summary_t latency_summary() const;
+
+private:
+    void connect();
+    void read_next();
+    void handle_record();
+    void apply_batch();
+    void handle_error(const boost::system::error_code& ec);
+    void schedule_retry();
+    void watch_liveness();
+    void do_write();
+    void acknowledge(const std::vector<message_t>& updates, bool snapshot);
+    void record_latency(int64_t hop_ns, int64_t origin_ns);
+
+    boost::asio::io_context& io_context_;
+    PositionServer& server_;
+    std::string host_;
+    short port_;
+    std::chrono::milliseconds promote_after_;
+    tcp::socket socket_;
+    boost::asio::steady_timer retry_timer_;
+    boost::asio::steady_timer liveness_timer_;
+    bool heard_;
+    std::chrono::steady_clock::time_point disconnected_since_;
+    message_t read_buffer_;
+    message_t subscribe_record_;
+    control_t pending_control_;
+    uint32_t pending_records_;
+    std::vector<message_t> payload_;
+    std::mutex write_mutex_;
+    std::vector<message_t> pending_writes_;
+    std::vector<message_t> in_flight_;
+    std::deque<message_t> unacknowledged_; // written to the primary, not yet seen on the stream
+    bool write_scheduled_;
+    std::atomic<bool> stopped_;
+    std::atomic<bool> connected_;
+    std::atomic<uint64_t> applied_sequence_;
+    std::atomic<uint64_t> primary_sequence_;
+    std::atomic<int64_t> lag_ns_;
+    mutable std::mutex latency_mutex_;
+    std::vector<int64_t> hop_samples_;
+    std::vector<int64_t> origin_samples_;
+    std::size_t next_sample_;
+};
+
+#endif // REPLICA_LINK_H
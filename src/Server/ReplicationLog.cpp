@@ -0,0 +1,72 @@
+#include "ReplicationLog.h"
+#include <cstring>
+#include <new>
+
+ReplicationLog::ReplicationLog(std::size_t capacity, void* memory)
+    : capacity_(capacity), owned_slots_(memory == nullptr ? new slot_t[capacity] : nullptr),
+      slots_(memory == nullptr ? owned_slots_.get() : static_cast<slot_t*>(memory)) {
+
+    if (memory != nullptr) {
+        for (std::size_t i = 0; i < capacity; ++i) {
+            new (&slots_[i]) slot_t();
+        }
+    }
+}
+
+// A slot's sequence is zero while it is being rewritten, so a reader never mistakes a
+// half-copied message for a published one.
+void ReplicationLog::append(uint64_t sequence, const message_t& message, const entry_times_t& times) {
+
+    slot_t& slot = slots_[sequence % capacity_];
+
+    slot.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(static_cast<void*>(&slot.message), &message, sizeof(message_t));
+    slot.times = times;
+    slot.sequence.store(sequence, std::memory_order_release);
+}
+
+bool ReplicationLog::read(uint64_t from, std::size_t max_records, std::vector<message_t>& out, std::size_t& copied, entry_times_t* first) const {
+
+    copied = 0;
+
+    if (from == 0) {
+        return false;
+    }
+
+    for (uint64_t sequence = from; copied < max_records; ++sequence) {
+
+        const slot_t& slot = slots_[sequence % capacity_];
+        uint64_t published = slot.sequence.load(std::memory_order_acquire);
+
+        if (published != sequence) {
+            // Newer than wanted means the entry was overwritten; older or zero means not yet written.
+            return published < sequence || copied > 0;
+        }
+
+        out.emplace_back();
+        std::memcpy(static_cast<void*>(&out.back()), &slot.message, sizeof(message_t));
+        entry_times_t times = slot.times;
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (slot.sequence.load(std::memory_order_relaxed) != sequence) {
+            out.pop_back();
+            return copied > 0;
+        }
+
+        if (copied == 0 && first) {
+            *first = times;
+        }
+
+        ++copied;
+    }
+
+    return true;
+}
+
+void ReplicationLog::reset() {
+
+    for (std::size_t i = 0; i < capacity_; ++i) {
+        slots_[i].sequence.store(0, std::memory_order_release);
+    }
+}
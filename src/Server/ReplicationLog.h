@@ -0,0 +1,51 @@
+#ifndef REPLICATION_LOG_H
+#define REPLICATION_LOG_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "../../include/Message.h"
+
+// The most recent updates indexed by store sequence number, so replicas can be fed an
+// ordered, gap-free stream and resume from where they left off after a reconnect. Ingest
+// threads publish slots in whatever order the store handed out sequences; readers copy
+// forward from their cursor and stop at the first slot that is not yet published.
+class ReplicationLog {
+public:
+    // Wall-clock times kept with each entry: when this server ingested it and when the
+    // origin server (the first in a chain of replicas or relays) did.
+    struct entry_times_t {
+        int64_t ingest_ns;
+        int64_t origin_ns;
+    };
+
+    // The slots live in memory when given (bytes_for(capacity) bytes, 64-byte aligned, kept alive
+    // by the caller), otherwise on the heap.
+    explicit ReplicationLog(std::size_t capacity = 16384, void* memory = nullptr);
+    static std::size_t bytes_for(std::size_t capacity) { return capacity * sizeof(slot_t); }
+
+    void append(uint64_t sequence, const message_t& message, const entry_times_t& times);
+
+    // Appends up to max_records updates starting at sequence `from` to out and returns how many
+    // were copied, with the times of the first one in `first` when given. Returns false when
+    // `from` has already been overwritten (the reader fell more than capacity behind and needs
+    // a snapshot instead).
+    bool read(uint64_t from, std::size_t max_records, std::vector<message_t>& out, std::size_t& copied, entry_times_t* first = nullptr) const;
+
+    // Forgets every entry, for when the sequence space restarts from a snapshot.
+    void reset();
+
+private:
+    struct alignas(64) slot_t {
+        std::atomic<uint64_t> sequence{0};
+        entry_times_t times;
+        message_t message;
+    };
+
+    std::size_t capacity_;
+    std::unique_ptr<slot_t[]> owned_slots_;
+    slot_t* slots_;
+};
+
+#endif // REPLICATION_LOG_H
@@ -0,0 +1,56 @@
+#ifndef SERVER_CONFIG_H
+#define SERVER_CONFIG_H
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "../../include/ThreadTuning.h"
+#include "../../include/Tls.h"
+#include "IngestBudget.h"
+
+// Run-time settings for PositionServer. The defaults keep the original server's threads (one
+// blocking I/O thread, two blocking dispatch threads) with an hour of history. Unlike the
+// original, connection liveness is on by default: the handshake, heartbeat, idle and
+// write-stall timeouts below each need setting to 0 to turn them off.
+struct ServerConfig {
+    short port = 12345;
+    std::size_t io_threads = 1;
+    std::size_t dispatch_threads = 2;
+    wait_mode mode = wait_mode::blocking;
+    std::vector<int> io_cpus;          // io_cpus[i] pins I/O thread i; missing entries stay unpinned
+    std::vector<int> dispatch_cpus;    // likewise for dispatch threads
+    int busy_poll_usec = 50;           // SO_BUSY_POLL applied to sessions in busy_poll mode
+    std::chrono::nanoseconds history_retention = std::chrono::hours(1);
+    std::string replica_of_host;                       // primary to replicate from when replica_of_port is set
+    short replica_of_port = 0;                         // 0 runs as a primary
+    std::chrono::milliseconds promote_after{0};        // promote a replica after losing its primary this long; 0 never
+    std::size_t replication_log_capacity = 16384;      // updates a replica can fall behind before needing a snapshot
+    std::vector<std::string> replica_peers;           // addresses allowed to subscribe to replication; empty allows none
+    bool relay = false;                                // follow replica_of as a fan-out relay (never promotes)
+    bool conflate_broadcasts = false;                  // replace queued broadcasts of a symbol instead of queueing more
+    std::string handoff_path;                          // Unix socket a successor connects to for a hot restart
+    std::string takeover_path;                         // take over a running server's sockets from its handoff_path
+    std::chrono::milliseconds timer_tick{100};         // resolution of the per-I/O-thread timer wheels
+    std::chrono::milliseconds handshake_timeout{5000}; // close connections that do not identify in time; 0 never
+    std::chrono::milliseconds heartbeat_interval{2000}; // heartbeat a connection quiet in either direction this long; 0 never
+    std::chrono::milliseconds idle_timeout{10000};     // reap sessions (and drop primaries) silent this long; 0 never
+    std::chrono::milliseconds write_stall_timeout{10000}; // reap sessions whose write has not completed in this long; 0 never
+    bool kernel_timestamps = false;                    // stamp each update with its SO_TIMESTAMPNS receive time (Linux)
+    std::string capture_path;                          // record inbound updates to this capture file for replay
+    std::size_t ingest_buffer_bytes = 65536;           // per-session read buffer; each read decodes every whole record in it
+    double ingest_updates_per_second = 0;              // per-publisher update budget; 0 unlimited
+    double ingest_bytes_per_second = 0;                // per-publisher inbound byte budget, control records included; 0 unlimited
+    std::chrono::milliseconds ingest_burst{250};       // how far a publisher may run ahead of its budget, as time at that rate
+    budget_policy ingest_policy = budget_policy::conflate; // what happens to updates over the budget
+    std::size_t ingest_hold_limit = 8192;              // updates the delay policy holds before the session stops reading
+    tls_options_t tls;                                 // TLS on client sessions (replica links stay plaintext)
+    short metrics_port = 0;                            // serve Prometheus metrics on this loopback port; 0 off
+    std::string metrics_path;                          // ... or on this Unix socket
+    bool preallocate = false;                          // carve the store, replication log and session buffers from one locked huge-page arena
+    std::size_t max_sessions = 256;                    // sessions the arena holds buffers for; more get heap buffers
+    std::size_t max_symbols = 65536;                   // symbols the arena holds store slots for; more go on the heap
+    std::size_t session_queue_records = 512;           // records a session's write queue holds in the arena before it spills to the heap
+};
+
+#endif // SERVER_CONFIG_H
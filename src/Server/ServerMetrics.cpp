@@ -0,0 +1,46 @@
+#include "ServerMetrics.h"
+
+// Metrics objects are told apart by id rather than address, so a thread's cached slot is never
+// taken for one in a later server built at the same address (a hot restart in place).
+static std::atomic<uint64_t> next_metrics_id{1};
+
+struct cached_slot_t {
+    uint64_t owner = 0;
+    void* slot = nullptr;
+};
+
+static thread_local cached_slot_t cached_slot;
+
+ServerMetrics::ServerMetrics() : id_(next_metrics_id++), next_slot_(0) {
+
+    for (auto& slot : slots_) {
+        for (auto& value : slot.values) {
+            value.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+uint64_t ServerMetrics::total(server_counter counter) const {
+
+    uint64_t sum = 0;
+
+    for (const auto& slot : slots_) {
+        sum += slot.values[static_cast<std::size_t>(counter)].load(std::memory_order_relaxed);
+    }
+
+    return sum;
+}
+
+ServerMetrics::slot_t& ServerMetrics::local_slot() {
+
+    if (cached_slot.owner == id_) {
+        return *static_cast<slot_t*>(cached_slot.slot);
+    }
+
+    std::size_t index = next_slot_.fetch_add(1, std::memory_order_relaxed);
+    slot_t& slot = slots_[index < max_slots ? index : max_slots];
+
+    cached_slot.owner = id_;
+    cached_slot.slot = &slot;
+    return slot;
+}
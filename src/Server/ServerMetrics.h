@@ -0,0 +1,59 @@
+#ifndef SERVER_METRICS_H
+#define SERVER_METRICS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Event counters the server keeps for its metrics endpoint.
+enum class server_counter : std::size_t {
+    accepted,           // connections taken off the listen backlog
+    rejected,           // refused at identification (client ID already connected, or mid-handoff)
+    closed,             // sessions removed
+    updates_in,         // updates ingested, from sessions, replicas and in-process publishers
+    updates_out,        // broadcasts queued to sessions, one per recipient
+    enqueued,           // updates put on the broadcast queue
+    dequeued,           // updates taken off it by the dispatchers
+    bytes_in,           // bytes read from client sockets
+    bytes_out,          // bytes written to client sockets
+    count
+};
+
+// Counters split into one cache-line-aligned slot per thread. A thread claims a slot the first
+// time it counts and is its only writer, so counting is a plain load and store to a line no other
+// thread writes; threads beyond the last slot share an overflow slot with atomic adds. Totals are
+// summed over the slots only when read, which only a scrape does.
+class ServerMetrics {
+public:
+    ServerMetrics();
+
+    void add(server_counter counter, uint64_t amount = 1) {
+
+        slot_t& slot = local_slot();
+        std::atomic<uint64_t>& value = slot.values[static_cast<std::size_t>(counter)];
+
+        if (&slot == &slots_[max_slots]) {
+            value.fetch_add(amount, std::memory_order_relaxed);
+        } else {
+            value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t total(server_counter counter) const;
+
+private:
+    static constexpr std::size_t max_slots = 63;
+    static constexpr std::size_t counter_count = static_cast<std::size_t>(server_counter::count);
+
+    struct alignas(64) slot_t {
+        std::atomic<uint64_t> values[counter_count];
+    };
+
+    slot_t& local_slot();
+
+    uint64_t id_;
+    std::atomic<std::size_t> next_slot_;
+    slot_t slots_[max_slots + 1];
+};
+
+#endif // SERVER_METRICS_H
@@ -0,0 +1,1151 @@
+#include "Session.h"
+#include "PositionServer.h"
+#include "../../include/Clock.h"
+#include "../../include/Common.h"
+#include "../../include/Probes.h"
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <iostream>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <sys/socket.h>
+#endif
+
+// Updates shipped to a replica per replication_batch record.
+static constexpr std::size_t max_replication_batch = 512;
+
+// Open-addressed symbol -> queued record table used for conflation. Symbols that do not find a
+// slot within conflation_max_probe steps are simply queued.
+static constexpr std::size_t conflation_table_size = 1024;
+static constexpr std::size_t conflation_max_probe = 8;
+
+// Outbound buffers are sized up front so a session's queue only grows past this under backlog.
+static constexpr std::size_t initial_write_capacity = 256;
+
+static std::atomic<uint32_t> next_session_id{1};
+
+// The record layer is reported once, for the first TLS session, unless debug logs are on.
+static std::atomic<bool> record_layer_reported{false};
+
+Session::Session(tcp::socket socket, boost::asio::io_context& io_context, TimerWheel& wheel, PositionServer& server, SlabPool* slabs)
+    : socket_(std::move(socket)), io_context_(io_context), wheel_(wheel), server_(server), id_(next_session_id++), memory_(slabs),
+      pending_writes_(&memory_), priority_writes_(&memory_), in_flight_(&memory_), in_flight_bytes_(0), in_flight_records_(0), write_scheduled_(false), wants_broadcasts_(true), pending_records_(0), encoding_(stream_encoding::plain), replica_(false), replica_cursor_(0), replica_sent_(0), replication_scheduled_(false), conflation_slots_(&memory_), conflated_(0),
+      identified_(false), read_active_(false), write_active_(false), suspending_(false), read_partial_(0), ingest_capacity_(std::max(server.config_.ingest_buffer_bytes, 2 * sizeof(message_t))), ingest_buffer_(&memory_), ingest_batch_(&memory_), read_paused_(false), receive_timestamps_(false), read_stamp_(0),
+      timer_due_(0), started_tick_(0), last_read_tick_(0), last_write_tick_(0), write_started_tick_(0), last_heartbeat_tick_(0) {
+
+    // A preallocated session reserves all three write buffers at the planned size, since they trade
+    // places as writes go out, and never grows its decode batch past one full read.
+    if (server_.config_.preallocate) {
+        pending_writes_.reserve(server_.config_.session_queue_records);
+        priority_writes_.reserve(server_.config_.session_queue_records);
+        in_flight_.reserve(server_.config_.session_queue_records);
+        ingest_batch_.reserve(ingest_capacity_ / sizeof(message_t));
+    } else {
+        pending_writes_.reserve(initial_write_capacity);
+        in_flight_.reserve(initial_write_capacity);
+    }
+
+    frame_.reserve(initial_write_capacity * sizeof(message_t));
+    pending_payload_.reserve(16);
+
+    if (server_.config_.conflate_broadcasts) {
+        conflation_slots_.assign(conflation_table_size, 0);
+    }
+
+    const ServerConfig& config = server_.config_;
+    budget_.configure(config.ingest_updates_per_second, config.ingest_bytes_per_second, config.ingest_burst, config.ingest_policy, config.ingest_hold_limit);
+
+    boost::system::error_code ec;
+    socket_.set_option(tcp::no_delay(true), ec);
+    auto endpoint = socket_.remote_endpoint(ec);
+
+    if (!ec) {
+        remote_address_ = endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+    }
+}
+
+// The three write buffers, the read buffer, one read's worth of decoded updates and the
+// conflation table, as the constructor and read_next() reserve them.
+std::size_t Session::slab_bytes(const ServerConfig& config) {
+
+    std::size_t ingest = std::max(config.ingest_buffer_bytes, 2 * sizeof(message_t));
+    std::size_t bytes = 3 * config.session_queue_records * sizeof(message_t) + ingest + ingest / sizeof(message_t) * sizeof(message_t);
+
+    if (config.conflate_broadcasts) {
+        bytes += conflation_table_size * sizeof(uint32_t);
+    }
+
+    // Room for each buffer's alignment.
+    return bytes + 6 * 64;
+}
+
+void Session::start() {
+
+    start_timer();
+
+    if (server_.tls_context_) {
+        start_tls();
+        return;
+    }
+
+    read_handshake();
+}
+
+// The handshake counts towards the handshake timeout, like the identifying record after it.
+void Session::start_tls() {
+
+    auto self = shared_from_this();
+
+    tls_ = std::make_unique<TlsChannel>(server_.tls_context_, true);
+    read_active_ = true;
+
+    tls_->async_handshake(socket_, make_custom_alloc_handler(read_memory_, [this, self](boost::system::error_code ec) {
+        read_active_ = false;
+
+        if (suspending_) {
+            check_suspended();
+            return;
+        }
+
+        if (ec) {
+            {
+                std::lock_guard<std::mutex> lock(print_mutex);
+                std::cerr << "TLS handshake with " << remote_address_ << " failed: " << ec.message() << std::endl;
+            }
+
+            close();
+            return;
+        }
+
+        if (server_.debugLogs_ || !record_layer_reported.exchange(true)) {
+            std::lock_guard<std::mutex> lock(print_mutex);
+            std::cout << "TLS session with " << remote_address_ << ": " << tls_->version() << ", " << tls_->record_layer() << " record layer" << std::endl;
+        }
+
+        read_handshake();
+    }));
+}
+
+template <typename Handler>
+void Session::read_exact(boost::asio::mutable_buffer buffer, Handler handler) {
+
+    if (tls_userspace()) {
+        tls_->async_read(socket_, buffer, std::move(handler));
+        return;
+    }
+
+    boost::asio::async_read(socket_, buffer, std::move(handler));
+}
+
+template <typename Handler>
+void Session::read_some(boost::asio::mutable_buffer buffer, Handler handler) {
+
+    if (tls_userspace()) {
+        tls_->async_read_some(socket_, buffer, std::move(handler));
+        return;
+    }
+
+    socket_.async_read_some(buffer, std::move(handler));
+}
+
+template <typename Handler>
+void Session::write_all(boost::asio::const_buffer buffer, Handler handler) {
+
+    if (tls_userspace()) {
+        tls_->async_write(socket_, buffer, std::move(handler));
+        return;
+    }
+
+    boost::asio::async_write(socket_, buffer, std::move(handler));
+}
+
+void Session::read_handshake() {
+
+    auto self = shared_from_this();
+
+    read_exact(boost::asio::buffer(&read_buffer_, sizeof(message_t)), make_custom_alloc_handler(read_memory_,
+        [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+            if (ec) {
+                std::lock_guard<std::mutex> lock(print_mutex);
+                std::cerr << "Read error: " << ec.message() << std::endl;
+                return;
+            }
+
+            last_read_tick_ = wheel_.ticks();
+
+            if (is_control(read_buffer_)) {
+
+                control_t control = to_control(read_buffer_);
+
+                // The encoding may be chosen before identifying, so the join snapshot already uses it.
+                if (static_cast<control_kind>(control.kind) == control_kind::set_encoding && control.count == 0) {
+                    set_encoding(static_cast<stream_encoding>(control.type));
+                    read_handshake();
+                    return;
+                }
+
+                if (static_cast<control_kind>(control.kind) == control_kind::replication_subscribe && control.count == 0) {
+
+                    // The stream carries the whole store, so only configured peers get it.
+                    if (!replica_peer()) {
+                        std::lock_guard<std::mutex> lock(print_mutex);
+                        std::cerr << "Client " << remote_address_ << " asked for replication but is not a configured replica peer. Rejecting connection." << std::endl;
+                        close();
+                        return;
+                    }
+
+                    replica_ = true;
+                    replica_cursor_ = control.sequence;
+                    replica_sent_.store(replica_cursor_, std::memory_order_relaxed);
+                    client_record_ = symbol_record("replica@" + remote_address_);
+                    server_.register_replica(self);
+                    pump_replication();
+                    read_next();
+                    return;
+                }
+
+                std::lock_guard<std::mutex> lock(print_mutex);
+                std::cerr << "Client " << remote_address_ << " sent a control record before identifying itself. Rejecting connection." << std::endl;
+                close();
+                return;
+            }
+
+            client_record_ = symbol_record(std::string(symbol_of(read_buffer_)));
+
+            if (!server_.register_client(self, read_buffer_)) {
+                close();
+                return;
+            }
+
+            identified_ = true;
+
+            server_.sendPositions(self);
+            read_next();
+        }));
+}
+
+bool Session::replica_peer() {
+
+    boost::system::error_code ec;
+    auto endpoint = socket_.remote_endpoint(ec);
+
+    if (ec) {
+        return false;
+    }
+
+    auto address = endpoint.address();
+
+    if (address.is_v6() && address.to_v6().is_v4_mapped()) {
+        address = boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, address.to_v6());
+    }
+
+    const auto& peers = server_.config_.replica_peers;
+    return std::find(peers.begin(), peers.end(), address.to_string()) != peers.end();
+}
+
+// Reads as much as has arrived, up to the ingest buffer's size, after any incomplete record
+// left over from the previous read (or handed over by the previous process on a hot restart).
+void Session::read_next() {
+
+    if (ingest_buffer_.empty()) {
+        ingest_buffer_.resize(ingest_capacity_);
+    }
+
+#if defined(__linux__)
+    // recvmsg() would see ciphertext under a userspace record layer, so those sessions go unstamped.
+    if (receive_timestamps_ && !tls_userspace()) {
+        read_stamped();
+        return;
+    }
+#endif
+
+    auto self = shared_from_this();
+
+    read_active_ = true;
+
+    read_some(boost::asio::buffer(ingest_buffer_.data() + read_partial_, ingest_capacity_ - read_partial_), make_custom_alloc_handler(read_memory_,
+        [this, self](boost::system::error_code ec, std::size_t length) {
+            read_active_ = false;
+
+            if (suspending_ && ec == boost::asio::error::operation_aborted) {
+                check_suspended();
+                return;
+            }
+
+            if (ec) {
+                handle_read_error(ec);
+                check_suspended();
+                return;
+            }
+
+            last_read_tick_ = wheel_.ticks();
+            decode_ingest(length, 0);
+
+            if (suspending_) {
+                check_suspended();
+                return;
+            }
+
+            if (socket_.is_open()) {
+                continue_reading();
+            }
+        }));
+}
+
+#if defined(__linux__)
+// Same as read_next() but through recvmsg(), to collect the SO_TIMESTAMPNS stamp of each read.
+// A read holding several records gives them all its stamp, which is that of the newest segment.
+void Session::read_stamped() {
+
+    auto self = shared_from_this();
+
+    read_active_ = true;
+
+    socket_.async_wait(tcp::socket::wait_read, make_custom_alloc_handler(read_memory_,
+        [this, self](boost::system::error_code ec) {
+            read_active_ = false;
+
+            if (suspending_ && ec == boost::asio::error::operation_aborted) {
+                check_suspended();
+                return;
+            }
+
+            if (ec) {
+                handle_read_error(ec);
+                check_suspended();
+                return;
+            }
+
+            iovec data;
+            data.iov_base = ingest_buffer_.data() + read_partial_;
+            data.iov_len = ingest_capacity_ - read_partial_;
+
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(timespec))];
+            msghdr header{};
+            header.msg_iov = &data;
+            header.msg_iovlen = 1;
+            header.msg_control = control;
+            header.msg_controllen = sizeof(control);
+
+            ssize_t length = ::recvmsg(socket_.native_handle(), &header, MSG_DONTWAIT);
+
+            if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                read_stamped();
+                return;
+            }
+
+            if (length <= 0) {
+                handle_read_error(length == 0 ? boost::asio::error::eof : boost::system::error_code(errno, boost::system::system_category()));
+                check_suspended();
+                return;
+            }
+
+            int64_t stamp = 0;
+
+            for (cmsghdr* message = CMSG_FIRSTHDR(&header); message != nullptr; message = CMSG_NXTHDR(&header, message)) {
+
+                if (message->cmsg_level == SOL_SOCKET && message->cmsg_type == SCM_TIMESTAMPNS) {
+                    timespec received;
+                    std::memcpy(&received, CMSG_DATA(message), sizeof(received));
+                    stamp = static_cast<int64_t>(received.tv_sec) * 1000000000LL + received.tv_nsec;
+                }
+            }
+
+            last_read_tick_ = wheel_.ticks();
+            decode_ingest(static_cast<std::size_t>(length), stamp);
+
+            if (suspending_) {
+                check_suspended();
+                return;
+            }
+
+            if (socket_.is_open()) {
+                continue_reading();
+            }
+        }));
+}
+#endif
+
+// Decodes every whole record in the ingest buffer. Runs of updates go to the server as one
+// batch; control records and their payloads are handled in between, so the order is kept. An
+// incomplete record at the end is moved to the front for the next read.
+void Session::decode_ingest(std::size_t length, int64_t stamp) {
+
+    server_.metrics_.add(server_counter::bytes_in, length);
+
+    std::size_t available = read_partial_ + length;
+    std::size_t offset = 0;
+
+    // A record that began in an earlier read keeps that read's stamp.
+    int64_t record_stamp = read_partial_ > 0 ? read_stamp_ : stamp;
+
+    std::size_t control_bytes = 0;
+
+    ingest_batch_.clear();
+
+    while (available - offset >= sizeof(message_t) && socket_.is_open()) {
+
+        std::memcpy(&read_buffer_, ingest_buffer_.data() + offset, sizeof(message_t));
+        offset += sizeof(message_t);
+
+        if (pending_records_ == 0 && !is_control(read_buffer_)) {
+
+            if (record_stamp != 0) {
+                read_buffer_.receive_ns = record_stamp;
+            }
+
+            ingest_batch_.push_back(read_buffer_);
+        } else {
+
+            submit_updates();
+            control_bytes += sizeof(message_t);
+            handle_record();
+        }
+
+        record_stamp = stamp;
+    }
+
+    if (socket_.is_open()) {
+        submit_updates();
+    }
+
+    if (control_bytes > 0 && budget_.enabled()) {
+        budget_.charge_bytes(control_bytes, Clock::now_ns());
+    }
+
+    std::size_t tail = available - offset;
+
+    if (tail > 0 && offset > 0) {
+        std::memmove(ingest_buffer_.data(), ingest_buffer_.data() + offset, tail);
+    }
+
+    if (tail > 0 && (offset > 0 || read_partial_ == 0)) {
+        read_stamp_ = stamp;
+    }
+
+    read_partial_ = static_cast<uint32_t>(tail);
+    POSITION_PROBE(decode, id_, offset / sizeof(message_t));
+}
+
+// Hands the run of updates decoded so far to the server, through the ingest budget when there is
+// one. Replica connections carry other servers' clients, which their own servers budget.
+void Session::submit_updates() {
+
+    if (ingest_batch_.empty()) {
+        return;
+    }
+
+    if (!budget_.enabled() || replica_) {
+        server_.process_batch(shared_from_this(), ingest_batch_.data(), ingest_batch_.size());
+        ingest_batch_.clear();
+        return;
+    }
+
+    admitted_batch_.clear();
+
+    if (budget_.admit(ingest_batch_.data(), ingest_batch_.size(), Clock::now_ns(), admitted_batch_)) {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << "Client " << client_id() << " is over its ingest budget; "
+                  << (budget_.policy() == budget_policy::reject ? "rejecting" : budget_.policy() == budget_policy::delay ? "delaying" : "conflating")
+                  << " updates beyond it." << std::endl;
+    }
+
+    ingest_batch_.clear();
+
+    if (!admitted_batch_.empty()) {
+        server_.process_batch(shared_from_this(), admitted_batch_.data(), admitted_batch_.size());
+    }
+
+    // Held updates are released from the timer as the budget refills.
+    if (budget_.held() > 0 && timer_due_ > wheel_.ticks() + 1) {
+        arm_timer(1);
+    }
+}
+
+// Releases held updates as far as the budget allows, or all of them before the session goes away.
+void Session::release_held(bool all) {
+
+    if (budget_.held() == 0) {
+        return;
+    }
+
+    admitted_batch_.clear();
+
+    if (all) {
+        budget_.drain(admitted_batch_);
+    } else {
+        budget_.release(Clock::now_ns(), admitted_batch_);
+    }
+
+    if (!admitted_batch_.empty()) {
+        server_.process_batch(shared_from_this(), admitted_batch_.data(), admitted_batch_.size());
+    }
+}
+
+// Under the delay policy a publisher holding its limit stops being read, so TCP pushes back on it;
+// on_timer picks the read up again once enough has been released.
+void Session::continue_reading() {
+
+    if (budget_.full()) {
+        read_paused_ = true;
+        budget_.note_paused();
+        return;
+    }
+
+    read_next();
+}
+
+ingest_budget_stats_t Session::budget_stats() const {
+
+    ingest_budget_stats_t stats = budget_.stats();
+    stats.session = id_;
+    stats.client_id = std::string(client_id());
+    return stats;
+}
+
+// Called from the metrics thread; the queues are read under the same lock deliver() takes.
+session_outbound_t Session::outbound() {
+
+    uint64_t queued;
+
+    {
+        std::lock_guard<std::mutex> lock(outbound_mutex_);
+        queued = pending_writes_.size() + priority_writes_.size();
+    }
+
+    session_outbound_t outbound;
+    outbound.queued_bytes = queued * sizeof(message_t) + in_flight_bytes_.load(std::memory_order_relaxed);
+
+    if (replica_) {
+        uint64_t next = server_.store_.sequence() + 1;
+        uint64_t sent = replica_sent_.load(std::memory_order_relaxed);
+        outbound.lag = next > sent ? next - sent : 0;
+    } else {
+        outbound.lag = queued + in_flight_records_.load(std::memory_order_relaxed);
+    }
+
+    return outbound;
+}
+
+void Session::handle_record() {
+
+    if (pending_records_ > 0) {
+
+        pending_payload_.push_back(read_buffer_);
+
+        if (--pending_records_ == 0) {
+            server_.handle_control(shared_from_this(), pending_request_, pending_payload_);
+        }
+
+        return;
+    }
+
+    pending_request_ = to_control(read_buffer_);
+    pending_payload_.clear();
+
+    if (pending_request_.count > max_control_payload) {
+        {
+            std::lock_guard<std::mutex> lock(print_mutex);
+            std::cerr << "Client " << client_id() << " announced " << pending_request_.count << " payload records. Closing connection." << std::endl;
+        }
+
+        close();
+        return;
+    }
+
+    pending_records_ = pending_request_.count;
+
+    if (pending_records_ == 0) {
+        server_.handle_control(shared_from_this(), pending_request_, pending_payload_);
+    }
+}
+
+bool Session::enable_receive_timestamps() {
+
+#if defined(__linux__) && defined(SO_TIMESTAMPNS)
+    int enabled = 1;
+
+    if (!socket_.is_open() || ::setsockopt(socket_.native_handle(), SOL_SOCKET, SO_TIMESTAMPNS, &enabled, sizeof(enabled)) != 0) {
+        return false;
+    }
+
+    receive_timestamps_ = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Session::handle_read_error(const boost::system::error_code& ec) {
+
+    // Updates already received are not lost with the connection.
+    if (!suspending_) {
+        release_held(true);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        if (ec == boost::asio::error::eof) {
+            std::cout << "Client " << client_id() << " closed connection.\n";
+        } else if (ec == boost::asio::error::operation_aborted) {
+            std::cout << "Operation aborted for client " << client_id() << ".\n";
+        } else {
+            std::cerr << "Error reading from client " << client_id() << ": " << ec.message() << std::endl;
+        }
+    }
+
+    server_.handle_disconnection(shared_from_this());
+}
+
+// Only accepted before the client identifies itself, so nothing has been written yet.
+void Session::set_encoding(stream_encoding encoding) {
+
+    encoding_ = encoding == stream_encoding::gorilla ? stream_encoding::gorilla : stream_encoding::plain;
+    encoder_.request_keyframe();
+}
+
+// Called by ingest threads after publishing to the replication log. At most one pump is
+// queued at a time; the pump clears the flag before reading, so nothing published is missed.
+void Session::notify_replication() {
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (replication_scheduled_.exchange(true)) {
+        return;
+    }
+
+    auto self = shared_from_this();
+
+    boost::asio::post(io_context_, make_custom_alloc_handler(replication_memory_, [this, self]() {
+        pump_replication();
+    }));
+}
+
+void Session::pump_replication() {
+
+    replication_scheduled_.store(false);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (!socket_.is_open()) {
+        return;
+    }
+
+    replication_batch_.clear();
+    replication_batch_.emplace_back();
+
+    std::size_t copied = 0;
+    ReplicationLog::entry_times_t first;
+
+    if (!server_.replication_log_.read(replica_cursor_, max_replication_batch, replication_batch_, copied, &first)) {
+        send_replication_snapshot();
+        return;
+    }
+
+    if (copied == 0) {
+        return;
+    }
+
+    control_t header;
+    header.kind = static_cast<uint8_t>(control_kind::replication_batch);
+    header.count = static_cast<uint32_t>(copied);
+    header.sequence = replica_cursor_;
+    header.request_id = server_.store_.sequence();
+    header.lower = first.ingest_ns / 1e9;
+    header.upper = first.origin_ns / 1e9;
+    replication_batch_.front() = to_record(header);
+
+    deliver(replication_batch_.data(), replication_batch_.size());
+    replica_cursor_ += copied;
+    replica_sent_.store(replica_cursor_, std::memory_order_relaxed);
+
+    if (copied == max_replication_batch) {
+        notify_replication();
+    }
+}
+
+// The store sequence is read before the snapshot, so the snapshot covers at least every update
+// up to it; updates after it are streamed next and may be applied twice, which is harmless.
+void Session::send_replication_snapshot() {
+
+    uint64_t covered = server_.store_.sequence();
+
+    replication_batch_.clear();
+    replication_batch_.emplace_back();
+    server_.store_.snapshot(replication_batch_);
+
+    control_t header;
+    header.kind = static_cast<uint8_t>(control_kind::replication_snapshot);
+    header.count = static_cast<uint32_t>(replication_batch_.size() - 1);
+    header.sequence = covered;
+    header.request_id = covered;
+    replication_batch_.front() = to_record(header);
+
+    deliver(replication_batch_.data(), replication_batch_.size());
+    replica_cursor_ = covered + 1;
+    replica_sent_.store(replica_cursor_, std::memory_order_relaxed);
+
+    {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << "Sent replica " << remote_address_ << " a snapshot of " << header.count << " positions at sequence " << covered << std::endl;
+    }
+
+    notify_replication();
+}
+
+void Session::deliver(const message_t& message) {
+    deliver(&message, 1);
+}
+
+void Session::deliver(const message_t* records, std::size_t count) {
+
+    bool schedule = false;
+
+    {
+        std::lock_guard<std::mutex> lock(outbound_mutex_);
+        pending_writes_.insert(pending_writes_.end(), records, records + count);
+
+        if (!write_scheduled_) {
+            write_scheduled_ = true;
+            schedule = true;
+        }
+    }
+
+    if (schedule) {
+        schedule_write();
+    }
+}
+
+// Responses, predicate events and heartbeats: sent ahead of queued broadcasts and join snapshots,
+// in the order they were delivered.
+void Session::deliver_priority(const message_t* records, std::size_t count) {
+
+    bool schedule = false;
+
+    {
+        std::lock_guard<std::mutex> lock(outbound_mutex_);
+        priority_writes_.insert(priority_writes_.end(), records, records + count);
+
+        if (!write_scheduled_) {
+            write_scheduled_ = true;
+            schedule = true;
+        }
+    }
+
+    if (schedule) {
+        schedule_write();
+    }
+}
+
+// Broadcast path. Without conflation this is deliver(); with it, an update for a symbol that is
+// still queued overwrites the queued record in place.
+void Session::deliver_update(const message_t& update) {
+
+    if (conflation_slots_.empty()) {
+        deliver(update);
+        return;
+    }
+
+    bool schedule = false;
+
+    {
+        std::lock_guard<std::mutex> lock(outbound_mutex_);
+
+        std::string_view symbol = symbol_of(update);
+        std::size_t mask = conflation_slots_.size() - 1;
+        std::size_t slot = std::hash<std::string_view>()(symbol) & mask;
+        bool queued = false;
+
+        for (std::size_t probe = 0; probe < conflation_max_probe; ++probe, slot = (slot + 1) & mask) {
+
+            uint32_t entry = conflation_slots_[slot];
+
+            if (entry == 0) {
+                conflation_slots_[slot] = static_cast<uint32_t>(pending_writes_.size() + 1);
+                break;
+            }
+
+            if (symbol_of(pending_writes_[entry - 1]) == symbol) {
+                pending_writes_[entry - 1] = update;
+                conflated_.fetch_add(1, std::memory_order_relaxed);
+                queued = true;
+                break;
+            }
+        }
+
+        if (!queued) {
+            pending_writes_.push_back(update);
+        }
+
+        if (!write_scheduled_) {
+            write_scheduled_ = true;
+            schedule = true;
+        }
+    }
+
+    if (schedule) {
+        schedule_write();
+    }
+}
+
+// Only one flush or write is ever outstanding (write_scheduled_), which is what lets
+// flush_memory_ and write_memory_ each serve a single handler at a time.
+void Session::schedule_write() {
+
+    auto self = shared_from_this();
+
+    boost::asio::post(io_context_, make_custom_alloc_handler(flush_memory_, [this, self]() {
+        do_write();
+    }));
+}
+
+void Session::do_write() {
+
+    bool resend = false;
+
+    {
+        std::lock_guard<std::mutex> lock(outbound_mutex_);
+
+        // A suspended session keeps its queue for export instead of writing it.
+        if (suspending_) {
+            write_scheduled_ = false;
+            return;
+        }
+
+        // The tail of a write interrupted by a hot restart goes out before anything queued after it.
+        resend = !unsent_.empty() && socket_.is_open();
+
+        if (!resend) {
+
+            // Queued records are leaving pending_writes_, so their conflation slots go with them.
+            std::fill(conflation_slots_.begin(), conflation_slots_.end(), 0);
+
+            if ((pending_writes_.empty() && priority_writes_.empty()) || !socket_.is_open()) {
+                pending_writes_.clear();
+                priority_writes_.clear();
+                write_scheduled_ = false;
+                return;
+            }
+
+            if (priority_writes_.empty()) {
+                in_flight_.swap(pending_writes_);
+            } else {
+                in_flight_.swap(priority_writes_);
+                in_flight_.insert(in_flight_.end(), pending_writes_.begin(), pending_writes_.end());
+                pending_writes_.clear();
+            }
+        }
+    }
+
+    boost::asio::const_buffer outgoing = boost::asio::buffer(in_flight_.data(), in_flight_.size() * sizeof(message_t));
+
+    if (resend) {
+        frame_.clear();
+        frame_.swap(unsent_);
+        outgoing = boost::asio::buffer(frame_);
+    } else if (encoding_ == stream_encoding::gorilla) {
+        frame_.clear();
+        encoder_.encode_frame(in_flight_.data(), in_flight_.size(), frame_);
+        outgoing = boost::asio::buffer(frame_);
+    }
+
+    auto self = shared_from_this();
+
+    write_active_ = true;
+    write_started_tick_ = wheel_.ticks();
+
+    in_flight_bytes_.store(outgoing.size(), std::memory_order_relaxed);
+    in_flight_records_.store(resend ? 0 : in_flight_.size(), std::memory_order_relaxed);
+
+    // Only read the clock for the write's trace span when tracing is on.
+    int64_t write_started_ns = TraceRecorder::active() ? Clock::now_ns() : 0;
+
+    write_all(outgoing, make_custom_alloc_handler(write_memory_,
+        [this, self, outgoing, write_started_ns](boost::system::error_code ec, std::size_t length) {
+            POSITION_PROBE_SPAN(write_done, write_started_ns, id_, length);
+            write_active_ = false;
+            last_write_tick_ = wheel_.ticks();
+            in_flight_bytes_.store(0, std::memory_order_relaxed);
+            in_flight_records_.store(0, std::memory_order_relaxed);
+            server_.metrics_.add(server_counter::bytes_out, length);
+
+            // Whatever the cancelled write did not get onto the socket is sent by the session's successor.
+            if (suspending_ && (!ec || ec == boost::asio::error::operation_aborted)) {
+                const uint8_t* data = static_cast<const uint8_t*>(outgoing.data());
+                unsent_.insert(unsent_.end(), data + length, data + outgoing.size());
+                in_flight_.clear();
+                check_suspended();
+                return;
+            }
+
+            if (ec) {
+                {
+                    std::lock_guard<std::mutex> lock(print_mutex);
+                    std::cerr << "Failed to send message: " << ec.message() << std::endl;
+                }
+
+                in_flight_.clear();
+                boost::system::error_code ignore;
+                socket_.close(ignore);
+                do_write();
+                return;
+            }
+
+            if (server_.debugLogs_) {
+
+                std::lock_guard<std::mutex> lock(print_mutex);
+
+                for (const auto& message : in_flight_) {
+                    if (!is_control(message)) {
+                        std::cout << "Sending BroadCast to: " << remote_address_ << std::endl;
+                        std::cout << "\nSent broadcast: Client: " << symbol_of(message) << ", Net Position: " << message.net_position << ", Timestamp of client: " << format_timestamp(message.timestamp_ns) << std::endl;
+                    }
+                }
+            }
+
+            in_flight_.clear();
+            do_write();
+        }));
+}
+
+void Session::suspend(std::function<void()> done) {
+
+    auto self = shared_from_this();
+
+    boost::asio::post(io_context_, [this, self, done]() {
+
+        // Held updates are ingested rather than handed over; the successor starts with a full budget.
+        release_held(true);
+        read_paused_ = false;
+
+        suspending_ = true;
+        suspend_done_ = done;
+
+        boost::system::error_code ignore;
+        socket_.cancel(ignore);
+        check_suspended();
+    });
+}
+
+void Session::check_suspended() {
+
+    if (suspending_ && suspend_done_ && !read_active_ && !write_active_) {
+        auto done = std::move(suspend_done_);
+        suspend_done_ = nullptr;
+        done();
+    }
+}
+
+void Session::export_state(handoff_session_t& out) {
+
+    out.fd = socket_.native_handle();
+    out.client_record = client_record_;
+    out.encoding = static_cast<uint8_t>(encoding_);
+    out.wants_broadcasts = wants_broadcasts();
+    out.read_partial = read_partial_;
+    out.read_buffer = message_t();
+
+    if (read_partial_ > 0) {
+        std::memcpy(&out.read_buffer, ingest_buffer_.data(), read_partial_);
+    }
+
+    out.pending_request = pending_request_;
+    out.pending_records = pending_records_;
+    out.pending_payload = pending_payload_;
+    out.unsent = unsent_;
+
+    std::lock_guard<std::mutex> lock(outbound_mutex_);
+    out.queued.assign(priority_writes_.begin(), priority_writes_.end());
+    out.queued.insert(out.queued.end(), pending_writes_.begin(), pending_writes_.end());
+}
+
+// The successor's encoder starts from a keyframe; any partly sent frame is finished from unsent_ first.
+void Session::restore(const handoff_session_t& state) {
+
+    identified_ = true;
+    client_record_ = state.client_record;
+    set_encoding(static_cast<stream_encoding>(state.encoding));
+    set_wants_broadcasts(state.wants_broadcasts);
+    read_partial_ = std::min<uint32_t>(state.read_partial, sizeof(message_t) - 1);
+    ingest_buffer_.resize(ingest_capacity_);
+    std::memcpy(ingest_buffer_.data(), &state.read_buffer, read_partial_);
+    pending_request_ = state.pending_request;
+    pending_records_ = state.pending_records;
+    pending_payload_ = state.pending_payload;
+    unsent_ = state.unsent;
+    pending_writes_.assign(state.queued.begin(), state.queued.end());
+}
+
+void Session::resume() {
+
+    auto self = shared_from_this();
+
+    boost::asio::post(io_context_, [this, self]() {
+        suspending_ = false;
+
+        // A successor's session starts its deadlines afresh; a cancelled handoff keeps its own.
+        if (timer_due_ == 0) {
+            started_tick_ = last_read_tick_ = last_write_tick_ = wheel_.ticks();
+            arm_timer(1);
+        }
+
+        read_next();
+
+        {
+            std::lock_guard<std::mutex> lock(outbound_mutex_);
+
+            if (write_scheduled_) {
+                return;
+            }
+
+            write_scheduled_ = true;
+        }
+
+        do_write();
+    });
+}
+
+// Posted because start() runs on the accepting thread and the wheel belongs to this session's.
+void Session::start_timer() {
+
+    auto self = shared_from_this();
+
+    boost::asio::post(io_context_, [this, self]() {
+        started_tick_ = last_read_tick_ = last_write_tick_ = wheel_.ticks();
+        arm_timer(1);
+    });
+}
+
+void Session::arm_timer(uint64_t delay) {
+    timer_due_ = wheel_.schedule(shared_from_this(), delay);
+}
+
+// Works out every deadline that applies and re-arms for the nearest one, so a session costs
+// one wheel entry however many timeouts are enabled.
+void Session::on_timer(uint64_t due) {
+
+    // A paused read cannot notice the socket closing, so the timer takes the disconnection path for it.
+    if (due == timer_due_ && read_paused_ && !socket_.is_open()) {
+        read_paused_ = false;
+        handle_read_error(boost::asio::error::operation_aborted);
+        return;
+    }
+
+    if (due != timer_due_ || !socket_.is_open()) {
+        return;
+    }
+
+    timer_due_ = 0;
+
+    const ServerConfig& config = server_.config_;
+    uint64_t now = wheel_.ticks();
+    uint64_t next = wheel_.to_ticks(std::chrono::seconds(1));
+
+    // Held for a hot restart: the successor restarts the deadlines.
+    if (suspending_) {
+        arm_timer(next);
+        return;
+    }
+
+    if (!identified_ && !replica_) {
+
+        uint64_t limit = wheel_.to_ticks(config.handshake_timeout);
+
+        if (limit > 0 && now - started_tick_ >= limit) {
+            reap("did not identify itself in time");
+            return;
+        }
+
+        if (limit > 0) {
+            next = std::min(next, started_tick_ + limit - now);
+        }
+
+        arm_timer(next);
+        return;
+    }
+
+    if (budget_.held() > 0) {
+
+        release_held(false);
+
+        if (read_paused_ && !budget_.full()) {
+            read_paused_ = false;
+            last_read_tick_ = now;
+            read_next();
+        }
+    }
+
+    // A session whose read is paused by its budget is not idle.
+    uint64_t idle = read_paused_ ? 0 : wheel_.to_ticks(config.idle_timeout);
+
+    if (idle > 0 && now - last_read_tick_ >= idle) {
+        reap("idle timeout");
+        return;
+    }
+
+    uint64_t stall = wheel_.to_ticks(config.write_stall_timeout);
+
+    if (stall > 0 && write_active_ && now - write_started_tick_ >= stall) {
+        reap("write stalled");
+        return;
+    }
+
+    uint64_t heartbeat = wheel_.to_ticks(config.heartbeat_interval);
+
+    if (heartbeat > 0) {
+
+        uint64_t quiet_since = std::max(std::min(last_read_tick_, last_write_tick_), last_heartbeat_tick_);
+
+        if (now - quiet_since >= heartbeat) {
+
+            control_t beat;
+            beat.kind = static_cast<uint8_t>(control_kind::heartbeat);
+            message_t record = to_record(beat);
+            deliver_priority(&record, 1);
+            last_heartbeat_tick_ = now;
+            quiet_since = now;
+        }
+
+        next = std::min(next, quiet_since + heartbeat - now);
+    }
+
+    if (idle > 0) {
+        next = std::min(next, last_read_tick_ + idle - now);
+    }
+
+    if (stall > 0 && write_active_) {
+        next = std::min(next, write_started_tick_ + stall - now);
+    }
+
+    if (budget_.held() > 0) {
+        next = 1;
+    }
+
+    arm_timer(next);
+}
+
+void Session::reap(const char* reason) {
+
+    {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << "Reaping " << (identified_ ? std::string(client_id()) : remote_address_) << ": " << reason << std::endl;
+    }
+
+    server_.sessions_reaped_.fetch_add(1, std::memory_order_relaxed);
+
+    boost::system::error_code ignore;
+    socket_.shutdown(tcp::socket::shutdown_both, ignore);
+    socket_.close(ignore);
+}
+
+void Session::close() {
+
+    auto self = shared_from_this();
+
+    boost::asio::post(io_context_, [this, self]() {
+        boost::system::error_code ignore;
+        socket_.shutdown(tcp::socket::shutdown_both, ignore);
+        socket_.close(ignore);
+    });
+}
@@ -0,0 +1,196 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <boost/asio.hpp>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "../../include/HandlerAllocator.h"
+#include "../../include/Message.h"
+#include "../../include/Protocol.h"
+#include "../../include/StreamCodec.h"
+#include "../../include/Tls.h"
+#include "Handoff.h"
+#include "IngestBudget.h"
+#include "MemoryArena.h"
+#include "TimerWheel.h"
+
+using boost::asio::ip::tcp;
+
+class PositionServer;
+struct ServerConfig;
+
+// What a session has queued and not yet written, for the metrics endpoint. A client session's lag
+// counts the records waiting; a replica's counts the store sequences it has not been sent.
+struct session_outbound_t {
+    uint64_t queued_bytes;
+    uint64_t lag;
+};
+
+// One connected client. A session belongs to a single io_context driven by one thread,
+// so reads, the outbound write queue and query handling for it run serialised on that
+// I/O thread without a strand (and without a type-erased strand executor per handler).
+// Outbound records are appended to a preallocated buffer under a short lock and a
+// single flush is posted per batch; read, write and flush handlers each recycle a
+// per-session handler_memory block, so steady-state traffic does no heap allocation.
+// With the gorilla stream encoding each outgoing batch is sent as one compressed frame,
+// encoded on the I/O thread. A replica's connection instead carries the replication stream,
+// pulled from the server's ReplicationLog whenever new sequences are published.
+// With conflation enabled, a broadcast for a symbol that already has an update waiting in
+// the outbound queue replaces it, so a slow subscriber gets the latest positions rather than
+// an ever-growing backlog.
+// For a hot restart a session can be suspended between records: its outstanding read and write
+// are cancelled, partial progress is kept, and the state is exported so a session in another
+// process can resume on the same socket without the client noticing.
+// Liveness is checked from the I/O thread's TimerWheel: each session keeps one entry armed for
+// its nearest deadline (handshake, idle, write stall or next heartbeat) and is reaped by closing
+// its socket, which ends the read and takes the usual disconnection path.
+// Inbound data is read in large chunks into a per-session ingest buffer and decoded in place;
+// each run of updates in a chunk is handed to the server as one batch, and an incomplete record
+// at the end waits in the buffer for the next read. With kernel receive timestamps enabled, reads
+// go through recvmsg() so each update can carry the SO_TIMESTAMPNS time of the read.
+// A publisher over its ingest budget (IngestBudget) has updates conflated, held back or dropped
+// before they reach the server, while its control records are still handled as they arrive.
+// Query responses, predicate events and heartbeats go out on a priority lane, ahead of any
+// broadcasts already queued for the session.
+// On a TLS server the session starts with the TLS handshake. When kTLS took both directions it
+// then runs exactly as a plaintext session; otherwise reads and writes go through its TlsChannel.
+class Session : public std::enable_shared_from_this<Session> {
+public:
+    // With a slab pool, the session's queues and read buffers are reserved at their planned sizes
+    // in one of its slabs.
+    Session(tcp::socket socket, boost::asio::io_context& io_context, TimerWheel& wheel, PositionServer& server, SlabPool* slabs = nullptr);
+
+    // The slab a session needs under ServerConfig::preallocate.
+    static std::size_t slab_bytes(const ServerConfig& config);
+
+    void start();
+    void deliver(const message_t& message);
+    void deliver(const message_t* records, std::size_t count);
+    void deliver_update(const message_t& update);
+    void deliver_priority(const message_t* records, std::size_t count);
+    void close();
+
+    uint32_t id() const { return id_; }
+    std::string_view client_id() const { return symbol_of(client_record_); }
+    const std::string& remote_address() const { return remote_address_; }
+    tcp::socket& socket() { return socket_; }
+    bool wants_broadcasts() const { return wants_broadcasts_.load(std::memory_order_relaxed); }
+    void set_wants_broadcasts(bool enabled) { wants_broadcasts_.store(enabled, std::memory_order_relaxed); }
+    stream_encoding encoding() const { return encoding_; }
+    bool is_replica() const { return replica_; }
+    bool identified() const { return identified_; }
+    uint64_t conflated() const { return conflated_.load(std::memory_order_relaxed); }
+
+    // TLS whose record layer is (partly) in this process; such a session cannot be handed off.
+    bool tls_userspace() const { return tls_ && !tls_->offloaded(); }
+    ingest_budget_stats_t budget_stats() const;
+    session_outbound_t outbound();
+    void notify_replication();
+
+    // Asks the kernel to stamp received data (Linux SO_TIMESTAMPNS); later updates carry the stamp
+    // in receive_ns. Call before start() or resume(). Returns false where unsupported.
+    bool enable_receive_timestamps();
+
+    // Hot restart. suspend() runs done on the session's I/O thread once no read or write is
+    // outstanding; export_state() must only be called after that. restore() fills a freshly
+    // constructed session from an exported state and resume() picks the I/O back up.
+    void suspend(std::function<void()> done);
+    void export_state(handoff_session_t& out);
+    void restore(const handoff_session_t& state);
+    void resume();
+
+    // Called by the timer wheel; `due` identifies the entry so superseded ones are ignored.
+    void on_timer(uint64_t due);
+
+private:
+    void start_tls();
+    void read_handshake();
+    bool replica_peer();
+    template <typename Handler> void read_exact(boost::asio::mutable_buffer buffer, Handler handler);
+    template <typename Handler> void read_some(boost::asio::mutable_buffer buffer, Handler handler);
+    template <typename Handler> void write_all(boost::asio::const_buffer buffer, Handler handler);
+    void read_next();
+#if defined(__linux__)
+    void read_stamped();
+#endif
+    void decode_ingest(std::size_t length, int64_t stamp);
+    void submit_updates();
+    void release_held(bool all);
+    void continue_reading();
+    void handle_record();
+    void handle_read_error(const boost::system::error_code& ec);
+    void set_encoding(stream_encoding encoding);
+    void pump_replication();
+    void send_replication_snapshot();
+    void schedule_write();
+    void do_write();
+    void check_suspended();
+    void start_timer();
+    void arm_timer(uint64_t delay);
+    void reap(const char* reason);
+
+    tcp::socket socket_;
+    std::unique_ptr<TlsChannel> tls_;
+    boost::asio::io_context& io_context_;
+    TimerWheel& wheel_;
+    PositionServer& server_;
+    uint32_t id_;
+    message_t client_record_;
+    std::string remote_address_;
+    message_t read_buffer_;
+    std::mutex outbound_mutex_;
+    SlabResource memory_;
+    std::pmr::vector<message_t> pending_writes_;
+    std::pmr::vector<message_t> priority_writes_;
+    std::pmr::vector<message_t> in_flight_;
+    std::atomic<uint64_t> in_flight_bytes_;
+    std::atomic<uint64_t> in_flight_records_;
+    bool write_scheduled_;
+    std::atomic<bool> wants_broadcasts_;
+    control_t pending_request_;
+    uint32_t pending_records_;
+    std::vector<message_t> pending_payload_;
+    stream_encoding encoding_;
+    StreamEncoder encoder_;
+    std::vector<uint8_t> frame_;
+    bool replica_;
+    uint64_t replica_cursor_;
+    std::atomic<uint64_t> replica_sent_;
+    std::atomic<bool> replication_scheduled_;
+    std::vector<message_t> replication_batch_;
+    std::pmr::vector<uint32_t> conflation_slots_;
+    std::atomic<uint64_t> conflated_;
+    bool identified_;
+    bool read_active_;
+    bool write_active_;
+    std::atomic<bool> suspending_;
+    std::function<void()> suspend_done_;
+    uint32_t read_partial_;
+    std::size_t ingest_capacity_;
+    std::pmr::vector<uint8_t> ingest_buffer_;
+    std::pmr::vector<message_t> ingest_batch_;
+    std::vector<message_t> admitted_batch_;
+    IngestBudget budget_;
+    bool read_paused_;
+    bool receive_timestamps_;
+    int64_t read_stamp_;
+    std::vector<uint8_t> unsent_;
+    uint64_t timer_due_;
+    uint64_t started_tick_;
+    uint64_t last_read_tick_;
+    uint64_t last_write_tick_;
+    uint64_t write_started_tick_;
+    uint64_t last_heartbeat_tick_;
+    handler_memory read_memory_;
+    handler_memory write_memory_;
+    handler_memory flush_memory_;
+    handler_memory replication_memory_;
+};
+
+#endif // SESSION_H
@@ -0,0 +1,114 @@
+#include "TimerWheel.h"
+#include "Session.h"
+#include <algorithm>
+
+TimerWheel::TimerWheel(boost::asio::io_context& io_context, std::chrono::milliseconds tick, std::size_t slots)
+    : timer_(io_context), tick_(tick.count() > 0 ? tick : std::chrono::milliseconds(1)), slots_(slots > 0 ? slots : 1),
+      current_tick_(0), running_(false) {
+
+    // Room for a few sessions per slot up front, so arming does not allocate once the wheel has
+    // turned a few times with a steady set of sessions.
+    for (auto& slot : slots_) {
+        slot.reserve(4);
+    }
+
+    due_.reserve(16);
+}
+
+void TimerWheel::start() {
+
+    if (running_) {
+        return;
+    }
+
+    running_ = true;
+    next_deadline_ = std::chrono::steady_clock::now() + tick_;
+    arm();
+}
+
+// Sessions of a stopped server are torn down or handed off, so whatever they had armed goes.
+void TimerWheel::stop() {
+
+    running_ = false;
+    timer_.cancel();
+
+    for (auto& slot : slots_) {
+        slot.clear();
+    }
+}
+
+uint64_t TimerWheel::schedule(const std::shared_ptr<Session>& session, uint64_t delay) {
+
+    uint64_t due = current_tick_ + (delay > 0 ? delay : 1);
+    slots_[due % slots_.size()].push_back(entry_t{session, due});
+    return due;
+}
+
+void TimerWheel::every(std::chrono::milliseconds interval, std::function<void()> task) {
+
+    uint64_t period = std::max<uint64_t>(to_ticks(interval), 1);
+    tasks_.push_back(task_t{period, current_tick_ + period, std::move(task)});
+}
+
+uint64_t TimerWheel::to_ticks(std::chrono::milliseconds duration) const {
+    return static_cast<uint64_t>((duration.count() + tick_.count() - 1) / tick_.count());
+}
+
+void TimerWheel::arm() {
+
+    timer_.expires_at(next_deadline_);
+    timer_.async_wait(make_custom_alloc_handler(timer_memory_, [this](const boost::system::error_code& ec) {
+
+        if (ec || !running_) {
+            return;
+        }
+
+        // Catch up tick by tick if the thread was held up, so no slot is skipped.
+        auto now = std::chrono::steady_clock::now();
+
+        while (next_deadline_ <= now) {
+            advance();
+            next_deadline_ += tick_;
+        }
+
+        arm();
+    }));
+}
+
+void TimerWheel::advance() {
+
+    ++current_tick_;
+
+    // Entries due in a later revolution stay where they are; the rest are fired after the
+    // slot has been compacted, so a callback may re-arm into this same slot.
+    auto& slot = slots_[current_tick_ % slots_.size()];
+    std::size_t kept = 0;
+
+    for (std::size_t i = 0; i < slot.size(); ++i) {
+
+        if (slot[i].due_tick <= current_tick_) {
+            due_.push_back(std::move(slot[i]));
+        } else {
+            slot[kept++] = std::move(slot[i]);
+        }
+    }
+
+    slot.resize(kept);
+
+    for (auto& entry : due_) {
+
+        if (auto session = entry.session.lock()) {
+            session->on_timer(entry.due_tick);
+        }
+    }
+
+    due_.clear();
+
+    for (auto& task : tasks_) {
+
+        if (task.due_tick <= current_tick_) {
+            task.due_tick = current_tick_ + task.period;
+            task.run();
+        }
+    }
+}
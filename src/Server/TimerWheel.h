@@ -0,0 +1,67 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "../../include/HandlerAllocator.h"
+
+class Session;
+
+// Hashed timing wheel serving every session on one I/O thread from a single steady_timer.
+// A session due in n ticks is filed under slot (now + n) % slots; each tick visits one slot,
+// so arming is O(1) and a tick costs only the entries filed in that slot. Entries hold weak
+// references and are never cancelled: a session that re-arms, closes or goes away simply
+// leaves a stale entry that is dropped when its slot comes round (Session ignores calls for a
+// due tick it is no longer waiting on). Only the owning I/O thread may call schedule() or ticks();
+// start() and stop() are called while that thread is not running the io_context.
+class TimerWheel {
+public:
+    explicit TimerWheel(boost::asio::io_context& io_context, std::chrono::milliseconds tick = std::chrono::milliseconds(100), std::size_t slots = 512);
+
+    void start();
+    void stop();
+
+    // Calls session->on_timer(due) on this wheel's thread once `delay` ticks have passed (at least
+    // one). Returns the due tick.
+    uint64_t schedule(const std::shared_ptr<Session>& session, uint64_t delay);
+
+    // Runs task on this wheel's thread every `interval` (in whole ticks, at least one) while the
+    // wheel runs; for housekeeping that is not tied to a session. Registered before start().
+    void every(std::chrono::milliseconds interval, std::function<void()> task);
+
+    // Coarse clock in ticks, advanced by the wheel; cheap enough to read on every record.
+    uint64_t ticks() const { return current_tick_; }
+    std::chrono::milliseconds tick_length() const { return tick_; }
+    uint64_t to_ticks(std::chrono::milliseconds duration) const;
+
+private:
+    struct entry_t {
+        std::weak_ptr<Session> session;
+        uint64_t due_tick;
+    };
+
+    struct task_t {
+        uint64_t period;
+        uint64_t due_tick;
+        std::function<void()> run;
+    };
+
+    void arm();
+    void advance();
+
+    boost::asio::steady_timer timer_;
+    std::chrono::milliseconds tick_;
+    std::chrono::steady_clock::time_point next_deadline_;
+    std::vector<std::vector<entry_t>> slots_;
+    std::vector<entry_t> due_;
+    std::vector<task_t> tasks_;
+    uint64_t current_tick_;
+    bool running_;
+    handler_memory timer_memory_;
+};
+
+#endif // TIMER_WHEEL_H
@@ -1,18 +1,76 @@
 #include "PositionServer.h"
+#include "SignalHandler.h"
 #include "../Client/PositionClient.h"
+#include "../../include/Clock.h"
 #include "../../include/Common.h"
+#include "../../include/TraceRecorder.h"
+#include <algorithm>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <thread>
 #include <chrono>
 #include <random>
 
 std::mutex print_mutex;
+std::atomic<bool> running{true};
+
+// CTRL C ends the run through the normal shutdown, so a capture file is flushed and closed.
+void signal_handler(int /*signal*/) {
+    running = false;
+}
+
+#ifdef POSITION_SERVER_COUNT_ALLOCATIONS
+#include <cstdlib>
+#include <new>
+
+// Build with -DPOSITION_SERVER_COUNT_ALLOCATIONS and drive the server with load generators
+// (client function 4) to check that a steady stream of updates does not touch the heap: the 5 s
+// report gains a heap line, and the server exits with status 1 if a steady window allocated.
+// A window is steady when the sessions did not change during it or the window before, so
+// connecting, identifying and disconnecting are left out; new symbols are too, as long as the
+// generators stick to theirs after the first window.
+static std::atomic<std::size_t> allocation_count{0};
+static constexpr bool counting_allocations = true;
+
+static std::size_t heap_allocations() {
+    return allocation_count.load(std::memory_order_relaxed);
+}
+
+void* operator new(std::size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* pointer = std::malloc(size)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+#else
+static constexpr bool counting_allocations = false;
+
+static std::size_t heap_allocations() {
+    return 0;
+}
+#endif
 
 int main(int argc, char* argv[]) {
 
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <DebugLogsRequired>" << std::endl;
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <DebugLogsRequired> [--busy-poll] [--io-threads N] [--dispatch-threads N] [--io-cpus 2,3] [--dispatch-cpus 4,5]"
+                  << " [--port N] [--replica-of host:port] [--promote-after-ms N] [--replication-log N] [--replica-peers 10.0.0.2,10.0.0.3]"
+                  << " [--relay-of host:port] [--conflate] [--handoff-path PATH] [--take-over PATH] [--simulate-restart-after S]"
+                  << " [--handshake-timeout-ms N] [--heartbeat-ms N] [--idle-timeout-ms N] [--write-stall-timeout-ms N]"
+                  << " [--kernel-timestamps] [--capture PATH] [--ingest-rate N] [--ingest-byte-rate N] [--ingest-burst-ms N]"
+                  << " [--ingest-policy conflate|delay|reject] [--local-publish N|max] [--tls-cert PEM --tls-key PEM] [--tls-no-ktls] [--metrics-port N | --metrics-path PATH]"
+                  << " [--trace PATH [--trace-window-ms N] [--trace-events N]] [--preallocate [--max-sessions N] [--max-symbols N] [--session-queue N]]"
+                  << " [--history-retention-s N]" << std::endl;
         return 1;
     }
 
@@ -27,17 +85,378 @@ int main(int argc, char* argv[]) {
         debugLogs = false;
     }
 
-    short port = 12345;
+    ServerConfig config;
+    int simulateRestartAfter = -1;
+    bool localPublish = false;
+    int localPublishRate = 0;
+    std::string tracePath;
+    int traceWindowMs = 1000;
+    std::size_t traceEvents = 65536;
+
+    for (int i = 2; i < argc; ++i) {
+
+        std::string option = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (option == "--busy-poll") {
+            config.mode = wait_mode::busy_poll;
+        } else if (option == "--io-threads" && hasValue) {
+            config.io_threads = static_cast<std::size_t>(std::stoi(argv[++i]));
+        } else if (option == "--dispatch-threads" && hasValue) {
+            config.dispatch_threads = static_cast<std::size_t>(std::stoi(argv[++i]));
+        } else if (option == "--io-cpus" && hasValue) {
+            config.io_cpus = parse_cpu_list(argv[++i]);
+        } else if (option == "--dispatch-cpus" && hasValue) {
+            config.dispatch_cpus = parse_cpu_list(argv[++i]);
+        } else if (option == "--port" && hasValue) {
+            config.port = static_cast<short>(std::stoi(argv[++i]));
+        } else if ((option == "--replica-of" || option == "--relay-of") && hasValue) {
+
+            std::string primary = argv[++i];
+            std::size_t colon = primary.rfind(':');
+
+            if (colon == std::string::npos) {
+                std::cerr << option << " expects host:port" << std::endl;
+                return 1;
+            }
+
+            config.replica_of_host = primary.substr(0, colon);
+            config.replica_of_port = static_cast<short>(std::stoi(primary.substr(colon + 1)));
+            config.relay = option == "--relay-of";
+        } else if (option == "--replica-peers" && hasValue) {
+
+            std::string peers = argv[++i];
+            std::size_t start = 0;
+
+            while (start <= peers.size()) {
+                std::size_t comma = std::min(peers.find(',', start), peers.size());
+                if (comma > start) {
+                    config.replica_peers.push_back(peers.substr(start, comma - start));
+                }
+                start = comma + 1;
+            }
+        } else if (option == "--conflate") {
+            config.conflate_broadcasts = true;
+        } else if (option == "--handoff-path" && hasValue) {
+            config.handoff_path = argv[++i];
+        } else if (option == "--take-over" && hasValue) {
+            config.takeover_path = argv[++i];
+        } else if (option == "--simulate-restart-after" && hasValue) {
+            simulateRestartAfter = std::stoi(argv[++i]);
+        } else if (option == "--promote-after-ms" && hasValue) {
+            config.promote_after = std::chrono::milliseconds(std::stoi(argv[++i]));
+        } else if (option == "--replication-log" && hasValue) {
+            config.replication_log_capacity = static_cast<std::size_t>(std::stoul(argv[++i]));
+        } else if (option == "--handshake-timeout-ms" && hasValue) {
+            config.handshake_timeout = std::chrono::milliseconds(std::stoi(argv[++i]));
+        } else if (option == "--heartbeat-ms" && hasValue) {
+            config.heartbeat_interval = std::chrono::milliseconds(std::stoi(argv[++i]));
+        } else if (option == "--idle-timeout-ms" && hasValue) {
+            config.idle_timeout = std::chrono::milliseconds(std::stoi(argv[++i]));
+        } else if (option == "--write-stall-timeout-ms" && hasValue) {
+            config.write_stall_timeout = std::chrono::milliseconds(std::stoi(argv[++i]));
+        } else if (option == "--kernel-timestamps") {
+            config.kernel_timestamps = true;
+        } else if (option == "--capture" && hasValue) {
+            config.capture_path = argv[++i];
+        } else if (option == "--ingest-rate" && hasValue) {
+            config.ingest_updates_per_second = std::stod(argv[++i]);
+        } else if (option == "--ingest-byte-rate" && hasValue) {
+            config.ingest_bytes_per_second = std::stod(argv[++i]);
+        } else if (option == "--ingest-burst-ms" && hasValue) {
+            config.ingest_burst = std::chrono::milliseconds(std::stoi(argv[++i]));
+        } else if (option == "--ingest-policy" && hasValue) {
 
-    auto server = PositionServer(port, debugLogs);
+            std::string policy = argv[++i];
+
+            if (policy == "conflate") {
+                config.ingest_policy = budget_policy::conflate;
+            } else if (policy == "delay") {
+                config.ingest_policy = budget_policy::delay;
+            } else if (policy == "reject") {
+                config.ingest_policy = budget_policy::reject;
+            } else {
+                std::cerr << "--ingest-policy expects conflate, delay or reject" << std::endl;
+                return 1;
+            }
+        } else if (option == "--tls-cert" && hasValue) {
+            config.tls.enabled = true;
+            config.tls.certificate_file = argv[++i];
+        } else if (option == "--tls-key" && hasValue) {
+            config.tls.private_key_file = argv[++i];
+        } else if (option == "--tls-no-ktls") {
+            config.tls.kernel_offload = false;
+        } else if (option == "--metrics-port" && hasValue) {
+            config.metrics_port = static_cast<short>(std::stoi(argv[++i]));
+        } else if (option == "--metrics-path" && hasValue) {
+            config.metrics_path = argv[++i];
+        } else if (option == "--history-retention-s" && hasValue) {
+            config.history_retention = std::chrono::seconds(std::stoll(argv[++i]));
+        } else if (option == "--preallocate") {
+            config.preallocate = true;
+        } else if (option == "--max-sessions" && hasValue) {
+            config.max_sessions = static_cast<std::size_t>(std::stoul(argv[++i]));
+        } else if (option == "--max-symbols" && hasValue) {
+            config.max_symbols = static_cast<std::size_t>(std::stoul(argv[++i]));
+        } else if (option == "--session-queue" && hasValue) {
+            config.session_queue_records = static_cast<std::size_t>(std::stoul(argv[++i]));
+        } else if (option == "--trace" && hasValue) {
+            tracePath = argv[++i];
+        } else if (option == "--trace-window-ms" && hasValue) {
+            traceWindowMs = std::stoi(argv[++i]);
+        } else if (option == "--trace-events" && hasValue) {
+            traceEvents = static_cast<std::size_t>(std::stoul(argv[++i]));
+        } else if (option == "--local-publish" && hasValue) {
+
+            std::string rate = argv[++i];
+            localPublish = true;
+            localPublishRate = rate == "max" ? 0 : std::stoi(rate);
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            return 1;
+        }
+    }
+
+    if (config.tls.enabled && config.tls.private_key_file.empty()) {
+        std::cerr << "--tls-cert needs --tls-key" << std::endl;
+        return 1;
+    }
+
+    auto server = PositionServer(config, debugLogs);
+
+    std::signal(SIGINT, signal_handler);
+    std::signal(SIGTERM, signal_handler);
+
+    // --trace records the probe points into per-thread rings of --trace-events events, and writes
+    // the last --trace-window-ms of them as Chrome trace JSON on the way out.
+    if (!tracePath.empty()) {
+        TraceRecorder::start(traceEvents);
+    }
 
     server.start();
 
+    // --local-publish drives the in-process API: a producer thread publishes a random walk on
+    // LOCAL at N updates/s (or as fast as it can, in batches of 64) and a subscriber times every
+    // broadcast from its publish timestamp, keeping LOCAL apart from updates sent over TCP.
+    std::atomic<bool> localPublishing{localPublish};
+    std::atomic<uint64_t> localPublished{0};
+    std::atomic<uint64_t> localReceived{0};
+    std::mutex latencyMutex;
+    std::vector<int64_t> localLatencies;
+    std::vector<int64_t> networkLatencies;
+    std::thread localPublisher;
+    uint64_t localSubscription = 0;
+
+    if (localPublish) {
+
+        localSubscription = server.subscribe([&](const message_t& update) {
+            int64_t latency = Clock::now_ns() - update.timestamp_ns;
+            localReceived.fetch_add(1, std::memory_order_relaxed);
+
+            std::lock_guard<std::mutex> lock(latencyMutex);
+            (symbol_of(update) == "LOCAL" ? localLatencies : networkLatencies).push_back(latency);
+        });
+
+        localPublisher = std::thread([&]() {
+
+            std::mt19937 gen(std::random_device{}());
+            std::uniform_real_distribution<> step(-1.0, 1.0);
+            std::size_t batch = localPublishRate > 0 ? 1 : 64;
+            std::vector<message_t> updates(batch);
+            double position = 100.0;
+
+            for (auto& update : updates) {
+                std::memcpy(update.symbol.data(), "LOCAL", 5);
+            }
+
+            auto interval = std::chrono::nanoseconds(1000000000LL / std::max(localPublishRate, 1));
+            auto next = std::chrono::steady_clock::now();
+
+            while (localPublishing && running) {
+
+                for (auto& update : updates) {
+                    position += step(gen);
+                    update.net_position = position;
+                    update.timestamp_ns = Clock::now_ns();
+                }
+
+                if (server.publish(updates.data(), updates.size())) {
+                    localPublished.fetch_add(updates.size(), std::memory_order_relaxed);
+                }
+
+                if (localPublishRate > 0) {
+                    next += interval;
+                    std::this_thread::sleep_until(next);
+                }
+            }
+        });
+    }
+
     std::cout << "As an example, I am going to keep the server running for 60 seconds (self set)\nThis can be altered for testing OR the server can be closed prematurely by pushing CTRL C..." << std::endl;
 
-    std::this_thread::sleep_for(std::chrono::seconds(70));
+    // Every 5 s, report whatever this run has to report: sessions reaped by the liveness checks,
+    // replication lag and hop/origin latency on a replica or relay, queued broadcasts replaced
+    // under --conflate, each publisher's admitted rate against its ingest budget, the in-process
+    // publish and subscribe rates with --local-publish, and heap allocations when they are counted.
+    // Quiet windows print nothing. The loop ends early on CTRL C or once a successor has taken the
+    // sockets over.
+    double budgetRate = config.ingest_updates_per_second;
+
+    if (config.ingest_bytes_per_second > 0) {
+        double byteLimited = config.ingest_bytes_per_second / sizeof(message_t);
+        budgetRate = budgetRate > 0 ? std::min(budgetRate, byteLimited) : byteLimited;
+    }
+
+    std::map<uint32_t, uint64_t> admittedBefore;
+    uint64_t publishedBefore = 0;
+    uint64_t receivedBefore = 0;
+    std::size_t allocationsBefore = heap_allocations();
+    uint64_t updatesBefore = server.updates_processed();
+    uint64_t sessionEventsBefore = server.session_events();
+    bool sessionsSettled = false;
+    std::size_t steadyAllocations = 0;
+
+    for (int elapsed = 0; elapsed < 70 && running && !server.handed_off(); elapsed += 5) {
+
+        for (int tick = 0; tick < 50 && running && !server.handed_off(); ++tick) {
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+            if (simulateRestartAfter >= 0 && elapsed * 10 + tick + 1 == simulateRestartAfter * 10) {
+                server.simulate_disconnect();
+            }
+        }
+
+        auto status = server.replication_status();
+        uint64_t reaped = server.sessions_reaped();
+
+        auto budgets = server.ingest_budgets();
+
+        if (!status.replica && !config.conflate_broadcasts && reaped == 0 && budgets.empty() && !localPublish && !counting_allocations) {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(print_mutex);
+
+        if (reaped > 0) {
+            std::cout << "Liveness: " << reaped << " sessions reaped" << std::endl;
+        }
+
+        if (status.promoted) {
+            std::cout << "Replication: promoted, now primary at sequence " << status.applied_sequence << std::endl;
+        } else if (status.replica) {
+            std::cout << (status.relay ? "Relay: " : "Replication: ") << (status.connected ? "connected" : "disconnected") << ", applied " << status.applied_sequence
+                      << " of " << status.primary_sequence << " (" << status.primary_sequence - status.applied_sequence << " behind, "
+                      << status.lag_seconds * 1000.0 << " ms lag)" << std::endl;
+            std::cout << "  hop latency p50 " << status.latency.hop_p50_ms << " ms, p99 " << status.latency.hop_p99_ms
+                      << " ms; from origin p50 " << status.latency.origin_p50_ms << " ms, p99 " << status.latency.origin_p99_ms
+                      << " ms (" << status.latency.samples << " batches)" << std::endl;
+        }
+
+        if (config.conflate_broadcasts) {
+            std::cout << "Conflation: " << status.conflated << " queued broadcasts replaced for connected clients" << std::endl;
+        }
+
+        for (const auto& budget : budgets) {
+
+            // Keyed by session, since a client that reconnects or is taken over counts from zero again.
+            double rate = (budget.admitted - admittedBefore[budget.session]) / 5.0;
+            admittedBefore[budget.session] = budget.admitted;
+
+            std::cout << "Ingest budget: " << budget.client_id << " " << rate << " updates/s (" << rate / budgetRate * 100.0 << "% of "
+                      << budgetRate << "), " << budget.held << " held, " << budget.conflated << " conflated, " << budget.rejected
+                      << " rejected, reads paused " << budget.paused_reads << " times" << std::endl;
+        }
+
+        if (localPublish) {
+
+            std::vector<int64_t> local;
+            std::vector<int64_t> network;
+
+            {
+                std::lock_guard<std::mutex> latencyLock(latencyMutex);
+                local.swap(localLatencies);
+                network.swap(networkLatencies);
+            }
+
+            std::sort(local.begin(), local.end());
+            std::sort(network.begin(), network.end());
+
+            auto percentile_us = [](const std::vector<int64_t>& window, double p) {
+                return window.empty() ? 0.0 : window[std::min(window.size() - 1, static_cast<std::size_t>(p * window.size()))] / 1000.0;
+            };
+
+            uint64_t published = localPublished.load();
+            uint64_t received = localReceived.load();
+
+            std::cout << "In-process: published " << (published - publishedBefore) / 5.0 << " updates/s, subscriber received "
+                      << (received - receivedBefore) / 5.0 << " updates/s, publish to callback p50 " << percentile_us(local, 0.50)
+                      << " us, p99 " << percentile_us(local, 0.99) << " us";
+
+            if (!network.empty()) {
+                std::cout << "; over TCP p50 " << percentile_us(network, 0.50) << " us, p99 " << percentile_us(network, 0.99) << " us";
+            }
+
+            std::cout << std::endl;
+
+            publishedBefore = published;
+            receivedBefore = received;
+        }
+
+        if (counting_allocations) {
+
+            std::size_t allocations = heap_allocations();
+            uint64_t updates = server.updates_processed();
+            uint64_t sessionEvents = server.session_events();
+            bool steady = sessionsSettled && sessionEvents == sessionEventsBefore && updates > updatesBefore;
+
+            std::cout << "Heap: " << allocations - allocationsBefore << " allocations for " << updates - updatesBefore << " updates in the last 5 s"
+                      << (steady ? (allocations == allocationsBefore ? " (steady: PASS)" : " (steady: FAIL)") : "") << std::endl;
+
+            if (steady) {
+                steadyAllocations += allocations - allocationsBefore;
+            }
+
+            sessionsSettled = sessionEvents == sessionEventsBefore;
+            allocationsBefore = allocations;
+            updatesBefore = updates;
+            sessionEventsBefore = sessionEvents;
+        }
+    }
+
+    localPublishing = false;
+
+    if (localPublisher.joinable()) {
+        localPublisher.join();
+    }
+
+    // The subscriber refers to locals that go before the server does.
+    if (localSubscription != 0) {
+        server.unsubscribe(localSubscription);
+    }
+
+    if (!tracePath.empty()) {
+
+        TraceRecorder::stop();
+
+        if (TraceRecorder::dump(tracePath, static_cast<int64_t>(traceWindowMs) * 1000000)) {
+            std::cout << "Wrote the last " << traceWindowMs << " ms of trace events to " << tracePath << std::endl;
+        } else {
+            std::cerr << "Could not write trace to " << tracePath << std::endl;
+        }
+    }
+
+    if (server.handed_off()) {
+        std::cout << "Handed over to the successor process; exiting." << std::endl;
+        return 0;
+    }
 
     std::cout << "Server stopped." << std::endl;
 
+    if (counting_allocations && steadyAllocations > 0) {
+        std::cerr << "Steady-state updates made " << steadyAllocations << " heap allocations." << std::endl;
+        return 1;
+    }
+
     return 0;
 }